@@ -65,9 +65,16 @@ def parse_binary_signatures(path):
     consisting of (nseqs, cardinalities, signatures).
     '''
     dat = np.memmap(path, np.uint8) # Map whole file
-    nseqs, sketchsize = map(int, dat[:16].view(np.uint64))
-    cardinalities = dat[16:16 + (8 * nseqs)].view(np.float64)
-    signatures = dat[16 + (8 * nseqs):].view(np.float64).reshape(nseqs, -1)
+    if bytes(dat[:8]) == b"D2STACK1":
+        # Appendable layout (dashing2 sketch --append): header, then cardinality slots, then registers
+        nseqs, _, sketchsize, capacity = map(int, dat[8:40].view(np.uint64))
+        cardinalities = dat[48:48 + (8 * nseqs)].view(np.float64)
+        regstart = 48 + 8 * capacity
+    else:
+        nseqs, sketchsize = map(int, dat[:16].view(np.uint64))
+        cardinalities = dat[16:16 + (8 * nseqs)].view(np.float64)
+        regstart = 16 + 8 * nseqs
+    signatures = dat[regstart:regstart + 8 * nseqs * sketchsize].view(np.float64).reshape(nseqs, -1)
     sigmul = sketchsize // signatures.shape[1]
     if sigmul != 1:
         signatures = signatures.view({2: np.uint32, 1: np.uint64, 4: np.uint16, 8: np.uint8}[sigmul])
@@ -170,11 +177,103 @@ def parse_binary_clustering(path, d64=False):
     return [indices[start:end] for start, end in zip(indptr[:-1], indptr[1:])]
 
 
+MATRIX_ENCODINGS = ["f32", "f16", "bf16", "u8", "u16"]
+
+
+def _parse_matrix_header(dat):
+    _, enc = map(int, dat[8:16].view(np.uint32))
+    nrows, ncols = map(int, dat[16:32].view(np.uint64))
+    kind = int(dat[32:36].view(np.uint32)[0])
+    scale = float(dat[40:48].view(np.float64)[0])
+    return MATRIX_ENCODINGS[enc], nrows, ncols, kind, scale
+
+
+def _decode_matrix_values(body, enc, scale):
+    if enc == "f32":
+        return body.view(np.float32)
+    if enc == "f16":
+        return body.view(np.float16).astype(np.float32)
+    if enc == "bf16":
+        return (body.view(np.uint16).astype(np.uint32) << 16).view(np.float32)
+    return body.view(np.uint8 if enc == "u8" else np.uint16).astype(np.float32) * np.float32(scale)
+
+
+def _symmetric_row_offset(nrows, firstrow, row):
+    # Number of condensed entries in rows [firstrow, row) of an upper-triangular matrix with nrows rows
+    return sum(nrows - r - 1 for r in range(firstrow, row))
+
+
+def read_block_compressed(path, rows=None):
+    '''
+    Read a block-compressed container (--block-compress) at <path>.
+    If rows = (start, stop) is provided, only the blocks covering those rows are decompressed.
+    Returns (prefix, body, firstrow), where prefix is the uncompressed prefix (a matrix header for matrix output),
+    body is the concatenated payload of the decompressed blocks, and firstrow is the first row body covers.
+
+    Layout (see src/blockz.h):
+        32 bytes: b"D2BLOCKZ", uint32_t version, uint32_t codec, uint32_t element width, uint32_t reserved, uint64_t prefix size
+        prefix size bytes: uncompressed prefix
+        compressed blocks, each zlib-compressed after transposing its bytes by element
+        40 bytes per block: uint64_t first row, number of rows, file offset, compressed size, and raw size
+        24 bytes: uint64_t number of blocks, uint64_t index offset, b"D2BZINDX"
+    '''
+    import zlib
+    dat = np.memmap(path, np.uint8)
+    if bytes(dat[:8]) != b"D2BLOCKZ" or bytes(dat[-8:]) != b"D2BZINDX":
+        raise ValueError(f"{path} is not a block-compressed dashing2 file")
+    width = int(dat[16:20].view(np.uint32)[0])
+    prefix_size = int(dat[24:32].view(np.uint64)[0])
+    prefix = dat[32:32 + prefix_size]
+    nblocks, index_offset = map(int, dat[-24:-8].view(np.uint64))
+    index = dat[index_offset:index_offset + 40 * nblocks].view(np.uint64).reshape(nblocks, 5)
+    if rows is not None:
+        start, stop = rows
+        index = index[(index[:, 0] + index[:, 1] > start) & (index[:, 0] < stop)]
+    parts = []
+    for _, _, offset, csize, rsize in map(lambda x: map(int, x), index):
+        raw = np.frombuffer(zlib.decompress(bytes(dat[offset:offset + csize])), dtype=np.uint8)
+        n = rsize // width
+        parts.append(np.concatenate([raw[:n * width].reshape(width, n).T.reshape(-1), raw[n * width:]]))
+    body = np.concatenate(parts) if parts else np.zeros(0, np.uint8)
+    return prefix, body, int(index[0, 0]) if len(index) else 0
+
+
+def parse_binary_matrix(path, rows=None):
+    '''
+    Parse a binary full-matrix output at <path>, decoding it to float32.
+    Output written with --binary-precision other than f32 begins with a 48-byte header:
+        8 bytes: b"D2MATRIX"
+        4 bytes each: uint32_t version, uint32_t encoding (index into MATRIX_ENCODINGS)
+        8 bytes each: uint64_t nrows, uint64_t ncols
+        4 bytes each: uint32_t output kind (0 for symmetric, 2 for asymmetric, 5 for panel), uint32_t reserved
+        8 bytes: double scale, by which u8/u16 values are multiplied
+    Symmetric output is condensed (the upper triangle, in row-major order); otherwise the result has shape (nrows, ncols).
+    Headerless files are float32, and are returned flat.
+
+    Block-compressed output (--block-compress) is decompressed transparently. For these, rows = (start, stop)
+    selects a range of rows, decompressing only the blocks covering them.
+    '''
+    dat = np.memmap(path, np.uint8)
+    firstrow = 0
+    if bytes(dat[:8]) == b"D2BLOCKZ":
+        dat, body, firstrow = read_block_compressed(path, rows)
+    elif bytes(dat[:8]) != b"D2MATRIX":
+        return dat.view(np.float32)
+    else:
+        body = dat[48:]
+    enc, nrows, ncols, kind, scale = _parse_matrix_header(dat)
+    ret = _decode_matrix_values(body, enc, scale)
+    start, stop = rows if rows is not None else (firstrow, nrows)
+    if kind in (0, 1):
+        return ret[_symmetric_row_offset(nrows, firstrow, start):_symmetric_row_offset(nrows, firstrow, stop)]
+    return ret.reshape(-1, ncols)[start - firstrow:stop - firstrow]
+
+
 def parse_binary_distmat(path):
     '''
     Parse all-pairs distances from binary distance matrix at <path>.
     '''
-    return np.memmap(path, np.float32)
+    return parse_binary_matrix(path)
 
 
 def parse_binary_rectmat(path, fpath, qpath):
@@ -185,7 +284,7 @@ def parse_binary_rectmat(path, fpath, qpath):
     '''
     ffiles, qfiles = map(lambda x: list(map(str.strip, open(x))), (fpath, qpath))
     nref, nquery = map(len, (ffiles, qfiles))
-    return np.memmap(path, np.float32).reshape(nref, nquery)
+    return parse_binary_matrix(path).reshape(nref, nquery)
 
 
 def parse_binary_contain(path):
@@ -210,5 +309,5 @@ def parse_minimizer_sequence_set(path):
     return {"canon": canon, "alphabet": alphabet, "nseqs": nseqs, "k": k, "w": w, "seqs": [lo[indptr[i]:indptr[i + 1]] for i in range(nseqs)]}
 
 
-__all__ = ["parse_knn", "parse_binary_signatures", "ParsedSignatureMatrix", "parse_binary_kmers", "ParsedKmerMatrix", "alphabetcvt", "pairwise_equality_compare", "parse_binary_clustering", "parse_binary_distmat", "parse_binary_rectmat",
+__all__ = ["parse_knn", "parse_binary_signatures", "ParsedSignatureMatrix", "parse_binary_kmers", "ParsedKmerMatrix", "alphabetcvt", "pairwise_equality_compare", "parse_binary_clustering", "parse_binary_distmat", "parse_binary_rectmat", "parse_binary_matrix", "read_block_compressed",
            "parse_minimizer_sequence_set", "parse_binary_sketch", "convert_sketches_to_packed_sketch"]
@@ -1,12 +1,121 @@
 #include "bedsketch.h"
+#include "mio.hpp"
+#include "posblock.h"
+#include <tuple>
 
 namespace dashing2 {
 
+struct BedInterval {
+    uint64_t chrhash_;
+    uint64_t start_, stop_;
+    double inc_;
+    bool operator<(const BedInterval &o) const {
+        return std::tie(chrhash_, start_, stop_) < std::tie(o.chrhash_, o.start_, o.stop_);
+    }
+};
+
+// Parses an unsigned integer, skipping leading blanks; stops at the end of the line
+static inline uint64_t parse_position(const char *&p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t')) ++p;
+    uint64_t ret = 0;
+    for(unsigned d; p < end && (d = unsigned(*p) - '0') < 10u; ++p) ret = ret * 10 + d;
+    return ret;
+}
+
+// Reads every interval in a BED file, through a memory map when possible
+static std::vector<BedInterval> parse_bed(const std::string &path, const Dashing2Options &opts) {
+    mio::mmap_source map;
+    std::string buf;
+    const char *dat = nullptr, *end = nullptr;
+    std::error_code ec;
+    if(bns::filesize(path.data()) > 0) map.map(path, ec);
+    if(map.is_mapped()) {
+        dat = map.data(); end = dat + map.size();
+    } else {
+        // Empty files, pipes and other unmappable inputs
+        std::ifstream ifs(path);
+        if(!ifs) throw std::runtime_error(std::string("Could not open BED file at ") + path);
+        buf.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        dat = buf.data(); end = dat + buf.size();
+    }
+    std::vector<BedInterval> ret;
+    const char *lastchr = nullptr;
+    size_t lastchrlen = 0;
+    uint64_t chrhash = 0;
+    for(const char *line = dat, *eol; line < end; line = eol + 1) {
+        if((eol = static_cast<const char *>(std::memchr(line, '\n', end - line))) == nullptr) eol = end;
+        const char *lend = eol;
+        if(lend > line && lend[-1] == '\r') --lend;
+        if(lend == line || *line == '#') continue;
+        const char *p = line, *p2 = static_cast<const char *>(std::memchr(line, '\t', lend - line));
+        if(p2 == nullptr)
+            throw std::invalid_argument(std::string("Malformed line: ") + std::string(line, lend));
+        if(opts.trim_chr_ && p2 - p >= 3 && ((*p == 'c' || *p == 'C') && p[1] == 'h' && p[2] == 'r'))
+            p += 3;
+        // BED files are usually grouped by chromosome, so only hash names when they change
+        const size_t chrlen = p2 - p;
+        if(lastchr == nullptr || chrlen != lastchrlen || std::memcmp(p, lastchr, chrlen)) {
+            chrhash = XXH3_64bits(p, chrlen);
+            lastchr = p; lastchrlen = chrlen;
+        }
+        p = p2 + 1;
+        const uint64_t start = parse_position(p, lend), stop = parse_position(p, lend);
+        if(stop <= start) continue;
+        ret.push_back(BedInterval{chrhash, start, stop, opts.bed_parse_normalize_intervals_ ? 1. / (stop - start): 1.});
+    }
+    return ret;
+}
+
+// Sorts intervals and merges overlapping or adjacent ones within each chromosome
+static void merge_intervals(std::vector<BedInterval> &ivs) {
+    std::sort(ivs.begin(), ivs.end());
+    auto out = ivs.begin();
+    for(auto it = ivs.begin(); it != ivs.end(); ++it) {
+        if(out != ivs.begin() && out[-1].chrhash_ == it->chrhash_ && it->start_ <= out[-1].stop_)
+            out[-1].stop_ = std::max(out[-1].stop_, it->stop_);
+        else *out++ = *it;
+    }
+    ivs.erase(out, ivs.end());
+}
+
+// Replaces intervals with disjoint segments whose weights are the sums of the weights of the intervals covering them
+static void flatten_intervals(std::vector<BedInterval> &ivs) {
+    struct Event {
+        uint64_t chrhash_, pos_;
+        double inc_;
+        int delta_;
+        bool operator<(const Event &o) const {return std::tie(chrhash_, pos_) < std::tie(o.chrhash_, o.pos_);}
+    };
+    std::vector<Event> events;
+    events.reserve(ivs.size() * 2);
+    for(const auto &iv: ivs) {
+        events.push_back({iv.chrhash_, iv.start_, iv.inc_, 1});
+        events.push_back({iv.chrhash_, iv.stop_, -iv.inc_, -1});
+    }
+    std::sort(events.begin(), events.end());
+    ivs.clear();
+    double w = 0.;
+    int64_t depth = 0;
+    for(size_t i = 0; i < events.size();) {
+        const uint64_t chrhash = events[i].chrhash_, pos = events[i].pos_;
+        for(; i < events.size() && events[i].chrhash_ == chrhash && events[i].pos_ == pos; ++i) {
+            w += events[i].inc_;
+            depth += events[i].delta_;
+        }
+        // Reset at gaps so that rounding errors do not accumulate across them
+        if(depth == 0) {w = 0.; continue;}
+        const uint64_t next = events[i].pos_; // Every open interval closes on this chromosome
+        if(!ivs.empty() && ivs.back().chrhash_ == chrhash && ivs.back().stop_ == pos && ivs.back().inc_ == w)
+            ivs.back().stop_ = next;
+        else
+            ivs.push_back(BedInterval{chrhash, pos, next, w});
+    }
+}
+
 std::pair<std::vector<RegT>, double> bed2sketch(const std::string &path, const Dashing2Options &opts) {
     if(opts.sspace_ > SPACE_PSET) throw std::invalid_argument("Can't do edit distance for BED files");
     if(opts.bed_parse_normalize_intervals_ && opts.sspace_ == SPACE_SET)
         throw std::invalid_argument("Can't normalize BED rows in set space. Use SPACE_MULTISET or SPACE_PSET");
-    std::ifstream ifs(path);
     const bool op = opts.one_perm();
     FullSetSketch ss(opts.count_threshold_, opts.sketchsize_);
     OPSetSketch opss(opts.sketchsize_);
@@ -33,27 +142,31 @@ std::pair<std::vector<RegT>, double> bed2sketch(const std::string &path, const D
         if(ispopen) ::pclose(ifp); else std::fclose(ifp);
         return ret;
     }
-    for(std::string s;std::getline(ifs, s);) {
-        if(s.empty() || s.front() == '#') continue;
-        char *p = s.data(), *p2;
-        if((p2 = std::strchr(p, '\t')) == nullptr)
-            throw std::invalid_argument(std::string("Malformed line: ") + s);
-        if(opts.trim_chr_ && ((*p == 'c' || *p == 'C') && p[1] == 'h' && p[2] == 'r'))
-            p += 3;
-        const uint64_t chrhash = XXH3_64bits(p, p2 - p);
-        p = p2 + 1;
-        const unsigned long start = std::strtoul(p, &p, 10), stop =  std::strtoul(p, &p, 10);
-        const double inc = opts.bed_parse_normalize_intervals_ ? 1. / (stop - start): 1;
-        // Consider SIMDifying packing these before adding?
-        // If set space, sketch directly.
-        if(opts.sspace_ == SPACE_SET) {
-            if(op) for(auto i = start; i < stop; opss.update(chrhash ^ i++));
-            else   for(auto i = start; i < stop; ss.update(chrhash ^ i++));
-        } else {
-            // else, we need to compute counts before we sketch
-            for(auto i = start; i < stop; ctr.add(chrhash ^ i++, inc));
+    std::vector<BedInterval> intervals = parse_bed(path, opts);
+    if(opts.sspace_ == SPACE_SET) {
+        // Sets ignore repeated positions, so overlapping intervals can be merged unless a count threshold is applied.
+        if(opts.count_threshold_ <= 1) merge_intervals(intervals);
+        else std::sort(intervals.begin(), intervals.end());
+        auto sketch_intervals = [&intervals](auto &sketch) {
+            PositionBlockUpdater<std::decay_t<decltype(sketch)>> block(sketch);
+            for(const auto &iv: intervals) block.add_range(iv.chrhash_, iv.start_, iv.stop_);
+            block.flush();
+        };
+        if(op) sketch_intervals(opss);
+        else   sketch_intervals(ss);
+    } else {
+        // else, we need to compute counts before we sketch
+        // Positions covered by several intervals are added once, with the summed weight.
+        flatten_intervals(intervals);
+        if(ctr.ct() == EXACT_COUNTING) {
+            size_t npos = 0;
+            for(const auto &iv: intervals) npos += iv.stop_ - iv.start_;
+            ctr.c64d_.reserve(npos);
         }
+        for(const auto &iv: intervals)
+            for(auto i = iv.start_; i < iv.stop_; ctr.add(iv.chrhash_ ^ i++, iv.inc_));
     }
+    DBG_ONLY(std::fprintf(stderr, "Sketched %zu intervals from %s\n", intervals.size(), path.data());)
     std::FILE *ofp = bfopen(cache_path.data(), "w");
     if(opts.sspace_ > SPACE_SET) {
         if(opts.ct() == EXACT_COUNTING) {
@@ -0,0 +1,76 @@
+#include "blockz.h"
+#include "enums.h"
+#include <thread>
+#include <zlib.h>
+
+namespace dashing2 {
+
+// Transposes n elements of w bytes each into w planes of n bytes; trailing bytes are copied as-is
+static void shuffle_bytes(const uint8_t *src, size_t nbytes, uint32_t w, uint8_t *dst) {
+    const size_t n = nbytes / w;
+    for(size_t i = 0; i < n; ++i)
+        for(uint32_t b = 0; b < w; ++b)
+            dst[b * n + i] = src[i * w + b];
+    std::copy(src + n * w, src + nbytes, dst + n * w);
+}
+static void unshuffle_bytes(const uint8_t *src, size_t nbytes, uint32_t w, uint8_t *dst) {
+    const size_t n = nbytes / w;
+    for(size_t i = 0; i < n; ++i)
+        for(uint32_t b = 0; b < w; ++b)
+            dst[i * w + b] = src[b * n + i];
+    std::copy(src + n * w, src + nbytes, dst + n * w);
+}
+
+void blockz_compress(const void *src, size_t nbytes, uint32_t elem_bytes, std::vector<uint8_t> &out, std::vector<uint8_t> &scratch) {
+    const uint8_t *data = static_cast<const uint8_t *>(src);
+    if(elem_bytes > 1) {
+        scratch.resize(nbytes);
+        shuffle_bytes(data, nbytes, elem_bytes, scratch.data());
+        data = scratch.data();
+    }
+    uLongf destlen = compressBound(nbytes);
+    out.resize(destlen);
+    const int rc = compress2(out.data(), &destlen, data, nbytes, Z_BEST_SPEED);
+    if(rc != Z_OK) THROW_EXCEPTION(std::runtime_error(std::string("Failed to compress block of ") + std::to_string(nbytes) + " bytes: zlib error " + std::to_string(rc)));
+    out.resize(destlen);
+}
+
+void blockz_decompress(const void *src, size_t compressed_bytes, uint32_t elem_bytes, void *dst, size_t raw_bytes, std::vector<uint8_t> &scratch) {
+    uint8_t *out = static_cast<uint8_t *>(dst);
+    if(elem_bytes > 1) {
+        scratch.resize(raw_bytes);
+        out = scratch.data();
+    }
+    uLongf destlen = raw_bytes;
+    const int rc = uncompress(out, &destlen, static_cast<const uint8_t *>(src), compressed_bytes);
+    if(rc != Z_OK || destlen != raw_bytes)
+        THROW_EXCEPTION(std::runtime_error(std::string("Corrupt compressed block: expected ") + std::to_string(raw_bytes) + " bytes, zlib error " + std::to_string(rc)));
+    if(elem_bytes > 1) unshuffle_bytes(out, raw_bytes, elem_bytes, static_cast<uint8_t *>(dst));
+}
+
+BlockzWriter::BlockzWriter(std::FILE *fp, uint32_t elem_bytes, const void *prefix, size_t prefix_bytes): fp_(fp), elem_bytes_(std::max(elem_bytes, 1u)) {
+    BlockzHeader hdr;
+    hdr.elem_bytes_ = elem_bytes_;
+    hdr.prefix_bytes_ = prefix_bytes;
+    checked_fwrite(fp_, &hdr, sizeof(hdr));
+    if(prefix_bytes) checked_fwrite(fp_, prefix, prefix_bytes);
+    offset_ = sizeof(hdr) + prefix_bytes;
+}
+
+void BlockzWriter::append(const void *compressed, size_t compressed_bytes, size_t raw_bytes, uint64_t first_row, uint64_t nrows) {
+    checked_fwrite(fp_, compressed, compressed_bytes);
+    index_.push_back(BlockzIndexEntry{first_row, nrows, offset_, compressed_bytes, raw_bytes});
+    offset_ += compressed_bytes;
+    raw_total_ += raw_bytes;
+}
+
+void BlockzWriter::finish() {
+    BlockzTrailer trailer;
+    trailer.nblocks_ = index_.size();
+    trailer.index_offset_ = offset_;
+    checked_fwrite(fp_, index_.data(), index_.size() * sizeof(BlockzIndexEntry));
+    checked_fwrite(fp_, &trailer, sizeof(trailer));
+    offset_ += index_.size() * sizeof(BlockzIndexEntry) + sizeof(trailer);
+}
+
+} // namespace dashing2
@@ -0,0 +1,81 @@
+#pragma once
+#ifndef DASHING2_BLOCKZ_H__
+#define DASHING2_BLOCKZ_H__
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace dashing2 {
+
+/*
+ * Block-compressed, seekable container for binary matrix output (--block-compress).
+ *
+ * Layout:
+ *   BlockzHeader (32 bytes)
+ *   prefix_bytes_ uncompressed bytes (e.g., the MatrixHeader for --binary-precision), so that it can be read without decompression
+ *   Compressed blocks, back to back
+ *   BlockzIndexEntry for every block
+ *   BlockzTrailer (24 bytes), at the end of the file
+ * Readers seek to the trailer, load the index and decompress only the blocks covering the rows they need.
+ *
+ * Each block holds the payload for a contiguous range of rows, exactly as it would have been written uncompressed.
+ * Blocks are byte-shuffled by element (all first bytes, then all second bytes, ...) and deflated at the fastest level.
+ * Shuffling groups the low-entropy sign/exponent bytes of similarities together, which is where most of the gain comes from.
+ * (Delta-coding the byte planes was tried, but neighboring similarities are too weakly correlated for it to pay off.)
+ */
+static constexpr uint32_t BLOCKZ_VERSION = 1;
+enum BlockzCodec: uint32_t {
+    BLOCKZ_SHUFFLE_DEFLATE = 0
+};
+struct BlockzHeader {
+    char magic_[8] = {'D', '2', 'B', 'L', 'O', 'C', 'K', 'Z'};
+    uint32_t version_ = BLOCKZ_VERSION;
+    uint32_t codec_ = BLOCKZ_SHUFFLE_DEFLATE;
+    uint32_t elem_bytes_ = 4;  // Shuffle width
+    uint32_t reserved_ = 0;
+    uint64_t prefix_bytes_ = 0;
+};
+struct BlockzIndexEntry {
+    uint64_t first_row_, nrows_;
+    uint64_t offset_;           // From the start of the file
+    uint64_t compressed_bytes_, raw_bytes_;
+};
+struct BlockzTrailer {
+    uint64_t nblocks_ = 0;
+    uint64_t index_offset_ = 0;
+    char magic_[8] = {'D', '2', 'B', 'Z', 'I', 'N', 'D', 'X'};
+};
+static_assert(sizeof(BlockzHeader) == 32, "BlockzHeader must be 32 bytes");
+static_assert(sizeof(BlockzIndexEntry) == 40, "BlockzIndexEntry must be 40 bytes");
+static_assert(sizeof(BlockzTrailer) == 24, "BlockzTrailer must be 24 bytes");
+
+// Compresses nbytes from src into out (resized to fit). scratch is reused between calls.
+// Thread-safe, so that blocks can be compressed concurrently.
+void blockz_compress(const void *src, size_t nbytes, uint32_t elem_bytes, std::vector<uint8_t> &out, std::vector<uint8_t> &scratch);
+// Inverts blockz_compress; dst must have room for raw_bytes. Throws std::runtime_error on corrupt input.
+void blockz_decompress(const void *src, size_t compressed_bytes, uint32_t elem_bytes, void *dst, size_t raw_bytes, std::vector<uint8_t> &scratch);
+
+/*
+ * BlockzWriter
+ * Writes a container to fp, which must be positioned at its start. Blocks are appended in order by a single thread;
+ * compression itself is done by the caller (e.g., on formatter threads) via blockz_compress.
+ */
+class BlockzWriter {
+    std::FILE *fp_;
+    uint64_t offset_ = 0;
+    uint32_t elem_bytes_;
+    std::vector<BlockzIndexEntry> index_;
+    uint64_t raw_total_ = 0;
+public:
+    BlockzWriter(std::FILE *fp, uint32_t elem_bytes, const void *prefix=nullptr, size_t prefix_bytes=0);
+    void append(const void *compressed, size_t compressed_bytes, size_t raw_bytes, uint64_t first_row, uint64_t nrows);
+    // Writes the index and trailer
+    void finish();
+    size_t nblocks() const {return index_.size();}
+    uint64_t raw_bytes() const {return raw_total_;}
+    uint64_t bytes_written() const {return offset_;}
+};
+
+} // namespace dashing2
+
+#endif
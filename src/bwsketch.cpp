@@ -1,21 +1,111 @@
 #include "d2.h"
 #include "bwsketch.h"
+#include "kernels.h"
+#include "posblock.h"
 #ifndef NOCURL
 #define NOCURL 1
 #endif
 #include "bigWig.h"
+#include <mutex>
 
 namespace dashing2 {
 
 static constexpr uint32_t default_BW_READ_BUFFER = 1<<30;
 
 uint32_t BW_READ_BUFFER = default_BW_READ_BUFFER;
-std::vector<RegT> reduce(const flat_hash_map<std::string, std::vector<RegT>> &map);
-std::vector<std::pair<int, bwOverlapIterator_t *>> get_iterators(bigWigFile_t *fp);
 
 
 using std::to_string;
 
+namespace {
+struct BWChunk {
+    int contig_;
+    uint32_t start_, stop_;
+};
+
+// Holds whichever sketch the options select, for one thread
+struct BWSketcher {
+    std::unique_ptr<FullSetSketch> fss_;
+    std::unique_ptr<OPSetSketch> opss_;
+    std::unique_ptr<BagMinHash> bmh_;
+    std::unique_ptr<ProbMinHash> pmh_;
+    size_t nupdates_ = 0;
+    BWSketcher(const Dashing2Options &opts) {
+        if(opts.sspace_ == SPACE_SET) {
+            if(opts.one_perm()) {
+                opss_.reset(new OPSetSketch(opts.sketchsize_));
+                if(opts.count_threshold_ > 1) opss_->set_mincount(opts.count_threshold_);
+            } else
+                fss_.reset(new FullSetSketch(opts.count_threshold_, opts.sketchsize_));
+        } else if(opts.sspace_ == SPACE_MULTISET)
+            bmh_.reset(new BagMinHash(opts.sketchsize_));
+        else
+            pmh_.reset(new ProbMinHash(opts.sketchsize_));
+    }
+    void reset() {
+        if(fss_) fss_->reset();
+        else if(opss_) opss_->reset();
+        else if(bmh_) bmh_->reset();
+        else pmh_->reset();
+        nupdates_ = 0;
+    }
+    bool empty() const {return nupdates_ == 0;}
+    // Each interval covers a run of positions sharing one value, so updates go range by range.
+    // Set sketches take the positions in blocks through update_batch; weighted sketches take them one at a time, with the interval's value.
+    template<bool WEIGHTED, typename Sketch>
+    static size_t add_ranges(Sketch &sketch, const bwOverlappingIntervals_t &ivs, uint64_t chrom_hash, uint32_t lo, uint32_t hi) {
+        size_t n = 0;
+        auto for_each_range = [&](const auto &func) {
+            for(uint32_t j = 0; j < ivs.l; ++j) {
+                // Intervals spanning a chunk boundary are returned for both chunks, so each keeps only its own part
+                const uint32_t start = std::max(ivs.start[j], lo), stop = std::min(ivs.end[j], hi);
+                if(start >= stop) continue;
+                n += stop - start;
+                func(start, stop, ivs.value[j]);
+            }
+        };
+        if constexpr(WEIGHTED) {
+            for_each_range([&](uint64_t start, uint64_t stop, float v) {
+                for(uint64_t i = start; i < stop; sketch.update(chrom_hash ^ i++, v));
+            });
+        } else {
+            PositionBlockUpdater<Sketch> block(sketch);
+            for_each_range([&](uint64_t start, uint64_t stop, float) {block.add_range(chrom_hash, start, stop);});
+            block.flush();
+        }
+        return n;
+    }
+    // Sketch updates are compiled per ISA level, and the CPU's is selected (kernels.h)
+    void add(const bwOverlappingIntervals_t &ivs, uint64_t chrom_hash, uint32_t lo, uint32_t hi) {
+        nupdates_ += dispatched([&]() {
+            return fss_ ? add_ranges<false>(*fss_, ivs, chrom_hash, lo, hi):
+                   opss_ ? add_ranges<false>(*opss_, ivs, chrom_hash, lo, hi):
+                   bmh_ ? add_ranges<true>(*bmh_, ivs, chrom_hash, lo, hi):
+                   add_ranges<true>(*pmh_, ivs, chrom_hash, lo, hi);
+        });
+    }
+    std::vector<RegT> to_sigs() {
+        return fss_ ? fss_->to_sigs(): opss_ ? opss_->to_sigs(): bmh_ ? bmh_->to_sigs(): pmh_->to_sigs();
+    }
+    bool weighted() const {return bmh_ || pmh_;}
+    // Weighted sketches' total weights add up across chunks
+    double total_weight() {return bmh_ ? bmh_->total_weight(): pmh_->total_weight();}
+    // Set cardinality from registers as returned by to_sigs(), reduced across chunks with reduce_pair.
+    // Registers reduce by min, so this is getcard() of one sketch given every chunk's updates, rather than a sum of small, biased estimates.
+    double card(const std::vector<RegT> &sigs) const {
+        long double sum = 0.;
+        if(fss_) {
+            for(const RegT v: sigs) sum += v;
+            return sigs.size() / sum;
+        }
+        // to_sigs() maps a one-permutation register x to -log(1 - x / 2^bits), so this recovers x / 2^bits
+        for(const RegT v: sigs) sum -= std::expm1(-static_cast<long double>(v));
+        if(!sum) return std::numeric_limits<double>::infinity();
+        return sigs.size() * (sigs.size() / sum);
+    }
+};
+} // anonymous namespace
+
 
 
 BigWigSketchResult bw2sketch(std::string path, const Dashing2Options &opts, bool parallel_process) {
@@ -54,7 +144,6 @@ BigWigSketchResult bw2sketch(std::string path, const Dashing2Options &opts, bool
     if(opts.count() != EXACT_COUNTING) {
         THROW_EXCEPTION(std::invalid_argument("Counting format must be exact for BigWigs. (No Count-Sketch approximation). This may change in the future."));
     }
-    flat_hash_map<std::string, std::vector<RegT>> retmap;
     DBG_ONLY(std::fprintf(stderr, "Space: %s\n", to_string(opts.sspace_).data());)
     if(opts.sspace_ != SPACE_SET && opts.sspace_ != SPACE_MULTISET && opts.sspace_ != SPACE_PSET)
         THROW_EXCEPTION(std::invalid_argument("Can't do edit distance for BigWig files"));
@@ -64,140 +153,84 @@ BigWigSketchResult bw2sketch(std::string path, const Dashing2Options &opts, bool
     }
     bigWigFile_t *fp = bwOpen(path.data(), nullptr, "r");
     if(fp == nullptr) THROW_EXCEPTION(std::runtime_error("Could not open bigwigfile at"s + path));
-
-    if(parallel_process || opts.by_chrom_) {
-        auto ids(get_iterators(fp));
-        for(const auto &p: ids) retmap.emplace(fp->cl->chrom[p.first], std::vector<RegT>());
-        const size_t ss = opts.sketchsize_;
-
-        std::vector<FullSetSketch> fss;
-        std::vector<OPSetSketch> opss;
-        std::vector<BagMinHash> bmhs;
-        std::vector<ProbMinHash> pmhs;
-        for(size_t i = 0; i < std::min(size_t(opts.nthreads()), ids.size()); ++i) {
-            if(opts.sspace_ == SPACE_SET) {
-                if(opts.one_perm()) {
-                    opss.emplace_back(ss);
-                    if(opts.count_threshold_ > 1) opss.back().set_mincount(opts.count_threshold_);
-                } else
-                    fss.emplace_back(opts.count_threshold_, ss);
-            } else if(opts.sspace_ == SPACE_MULTISET)
-                bmhs.emplace_back(ss);
-            else
-                pmhs.emplace_back(ss);
+    DBG_ONLY(auto timestart = std::chrono::high_resolution_clock::now();)
+    // Split contigs into chunks, so that large chromosomes are spread across threads
+    const int nk = fp->cl->nKeys;
+    std::vector<BWChunk> chunks;
+    for(int i = 0; i < nk; ++i)
+        for(uint32_t start = 0, len = fp->cl->len[i]; start < len; start += std::min(len - start, bw_chunk_size))
+            chunks.push_back(BWChunk{i, start, start + std::min(len - start, bw_chunk_size)});
+    const int nt = parallel_process ? std::max(std::min(int(opts.nthreads()), int(chunks.size())), 1): 1;
+    // libBigWig handles hold a file offset, so each thread reads through its own
+    std::vector<bigWigFile_t *> fps(nt);
+    fps[0] = fp;
+    std::vector<BWSketcher> sketchers;
+    sketchers.reserve(nt);
+    for(int i = 0; i < nt; ++i) sketchers.emplace_back(opts);
+    std::vector<std::vector<RegT>> contigsigs(nk);
+    std::vector<double> contigcards(nk);
+    std::vector<std::mutex> contiglocks(nk);
+    std::atomic<int> failed(0);
+    OMP_PRAGMA("omp parallel for schedule(dynamic, 1) num_threads(nt)")
+    for(size_t ci = 0; ci < chunks.size(); ++ci) {
+        if(failed.load(std::memory_order_relaxed)) continue;
+        const int tid = OMP_ELSE(omp_get_thread_num(), 0);
+        const BWChunk &chunk = chunks[ci];
+        if(fps[tid] == nullptr && (fps[tid] = bwOpen(path.data(), nullptr, "r")) == nullptr) {
+            failed = 1;
+            continue;
         }
-        long double total_weight = 0.;
-        OMP_PRAGMA("omp parallel for schedule(dynamic) reduction(+:total_weight)")
-        for(size_t i = 0; i < ids.size(); ++i) {
-            DBG_ONLY(std::fprintf(stderr, "Processing contig %zu/%zu\n", i, ids.size());)
-            const int tid = OMP_ELSE(omp_get_thread_num(), 0);
-            const int contig_id = ids[i].first;
-            std::string chrom = fp->cl->chrom[contig_id];
-            const uint64_t chrom_hash = std::hash<std::string>{}(chrom);
-            auto &rvec = retmap[chrom];
-            auto &ptr = ids[i].second;
-            if(ptr == nullptr) {
-                std::fprintf(stderr, "bwOverlapIterator_t * is null when it should be non-null (tid = %d/contig = %d)\n", tid, contig_id);
-                std::exit(1);
-            }
-            {
-                if(fss.size()) {fss[tid].reset();}
-                else if(opss.size()) {opss[tid].reset();}
-                else if(bmhs.size()) {bmhs[tid].reset();}
-                else if(pmhs.size()) {pmhs[tid].reset();}
-                else THROW_EXCEPTION(std::invalid_argument("Not supported: sketching besides PMH, BMH, SetSketch for BigWig files"));
-                for(;ptr->data;ptr = bwIteratorNext(ptr)) {
-                    const uint32_t numi = ptr->intervals->l;
-                    float *vptr = ptr->intervals->value;
-#define DO_FOR_SKETCH(item) do {\
-                    for(uint32_t j = 0; j < numi; ++j) { \
-                        for(auto istart = ptr->intervals->start[j], iend = ptr->intervals->end[j];istart < iend;(item).update(chrom_hash ^ istart++, vptr[j]));\
-                    } } while(0)
-#define DO_FOR_UNWEIGHTED_SKETCH(item) do {\
-                    for(uint32_t j = 0; j < numi; ++j) { \
-                        for(auto istart = ptr->intervals->start[j], iend = ptr->intervals->end[j];istart < iend;(item).update(chrom_hash ^ istart++));\
-                    } } while(0)
-                    if(fss.size()) {
-                        DO_FOR_UNWEIGHTED_SKETCH(fss[tid]);
-                    } else if(opss.size()) {
-                        DO_FOR_UNWEIGHTED_SKETCH(opss[tid]);
-                    } else if(bmhs.size()) {
-                        DO_FOR_SKETCH(bmhs[tid]);
-                    } else if(pmhs.size()) {
-                        DO_FOR_SKETCH(pmhs[tid]);
-                    }
-#ifndef NDEBUG
-                    std::fprintf(stderr, "processed %u intervals. Now loading next batch (%s)\n", numi, chrom.data());
-#endif
-                }
-
-                auto newvec = fss.size() ? fss[tid].to_sigs() :
-                              opss.size() ? opss[tid].to_sigs() :
-                              bmhs.size() ? bmhs[tid].to_sigs(): pmhs[tid].to_sigs();
-                const auto winc = (fss.size() ? fss[tid].getcard(): opss.size() ? opss[tid].getcard(): bmhs.size() ? bmhs[tid].total_weight(): pmhs.size() ? pmhs[tid].total_weight(): RegT(-1));
-                total_weight += winc;
-                ret.cardmap_[chrom] = winc;
-
-                if(rvec.empty()) {
-                    rvec = newvec;
-                } else {
-                    OMP_PRAGMA("omp simd")
-                    for(size_t i = 0; i < rvec.size(); ++i) {
-                        rvec[i] = std::min(rvec[i], newvec[i]);
-                    }
-                }
-            }
-            bwIteratorDestroy(ptr);
-        }
-        ret.card_ = total_weight;
-        ret.global_.reset(new std::vector<RegT>(reduce(retmap)));
-    } else {
-        DBG_ONLY(auto timestart = std::chrono::high_resolution_clock::now();)
-        auto cp = fp->cl;
-        const int nk = cp->nKeys;
-        std::unique_ptr<FullSetSketch> fss;
-        std::unique_ptr<OPSetSketch> opss;
-        std::unique_ptr<ProbMinHash> pmh;
-        std::unique_ptr<BagMinHash> bmh;
-        if(opts.sspace_ == SPACE_SET) {
-            if(opts.one_perm()) {
-                opss.reset(new OPSetSketch(opts.sketchsize_));
-                if(opts.count_threshold_ > 1) opss->set_mincount(opts.count_threshold_);
-            } else
-                fss.reset(new FullSetSketch(opts.count_threshold_, opts.sketchsize_));
-        } else if(opts.sspace_ == SPACE_MULTISET)
-            bmh.reset(new BagMinHash(opts.sketchsize_));
-        else
-            pmh.reset(new ProbMinHash(opts.sketchsize_));
-        for(auto i = 0; i < nk; ++i) {
-            if(cp->len[i] < 1) continue;
-            auto cid = fp->cl->chrom[i];
-            auto ptr = bwOverlappingIntervalsIterator(fp, cid, 0, fp->cl->len[i], blocks_per_iter);
-            if(!ptr->data || (ptr->intervals && ptr->intervals->l == 0)) {
-                bwIteratorDestroy(ptr);
-                continue;
-            }
-            const uint64_t chrom_hash = std::hash<std::string>{}(cid);
-            const uint32_t numi = ptr->intervals->l;
-            float *vptr = ptr->intervals->value;
-            if(fss) {
-                DO_FOR_UNWEIGHTED_SKETCH(*fss);
-            } else if(opss) {
-                DO_FOR_UNWEIGHTED_SKETCH(*opss);
-            } else if(bmh) {
-                DO_FOR_SKETCH(*bmh);
-            } else if(pmh) {
-                DO_FOR_SKETCH(*pmh);
-            }
+        char *chrom = fps[tid]->cl->chrom[chunk.contig_];
+        const uint64_t chrom_hash = std::hash<std::string>{}(chrom);
+        auto &sketcher = sketchers[tid];
+        sketcher.reset();
+        auto ptr = bwOverlappingIntervalsIterator(fps[tid], chrom, chunk.start_, chunk.stop_, blocks_per_iter);
+        if(ptr == nullptr) {
+            failed = 2;
+            continue;
         }
-        ret.card_ = (fss ? fss->getcard(): opss ? opss->getcard(): bmh ? bmh->total_weight(): pmh ? pmh->total_weight(): std::numeric_limits<RegT>::infinity());
-        if(ret.card_ == std::numeric_limits<RegT>::infinity()) {
-            std::fprintf(stderr, "Warning: infinite cardinality\n");
+        for(;ptr->data;ptr = bwIteratorNext(ptr)) {
+            if(ptr->intervals) sketcher.add(*ptr->intervals, chrom_hash, chunk.start_, chunk.stop_);
         }
-        ret.global_.reset(new std::vector<RegT>(bmh ? bmh->to_sigs(): pmh ? pmh->to_sigs(): opss ? opss->to_sigs(): fss ? fss->to_sigs(): std::vector<RegT>()));
-        DBG_ONLY(auto timestop = std::chrono::high_resolution_clock::now();
-                 std::fprintf(stderr, "Took %gms to sketch\n", std::chrono::duration<double>(timestop - timestart).count());)
+        bwIteratorDestroy(ptr);
+        if(sketcher.empty()) continue;
+        std::vector<RegT> sigs = sketcher.to_sigs();
+        const double weight = sketcher.weighted() ? sketcher.total_weight(): 0.;
+        std::lock_guard<std::mutex> lock(contiglocks[chunk.contig_]);
+        if(auto &csigs = contigsigs[chunk.contig_]; csigs.empty()) csigs = std::move(sigs);
+        else reduce_pair(csigs, sigs);
+        contigcards[chunk.contig_] += weight;
+    }
+    if(failed) {
+        for(int i = 1; i < nt; ++i) if(fps[i]) bwClose(fps[i]);
+        bwClose(fp);
+        THROW_EXCEPTION(std::runtime_error("Failed to "s + (failed == 1 ? "open": "iterate over") + " bigwig file at " + path));
+    }
+    flat_hash_map<std::string, std::vector<RegT>> retmap;
+    const bool weighted = sketchers[0].weighted();
+    long double total_weight = 0.;
+    for(int i = 0; i < nk; ++i) {
+        if(contigsigs[i].empty()) continue;
+        const std::string chrom = fp->cl->chrom[i];
+        total_weight += contigcards[i];
+        ret.cardmap_[chrom] = weighted ? contigcards[i]: sketchers[0].card(contigsigs[i]);
+        retmap.emplace(chrom, std::move(contigsigs[i]));
+    }
+    if(retmap.empty()) {
+        sketchers[0].reset();
+        ret.global_.reset(new std::vector<RegT>(sketchers[0].to_sigs()));
+        ret.card_ = 0.;
+    } else {
+        ret.global_.reset(new std::vector<RegT>(reduce(retmap)));
+        // Contigs' hashes are disjoint, but one estimate over the whole file is less biased than a sum of per-contig estimates
+        ret.card_ = weighted ? double(total_weight): sketchers[0].card(*ret.global_);
+    }
+    if(ret.card_ == std::numeric_limits<RegT>::infinity()) {
+        std::fprintf(stderr, "Warning: infinite cardinality\n");
     }
+    DBG_ONLY(auto timestop = std::chrono::high_resolution_clock::now();
+             std::fprintf(stderr, "Took %gs to sketch %zu chunks with %d threads\n", std::chrono::duration<double>(timestop - timestart).count(), chunks.size(), nt);)
+    for(int i = 1; i < nt; ++i) if(fps[i]) bwClose(fps[i]);
 
     bwClose(fp);
     bwCleanup();
@@ -214,6 +247,5 @@ BigWigSketchResult bw2sketch(std::string path, const Dashing2Options &opts, bool
     }
     return ret;
 }
-#undef DO_FOR_SKETCH
 
 } // dashing2
@@ -11,6 +11,21 @@ std::vector<RegT> reduce(const flat_hash_map<std::string, std::vector<RegT>> &ma
 #define BLOCKS_PER_ITER 4000000
 #endif
 static constexpr size_t blocks_per_iter = BLOCKS_PER_ITER;
+// Contigs are split into chunks of this many bases, which threads sketch independently
+#ifndef BW_CHUNK_SIZE
+#define BW_CHUNK_SIZE (1u << 24)
+#endif
+static constexpr uint32_t bw_chunk_size = BW_CHUNK_SIZE;
+
+// Merges rhs's registers into lhs's
+template<typename T>
+void reduce_pair(T &lhs, T &rhs) {
+    const size_t n = lhs.size();
+    OMP_PRAGMA("omp simd")
+    for(size_t i = 0; i < n; ++i){
+        lhs[i] = std::min(lhs[i], rhs[i]);
+    }
+}
 
 }
 #endif
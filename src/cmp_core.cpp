@@ -1,41 +1,25 @@
 #include "cmp_main.h"
-#include "sketch/count_eq.h"
+#include "tilecmp.h"
 #include "sketch/hash.h"
 #include "index_build.h"
 #include "refine.h"
 #include "emitnn.h"
 #include "mio.hpp"
 #include "wcompare.h"
+#include "kmerstore.h"
+#include "lshindex.h"
 #include "options.h"
 #include "edlib.h"
+#include "kernels.h"
 
 #include <span>
+#include <unistd.h>
 
 namespace dashing2 {
 std::pair<std::vector<LSHIDType>, std::vector<std::vector<LSHIDType>>> dedup_core(sketch::lsh::SetSketchIndex<LSHIDType, LSHIDType> &idx, const Dashing2DistOptions &opts, const SketchingResult &result);
 void dedup_emit(const std::vector<LSHIDType> &, const std::vector<std::vector<LSHIDType>> &constituents, const Dashing2DistOptions &opts, const SketchingResult &result);
 
 
-template<typename T> INLINE uint64_t reg2sig(const T x) {
-    if constexpr(sizeof(T) <= 4) {
-        uint32_t v = 0;
-        std::memcpy(&v, &x, sizeof(T));
-        return sketch::hash::WangHash::hash(v ^ 0xa3407fb23cd20eful);
-    }
-    uint64_t v;
-    std::memcpy(&v, &x, sizeof(uint64_t));
-    uint64_t hashvalue = sketch::hash::WangHash::hash(v ^ 0xa3407fb23cd20eful);
-    if constexpr(sizeof(T) == 8) {
-        return hashvalue;
-    }
-    for(size_t i = 1; i < sizeof(T) / sizeof(uint64_t); ++i) {
-        std::memcpy(&v, &x, sizeof(uint64_t));
-        const uint64_t new_hash_value = sketch::hash::WangHash::hash(v ^ hashvalue);
-        hashvalue ^= new_hash_value;
-    }
-    return hashvalue;
-}
-
 template<typename T>
 size_t simdcount(const T *ptr, size_t n, const T v=static_cast<T>(0)) {
     size_t ret = 0;
@@ -46,121 +30,6 @@ size_t simdcount(const T *ptr, size_t n, const T v=static_cast<T>(0)) {
     return ret;
 }
 
-namespace detail{
-#if 0
-INLINE void setnthbit(uint64_t *ptr, size_t index, bool val) {
-    ptr[index / 64] |= uint64_t(val) << (index % 64);
-}
-template<typename T> INLINE void setnthbit(T *ptr, size_t index, bool val) {
-    return setnthbit(reinterpret_cast<uint64_t *>(ptr), index, val);
-}
-
-static INLINE uint64_t getnthbit(const uint64_t *ptr, size_t index) {
-    return (ptr[index / 64] >> (index % 64)) & 1u;
-}
-
-template<typename T> INLINE T getnthbit(const T *ptr, size_t index) {
-    return T(getnthbit(reinterpret_cast<const uint8_t *>(ptr), index));
-}
-INLINE uint64_t getnthbit(uint64_t val, size_t index) {
-    return getnthbit(&val, index);
-}
-
-
-#if __SSE2__
-
-INLINE bool is_all_zeros(__m128i x) {
-#if __SSE4_1__
-    return _mm_test_all_zeros(x, x);
-#else
-    return _mm_movemask_epi8(_mm_cmpeq_epi32(x,_mm_setzero_si128())) == 0xFFFF;
-#endif
-}
-
-INLINE uint64_t matching_bits(const __m128i *s1, const __m128i *s2, uint16_t b) {
-    --b;
-    __m128i match = ~(*s1++ ^ *s2++);
-    while(b >= 4) {
-        match &= (~(*s1 ^ *s2)) & (~(s1[1] ^ s2[1])) & (~(s1[2] ^ s2[2])) & (~(s1[3] ^ s2[3]));
-        s1 += 4;
-        s2 += 4;
-        b -= 4;
-        if(is_all_zeros(match)) return 0;
-    }
-    while(b-- && !is_all_zeros(match)) match &= ~(*s1++ ^ *s2++);
-    return popcount(common::vatpos(match, 0)) + popcount(common::vatpos(match, 1));
-}
-#endif
-
-#if __AVX2__
-INLINE bool is_all_zeros(__m256i x) {return _mm256_testz_si256(x, x);}
-INLINE auto matching_bits(const __m256i *s1, const __m256i *s2, uint16_t b) {
-    // Only do popcnt if match is nonzero
-    --b;
-    __m256i match = ~(*s1++ ^ *s2++);
-    while(b >= 4) {
-        match &= (~(*s1 ^ *s2)) & (~(s1[1] ^ s2[1])) & (~(s1[2] ^ s2[2])) & (~(s1[3] ^ s2[3]));
-        b -= 4;
-        s1 += 4;
-        s2 += 4;
-        if(is_all_zeros(match)) return match;
-    }
-    switch(b) {
-        case 3: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 2: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 1: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 0: default: ;
-    }
-    return is_all_zeros(match) ? match: popcnt256(match);
-}
-#endif
-
-
-#if HAS_AVX_512
-INLINE bool is_all_zeros(__m512i x) {
-    return _mm512_test_epi64_mask(x, x) == 0;
-}
-INLINE auto sbit_accum(const __m512i *s1, const __m512i *s2, uint16_t b) {
-    __m512i match = ~(*s1++ ^ *s2++);
-    while(--b)
-        match &= ~(*s1++ ^ *s2++);
-    return match;
-}
-INLINE auto matching_bits(const __m512i *s1, const __m512i *s2, uint16_t b) {
-#define ONE_ITER do {\
-        match &= (~(*s1 ^ *s2)) & (~(s1[1] ^ s2[1])) & (~(s1[2] ^ s2[2])) & (~(s1[3] ^ s2[3])); \
-        if(is_all_zeros(match)) return match;\
-        b -= 4; s1 += 4; s2 += 4;\
-        } while(0)
-    // Only do popcnt if match is nonzero
-    --b;
-    __m512i match = ~(*s1++ ^ *s2++);
-    while(b >= 4) {
-        switch(b >> 2) {
-            case 8: ONE_ITER;[[fallthrough]];
-            case 7: ONE_ITER;[[fallthrough]];
-            case 6: ONE_ITER;[[fallthrough]];
-            case 5: ONE_ITER;[[fallthrough]];
-            case 4: ONE_ITER;[[fallthrough]];
-            case 3: ONE_ITER;[[fallthrough]];
-            case 2: ONE_ITER;[[fallthrough]];
-            case 1: ONE_ITER;
-        }
-    }
-#undef ONE_ITER
-    switch(b) {
-        case 3: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 2: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 1: match &= ~(*s1++ ^ *s2++); [[fallthrough]];
-        case 0: default: ;
-    }
-    return is_all_zeros(match) ? match: popcnt512(match);
-}
-#endif
-#endif
-
-} // namespace detail
-
 #ifdef _OPENMP
 #define OMP_STATIC_SCHED32 _Pragma("omp parallel for schedule(static, 32)")
 #else
@@ -225,6 +94,15 @@ void make_compressed(CompressedRet &ret, int truncation_method, double fd, const
     compressed_reps = ptr_roundup(static_cast<void *>(ret.up.get()));
     const size_t nsigs = sigs.size();
     assert(fd != 0.5 || sigs.size() % 2 == 0);
+    // Registers are packed by the dispatched kernels in chunks of an even number, so that nibbles stay paired
+    const KernelTable &kern = kernels();
+    const int width = 2. * fd;
+    auto pack_chunks = [&](const auto &pack) {
+        static constexpr size_t CHUNK = 4096;
+        OMP_PFOR
+        for(size_t i = 0; i < nsigs; i += CHUNK)
+            pack(i, std::min(CHUNK, nsigs - i), static_cast<uint8_t *>(compressed_reps) + size_t(i * fd));
+    };
     if(is_edit_distance) {
         const uint64_t *sptr = (const uint64_t *)sigs.data();
         if(fd == 0.5) {
@@ -267,63 +145,13 @@ void make_compressed(CompressedRet &ret, int truncation_method, double fd, const
         }
         ret.a(a); ret.b(b);
         logbinv = 1.L / std::log1p(b - 1.L);
-        if(fd == 0.5) {
-            OMP_STATIC_SCHED32
-            for(size_t i = 0; i < nsigs / 2; ++i) {
-                const auto lowerv = std::max((1.L - std::log(sigs[2 * i] / a) * logbinv), 0.L);
-                const auto higherv = std::max((1.L - std::log(sigs[2 * i + 1] / a) * logbinv), 0.L);
-                const uint8_t lower_half = std::max(0, std::min(int(q) + 1, static_cast<int>(lowerv)));
-                const uint8_t upper_half = std::max(0, std::min(int(q) + 1, static_cast<int>(higherv))) << 4;
-                ((uint8_t *)compressed_reps)[i] = lower_half | upper_half;
-            }
-        } else {
-            OMP_STATIC_SCHED32
-            for(size_t i = 0; i < nsigs; ++i) {
-                const long double sub = 1.L - std::log(static_cast<long double>(sigs[i]) / a) * logbinv;
-                if(fd == 8) {
-                    ((uint64_t *)compressed_reps)[i] = std::min(uint64_t(q + 1), uint64_t(sub));
-                } else {
-                    const int64_t isub = std::max(int64_t(0), std::min(int64_t(q + 1), static_cast<int64_t>(sub)));
-                    if(fd == 4)      ((uint32_t *)compressed_reps)[i] = isub;
-                    else if(fd == 2) ((uint16_t *)compressed_reps)[i] = isub;
-                    else             ((uint8_t *)compressed_reps)[i] = isub;
-                }
-            }
-        }
+        pack_chunks([&](size_t i, size_t n, void *out) {kern.pack_setsketch(&sigs[i], n, width, a, logbinv, q, out);});
+    } else if(kmers.size()) {
+        pack_chunks([&](size_t i, size_t n, void *out) {kern.pack_bbit_kmers(&kmers[i], n, width, out);});
     } else {
-        //bbit:
-        auto getsig = [kne=!kmers.empty(),&sigs,&kmers](auto x) -> uint64_t {
-            return kne ? sketch::hash::WangHash::hash(kmers[x]): reg2sig(sigs[x]);
-        };
-        if(fd == 0.5) {
-            uint8_t *ptr = (uint8_t *)compressed_reps;
-            OMP_STATIC_SCHED32
-            for(size_t i = 0; i < nsigs / 2; ++i) {
-                const uint64_t sig1 = getsig(2 * i), sig2 = getsig(2 * i + 1);
-                ptr[i] = (sig1 & 0xfu) | ((sig2 & 0xfu) << 4);
-            }
-        } else {
-            static constexpr int shift [] {0, 58, 48, 0, 32, 0, 0, 0, 0, 0};
-            static_assert(shift[1] == 58, "Shift 1 must be 58");
-            static_assert(shift[2] == 48, "Shift 2 must be 48");
-            static_assert(shift[4] == 32, "Shift 4 must be 32");
-            static_assert(shift[8] == 0, "Shift 8 must be 0");
-            const int myshift = shift[int(fd)];
-            OMP_STATIC_SCHED32
-            for(size_t i = 0; i < nsigs; ++i) {
-                const uint64_t sig = getsig(i) >> myshift;
-                if(fd == 8) ((uint64_t *)compressed_reps)[i] = sig;
-                else if(fd == 4) ((uint32_t *)compressed_reps)[i] = sig;
-                else if(fd == 2) ((uint16_t *)compressed_reps)[i] = sig;
-                else ((uint8_t *)compressed_reps)[i] = sig;
-            }
-        }
+        pack_chunks([&](size_t i, size_t n, void *out) {kern.pack_bbit_regs(&sigs[i], n, width, out);});
     }
 }
-static inline long double g_b(long double b, long double arg) {
-    return (1.L - std::pow(b, -arg)) / (1.L - 1.L / b);
-}
-
 #if COUNT_COMPARE_CALLS
 std::atomic<uint64_t> compare_count{0};
 #endif
@@ -346,7 +174,29 @@ int32_t edlib_edit_distance(const T&x, const T& y) {
     return result.editDistance;
 }
 
-LSHDistType compare(const Dashing2DistOptions &opts, const SketchingResult &result, size_t i, size_t j) {
+LSHDistType compare_sketches(const Dashing2DistOptions &opts, const RegT *lhsrc, const RegT *rhsrc, double lhcard, double rhcard) {
+    const MeasureFinalizer fin(opts);
+    long double ret;
+    if(opts.sspace_ == SPACE_SET && opts.truncation_method_ <= 0) {
+        const auto gtlt = kernels().count_gtlt(lhsrc, rhsrc, opts.sketchsize_);
+        assert((opts.sketchsize_ - (gtlt.first + gtlt.second)) == std::inner_product(lhsrc, lhsrc + opts.sketchsize_, rhsrc, size_t(0), std::plus<>(), std::equal_to<>()));
+        if(verbosity >= Verbosity::DEBUG) {
+            const int counteqman = std::inner_product(lhsrc, lhsrc + opts.sketchsize_, rhsrc, size_t{0}, std::plus<>{}, std::equal_to<>{});
+            std::fprintf(stderr, "gtlt: %d/%d. Out of %d. Number equal simd/manual: %d/%d.\n", int(gtlt.first), int(gtlt.second), int(opts.sketchsize_), int(kernels().count_eq(lhsrc, rhsrc, opts.sketchsize_)), counteqman);
+        }
+        ret = fin.fullsetsketch(gtlt.first, gtlt.second, lhcard, rhcard);
+        if(verbosity >= Verbosity::DEBUG) {
+            std::fprintf(stderr, "%s: %g\n", to_string(opts.measure_).data(), double(ret));
+        }
+        assert(ret >= 0. || !std::fprintf(stderr, "measure: %s. value: %g\n", to_string(opts.measure_).data(), double(ret)));
+    } else {
+        const auto neq = kernels().count_eq(lhsrc, rhsrc, opts.sketchsize_);
+        ret = fin.exactreg(neq, lhcard, rhcard);
+    }
+    return MeasureFinalizer::finish(ret);
+}
+
+static LSHDistType compare_pair(const Dashing2DistOptions &opts, const SketchingResult &result, size_t i, size_t j) {
 #if COUNT_COMPARE_CALLS
     ++compare_count;
 #endif
@@ -357,8 +207,8 @@ LSHDistType compare(const Dashing2DistOptions &opts, const SketchingResult &resu
 #endif
     long double ret = std::numeric_limits<LSHDistType>::max();
     const long double lhcard = result.cardinalities_.at(i), rhcard = result.cardinalities_.at(j);
-    const long double invdenom = 1.L / opts.sketchsize_;
-    auto sim2dist = [poisson_mult=-1. / std::max(1, opts.k_)](auto x) -> double {if(x) return std::log(2. * x / (1. + x)) * poisson_mult; return std::numeric_limits<double>::infinity();};
+    const MeasureFinalizer fin(opts);
+    auto sim2dist = [&fin](auto x) -> double {return fin.sim2dist(x);};
     if(opts.compressed_ptr_) {
         if(verbosity >= EXTREME) {
             std::fprintf(stderr, "Comparing compressed representations.\n");
@@ -375,12 +225,12 @@ LSHDistType compare(const Dashing2DistOptions &opts, const SketchingResult &resu
                 CASE_ENTRY(4, uint16_t)\
                 CASE_ENTRY(2, uint8_t)
 #define CASE_ENTRY(v, TYPE)\
-case v: {TYPE *ptr = static_cast<TYPE *>(opts.compressed_ptr_); equal_regs = sketch::eq::count_eq(ptr + i * opts.sketchsize_, ptr + j * opts.sketchsize_, opts.sketchsize_);} break;
+case v: {TYPE *ptr = static_cast<TYPE *>(opts.compressed_ptr_); equal_regs = kernels().count_eq(ptr + i * opts.sketchsize_, ptr + j * opts.sketchsize_, opts.sketchsize_);} break;
                 CASEPOW2
 #undef CASE_ENTRY
                 case 1: {
                     uint8_t *ptr = static_cast<uint8_t *>(opts.compressed_ptr_);
-                    equal_regs = sketch::eq::count_eq_nibbles(ptr + i * opts.sketchsize_ / 2, ptr + j * opts.sketchsize_ / 2, opts.sketchsize_);
+                    equal_regs = kernels().count_eq_nibbles(ptr + i * opts.sketchsize_ / 2, ptr + j * opts.sketchsize_ / 2, opts.sketchsize_);
                     break;
                 }
                 default: __builtin_unreachable();
@@ -390,63 +240,20 @@ case v: {TYPE *ptr = static_cast<TYPE *>(opts.compressed_ptr_); equal_regs = ske
 #define CASE_ENTRY(v, TYPE)\
 case v: {\
     TYPE *ptr = static_cast<TYPE *>(opts.compressed_ptr_);\
-    res = sketch::eq::count_gtlt(ptr + i * opts.sketchsize_, ptr + j * opts.sketchsize_, opts.sketchsize_);\
+    res = kernels().count_gtlt(ptr + i * opts.sketchsize_, ptr + j * opts.sketchsize_, opts.sketchsize_);\
     } break;
                 CASEPOW2
 #undef CASE_ENTRY
 #undef CASEPOW2
                 case 1: {
                     uint8_t *ptr = static_cast<uint8_t *>(opts.compressed_ptr_);
-                    res = sketch::eq::count_gtlt_nibbles(ptr + i * opts.sketchsize_ / 2, ptr + j * opts.sketchsize_ / 2, opts.sketchsize_);
+                    res = kernels().count_gtlt_nibbles(ptr + i * opts.sketchsize_ / 2, ptr + j * opts.sketchsize_ / 2, opts.sketchsize_);
                     break;
                 }
                 default: __builtin_unreachable();
             }
         }
-        if(bbit_c) {
-            // ret = ((num / denom) - (1. / 2^b)) / (1. - 1. / 2^b);
-            // maps equality to 1 and down-estimates for account for collisions
-            const long double b2pow = -std::ldexp(1.L, -static_cast<int>(opts.fd_level_ * 8.));
-            ret = std::max(0.L, std::fma(res.first, invdenom, b2pow) / (1.L + b2pow));
-            if(opts.measure_ == INTERSECTION || opts.measure_ == UNION_SIZE) {
-                const long double isz = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L);
-                if(opts.measure_ == INTERSECTION) {
-                    ret = isz;
-                } else { // UNION_SIZE
-                    ret = lhcard + rhcard - isz;
-                }
-            } else if(opts.measure_ == CONTAINMENT)
-                ret = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L) * ret / lhcard;
-            else if(opts.measure_ == POISSON_LLR)
-                ret = sim2dist(ret);
-            else if(opts.measure_ == SYMMETRIC_CONTAINMENT)
-                ret = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L) * ret / std::min(lhcard, rhcard);
-        } else {
-            long double alpha = res.first * invdenom;
-            long double beta = res.second * invdenom;
-            const long double b = opts.compressed_b_;
-            long double mu;
-            if(opts.fd_level_ < sizeof(RegT)) {
-                alpha = g_b(b, alpha);
-                beta = g_b(b, beta);
-            }
-            if(alpha + beta >= 1.) {
-                mu = lhcard + rhcard;
-            } else {
-                mu = std::max((lhcard + rhcard) / (2.L - alpha - beta), 0.L);
-            }
-            auto triple = std::make_tuple(alpha, beta, mu);
-            ret = std::max(1.L - (std::get<0>(triple) + std::get<1>(triple)), 0.L);
-            switch(opts.measure_) {
-                case INTERSECTION: ret *= mu; break;
-                case UNION_SIZE: ret = lhcard + rhcard - (ret * mu); break;
-                case CONTAINMENT: ret  = ret * mu / lhcard; break;
-                case SYMMETRIC_CONTAINMENT:
-                    ret = (ret * mu) / std::min(lhcard, rhcard); break;
-                case POISSON_LLR: ret = sim2dist(ret); break;
-                default: ;
-            }
-        }
+        ret = bbit_c ? fin.bbit(res.first, lhcard, rhcard): fin.setsketch(res.first, res.second, lhcard, rhcard);
     } else if(opts.sspace_ == SPACE_EDIT_DISTANCE && (opts.exact_kmer_dist_ || opts.measure_ == M_EDIT_DISTANCE)) {
         assert(result.sequences_.size() > std::max(i, j) || !std::fprintf(stderr, "Expected sequences to be non-null for exact edit distance calculation (%zu vs %zu/%zu)\n", result.sequences_.size(), i, j));
         const auto& lhs = result.sequences_[i];
@@ -456,65 +263,17 @@ case v: {\
         }
         return edlib_edit_distance(lhs, rhs);
     } else if(opts.kmer_result_ <= FULL_SETSKETCH) {
-        const RegT *lhsrc = &result.signatures_[opts.sketchsize_ * i], *rhsrc = &result.signatures_[opts.sketchsize_ * j];
-        if(opts.sspace_ == SPACE_SET && opts.truncation_method_ <= 0) {
-            const auto gtlt = sketch::eq::count_gtlt(lhsrc, rhsrc, opts.sketchsize_);
-            long double alpha, beta, eq, lhcard, ucard, rhcard;
-            alpha = gtlt.first * invdenom;
-            beta = gtlt.second * invdenom;
-            assert((opts.sketchsize_ - (gtlt.first + gtlt.second)) == std::inner_product(lhsrc, lhsrc + opts.sketchsize_, rhsrc, size_t(0), std::plus<>(), std::equal_to<>()));
-            lhcard = result.cardinalities_[i], rhcard = result.cardinalities_[j];
-            eq = (1. - alpha - beta);
-            ucard = std::max((lhcard + rhcard) / (2.L - alpha - beta), 0.L);
-            if(verbosity >= Verbosity::DEBUG) {
-                const int counteqman = std::inner_product(lhsrc, lhsrc + opts.sketchsize_, rhsrc, size_t{0}, std::plus<>{}, std::equal_to<>{});
-                std::fprintf(stderr, "gtlt: %d/%d between %zu and %zu. Out of %d. Number equal simd/manual: %d/%d.  alpha: %g. beta: %g. ucard: %g\n", int(gtlt.first), int(gtlt.second), i, j, int(opts.sketchsize_), int(sketch::eq::count_eq(lhsrc, rhsrc, opts.sketchsize_)), counteqman, double(alpha), double(beta), double(ucard));
-            }
-            if(eq <= 0.) {
-                return opts.measure_ != POISSON_LLR ? 0.: std::numeric_limits<double>::max();
-            }
-            static constexpr long double EPS = 1e-15;
-            if(eq <= EPS) {
-                eq = 0;
-            }
-            const LSHDistType isz = ucard * eq, sim = eq;
-            switch(opts.measure_) {
-                case SIMILARITY: ret = sim; break;
-                case INTERSECTION: ret = isz; break;
-                case CONTAINMENT: ret = isz / rhcard; break;
-                case SYMMETRIC_CONTAINMENT: ret = isz / (std::min(lhcard, rhcard)); break;
-                case POISSON_LLR: ret = sim2dist(sim); break;
-                case UNION_SIZE: ret = lhcard + rhcard - isz; break;
-                default: ret = LSHDistType(-1); break; // This never happens
-            }
-            if(verbosity >= Verbosity::DEBUG) {
-                std::fprintf(stderr, "sim: %g. isz: %g. llr: %g\n", double(sim), double(isz), double(sim2dist(sim)));
-            }
-
-            assert(ret >= 0. || !std::fprintf(stderr, "measure: %s. sim: %g. isz: %g\n", to_string(opts.measure_).data(), sim, isz));
-        } else {
-            const RegT *sptr = result.signatures_.data();
-            if constexpr(sizeof(RegT) == 8) {
-                // If RegT are the same size as k-mers, compare the k-mers themselves
-                // instead of the doubles
-                // Since we're only comparing for equality, this can only improve accuracy
-                if(result.kmers_.size() == result.signatures_.size() && !opts.use128()) {
-                    DBG_ONLY(std::fprintf(stderr, "Comparing k-mers sampled rather than the items themselves. This should be more specific, since there is 0 chance of collisions.\n");)
-                    sptr = reinterpret_cast<const RegT *>(result.kmers_.data());
-                }
-            }
-            const auto neq = sketch::eq::count_eq(&sptr[opts.sketchsize_ * i], &sptr[opts.sketchsize_ * j], opts.sketchsize_);
-            ret = invdenom * neq;
-            if(opts.measure_ == INTERSECTION) {
-                ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L);
-            } else if(opts.measure_ == SYMMETRIC_CONTAINMENT) ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L) / std::min(lhcard, rhcard);
-            else if(opts.measure_ == CONTAINMENT) ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L) / lhcard;
-            else if(opts.measure_ == POISSON_LLR) ret = sim2dist(ret);
-            else if(opts.measure_ == UNION_SIZE) {
-                const long double isz = ret * std::max((lhcard + rhcard) / (1.L + ret), 0.L);
-                ret = (lhcard + rhcard - isz);
+        const RegT *sptr = result.signatures_.data();
+        if constexpr(sizeof(RegT) == 8) {
+            // If RegT are the same size as k-mers, compare the k-mers themselves
+            // instead of the doubles
+            // Since we're only comparing for equality, this can only improve accuracy
+            if(!(opts.sspace_ == SPACE_SET && opts.truncation_method_ <= 0) && result.kmers_.size() == result.signatures_.size() && !opts.use128()) {
+                DBG_ONLY(std::fprintf(stderr, "Comparing k-mers sampled rather than the items themselves. This should be more specific, since there is 0 chance of collisions.\n");)
+                sptr = reinterpret_cast<const RegT *>(result.kmers_.data());
             }
         }
+        return compare_sketches(opts, &sptr[opts.sketchsize_ * i], &sptr[opts.sketchsize_ * j], lhcard, rhcard);
     } else {
 #define CORRECT_RES(res, measure, lhc, rhc)\
             if(measure == SYMMETRIC_CONTAINMENT) \
@@ -524,6 +283,14 @@ case v: {\
                 if(measure == POISSON_LLR) res = sim2dist(res);\
             } else if(measure == CONTAINMENT) res /= lhc;\
             ret = res;
+        if(opts.kmerstore_) {
+            // Sets are loaded once and kept resident, rather than re-read for every pair
+            const auto lhs = opts.kmerstore_->get(i), rhs = opts.kmerstore_->get(j);
+            double res = opts.kmerstore_->intersection(*lhs, *rhs);
+            const double lhc = lhs->card_, rhc = rhs->card_;
+            CORRECT_RES(res, opts.measure_, lhc, rhc)
+            return MeasureFinalizer::finish(ret);
+        }
         const std::string &lpath = result.destination_files_[i], &rpath = result.destination_files_[j];
         if(lpath.empty() || rpath.empty()) THROW_EXCEPTION(std::runtime_error("Destination files for k-mers empty -- cannot load from disk"));
         std::FILE *lhk = 0, *rhk = 0, *lhn = 0, *rhn = 0;
@@ -570,8 +337,12 @@ case v: {\
 #undef CORRECT_RES
         // Compare exact representations, not compressed shrunk
     }
-    if(std::isnan(ret) || std::isinf(ret)) ret = std::numeric_limits<decltype(ret)>::max();
-    return ret;
+    return MeasureFinalizer::finish(ret);
+}
+
+// Compiled per ISA level, and the CPU's is selected (kernels.h)
+LSHDistType compare(const Dashing2DistOptions &opts, const SketchingResult &result, size_t i, size_t j) {
+    return dispatched([&]() {return compare_pair(opts, result, i, j);});
 }
 
 template<typename MHT>
@@ -612,16 +383,7 @@ inline size_t densify(std::span<MHT> minhashes, uint64_t *const kmers, const sch
     return ne;
 }
 
-void cmp_core(const Dashing2DistOptions &opts, SketchingResult &result) {
-    if(verbosity >= EXTREME) {
-        std::fprintf(stderr, "Beginning cmp_core");
-    }
-    if(opts.sketch_compressed() && opts.truncate_mode() != 0) {
-        THROW_EXCEPTION(std::invalid_argument("Can't use truncated setsketch generation with bbit signatures. Omit --bbit-sigs or --setsketch-ab"));
-    }
-    if(opts.sketch_compressed() && opts.save_kmers()) {
-        THROW_EXCEPTION(std::invalid_argument("Can't use truncated setsketch generation --save-kmers. Omit --save-kmers or --setsketch-ab"));
-    }
+void prepare_results(const Dashing2DistOptions &opts, SketchingResult &result) {
     // We handle some details before dispatching the final comparison code
     // First, we compute cardinalities for sets/multisets
     // and then we densify one-permutation minhashing
@@ -731,6 +493,23 @@ void cmp_core(const Dashing2DistOptions &opts, SketchingResult &result) {
         }
         std::fprintf(stderr, "Result type: %s\n", to_string(opts.kmer_result_).data());
     )
+}
+
+void cmp_core(const Dashing2DistOptions &opts, SketchingResult &result) {
+    if(verbosity >= EXTREME) {
+        std::fprintf(stderr, "Beginning cmp_core");
+    }
+    if(opts.sketch_compressed() && opts.truncate_mode() != 0) {
+        THROW_EXCEPTION(std::invalid_argument("Can't use truncated setsketch generation with bbit signatures. Omit --bbit-sigs or --setsketch-ab"));
+    }
+    if(opts.sketch_compressed() && opts.save_kmers()) {
+        THROW_EXCEPTION(std::invalid_argument("Can't use truncated setsketch generation --save-kmers. Omit --save-kmers or --setsketch-ab"));
+    }
+    prepare_results(opts, result);
+    if(LSH_INDEX_PATH.size()) {
+        query_lsh_index(LSH_INDEX_PATH, opts, result);
+        return;
+    }
     if(opts.kmer_result_ <= FULL_MMER_SET && opts.fd_level_ < sizeof(RegT)) {
         if(result.signatures_.empty()) THROW_EXCEPTION(std::runtime_error("Empty signatures; trying to compress registers but don't have any"));
     }
@@ -743,6 +522,25 @@ void cmp_core(const Dashing2DistOptions &opts, SketchingResult &result) {
         std::fprintf(stderr, "Made compressed.\n");
     }
     std::tie(opts.compressed_ptr_, opts.compressed_a_, opts.compressed_b_) = cret;
+    if(opts.exact_kmer_dist_ && !opts.compressed_ptr_ && (opts.kmer_result_ == FULL_MMER_SET || opts.kmer_result_ == FULL_MMER_COUNTDICT)
+       && result.destination_files_.size()) {
+        size_t budget = EXACT_CACHE_BYTES;
+        if(!budget) {
+            // By default, allow resident sets to use half of physical memory
+            budget = size_t(::sysconf(_SC_PHYS_PAGES)) * size_t(::sysconf(_SC_PAGE_SIZE)) / 2;
+        }
+        opts.kmerstore_ = std::make_shared<KmerSetStore>(opts, result, budget);
+    }
+    if(opts.output_kind_ == PAIRLIST) {
+        emit_pairs(opts, result);
+        return;
+    }
+    if(opts.threshold_all_pairs_) {
+        if(opts.output_kind_ != SYMMETRIC_ALL_PAIRS && opts.output_kind_ != ASYMMETRIC_ALL_PAIRS && opts.output_kind_ != PANEL)
+            THROW_EXCEPTION(std::invalid_argument("--all-pairs-threshold requires symmetric, asymmetric (--asymmetric-all-pairs) or panel (-Q) output, not "s + to_string(opts.output_kind_)));
+        emit_thresholded(opts, result);
+        return;
+    }
     if(opts.output_kind_ <= ASYMMETRIC_ALL_PAIRS || opts.output_kind_ == PANEL) {
         if(verbosity >= Verbosity::DEBUG) {
             std::fprintf(stderr, "before calling emit_rectangular, output format is %s\n", to_string(opts.output_format_).data());
@@ -754,22 +552,7 @@ void cmp_core(const Dashing2DistOptions &opts, SketchingResult &result) {
     // thresholded nn graphs
 
     // Step 1: Build LSH Index
-    std::vector<uint64_t> nperhashes;
-    while(nperhashes.size() < opts.nLSH) {
-        nperhashes.emplace_back(nperhashes.size() < 3 ? (1ull << nperhashes.size()): static_cast<unsigned long long>(nperhashes.size() * 2));
-    }
-    std::vector<uint64_t> nperrows(nperhashes.size());
-    for(size_t i = 0; i < nperhashes.size(); ++i) {
-        const auto nh = nperhashes[i];
-        auto &np = nperrows[i];
-        if(nh <= 2) {
-            np = opts.sketchsize_ / nh;
-        } else {
-            np = opts.sketchsize_ * 8 / nh;
-        }
-    }
-    using SSI = SetSketchIndex<LSHIDType, LSHIDType>;
-    SSI idx(opts.kmer_result_ < FULL_MMER_SET ? SSI(opts.sketchsize_, nperhashes, nperrows): SSI());
+    SetSketchIndex<LSHIDType, LSHIDType> idx(make_index(opts));
 
 
     // Step 2: Build nearest-neighbor candidate table
@@ -2,6 +2,8 @@
 #include "sketch_core.h"
 #include "options.h"
 #include "refine.h"
+#include "lshindex.h"
+#include "stackdb.h"
 #include <type_traits>
 
 namespace dashing2 {
@@ -21,6 +23,14 @@ void cmp_usage() {
                          SHARED_DOC_LINES
     );
 }
+void index_usage() {
+    std::fprintf(stderr, "dashing2 index <opts> --index <path> [fastas... or a single stacked sketch with --presketched]\n"
+                         "Sketches (or loads) a collection and writes a persistent LSH index over it to <path>, with names at <path>.names.txt.\n"
+                         "Query it with `dashing2 cmp --index <path> --topk <k>` (or --similarity-threshold), using the same sketch options.\n"
+                         "--presketched\t Index pre-sketched data (e.g., from dashing2 sketch -o path) rather than sketching inputs.\n"
+                         SHARED_DOC_LINES
+    );
+}
 void load_results(Dashing2DistOptions &opts, SketchingResult &result, const std::vector<std::string> &paths) {
     DBG_ONLY(std::fprintf(stderr, "Loading results using Dashing2Options: %s\n", opts.to_string().data());)
     if(verbosity >= Verbosity::INFO) {
@@ -71,7 +81,20 @@ void load_results(Dashing2DistOptions &opts, SketchingResult &result, const std:
         }
         // sketch size (64-bit integer)
         uint64_t sketchsize;
-        if(std::fread(&sketchsize, sizeof(sketchsize), 1, fp) != 1) {
+        // Stacked sketches which have been appended to (see stackdb.h) have a header, and room for more cardinalities
+        StackedHeader shdr;
+        const bool appendable = read_stacked_header(pf, shdr);
+        if(appendable) {
+            num_entities = shdr.nentities_;
+            sketchsize = shdr.sketchsize_;
+            std::fseek(fp, shdr.cardinality_offset(), SEEK_SET);
+            // Names past the committed count are from an interrupted append
+            if(result.names_.size() > num_entities) {
+                result.names_.resize(num_entities);
+                if(result.cardinalities_.size() > num_entities) result.cardinalities_.resize(num_entities);
+                if(result.kmercountfiles_.size() > num_entities) result.kmercountfiles_.resize(num_entities);
+            }
+        } else if(std::fread(&sketchsize, sizeof(sketchsize), 1, fp) != 1) {
             THROW_EXCEPTION(std::runtime_error(std::string("Failed to read sketch size from file ") + pf + " of size " + std::to_string(st.st_size)));
         }
         opts.sketchsize_ = sketchsize;
@@ -89,9 +112,10 @@ void load_results(Dashing2DistOptions &opts, SketchingResult &result, const std:
         if(std::fread(result.cardinalities_.data(), sizeof(double), result.cardinalities_.size(), fp) != result.cardinalities_.size())
             THROW_EXCEPTION(std::runtime_error("Failed to read cardinalities from disk"));
         std::fclose(fp);
-        const size_t offset = (num_entities + 2) * sizeof(uint64_t);
+        const size_t offset = appendable ? shdr.register_offset(): (num_entities + 2) * sizeof(uint64_t);
         assert((st.st_size - offset) % sizeof(RegT) == 0);
         result.signatures_.assign(pf, offset, (st.st_size - offset) / sizeof(RegT));
+        if(appendable) result.signatures_.resize(num_entities * sketchsize);
     } else { // Else, we have to load sketches from each file
         if(verbosity >= Verbosity::INFO ) {
             std::fprintf(stderr, "Parsing in data from file\n");
@@ -197,7 +221,7 @@ void load_results(Dashing2DistOptions &opts, SketchingResult &result, const std:
     }
 }
 
-int cmp_main(int argc, char **argv) {
+static int cmp_main_(int argc, char **argv, bool build_index) {
     int c;
     int k = -1, w = 0, nt = -1;
     SketchSpace sketch_space = SPACE_SET;
@@ -208,7 +232,10 @@ int cmp_main(int argc, char **argv) {
     long double compressed_a = -1.L, compressed_b = -1.L;
     unsigned int count_threshold = 0.;
     double similarity_threshold = -1.;
-    size_t cssize = 0, sketchsize = 1024;
+    bool threshold_all_pairs = false;
+    MatrixEncoding binary_precision = ENCODE_F32;
+    bool block_compress = false;
+    size_t cssize = 0, sketchsize = 1024, count_filter_bytes = 0;
     std::string ffile, outfile, qfile;
     int option_index = 0;
     bns::RollingHashingType rht = bns::DNA;
@@ -226,12 +253,13 @@ int cmp_main(int argc, char **argv) {
     bool parse_by_seq = false;
     bool hpcompress = false;
     std::string fsarg;
+    double filterset_fpr = -1.;
     Measure measure = SIMILARITY;
     uint64_t seedseed = 0;
     size_t batch_size = 0;
     bool fasta_dedup = false;
     std::string spacing;
-    std::vector<std::pair<uint32_t, uint32_t>> compareids; // TODO: consider a sparse mode comparing only pairs of presented genomes.
+    std::vector<std::pair<uint32_t, uint32_t>> compareids;
     // By default, use full hash values, but allow people to enable smaller
     OutputFormat of = OutputFormat::HUMAN_READABLE;
     if(verbosity >= Verbosity::DEBUG) {
@@ -244,16 +272,31 @@ int cmp_main(int argc, char **argv) {
         std::fprintf(stderr, "output format should be %s before parsing options \n", to_string(of).data());
     }
     for(;(c = getopt_long(argc, argv, "m:p:k:w:c:f:S:F:Q:o:L:vNs2BPWh?ZJGH", cmp_long_options, &option_index)) >= 0;) {switch(c) {
-        case OPTARG_HELP: case '?': case 'h': cmp_usage(); return 1;
+        case OPTARG_HELP: case '?': case 'h': if(build_index) index_usage(); else cmp_usage(); return 1;
         SHARED_FIELDS
     }}
     if(verbosity >= INFO) {
         std::fprintf(stderr, "output format should be %s after parsing options \n", to_string(of).data());
     }
     if(k < 0) k = nregperitem(rht, use128);
+    if(build_index && LSH_INDEX_PATH.empty()) {
+        index_usage();
+        THROW_EXCEPTION(std::invalid_argument("dashing2 index requires an output path (--index <path>)"));
+    }
     if(compareids.empty()) {
         paths.insert(paths.end(), argv + optind, argv + argc);
-    } else if(optind != argc) throw std::runtime_error("CLI paths must be empty to use pairlist mode.");
+    } else if(optind != argc) {
+        throw std::runtime_error("CLI paths must be empty to use pairlist mode.");
+    } else if(ffile.size() || qfile.size()) {
+        throw std::runtime_error("-F/--ffile and -Q/--qfile cannot be used with pairlist mode.");
+    } else if(parse_by_seq) {
+        throw std::runtime_error("pairlist mode compares files, and cannot be used with --parse-by-seq.");
+    } else if(ok != SYMMETRIC_ALL_PAIRS || threshold_all_pairs) {
+        // Set after parsing, so that no other output option can replace it, whatever the argument order
+        throw std::runtime_error("--pairlist cannot be combined with -K/--topk, -T, --greedy, --asymmetric-all-pairs, or --all-pairs-threshold.");
+    } else {
+        ok = OutputKind::PAIRLIST;
+    }
     std::unique_ptr<std::vector<std::string>> qup;
     if(nt < 0) {
         char *s = std::getenv("OMP_NUM_THREADS");
@@ -283,6 +326,7 @@ int cmp_main(int argc, char **argv) {
         .save_kmers(save_kmers)
         .parse_by_seq(parse_by_seq)
         .count_threshold(count_threshold)
+        .count_filter_bytes(count_filter_bytes)
         .homopolymer_compress_minimizers(hpcompress)
         .seedseed(seedseed)
         .fasta_dedup(fasta_dedup);
@@ -293,7 +337,7 @@ int cmp_main(int argc, char **argv) {
     if(hpcompress) {
         if(!opts.homopolymer_compress_minimizers_) THROW_EXCEPTION(std::runtime_error("Failed to hpcompress minimizers"));
     }
-    opts.filterset(fsarg);
+    opts.filterset(fsarg, filterset_fpr);
     // Ensure we pad the number of registers to a multiple of 64 bits.
     opts.bed_parse_normalize_intervals_ = normalize_bed;
     opts.downsample(downsample_frac);
@@ -301,6 +345,10 @@ int cmp_main(int argc, char **argv) {
     default_batchsize(batch_size, distopts);
     distopts.measure_ = measure;
     distopts.cmp_batch_size_ = default_batchsize(batch_size, distopts);
+    distopts.compareids_ = std::move(compareids);
+    distopts.threshold_all_pairs_ = threshold_all_pairs;
+    distopts.output_encoding_ = binary_precision;
+    distopts.block_compress_ = block_compress;
     SketchingResult result;
     if(presketched) {
         std::set<std::string> suffixset;
@@ -362,10 +410,22 @@ int cmp_main(int argc, char **argv) {
             }
         }
     }
+    if(build_index) {
+        prepare_results(distopts, result);
+        write_lsh_index(LSH_INDEX_PATH, distopts, result);
+        return 0;
+    }
     cmp_core(distopts, result);
     return 0;
 }
 
+int cmp_main(int argc, char **argv) {
+    return cmp_main_(argc, argv, false);
+}
+int index_main(int argc, char **argv) {
+    return cmp_main_(argc, argv, true);
+}
+
 
 size_t default_batchsize(size_t &batch_size, const Dashing2DistOptions &opts) {
     if(batch_size == 0) {
@@ -49,6 +49,23 @@ static constexpr inline bool distance(Measure msr) {
 }
 
 
+class KmerSetStore;
+
+// Binary pairlist and thresholded all-pairs output are streams of these records, with no header.
+struct __attribute__((packed)) PairRecord {
+    uint32_t lhs;
+    uint32_t rhs;
+    float value;
+};
+static_assert(sizeof(PairRecord) == 12, "PairRecord must be packed");
+
+// fmt format for values in text output, shared by every emitter so that they print numbers alike
+#if USE_FMT_FPRINTF
+#define D2_VALUE_FMT "{:0.7g}"
+#else
+#define D2_VALUE_FMT "{}"
+#endif
+
 struct Dashing2DistOptions: public Dashing2Options {
     OutputKind output_kind_;
     OutputFormat output_format_;
@@ -56,6 +73,9 @@ struct Dashing2DistOptions: public Dashing2Options {
     // If 1 (> 0), generates b-bit signatures and truncates
     int num_neighbors_ = -1; // Only emits top-"nn" neighbors
     double min_similarity_ = -1.; // Only emit similarities which are above min_similarity_ if nonnegative
+    bool threshold_all_pairs_ = false; // Compare all pairs exhaustively, emitting only those passing min_similarity_
+    MatrixEncoding output_encoding_ = ENCODE_F32; // Value encoding for binary full-matrix output
+    bool block_compress_ = false; // Write binary full-matrix output as a seekable block-compressed container
     mutable void *compressed_ptr_ = nullptr;
     mutable Measure measure_ = SIMILARITY;
     std::string outfile_path_;
@@ -63,6 +83,8 @@ struct Dashing2DistOptions: public Dashing2Options {
     bool refine_exact_ = false;
     size_t cmp_batch_size_ = 16;
     unsigned int nLSH = 2;
+    std::vector<std::pair<uint32_t, uint32_t>> compareids_; // Only used for PAIRLIST output
+    mutable std::shared_ptr<KmerSetStore> kmerstore_; // Resident k-mer sets for exact comparisons; set in cmp_core
     Dashing2DistOptions(Dashing2Options &opts, OutputKind outres, OutputFormat of, double nbytes_for_fastdists=-1, int truncate_method=0, int nneighbors=-1, double minsim=-1., std::string outpath="", bool exact_kmer_dist=false, bool refine_exact=false, int nlshsubs=3):
         Dashing2Options(opts), output_kind_(outres), output_format_(of), outfile_path_(outpath), exact_kmer_dist_(exact_kmer_dist), refine_exact_(refine_exact), nLSH(nlshsubs)
     {
@@ -127,10 +149,18 @@ struct Dashing2DistOptions: public Dashing2Options {
 #endif
     }
 };
+// Computes missing cardinalities and densifies one-permutation sketches; called by cmp_core
+void prepare_results(const Dashing2DistOptions &opts, SketchingResult &res);
 void cmp_core(const Dashing2DistOptions &ddo, SketchingResult &res);
 LSHDistType compare(const Dashing2DistOptions &opts, const SketchingResult &result, size_t i, size_t j);
+// Compares two full-width sketches directly, given their cardinalities
+LSHDistType compare_sketches(const Dashing2DistOptions &opts, const RegT *lhs, const RegT *rhs, double lhcard, double rhcard);
 void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &result);
+void emit_pairs(const Dashing2DistOptions &opts, const SketchingResult &result);
+void emit_thresholded(const Dashing2DistOptions &opts, const SketchingResult &result);
 size_t default_batchsize(size_t &batch_size, const Dashing2DistOptions &opts);
+// Returns the command to decompress path, or an empty string if it is not compressed
+std::string path2cmd(const std::string &path);
 
 
 }
@@ -4,11 +4,11 @@
 #include "bonsai/encoder.h"
 #include "fmt/format.h"
 #include "FastxParser.hpp"
+#include "containidx.h"
+#include "kernels.h"
+#include <condition_variable>
 
 namespace dashing2 {
-template<typename Key, typename V, typename Hash>
-using flat_hash_map = robin_hood::unordered_flat_map<Key, V, Hash>;
-
 int contain_usage() {
     std::fprintf(stderr, "Usage: dashing2 contain <flags> database.kmers <input.fq> <input2.fq>...\n"
                          "This application is inspired by mash screen.\n"
@@ -18,34 +18,89 @@ int contain_usage() {
                          "-o: Set output [stdout]\n"
                          "-b: Emit binary output instead of human-readable.\n"\
                          "-F: read input paths from file at <arg>\n"\
+                         "Streaming:\n"
+                         "-s: Screen the inputs as one stream (e.g., reads as they are sequenced), emitting a snapshot of coverage as it goes.\n"
+                         "    Memory use is fixed however long the stream runs.\n"
+                         "-N: emit a snapshot every <arg> reads. Implies -s. [100000 with -s]\n"
+                         "-T: emit a snapshot every <arg> seconds. Implies -s. [off]\n"
+                         "    Snapshots are also emitted when the stream ends. Each is labeled <reads>:<seconds> in text output,\n"
+                         "    and is written in binary output as if for a single query.\n"
+                         "    A snapshot which falls due while the previous one is being written is taken once that write finishes,\n"
+                         "    so it may count more reads than -N asks for; several falling due during one write yield a single snapshot.\n"
                 );
     return EXIT_FAILURE;
 }
 
-INLINE flat_hash_map<uint64_t, uint64_t> & operator+=(flat_hash_map<uint64_t, uint64_t> &lhs, const flat_hash_map<uint64_t, uint64_t> &rhs) {
-    for(const auto &pair: rhs) {
-        auto lit = lhs.find(pair.first);
-        if(lit != lhs.end()) lit->second += pair.second;
-        else lhs.emplace(pair.first, pair.second);
+// For one query: the number of each reference's k-mers found, and the total number of times they were found
+struct ContainCounts {
+    std::vector<uint32_t> matches_;
+    std::vector<uint64_t> sums_;
+    ContainCounts(size_t nitems=0): matches_(nitems), sums_(nitems) {}
+    ContainCounts &operator+=(const ContainCounts &o) {
+        for(size_t i = 0; i < matches_.size(); ++i) {
+            matches_[i] += o.matches_[i];
+            sums_[i] += o.sums_[i];
+        }
+        return *this;
     }
-    return lhs;
-}
+};
+
+/*
+ * Accumulates a query's k-mers into dense per-reference counts, hashing and looking them up in batches.
+ * first_sight(ki) marks key ki as found and returns whether this is the first time,
+ * so that each k-mer counts once towards matches however often it is found.
+ */
+template<typename FirstSight>
+class ContainCounter {
+    static constexpr size_t BATCH = 256;
+    const ContainIndex &idx_;
+    const KernelTable &kern_;
+    ContainCounts &counts_;
+    const FirstSight &first_sight_;
+    const uint64_t minkmer_, maxkmer_;
+    uint64_t buf_[BATCH];
+    size_t n_ = 0;
+public:
+    ContainCounter(const ContainIndex &idx, ContainCounts &counts, const FirstSight &first_sight):
+        idx_(idx), kern_(kernels()), counts_(counts), first_sight_(first_sight), minkmer_(idx.min_key()), maxkmer_(idx.max_key()) {}
+    void add(uint64_t kmer) {
+        buf_[n_++] = kmer;
+        if(n_ == BATCH) flush();
+    }
+    void flush() {
+        kern_.mask_kmers(buf_, n_);
+        // Sampled k-mers are hashed, so that any outside of the database's range can be discarded with a comparison
+        size_t nin = 0;
+        for(size_t i = 0; i < n_; ++i) {
+            buf_[nin] = buf_[i];
+            nin += buf_[i] >= minkmer_ && buf_[i] <= maxkmer_;
+        }
+        idx_.find_batch(buf_, nin, [this](size_t, size_t ki) {
+            const uint32_t first = first_sight_(ki);
+            for(const uint32_t *p = idx_.ids_begin(ki), *e = idx_.ids_end(ki); p != e; ++p) {
+                counts_.matches_[*p] += first;
+                ++counts_.sums_[*p];
+            }
+        });
+        n_ = 0;
+    }
+};
 
-std::vector<flat_hash_map<uint64_t, uint64_t>> get_results(bns::Encoder<bns::score::Lex, uint64_t> &eenc, bns::RollingHasher<uint64_t> &renc, std::vector<std::string> input_files, const flat_hash_map<uint64_t, std::vector<uint64_t>> &kmer2ids, const uint64_t maxkmer, const uint64_t minkmer) {
-    std::vector<flat_hash_map<uint64_t, uint64_t>> res(input_files.size());
-    //KSeqHolder kseqs(nthreads);
+// Queries input files independently, each by one thread
+std::vector<ContainCounts> get_results(bns::Encoder<bns::score::Lex, uint64_t> &eenc, bns::RollingHasher<uint64_t> &renc, std::vector<std::string> input_files, const ContainIndex &idx) {
+    std::vector<ContainCounts> res(input_files.size());
     OMP_PFOR_DYN
     for(size_t i = 0; i < input_files.size(); ++i) {
-        auto &myres = res[i];
-        auto func = [&](auto kmer) {
-            kmer = maskfn(kmer);
-            if(kmer < minkmer || kmer > maxkmer) return;
-            auto kmeridit = kmer2ids.find(kmer);
-            if(kmeridit == kmer2ids.end()) return;
-            auto it = myres.find(kmer);
-            if(it == myres.end()) myres.emplace(kmer, 1);
-            else ++it->second;
+        res[i] = ContainCounts(idx.nitems());
+        std::vector<uint64_t> seen((idx.nkeys() + 63) / 64);
+        auto first_sight = [&seen](size_t ki) {
+            const uint64_t bit = uint64_t(1) << (ki % 64);
+            const bool ret = !(seen[ki / 64] & bit);
+            seen[ki / 64] |= bit;
+            return ret;
         };
+        ContainCounter<decltype(first_sight)> counter(idx, res[i], first_sight);
+        auto func = [&counter](auto kmer) {counter.add(kmer);};
         auto path = input_files[i].data();
         if(eenc.k() <= eenc.nremperres64()) {
             bns::Encoder<bns::score::Lex, uint64_t> mye(eenc);
@@ -54,27 +109,29 @@ std::vector<flat_hash_map<uint64_t, uint64_t>> get_results(bns::Encoder<bns::sco
             bns::RollingHasher<uint64_t> myr(renc);
             myr.for_each_hash(func, path);
         }
+        counter.flush();
     }
     return res;
 }
 
-template<typename T>
-void par_reduce(T *x, size_t n) {
-    const unsigned int ln = static_cast<int>(std::ceil(std::log2(n)));
-    for(size_t i = 0; i < ln; ++i) {
-        const size_t step_size = size_t(1) << i;
-        const size_t sweep_size = (i + 1) << 1;
-        const size_t nsweeps = (n + (sweep_size - 1)) / sweep_size;
+// Which of an index's keys have been found, shared between threads
+class SharedSeen {
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+public:
+    SharedSeen(size_t nkeys): words_(new std::atomic<uint64_t>[(nkeys + 63) / 64]) {
         OMP_PFOR
-        for(size_t j = 0; j < nsweeps; ++j) {
-            if(const size_t lh = j * sweep_size, rh = lh + step_size; rh < n)
-                x[lh] += x[rh];
-        }
+        for(size_t i = 0; i < (nkeys + 63) / 64; ++i) words_[i].store(0, std::memory_order_relaxed);
     }
-}
+    bool operator()(size_t ki) const {
+        const uint64_t bit = uint64_t(1) << (ki % 64);
+        return !(words_[ki / 64].load(std::memory_order_relaxed) & bit) && !(words_[ki / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+};
 
-flat_hash_map<uint64_t, uint64_t> get_results_sf(bns::Encoder<bns::score::Lex, uint64_t> &eenc, bns::RollingHasher<uint64_t> &renc, std::string input_file, const flat_hash_map<uint64_t, std::vector<uint64_t>> &kmer2ids, const uint64_t maxkmer, const uint64_t minkmer, const int nthreads) {
-    std::vector<flat_hash_map<uint64_t, uint64_t>> res(nthreads);
+// Queries a single input file with nthreads threads, which share which k-mers have been found and sum their counts at the end
+ContainCounts get_results_sf(bns::Encoder<bns::score::Lex, uint64_t> &eenc, bns::RollingHasher<uint64_t> &renc, std::string input_file, const ContainIndex &idx, const int nthreads) {
+    std::vector<ContainCounts> res(nthreads, ContainCounts(idx.nitems()));
+    const SharedSeen first_sight(idx.nkeys());
     std::vector<std::string> sf;
     for_each_substr([&sf](const auto &x) {sf.push_back(x);}, input_file);
     std::vector<std::thread> threads;
@@ -83,15 +140,8 @@ flat_hash_map<uint64_t, uint64_t> get_results_sf(bns::Encoder<bns::score::Lex, u
     parser.start();
     for(size_t i = 0; i < size_t(nthreads); ++i) {
         threads.emplace_back([&,i]() {
-            auto func = [minkmer,maxkmer,&kmer2ids,&myres=res[i]](auto kmer) __attribute__((always_inline)) {
-                kmer = maskfn(kmer);
-                if(kmer < minkmer || kmer > maxkmer) return;
-                auto kmeridit = kmer2ids.find(kmer);
-                if(kmeridit == kmer2ids.end()) return;
-                auto it = myres.find(kmer);
-                if(it == myres.end()) myres.emplace(kmer, 1);
-                else ++it->second;
-            };
+            ContainCounter<decltype(first_sight)> counter(idx, res[i], first_sight);
+            auto func = [&counter](auto kmer) __attribute__((always_inline)) {counter.add(kmer);};
             bns::Encoder<bns::score::Lex, uint64_t> mye(eenc);
             bns::RollingHasher<uint64_t> myr(renc);
             for(auto rg = parser.getReadGroup();parser.refill(rg);) {
@@ -101,18 +151,119 @@ flat_hash_map<uint64_t, uint64_t> get_results_sf(bns::Encoder<bns::score::Lex, u
                     for(const auto &seq: rg) myr.for_each_hash(func, seq.seq.data(), seq.seq.size());
                 }
             }
+            counter.flush();
         });
     }
     for(auto &t: threads) t.join();
     parser.stop();
-    if(nthreads > 1) {
-        OMP_ONLY(omp_set_num_threads(nthreads));
-    }
-    par_reduce(res.data(), res.size());
-    OMP_ONLY(omp_set_num_threads(1));
+    for(size_t i = 1; i < res.size(); ++i) res.front() += res[i];
     return std::move(res.front());
 }
 
+/*
+ * Screens inputs as one stream with nthreads threads, calling emit(counts, reads, seconds) from the calling thread
+ * every snap_reads reads and/or every snap_seconds seconds (when nonzero), and once the stream ends.
+ * Memory is fixed: each thread's counts per reference, and one bit per indexed k-mer for whether it has been found.
+ * Threads hold their own lock while they process a read group. When a snapshot is due, they pause between read groups
+ * while it takes all of those locks and sums their counts, so that it counts exactly the reads it reports.
+ * Threads only pause while counts are summed, not while a snapshot is emitted, so requests made during emit() are
+ * served together by one snapshot once it returns.
+ */
+template<typename Emit>
+void get_results_stream(bns::Encoder<bns::score::Lex, uint64_t> &eenc, bns::RollingHasher<uint64_t> &renc, const std::vector<std::string> &inputs, const ContainIndex &idx, const int nthreads,
+                        size_t snap_reads, double snap_seconds, const Emit &emit)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<ContainCounts> res(nthreads, ContainCounts(idx.nitems()));
+    std::vector<size_t> nreads(nthreads);
+    std::unique_ptr<std::mutex[]> locks(new std::mutex[nthreads]);
+    const SharedSeen first_sight(idx.nkeys());
+    std::atomic<size_t> total_reads{0};
+    std::atomic<bool> pause{false};
+    std::mutex m;
+    std::condition_variable cv;
+    int nfinished = 0;
+    std::vector<std::string> sf;
+    for(const auto &input: inputs) for_each_substr([&sf](const auto &x) {sf.push_back(x);}, input);
+    fastx_parser::FastxParser<fastx_parser::ReadSeq> parser(sf, nthreads, 1);
+    const bool use_direct_encoding = eenc.k() <= eenc.nremperres64();
+    const auto start = clock::now();
+    parser.start();
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < size_t(nthreads); ++i) {
+        threads.emplace_back([&,i]() {
+            ContainCounter<SharedSeen> counter(idx, res[i], first_sight);
+            auto func = [&counter](auto kmer) __attribute__((always_inline)) {counter.add(kmer);};
+            bns::Encoder<bns::score::Lex, uint64_t> mye(eenc);
+            bns::RollingHasher<uint64_t> myr(renc);
+            for(auto rg = parser.getReadGroup();parser.refill(rg);) {
+                const size_t n = rg.size();
+                {
+                    std::lock_guard<std::mutex> lock(locks[i]);
+                    if(use_direct_encoding) {
+                        for(const auto &seq: rg) mye.for_each(func, seq.seq.data(), seq.seq.size());
+                    } else {
+                        for(const auto &seq: rg) myr.for_each_hash(func, seq.seq.data(), seq.seq.size());
+                    }
+                    counter.flush();
+                    nreads[i] += n;
+                }
+                const size_t before = total_reads.fetch_add(n, std::memory_order_relaxed);
+                if(snap_reads && (before + n) / snap_reads != before / snap_reads) {
+                    std::lock_guard<std::mutex> lock(m);
+                    pause.store(true);
+                    cv.notify_all();
+                }
+                if(pause.load()) {
+                    std::unique_lock<std::mutex> lock(m);
+                    cv.wait(lock, [&pause]() {return !pause.load();});
+                }
+            }
+            std::lock_guard<std::mutex> lock(m);
+            ++nfinished;
+            cv.notify_all();
+        });
+    }
+    ContainCounts snap(idx.nitems());
+    auto snapshot = [&]() {
+        size_t n = 0;
+        for(int i = 0; i < nthreads; ++i) locks[i].lock();
+        std::fill(snap.matches_.begin(), snap.matches_.end(), 0u);
+        std::fill(snap.sums_.begin(), snap.sums_.end(), uint64_t(0));
+        for(int i = 0; i < nthreads; ++i) {
+            snap += res[i];
+            n += nreads[i];
+        }
+        for(int i = 0; i < nthreads; ++i) locks[i].unlock();
+        return n;
+    };
+    {
+        const auto period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(snap_seconds));
+        auto last = start;
+        std::unique_lock<std::mutex> lock(m);
+        auto ready = [&]() {return nfinished == nthreads || pause.load();};
+        for(;;) {
+            if(snap_seconds > 0.) cv.wait_until(lock, last + period, ready);
+            else cv.wait(lock, ready);
+            if(nfinished == nthreads) break;
+            pause.store(true);
+            lock.unlock();
+            const size_t n = snapshot();
+            lock.lock();
+            pause.store(false);
+            cv.notify_all();
+            lock.unlock();
+            emit(snap, n, std::chrono::duration<double>(clock::now() - start).count());
+            last = clock::now();
+            lock.lock();
+        }
+    }
+    for(auto &t: threads) t.join();
+    parser.stop();
+    const size_t n = snapshot();
+    emit(snap, n, std::chrono::duration<double>(clock::now() - start).count());
+}
+
 
 #ifdef __AVX512F__
 INLINE void interleave_512_ps(__m512 &lhs, __m512 &rhs) {
@@ -130,16 +281,83 @@ INLINE void interleave_256_ps(__m256 &lhs, __m256 &rhs) {
 }
 #endif
 
+// Fills the fraction of each reference's k-mers found by a query, and their mean depth where any were found
+void coverage_row(const ContainCounts &counts, size_t sketchsize, float *cmatptr, float *cstatsptr) {
+    const uint32_t *const matches = counts.matches_.data();
+    const uint64_t *const matchsums = counts.sums_.data();
+    const double ssiv = 1. / sketchsize;
+#ifdef _OPENMP
+    #pragma omp simd
+#endif
+    for(size_t j = 0; j < counts.matches_.size(); ++j) {
+        if(matches[j]) {
+            cmatptr[j] = ssiv * matches[j];
+            cstatsptr[j] = double(matchsums[j]) / matches[j];
+        }
+    }
+}
+
+void write_header(std::FILE *ofp, const std::vector<std::string> &names) {
+    fmt::print(ofp, "#Dashing2 contain - a list of coverage %%s for the set of references, + mean coverage levels.\n"
+                    "#Each matrix entry consists of <coverage%%:mean depth of coverage>\n"
+                    "##References:");
+    for(const auto &name: names)
+        fmt::print(ofp, "\t{}", name);
+    fmt::print(ofp, "\n");
+}
+
+void write_row(std::FILE *ofp, const std::string &label, const float *cmatptr, const float *cstatsptr, const size_t nitems) {
+    fmt::print(ofp, "{}", label);
+    size_t j = 0;
+#if __AVX512F__
+    for(;nitems - j >= 16;j += 16) {
+        __m512 matd = _mm512_mul_ps(_mm512_loadu_ps(cmatptr + j), _mm512_set1_ps(100.f));
+        __m512 statd = _mm512_loadu_ps(cstatsptr + j);
+        interleave_512_ps(matd, statd);
+        float mat_arr[sizeof(matd) / sizeof(float)];
+        float stat_arr[sizeof(matd) / sizeof(float)];
+        std::memcpy(mat_arr, &matd, sizeof(matd));
+        std::memcpy(stat_arr, &statd, sizeof(statd));
+        fmt::print(ofp, "\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}",
+                   mat_arr[0], mat_arr[1], mat_arr[2], mat_arr[3], mat_arr[4], mat_arr[5], mat_arr[6], mat_arr[7], mat_arr[8], mat_arr[9], mat_arr[10], mat_arr[11], mat_arr[12], mat_arr[13], mat_arr[14], mat_arr[15], stat_arr[0], stat_arr[1], stat_arr[2], stat_arr[3], stat_arr[4], stat_arr[5], stat_arr[6], stat_arr[7], stat_arr[8], stat_arr[9], stat_arr[10], stat_arr[11], stat_arr[12], stat_arr[13], stat_arr[14], stat_arr[15]
+        );
+    }
+#elif __AVX2__
+    for(;nitems - j >= 8;j += 8) {
+        __m256 matd = _mm256_mul_ps(_mm256_loadu_ps(cmatptr + j), _mm256_set1_ps(100.f));
+        __m256 statd = _mm256_loadu_ps(cstatsptr + j);
+        interleave_256_ps(matd, statd);
+
+        float mat_arr[sizeof(matd) / sizeof(float)];
+        float stat_arr[sizeof(matd) / sizeof(float)];
+        std::memcpy(mat_arr, &matd, sizeof(matd));
+        std::memcpy(stat_arr, &statd, sizeof(statd));
+        fmt::print(ofp, "\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}",
+                mat_arr[0], mat_arr[1], mat_arr[2], mat_arr[3], mat_arr[4], mat_arr[5], mat_arr[6], mat_arr[7], stat_arr[0], stat_arr[1], stat_arr[2], stat_arr[3], stat_arr[4], stat_arr[5], stat_arr[6], stat_arr[7]
+        );
+    }
+#endif
+    for(;j < nitems; ++j) {
+        fmt::print(ofp, "\t{:0.6g}%:{}", 100.f * cmatptr[j], cstatsptr[j]);
+    }
+    std::fputc('\n', ofp);
+}
+
 int contain_main(int argc, char **argv) {
     int nthreads = 1;
-    bool binary_output = false;
+    bool binary_output = false, stream = false;
+    size_t snap_reads = 0;
+    double snap_seconds = 0.;
     char *outpath = 0;
     std::vector<std::string> streamfiles;
-    for(int c;(c = getopt(argc, argv, "bh?p:o:F:")) >= 0;) switch(c) {
+    for(int c;(c = getopt(argc, argv, "bsh?p:o:F:N:T:")) >= 0;) switch(c) {
         case 'h': case '?': return contain_usage();
         case 'p': nthreads = std::max(std::atoi(optarg), 1); break;
         case 'b': binary_output = true; break;
         case 'o': outpath = optarg; break;
+        case 's': stream = true; break;
+        case 'N': stream = true; snap_reads = std::strtoull(optarg, nullptr, 10); break;
+        case 'T': stream = true; snap_seconds = std::atof(optarg); break;
         case 'F': {
             std::ifstream ifs(optarg);
             for(std::string line;std::getline(ifs, line);)
@@ -185,114 +403,58 @@ int contain_main(int argc, char **argv) {
     bns::Spacer sp(k, w);
     bns::Encoder<bns::score::Lex, uint64_t> e64(sp, nullptr, canon);
     bns::RollingHasher<uint64_t> rh64(k, canon, rht, w);
-    flat_hash_map<uint64_t, std::vector<uint64_t>> kmer2ids;
-    for(size_t i = 0; i < nitems; ++i) {
-        uint64_t *ptr = ((uint64_t *)dbptr + 3 + sketchsize * i);
-        assert((const char *)ptr < &db.data()[db.size()]);
-#if _OPENMP >= 201307L
-        #pragma omp simd
-#endif
-        for(size_t j = 0; j < sketchsize; ++j) {
-            kmer2ids[ptr[j]].push_back(i);
+    OMP_ONLY(omp_set_num_threads(nthreads);)
+    const ContainIndex idx = ContainIndex::open(databasefile, (const uint64_t *)dbptr + 3, nitems, sketchsize);
+    std::FILE *ofp = outpath ? bfopen(outpath, "w"): stdout;
+    if(stream) {
+        if(!snap_reads && snap_seconds <= 0.) snap_reads = 100000;
+        if(!binary_output) {
+            write_header(ofp, names);
+            fmt::print(ofp, "##Snapshots of {}", streamfiles.front());
+            for(size_t i = 1; i < nq; ++i) fmt::print(ofp, ",{}", streamfiles[i]);
+            fmt::print(ofp, " as one stream, labeled <reads>:<seconds>\n");
         }
+        std::vector<float, sketch::Allocator<float>> row(nitems * 2);
+        get_results_stream(e64, rh64, streamfiles, idx, nthreads, snap_reads, snap_seconds, [&](const ContainCounts &counts, size_t nreads, double seconds) {
+            std::fill(row.begin(), row.end(), 0.f);
+            coverage_row(counts, sketchsize, row.data(), row.data() + nitems);
+            if(binary_output) {
+                const uint64_t tmparr[2] {nitems, 1};
+                checked_fwrite(tmparr, sizeof(tmparr), 1, ofp);
+                checked_fwrite(row.data(), sizeof(float), row.size(), ofp);
+            } else {
+                write_row(ofp, fmt::format("{}:{:.3f}", nreads, seconds), row.data(), row.data() + nitems, nitems);
+            }
+            std::fflush(ofp);
+            if(verbosity >= INFO) std::fprintf(stderr, "Snapshot after %zu reads and %gs\n", nreads, seconds);
+        });
+        if(ofp != stdout) std::fclose(ofp);
+        return 0;
     }
-    // We can quickly filter out k-mers by using min/max k-mers
-    // to eliminate anything > or <
-    // These only take a comparison instruction and a jump, which means there's no cache miss.
-    // We also compute the minimum over the set of keys, so it's on the order of the number of unique sampled k-mers
-    // instead of the total number of sampled k-mers (num_samples * sample_size).
-    uint64_t maxkmer = 0, minkmer = std::numeric_limits<uint64_t>::max();
-    for(const auto &pair: kmer2ids) {
-        maxkmer = std::max(maxkmer, pair.first);
-        minkmer = std::min(minkmer, pair.first);
-    }
-    std::vector<flat_hash_map<uint64_t, uint64_t>> res;
+    std::vector<ContainCounts> res;
     if(nthreads > 1 && nq < size_t(nthreads)) {
         for(const auto &sf: streamfiles) {
-            res.emplace_back(get_results_sf(e64, rh64, sf, kmer2ids, maxkmer, minkmer, nthreads));
+            res.emplace_back(get_results_sf(e64, rh64, sf, idx, nthreads));
         }
     } else {
-        res = get_results(e64, rh64, streamfiles, kmer2ids, maxkmer, minkmer);
+        res = get_results(e64, rh64, streamfiles, idx);
     }
     const size_t tablesize = nitems * streamfiles.size();
     const size_t table2size = tablesize * 2;
     std::vector<float, sketch::Allocator<float>> coverage_mat(table2size);
     float *const coverage_stats = coverage_mat.data() + tablesize;
-    const double ssiv = 1. / sketchsize;
     OMP_PFOR_DYN
-    for(size_t i = 0; i < res.size(); ++i) {
-        uint32_t *matches = static_cast<uint32_t *>(std::calloc(nitems * 2, sizeof(uint32_t)));
-        uint32_t *matchsums = matches + nitems;
-        for(const auto &[key, value]: res[i]) {
-            for(const auto refid: kmer2ids[key]) {
-                ++matches[refid];
-                matchsums[refid] += value;
-            }
-        }
-        const auto cmatptr = &coverage_mat[nitems * i];
-        const auto cstatsptr = &coverage_stats[nitems * i];
-#ifdef _OPENMP
-        #pragma omp simd
-#endif
-        for(size_t j = 0; j < nitems; ++j) {
-            if(matches[j]) {
-                cmatptr[j] = ssiv * matches[j];
-                cstatsptr[j] = matchsums[j] / matches[j];
-            }
-        }
-        std::free(matches);
-    }
-    std::FILE *ofp = outpath ? bfopen(outpath, "w"): stdout;
+    for(size_t i = 0; i < res.size(); ++i)
+        coverage_row(res[i], sketchsize, &coverage_mat[nitems * i], &coverage_stats[nitems * i]);
     if(binary_output) {
         uint64_t tmparr[2] {nitems, res.size()};
         checked_fwrite(tmparr, sizeof(tmparr), 1, ofp);
         checked_fwrite(coverage_mat.data(), sizeof(float), coverage_mat.size(), ofp);
     } else {
         // TODO: Parallize results formatting
-        fmt::print(ofp, "#Dashing2 contain - a list of coverage %%s for the set of references, + mean coverage levels.\n"
-                        "#Each matrix entry consists of <coverage%%:mean depth of coverage>\n"
-                        "##References:");
-        for(size_t i = 0; i < nitems; ++i)
-            fmt::print(ofp, "\t{}", names[i]);
-        fmt::print(ofp, "\n");
-        for(size_t i = 0; i < nq; ++i) {
-            fmt::print(ofp, "{}", streamfiles[i]);
-            const float *cmatptr = &coverage_mat[nitems * i];
-            const float *cstatsptr = &coverage_stats[nitems * i];
-            size_t j = 0;
-#if __AVX512F__
-            for(;nitems - j >= 16;j += 16) {
-                __m512 matd = _mm512_mul_ps(_mm512_loadu_ps(cmatptr + j), _mm512_set1_ps(100.f));
-                __m512 statd = _mm512_loadu_ps(cstatsptr + j);
-                interleave_512_ps(matd, statd);
-                float mat_arr[sizeof(matd) / sizeof(float)];
-                float stat_arr[sizeof(matd) / sizeof(float)];
-                std::memcpy(mat_arr, &matd, sizeof(matd));
-                std::memcpy(stat_arr, &statd, sizeof(statd));
-                fmt::print("\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}",
-                           mat_arr[0], mat_arr[1], mat_arr[2], mat_arr[3], mat_arr[4], mat_arr[5], mat_arr[6], mat_arr[7], mat_arr[8], mat_arr[9], mat_arr[10], mat_arr[11], mat_arr[12], mat_arr[13], mat_arr[14], mat_arr[15], stat_arr[0], stat_arr[1], stat_arr[2], stat_arr[3], stat_arr[4], stat_arr[5], stat_arr[6], stat_arr[7], stat_arr[8], stat_arr[9], stat_arr[10], stat_arr[11], stat_arr[12], stat_arr[13], stat_arr[14], stat_arr[15]
-                );
-            }
-#elif __AVX2__
-            for(;nitems - j >= 8;j += 8) {
-                __m256 matd = _mm256_mul_ps(_mm256_loadu_ps(cmatptr + j), _mm256_set1_ps(100.f));
-                __m256 statd = _mm256_loadu_ps(cstatsptr + j);
-                interleave_256_ps(matd, statd);
-
-                float mat_arr[sizeof(matd) / sizeof(float)];
-                float stat_arr[sizeof(matd) / sizeof(float)];
-                std::memcpy(mat_arr, &matd, sizeof(matd));
-                std::memcpy(stat_arr, &statd, sizeof(statd));
-                fmt::print("\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}\t{:0.6g}%:{}",
-                        mat_arr[0], mat_arr[1], mat_arr[2], mat_arr[3], mat_arr[4], mat_arr[5], mat_arr[6], mat_arr[7], stat_arr[0], stat_arr[1], stat_arr[2], stat_arr[3], stat_arr[4], stat_arr[5], stat_arr[6], stat_arr[7]
-                );
-            }
-#endif
-            for(;j < nitems; ++j) {
-                fmt::print(ofp, "\t{:0.6g}%:{}", 100.f * cmatptr[j], cstatsptr[j]);
-            }
-            std::fputc('\n', ofp);
-        }
+        write_header(ofp, names);
+        for(size_t i = 0; i < nq; ++i)
+            write_row(ofp, streamfiles[i], &coverage_mat[nitems * i], &coverage_stats[nitems * i], nitems);
     }
     if(ofp != stdout) std::fclose(ofp);
     return 0;
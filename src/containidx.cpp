@@ -0,0 +1,197 @@
+#include "containidx.h"
+#include <cstring>
+#include <sys/stat.h>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+static constexpr size_t pad8(size_t nb) {return (nb + 7) & ~size_t(7);}
+
+// Records the database's size, inode and modification time in nanoseconds,
+// so that rewrites within the same second, or replacement by another file of the same size, are caught
+static void stamp(const std::string &dbpath, ContainIndexHeader &hdr) {
+    struct stat st;
+    if(::stat(dbpath.data(), &st))
+        THROW_EXCEPTION(std::runtime_error("Failed to stat "s + dbpath + ": " + std::strerror(errno)));
+    hdr.dbbytes_ = st.st_size;
+    hdr.dbino_ = st.st_ino;
+    hdr.dbmtime_ = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+ContainIndex::ContainIndex(const uint64_t *kmers, size_t nitems, size_t sketchsize) {
+    if(nitems > size_t(std::numeric_limits<uint32_t>::max()))
+        THROW_EXCEPTION(std::invalid_argument("Too many references ("s + std::to_string(nitems) + ") for a contain index"));
+    auto start = std::chrono::high_resolution_clock::now();
+    const size_t npairs = nitems * sketchsize;
+    // Pairs are first partitioned by their keys' top bits, then sorted within each partition.
+    // Each thread scatters a contiguous range of references, so that ids are ascending within each partition,
+    // and a lexicographic sort of (key, id) keeps them so within each key.
+    const unsigned pbits = npairs >= (size_t(1) << 20) ? 12: 4;
+    const size_t nparts = size_t(1) << pbits;
+    const unsigned pshift = 64 - pbits;
+    const int nt = std::max(OMP_ELSE(omp_get_max_threads(), 1), 1);
+    std::vector<uint64_t> pos(size_t(nt) * nparts), pstart(nparts + 1);
+    OMP_PRAGMA("omp parallel for schedule(static, 1) num_threads(nt)")
+    for(int t = 0; t < nt; ++t) {
+        uint64_t *const hist = &pos[size_t(t) * nparts];
+        for(const uint64_t *p = kmers + nitems * t / nt * sketchsize, *e = kmers + nitems * (t + 1) / nt * sketchsize; p < e; ++p)
+            ++hist[*p >> pshift];
+    }
+    for(size_t part = 0, total = 0; part < nparts; ++part) {
+        pstart[part] = total;
+        for(int t = 0; t < nt; ++t) {
+            const uint64_t c = pos[size_t(t) * nparts + part];
+            pos[size_t(t) * nparts + part] = total;
+            total += c;
+        }
+    }
+    pstart[nparts] = npairs;
+    std::vector<uint64_t> pkeys(npairs);
+    idbuf_.resize(npairs);
+    OMP_PRAGMA("omp parallel for schedule(static, 1) num_threads(nt)")
+    for(int t = 0; t < nt; ++t) {
+        uint64_t *const cursor = &pos[size_t(t) * nparts];
+        for(size_t i = nitems * t / nt, e = nitems * (t + 1) / nt; i < e; ++i) {
+            for(const uint64_t *p = kmers + i * sketchsize, *pe = p + sketchsize; p < pe; ++p) {
+                const uint64_t o = cursor[*p >> pshift]++;
+                pkeys[o] = *p;
+                idbuf_[o] = i;
+            }
+        }
+    }
+    std::vector<uint64_t> kstart(nparts + 1);
+    OMP_PRAGMA("omp parallel")
+    {
+        std::vector<std::pair<uint64_t, uint32_t>> tmp;
+        OMP_PRAGMA("omp for schedule(dynamic)")
+        for(size_t part = 0; part < nparts; ++part) {
+            const size_t b = pstart[part], e = pstart[part + 1];
+            tmp.resize(e - b);
+            for(size_t i = b; i < e; ++i) tmp[i - b] = {pkeys[i], idbuf_[i]};
+            std::sort(tmp.begin(), tmp.end());
+            size_t nuniq = 0;
+            for(size_t i = b; i < e; ++i) {
+                std::tie(pkeys[i], idbuf_[i]) = tmp[i - b];
+                nuniq += i == b || pkeys[i] != pkeys[i - 1];
+            }
+            kstart[part + 1] = nuniq;
+        }
+    }
+    for(size_t part = 0; part < nparts; ++part) kstart[part + 1] += kstart[part];
+    const size_t nkeys = kstart[nparts];
+    keybuf_.resize(nkeys);
+    offsetbuf_.resize(nkeys + 1);
+    OMP_PFOR_DYN
+    for(size_t part = 0; part < nparts; ++part) {
+        size_t k = kstart[part];
+        for(size_t i = pstart[part], e = pstart[part + 1]; i < e; ++i) {
+            if(i == pstart[part] || pkeys[i] != pkeys[i - 1]) {
+                keybuf_[k] = pkeys[i];
+                offsetbuf_[k++] = i;
+            }
+        }
+    }
+    offsetbuf_[nkeys] = npairs;
+    std::vector<uint64_t>().swap(pkeys);
+    // About two keys per directory entry
+    unsigned dirbits = 1;
+    while(dirbits < 30 && (uint64_t(1) << (dirbits + 1)) <= nkeys) ++dirbits;
+    shift_ = 64 - dirbits;
+    dirbuf_.resize((size_t(1) << dirbits) + 1);
+    OMP_PFOR
+    for(size_t i = 0; i < nkeys; ++i) {
+        for(uint64_t x = i ? (keybuf_[i - 1] >> shift_) + 1: 0, b = keybuf_[i] >> shift_; x <= b; ++x)
+            dirbuf_[x] = i;
+    }
+    for(uint64_t x = nkeys ? (keybuf_[nkeys - 1] >> shift_) + 1: 0; x < dirbuf_.size(); ++x)
+        dirbuf_[x] = nkeys;
+
+    std::memcpy(hdr_.magic_, ContainIndexHeader::MAGIC, sizeof(hdr_.magic_));
+    hdr_.version_ = ContainIndexHeader::VERSION;
+    hdr_.dirbits_ = dirbits;
+    hdr_.nitems_ = nitems;
+    hdr_.sketchsize_ = sketchsize;
+    hdr_.nkeys_ = nkeys;
+    hdr_.nids_ = npairs;
+    keys_ = keybuf_.data();
+    offsets_ = offsetbuf_.data();
+    dir_ = dirbuf_.data();
+    ids_ = idbuf_.data();
+    if(verbosity >= INFO) {
+        std::fprintf(stderr, "Built contain index of %zu k-mers from %zu references in %gs\n", nkeys, nitems,
+                     std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+}
+
+ContainIndex::ContainIndex(const std::string &path): map_(path) {
+    if(map_.size() < sizeof(ContainIndexHeader))
+        THROW_EXCEPTION(std::runtime_error("Contain index at "s + path + " is truncated"));
+    std::memcpy(&hdr_, map_.data(), sizeof(hdr_));
+    if(std::memcmp(hdr_.magic_, ContainIndexHeader::MAGIC, sizeof(hdr_.magic_)) || hdr_.version_ != ContainIndexHeader::VERSION)
+        THROW_EXCEPTION(std::runtime_error("File at "s + path + " is not a contain index of this version"));
+    if(!hdr_.dirbits_ || hdr_.dirbits_ > 30)
+        THROW_EXCEPTION(std::runtime_error("Contain index at "s + path + " is corrupted"));
+    const size_t ndir = (size_t(1) << hdr_.dirbits_) + 1;
+    const size_t expected = sizeof(ContainIndexHeader) + (hdr_.nkeys_ + hdr_.nkeys_ + 1 + ndir) * sizeof(uint64_t) + pad8(hdr_.nids_ * sizeof(uint32_t));
+    if(map_.size() != expected)
+        THROW_EXCEPTION(std::runtime_error("Contain index at "s + path + " has size " + std::to_string(map_.size()) + "; expected " + std::to_string(expected)));
+    const char *p = map_.data() + sizeof(ContainIndexHeader);
+    keys_ = reinterpret_cast<const uint64_t *>(p);
+    offsets_ = keys_ + hdr_.nkeys_;
+    dir_ = offsets_ + hdr_.nkeys_ + 1;
+    ids_ = reinterpret_cast<const uint32_t *>(dir_ + ndir);
+    shift_ = 64 - hdr_.dirbits_;
+}
+
+void ContainIndex::write(const std::string &path, const std::string &dbpath) const {
+    ContainIndexHeader hdr = hdr_;
+    stamp(dbpath, hdr);
+    const std::string tmppath = path + ".tmp";
+    std::FILE *fp = bfopen(tmppath.data(), "wb");
+    if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open "s + tmppath + " for writing"));
+    try {
+        static constexpr char zeros[8]{};
+        checked_fwrite(fp, &hdr, sizeof(hdr));
+        checked_fwrite(fp, keys_, hdr.nkeys_ * sizeof(uint64_t));
+        checked_fwrite(fp, offsets_, (hdr.nkeys_ + 1) * sizeof(uint64_t));
+        checked_fwrite(fp, dir_, ((size_t(1) << hdr.dirbits_) + 1) * sizeof(uint64_t));
+        checked_fwrite(fp, ids_, hdr.nids_ * sizeof(uint32_t));
+        checked_fwrite(fp, zeros, pad8(hdr.nids_ * sizeof(uint32_t)) - hdr.nids_ * sizeof(uint32_t));
+    } catch(...) {
+        std::fclose(fp);
+        std::remove(tmppath.data());
+        throw;
+    }
+    if(std::fclose(fp) || std::rename(tmppath.data(), path.data())) {
+        std::remove(tmppath.data());
+        THROW_EXCEPTION(std::runtime_error("Failed to write contain index to "s + path));
+    }
+}
+
+ContainIndex ContainIndex::open(const std::string &dbpath, const uint64_t *kmers, size_t nitems, size_t sketchsize) {
+    const std::string path = dbpath + ".cidx";
+    if(bns::isfile(path)) {
+        try {
+            ContainIndex ret(path);
+            ContainIndexHeader cur;
+            stamp(dbpath, cur);
+            const auto &h = ret.header();
+            if(h.nitems_ == nitems && h.sketchsize_ == sketchsize && h.dbbytes_ == cur.dbbytes_ && h.dbino_ == cur.dbino_ && h.dbmtime_ == cur.dbmtime_) {
+                if(verbosity >= INFO) std::fprintf(stderr, "Loaded contain index from %s\n", path.data());
+                return ret;
+            }
+            if(verbosity >= INFO) std::fprintf(stderr, "Contain index at %s is out of date; rebuilding\n", path.data());
+        } catch(const std::exception &ex) {
+            std::fprintf(stderr, "Warning: ignoring contain index at %s (%s)\n", path.data(), ex.what());
+        }
+    }
+    ContainIndex ret(kmers, nitems, sketchsize);
+    try {
+        ret.write(path, dbpath);
+    } catch(const std::exception &ex) {
+        std::fprintf(stderr, "Warning: failed to save contain index to %s (%s); it will be rebuilt next time\n", path.data(), ex.what());
+    }
+    return ret;
+}
+
+} // namespace dashing2
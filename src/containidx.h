@@ -0,0 +1,102 @@
+#pragma once
+#ifndef DASHING2_CONTAINIDX_H__
+#define DASHING2_CONTAINIDX_H__
+#include "d2.h"
+#include "mio.hpp"
+
+namespace dashing2 {
+
+/*
+ * Inverted index for `dashing2 contain`
+ * Maps each k-mer sampled from a database's references to the references it was sampled from, in CSR form.
+ *
+ * Layout (8-byte aligned sections, in order):
+ *   ContainIndexHeader
+ *   u64 keys[nkeys]                  sorted and unique
+ *   u64 offsets[nkeys + 1]           each key's range in ids
+ *   u64 dir[2^dirbits + 1]           the first key whose top dirbits bits are at least each value, so that a lookup scans a couple of keys
+ *   u32 ids[nids]                    ascending within each key; a reference appears once per register holding the k-mer
+ * It is built in parallel, and saved to <database>.cidx, where later runs memory-map it unless the database has since changed.
+ */
+struct ContainIndexHeader {
+    static constexpr char MAGIC[8] = {'D', '2', 'C', 'O', 'N', 'I', 'D', 'X'};
+    static constexpr uint32_t VERSION = 2;
+    char magic_[8];
+    uint32_t version_;
+    uint32_t dirbits_;
+    uint64_t nitems_, sketchsize_;
+    uint64_t nkeys_, nids_;
+    uint64_t dbbytes_; // Size of the database the index was built from,
+    uint64_t dbino_;   // its inode,
+    int64_t dbmtime_;  // and its modification time, in nanoseconds
+};
+
+class ContainIndex {
+    ContainIndexHeader hdr_{};
+    std::vector<uint64_t> keybuf_, offsetbuf_, dirbuf_;
+    std::vector<uint32_t> idbuf_;
+    mio::mmap_source map_;
+    const uint64_t *keys_ = nullptr, *offsets_ = nullptr, *dir_ = nullptr;
+    const uint32_t *ids_ = nullptr;
+    unsigned shift_ = 63;
+public:
+    static constexpr size_t npos = size_t(-1);
+    // Indexes nitems references of sketchsize k-mers each, reference i's at kmers[i * sketchsize]
+    ContainIndex(const uint64_t *kmers, size_t nitems, size_t sketchsize);
+    // Maps the index saved at path
+    ContainIndex(const std::string &path);
+    ContainIndex(ContainIndex &&) = default;
+    // Loads the index of the database at dbpath from <dbpath>.cidx if it is up to date,
+    // and otherwise builds it from the database's k-mers and tries to save it there
+    static ContainIndex open(const std::string &dbpath, const uint64_t *kmers, size_t nitems, size_t sketchsize);
+    // Saves the index to path, stamped with the size, inode and modification time of the database at dbpath
+    void write(const std::string &path, const std::string &dbpath) const;
+
+    const ContainIndexHeader &header() const {return hdr_;}
+    bool mapped() const {return map_.is_mapped();}
+    size_t nkeys() const {return hdr_.nkeys_;}
+    size_t nids() const {return hdr_.nids_;}
+    size_t nitems() const {return hdr_.nitems_;}
+    uint64_t min_key() const {return hdr_.nkeys_ ? keys_[0]: std::numeric_limits<uint64_t>::max();}
+    uint64_t max_key() const {return hdr_.nkeys_ ? keys_[hdr_.nkeys_ - 1]: 0;}
+    const uint32_t *ids_begin(size_t ki) const {return ids_ + offsets_[ki];}
+    const uint32_t *ids_end(size_t ki) const {return ids_ + offsets_[ki + 1];}
+
+    // Returns the index of key, or npos if absent
+    size_t find(uint64_t key) const {
+        const uint64_t b = key >> shift_;
+        for(const uint64_t *p = keys_ + dir_[b], *e = keys_ + dir_[b + 1]; p < e; ++p)
+            if(*p >= key) return *p == key ? size_t(p - keys_): npos;
+        return npos;
+    }
+    // Looks up keys[0, n), calling f(i, key index) for each keys[i] present, in order.
+    // Directory entries and then keys are prefetched for a batch at a time, so that their cache misses overlap.
+    template<typename F>
+    void find_batch(const uint64_t *keys, size_t n, const F &f) const {
+        static constexpr size_t BATCH = 32;
+        uint64_t lo[BATCH], hi[BATCH];
+        for(size_t s = 0; s < n; s += BATCH) {
+            const size_t nb = std::min(BATCH, n - s);
+            const uint64_t *const bk = keys + s;
+            for(size_t i = 0; i < nb; ++i)
+                __builtin_prefetch(&dir_[bk[i] >> shift_]);
+            for(size_t i = 0; i < nb; ++i) {
+                const uint64_t b = bk[i] >> shift_;
+                lo[i] = dir_[b]; hi[i] = dir_[b + 1];
+                __builtin_prefetch(keys_ + lo[i]);
+            }
+            for(size_t i = 0; i < nb; ++i) {
+                for(const uint64_t *p = keys_ + lo[i], *e = keys_ + hi[i]; p < e; ++p) {
+                    if(*p >= bk[i]) {
+                        if(*p == bk[i]) f(s + i, size_t(p - keys_));
+                        break;
+                    }
+                }
+            }
+        }
+    }
+};
+
+} // namespace dashing2
+
+#endif
@@ -1,8 +1,10 @@
 #include "d2.h"
+#include "kernels.h"
 #include <filesystem>
 
 namespace dashing2 {
 int cmp_main(int argc, char **argv);
+int index_main(int argc, char **argv);
 int contain_main(int argc, char **argv);
 int wsketch_main(int argc, char **argv);
 int sketch_main(int argc, char **argv);
@@ -17,6 +19,8 @@ std::string Dashing2Options::to_string() const {
     pos += std::sprintf(&ret[pos], ";sketchsize:%zu", sketchsize_);
     if(count_threshold_ > 0)
         pos += std::sprintf(&ret[pos], ";%u", count_threshold_);
+    if(count_threshold_ > 1 && count_filter_bytes_)
+        pos += std::sprintf(&ret[pos], ";countfilter:%zu", count_filter_bytes_);
     pos += std::sprintf(&ret[pos], ";sketchtype:%s",
             kmer_result_ == ONE_PERM ? "onepermsetsketch"
                   : kmer_result_ == FULL_SETSKETCH ? (sspace_ == SPACE_SET ? "fullsetsketch": sspace_ == SPACE_MULTISET ? "bagminhash": sspace_ == SPACE_PSET ? "probminhash": sspace_ == SPACE_EDIT_DISTANCE ? "orderminhash": "unknown")
@@ -42,14 +46,14 @@ std::string Dashing2Options::to_string() const {
     return ret;
 }
 
-void Dashing2Options::filterset(const std::string &fsarg) {
+void Dashing2Options::filterset(const std::string &fsarg, double fpr) {
     if(fsarg.empty()) return;
     auto i = fsarg.find_last_of(':');
-    filterset(fsarg.substr(0, i), (i != std::string::npos && static_cast<char>(fsarg[i + 1] & 0xdf) != 'K'));
+    filterset(fsarg.substr(0, i), (i != std::string::npos && static_cast<char>(fsarg[i + 1] & 0xdf) != 'K'), fpr);
 }
 
-void Dashing2Options::filterset(const std::string &path, bool is_kmer) {
-    fs_.reset(new FilterSet());
+void Dashing2Options::filterset(const std::string &path, bool is_kmer, double fpr) {
+    fs_.reset(new FilterSet(fpr));
     if(is_kmer) {
         std::string cmd;
         if(endswith(path, ".xz")) cmd = "xz -dc ";
@@ -59,7 +63,7 @@ void Dashing2Options::filterset(const std::string &path, bool is_kmer) {
         else cmd = "";
         std::FILE *ifp;
         if(cmd.empty()) {
-            if((ifp = bfopen(cmd.data(), "rb")) == 0)
+            if((ifp = bfopen(path.data(), "rb")) == 0)
                 THROW_EXCEPTION(std::runtime_error("Failed to open file "s + path + " for reading"));
         } else {
             if((ifp= ::popen((cmd + path).data(), "r")) == 0)
@@ -119,17 +123,20 @@ int main_usage() {
                          "This is probably the most common subcommand to use.\n\n"
     );
     std::fprintf(stderr, "\tcmp: compares previously sketched/decomposed k-mer sets and emits results. alias: dist\n\n");
+    std::fprintf(stderr, "\tindex: builds a persistent LSH index over a collection of sketches, which cmp --index queries without rebuilding.\n\n");
     std::fprintf(stderr, "\tcontain: Takes a k-mer database (built with dashing2 sketch --save-kmers), then computes coverage for all k-mer references using input streams.\n");
     std::fprintf(stderr, "\twsketch: Takes a tuple of [1-3] input binary files [(u32 or u64), (float or double), (u32 or u64)] and performs weighted minhash sketching.\n"
                          "Three files are treated as Compressed Sparse Row (CSR)-format, where the third file contains indptr values, specifying the lengths of consecutive runs of pairs in the first two files corresponding to each row.\n"
                          "wsketch is for sketching binary files which have already been summed, whereas sketch is for parsing and sketching (from Fast{qa}, BED, BigWig)\n");
     std::fprintf(stderr, "\n\nMiscellania:\n");
     std::fprintf(stderr, "printmin: Emit minimizer sequence sets in human-readable form.\n");
+    std::fprintf(stderr, "--report-kernels: Print which SIMD level this CPU selects for the kernels and the sketching and comparison loops. Set DASHING2_SIMD to baseline, avx2 or avx512bw to cap the level.\n");
     return 1;
 }
 using namespace dashing2;
 
 
+#ifndef DASHING2_NO_MAIN
 int main(int argc, char **argv) {
     std::string cmd(std::filesystem::absolute(std::filesystem::path(argv[0])));
     for(char **s = (argv + 1); *s; cmd += std::string(" ") + *s++);
@@ -139,6 +146,8 @@ int main(int argc, char **argv) {
             return sketch_main(argc - 1, argv + 1);
         if(std::strcmp(argv[1], "cmp") == 0 || std::strcmp(argv[1], "dist") == 0)
             return cmp_main(argc - 1, argv + 1);
+        if(std::strcmp(argv[1], "index") == 0)
+            return index_main(argc - 1, argv + 1);
         if(std::strcmp(argv[1], "wsketch") == 0)
             return wsketch_main(argc - 1, argv + 1);
         if(std::strcmp(argv[1], "contain") == 0)
@@ -146,6 +155,11 @@ int main(int argc, char **argv) {
         if(std::strcmp(argv[1], "printmin") == 0) {
             return printmin_main(argc - 1, argv + 1);
         }
+        if(std::strcmp(argv[1], "--report-kernels") == 0) {
+            report_kernels(stdout);
+            return 0;
+        }
     }
     return main_usage();
 }
+#endif
@@ -105,6 +105,7 @@ struct Dashing2Options {
     bool by_chrom_ = false;
     bool bed_parse_normalize_intervals_ = false;
     size_t cssize_ = 0;
+    size_t count_filter_bytes_ = 0; // If nonzero, the memory for counting k-mers below count_threshold_ in each full SetSketch
     bool save_kmers_ = false;
     bool save_kmercounts_ = false;
     bool homopolymer_compress_minimizers_ = false;
@@ -163,7 +164,7 @@ public:
     D2O2(save_kmercounts) D2O2(homopolymer_compress_minimizers)
     D2O2(kmer_result) D2O2(use128) D2O2(cache_sketches)
     D2O2(sketchsize) D2O2(cssize) D2O2(parse_by_seq)
-    D2O2(count_threshold)
+    D2O2(count_threshold) D2O2(count_filter_bytes)
     D2O2(fasta_dedup);
 #undef D2O
 #undef D2O2
@@ -202,8 +203,9 @@ public:
         OMP_ONLY(omp_set_num_threads(nt);)
         return *this;
     }
-    void filterset(const std::string &path, bool is_kmer);
-    void filterset(const std::string &fsarg);
+    // If fpr is positive, the filter set is a Bloom filter with this false positive rate; otherwise, it is exact.
+    void filterset(const std::string &path, bool is_kmer, double fpr);
+    void filterset(const std::string &fsarg, double fpr=-1.);
     CountingType ct() const {return cssize_ > 0 ? COUNTMIN_COUNTING: EXACT_COUNTING;}
     CountingType count() const {return ct();}
     bool trim_folder_paths() const {
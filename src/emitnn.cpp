@@ -9,7 +9,8 @@ namespace dashing2 {
 // (nids + 1) * 8 bytes: indptr in uint64_t
 // nnz * sizeof(LSHIDType): indices in LSHIDType (default uint32_t)
 // nnz * sizeof(LSHDistType): data in LSHDistType (default float)
-void emit_neighbors(std::vector<pqueue> &lists, const Dashing2DistOptions &opts, const SketchingResult &result) {
+void emit_neighbors(std::vector<pqueue> &lists, const Dashing2DistOptions &opts, const SketchingResult &result, const std::vector<std::string> *neighbor_names) {
+    const std::vector<std::string> &nnames = neighbor_names ? *neighbor_names: result.names_;
     auto emitstart = std::chrono::high_resolution_clock::now();
     const std::string &outname = opts.outfile_path_;
     std::FILE *ofp = stdout;
@@ -23,7 +24,7 @@ void emit_neighbors(std::vector<pqueue> &lists, const Dashing2DistOptions &opts,
             fmt::print(ofp, "{}", result.names_[i]);
             for(size_t j = 0; j < l.size(); ++j) {
                 const auto [msr, rhid] = l[j];
-                fmt::print(ofp, "\t{}:{:0.8g}", result.names_[rhid], msr);
+                fmt::print(ofp, "\t{}:{:0.8g}", nnames[rhid], msr);
             }
             fmt::print(ofp, "\n");
         }
@@ -4,7 +4,8 @@
 #include "index_build.h"
 
 namespace dashing2 {
-void emit_neighbors(std::vector<pqueue> &lists, const Dashing2DistOptions &opts, const SketchingResult &result);
+// If neighbor_names is set, neighbors are named from it rather than from result (e.g., for queries against a persistent index)
+void emit_neighbors(std::vector<pqueue> &lists, const Dashing2DistOptions &opts, const SketchingResult &result, const std::vector<std::string> *neighbor_names=nullptr);
 }
 
 #endif
@@ -0,0 +1,84 @@
+#include "cmp_main.h"
+#include "tilecmp.h"
+#include "fmt/format.h"
+#include <thread>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+/*
+ * emit_pairs
+ * Computes only the pairs given by --pairlist.
+ * Pairs are sorted by blocks of ids so that consecutive comparisons reuse sketches in cache,
+ * and are then computed in parallel batches; each batch is written by a separate thread
+ * while the next one is computed, so memory use is bounded by two batches regardless of the number of pairs.
+ */
+void emit_pairs(const Dashing2DistOptions &opts, const SketchingResult &result) {
+    const size_t ns = result.cardinalities_.size();
+    const size_t np = opts.compareids_.size();
+    for(const auto &[lhs, rhs]: opts.compareids_) {
+        if(std::max(lhs, rhs) >= ns)
+            THROW_EXCEPTION(std::runtime_error("Pair ("s + std::to_string(lhs) + ", " + std::to_string(rhs) + ") is out of range for " + std::to_string(ns) + " sketches"));
+    }
+    const TileComparator tiler(opts, result);
+    // Group ids into blocks of sketches which fit in cache together
+    const size_t blocksize = tiler ? std::max(tiler.tile_cols() / 2, size_t(1)): size_t(64);
+    std::vector<std::pair<uint32_t, uint32_t>> pairs(opts.compareids_);
+    std::sort(pairs.begin(), pairs.end(), [blocksize](const auto &x, const auto &y) {
+        return std::make_tuple(x.first / blocksize, x.second / blocksize, x.first, x.second)
+             < std::make_tuple(y.first / blocksize, y.second / blocksize, y.first, y.second);
+    });
+    if(verbosity >= Verbosity::DEBUG) {
+        std::fprintf(stderr, "Emitting %zu pairs from %zu sketches with blocks of %zu sketches; tiled kernel: %d\n", np, ns, blocksize, int(tiler.kernel()));
+    }
+    const bool human = opts.output_format_ == HUMAN_READABLE;
+    std::FILE *ofp;
+    if(opts.outfile_path_.empty() || opts.outfile_path_ == "-" || opts.outfile_path_ == "/dev/stdout") {
+        ofp = stdout;
+        buffer_to_blksize(ofp);
+    } else if((ofp = bfopen(opts.outfile_path_.data(), "wb")) == nullptr) {
+        THROW_EXCEPTION(std::runtime_error("Failed to open path "s + opts.outfile_path_ + " for writing"));
+    }
+    auto name = [&](size_t i) -> std::string {
+        if(result.names_.size() > i && !result.names_[i].empty()) return result.names_[i];
+        return "E"s + std::to_string(i);
+    };
+    if(human) {
+        std::fprintf(ofp, "#Dashing2 PairList Output\n#Dashing2Options: %s\n#Source1\tSource2\t%s\n", opts.to_string().data(), to_string(opts.measure_).data());
+    }
+    static constexpr size_t BATCH_SIZE = 1 << 16;
+    std::vector<float> values[2];
+    auto write_batch = [&](size_t start, size_t stop, const std::vector<float> &vals) {
+        if(human) {
+            fmt::memory_buffer buf;
+            auto bi = std::back_inserter(buf);
+            for(size_t i = start; i < stop; ++i) {
+                fmt::format_to(bi, "{}\t{}\t" D2_VALUE_FMT "\n", name(pairs[i].first), name(pairs[i].second), vals[i - start]);
+            }
+            checked_fwrite(ofp, buf.data(), buf.size());
+        } else {
+            std::vector<PairRecord> recs(stop - start);
+            for(size_t i = start; i < stop; ++i)
+                recs[i - start] = PairRecord{pairs[i].first, pairs[i].second, vals[i - start]};
+            checked_fwrite(ofp, recs.data(), recs.size() * sizeof(PairRecord));
+        }
+    };
+    std::thread writer;
+    for(size_t start = 0, bufid = 0; start < np; start += BATCH_SIZE, bufid ^= 1) {
+        const size_t stop = std::min(start + BATCH_SIZE, np);
+        auto &vals = values[bufid];
+        vals.resize(stop - start);
+        OMP_PFOR_DYN
+        for(size_t i = start; i < stop; ++i) {
+            const auto [lhs, rhs] = pairs[i];
+            vals[i - start] = tiler ? tiler(lhs, rhs): compare(opts, result, lhs, rhs);
+        }
+        if(writer.joinable()) writer.join();
+        writer = std::thread(write_batch, start, stop, std::cref(vals));
+    }
+    if(writer.joinable()) writer.join();
+    if(ofp != stdout) std::fclose(ofp);
+    else std::fflush(ofp);
+}
+
+} // namespace dashing2
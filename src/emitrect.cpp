@@ -1,26 +1,57 @@
 #include "cmp_main.h"
+#include "tilecmp.h"
 #include "fmt/format.h"
-#include "fmt/os.h"
+#include "ring.h"
+#include "kernels.h"
+#include "blockz.h"
 #include <optional>
 
 namespace dashing2 {
 using namespace std::literals::string_literals;
 
-struct QTup: public std::tuple<std::unique_ptr<float[]>, size_t, size_t, size_t> {
-    using super = std::tuple<std::unique_ptr<float[]>, size_t, size_t, size_t>;
-    template<typename...Args>
-    QTup(Args &&...args): super(std::forward<Args>(args)...) {}
-    auto data() {return std::get<0>(*this).get();}
-    auto data() const {return std::get<0>(*this).get();}
-    auto &ptr() {return std::get<0>(*this);}
-    auto &ptr() const {return std::get<0>(*this);}
-    auto &start() {return std::get<1>(*this);}
-    auto start() const {return std::get<1>(*this);}
-    auto &stop() {return std::get<2>(*this);}
-    auto stop() const {return std::get<2>(*this);}
-    auto &nwritten() {return std::get<3>(*this);}
-    auto &nwritten() const {return std::get<3>(*this);}
+// A batch of output rows, reused across batches by the output ring
+struct RowBatch {
+    std::unique_ptr<float[]> data_;
+    size_t capacity_ = 0;
+    size_t start_ = 0, stop_ = 0; // Rows [start_, stop_)
+    size_t nwritten_ = 0;         // Number of floats in data_
+    fmt::memory_buffer text_;     // Formatted rows, for human-readable output
+    std::unique_ptr<uint8_t[]> encoded_; // data_ in the output encoding, for binary output other than f32
+    size_t encoded_capacity_ = 0;
+    std::vector<uint8_t> compressed_, scratch_; // For --block-compress
+    float *reserve(size_t n) {
+        if(n > capacity_ || !data_) {
+            capacity_ = std::max(n, size_t(1));
+            data_.reset(new float[capacity_]);
+        }
+        nwritten_ = n;
+        return data_.get();
+    }
+    uint8_t *reserve_encoded(size_t nbytes) {
+        if(nbytes > encoded_capacity_ || !encoded_) {
+            encoded_capacity_ = std::max(nbytes, size_t(1));
+            encoded_.reset(new uint8_t[encoded_capacity_]);
+        }
+        return encoded_.get();
+    }
+};
+
+/*
+ * Header preceding binary full-matrix output in any encoding other than f32, which remains headerless
+ * (unless block-compressed, in which case it is the container's prefix).
+ * Values follow in the same order as for f32: the condensed upper triangle for symmetric output,
+ * or row-major (nrows_, ncols_) otherwise. Fixed-point values decode as value * scale_.
+ */
+struct MatrixHeader {
+    char magic_[8] = {'D', '2', 'M', 'A', 'T', 'R', 'I', 'X'};
+    uint32_t version_ = 1;
+    uint32_t encoding_ = ENCODE_F32;
+    uint64_t nrows_ = 0, ncols_ = 0;
+    uint32_t kind_ = SYMMETRIC_ALL_PAIRS; // OutputKind
+    uint32_t reserved_ = 0;
+    double scale_ = 1.;
 };
+static_assert(sizeof(MatrixHeader) == 48, "MatrixHeader must be 48 bytes");
 
 template<size_t L>
 constexpr std::array<char, 2 * L + 1> make_tablut() {
@@ -37,59 +68,20 @@ constexpr std::array<char, 2 * L + 1> make_tablut() {
 static constexpr const std::array<char, 513> tabarr = make_tablut<256>();
 static constexpr std::string_view tabstr(tabarr.data(), 512);
 
-static INLINE int print_tabs(size_t n, std::FILE *ofp) {
-    static constexpr const char *ts = tabarr.data();
-    while(n > 256) {
-        if(std::fwrite(ts, 512, 1, ofp) != 1u) return -1;
-        n -= 256;
-    }
-    const auto nw = 2u * n;
-    return std::fwrite(ts, 1, nw, ofp) == nw ? 0: -2;
-}
-
 static INLINE void print_tabs(size_t n, std::back_insert_iterator<fmt::memory_buffer> &biof) {
     for(;n > 256; fmt::format_to(biof, tabstr), n -= 256);
     const auto substr = tabstr.substr(0, n << 1);
     fmt::format_to(biof, "{}", substr);
 }
 
-static INLINE void print_tabs(size_t n, fmt::ostream &os) {
-    for(;n > 256; os.print("{}", tabstr), n -= 256);
-    const auto substr = tabstr.substr(0, n << 1);
-#ifndef NDEBUG
-    for(size_t i = 0; i < substr.size() >> 1; ++i) {
-        assert(substr[i * 2] == '\t');
-        assert(substr[i * 2 + 1] == '-');
-    }
-#endif
-    os.print("{}", substr);
-}
 #ifndef NDEBUG
 #define EMPTY -137.
 #endif
 using cfloatp = const float *;
-#if USE_FMT_FPRINTF
-static constexpr const char *FMT8 = "\t{:0.7g}\t{:0.7g}\t{:0.7g}\t{:0.7g}\t{:0.7g}\t{:0.7g}\t{:0.7g}\t{:0.7g}";
-static constexpr const char *FMT1 = "\t{:0.7g}";
-#else
-static constexpr const char *FMT8 = "\t{}\t{}\t{}\t{}\t{}\t{}\t{}\t{}";
-static constexpr const char *FMT1 = "\t{}";
-#endif
-
-void batched_write(cfloatp &src, fmt::ostream &of, const size_t jend) {
-    // Batched formatting provides a significant speed advantage
-    const float *dat8end = src + (jend / 8) * 8;
-    const float *datend = src + jend;
-    for(;src < dat8end; src += 8) {
-        of.print(FMT8,
-                 *src, src[1], src[2], src[3], src[4], src[5], src[6], src[7]);
-    }
-
-    for(;src < datend; ++src) {
-        of.print(FMT1, *src);
-    }
-    of.print("\n");
-}
+#define FMTV "\t" D2_VALUE_FMT
+static constexpr const char *FMT8 = FMTV FMTV FMTV FMTV FMTV FMTV FMTV FMTV;
+static constexpr const char *FMT1 = FMTV;
+#undef FMTV
 
 void batched_write(const float * &src, std::back_insert_iterator<fmt::memory_buffer> &biof, const size_t jend) {
     // Batched formatting provides a significant speed advantage
@@ -105,102 +97,171 @@ void batched_write(const float * &src, std::back_insert_iterator<fmt::memory_buf
     fmt::format_to(biof, "\n");
 }
 
+
 void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &result) {
     if(verbosity >= Verbosity::DEBUG) {
         std::fprintf(stderr, "output format should be %s based on value at emit_rectangular start\n", to_string(opts.output_format_).data());
     }
     const size_t ns = result.names_.empty() ? result.nqueries(): result.names_.size();
-    const std::string outp = opts.outfile_path_.empty() || opts.outfile_path_.front() == '-'
-            ? "/dev/stdout"s: opts.outfile_path_;
-    // Only make fmt::ostream if emitting in human-readable form
-    std::optional<fmt::ostream> ofopt(opts.output_format_ == HUMAN_READABLE
-                ? std::optional<fmt::ostream>(fmt::output_file(outp, fmt::buffer_size=131072))
-                : std::optional<fmt::ostream>(std::nullopt));
+    const bool human = opts.output_format_ == HUMAN_READABLE;
+    const MatrixEncoding enc = human ? ENCODE_F32: opts.output_encoding_;
+    if(human && opts.output_encoding_ != ENCODE_F32 && verbosity >= Verbosity::INFO)
+        std::fprintf(stderr, "Warning: --binary-precision %s is ignored for human-readable output\n", to_string(opts.output_encoding_).data());
+    if((enc == ENCODE_U8 || enc == ENCODE_U16) && opts.measure_ != SIMILARITY && opts.measure_ != CONTAINMENT && opts.measure_ != SYMMETRIC_CONTAINMENT)
+        THROW_EXCEPTION(std::invalid_argument("--binary-precision "s + to_string(enc) + " quantizes values in [0, 1], which " + to_string(opts.measure_) + " does not produce"));
+    const bool compress = !human && opts.block_compress_;
+    if(human && opts.block_compress_ && verbosity >= Verbosity::INFO)
+        std::fprintf(stderr, "Warning: --block-compress is ignored for human-readable output\n");
     std::FILE *ofp = 0;
-    if(opts.output_format_ == MACHINE_READABLE) {
-        if(opts.outfile_path_.empty() || opts.outfile_path_.front() == '-') {
-            ofp = stdout;
-            buffer_to_blksize(ofp);
-        } else {
-            if((ofp = bfopen(opts.outfile_path_.data(), "wb")) == 0)
-                THROW_EXCEPTION(std::runtime_error("Failed to open path "s + opts.outfile_path_ + " for writing"));
-        }
+    if(opts.outfile_path_.empty() || opts.outfile_path_.front() == '-') {
+        ofp = stdout;
+        buffer_to_blksize(ofp);
+    } else {
+        if((ofp = bfopen(opts.outfile_path_.data(), "wb")) == 0)
+            THROW_EXCEPTION(std::runtime_error("Failed to open path "s + opts.outfile_path_ + " for writing"));
     }
     const bool asym = opts.output_kind_ == ASYMMETRIC_ALL_PAIRS;
-    std::deque<QTup> datq;
-    std::mutex datq_lock;
     if(verbosity >= Verbosity::DEBUG) {
         std::fprintf(stderr, "Emitting %s: %s\n", opts.output_format_ == MACHINE_READABLE ? "machine readable": "human readable", to_string(opts.output_format_).data());
     }
     // Emit Header
-    if(opts.output_format_ == HUMAN_READABLE) {
-        auto &of = ofopt.value();
+    if(human) {
+        fmt::memory_buffer hdr;
+        auto biof = std::back_inserter(hdr);
         if(opts.output_kind_ != PHYLIP) {
             const char *labelstr = asym ? "Asymmetric pairwise": opts.output_kind_ == PANEL ? "Panel (Query/Refernce)": "Symmetric pairwise";
-            of.print("#Dashing2 {} Output\n", labelstr);
-            of.print("#Dashing2Options: {}\n", opts.to_string());
-            of.print("#Sources");
+            fmt::format_to(biof, "#Dashing2 {} Output\n", labelstr);
+            fmt::format_to(biof, "#Dashing2Options: {}\n", opts.to_string());
+            fmt::format_to(biof, "#Sources");
             const int64_t end = result.names_.empty() ? result.nqueries(): result.names_.size();
             for(int64_t i = 0; i < end; ++i) {
-                result.names_.empty() ? of.print("\tE{}", i) : of.print("\t{}", result.names_[i]);
+                result.names_.empty() ? fmt::format_to(biof, "\tE{}", i) : fmt::format_to(biof, "\t{}", result.names_[i]);
             }
-            of.print("\n");
+            fmt::format_to(biof, "\n");
         } else {
-            of.print("{}\n", ns);
+            fmt::format_to(biof, "{}\n", ns);
         }
+        checked_fwrite(ofp, hdr.data(), hdr.size());
     }
+    const size_t nq = result.nqueries(), nf = ns ? (ns - nq): 0;
+    const size_t eb = encoded_bytes(enc);
+    MatrixHeader mh;
+    mh.encoding_ = enc;
+    mh.kind_ = opts.output_kind_;
+    mh.nrows_ = opts.output_kind_ == PANEL ? nf: ns;
+    mh.ncols_ = opts.output_kind_ == PANEL ? nq: ns;
+    mh.scale_ = enc == ENCODE_U8 ? 1. / 255: enc == ENCODE_U16 ? 1. / 65535: 1.;
+    // With --block-compress, the matrix header is always stored, uncompressed, ahead of the blocks, so that readers know the shape
+    std::optional<BlockzWriter> blockz;
+    if(compress) blockz.emplace(ofp, eb, &mh, sizeof(mh));
+    else if(enc != ENCODE_F32) checked_fwrite(ofp, &mh, sizeof(mh));
     /*
-     *  This is a worker thread which processes and emits
-     *  data in the datq which computation is done in parallel by other threads.
-     *  If the queue is empty, it sleeps.
+     *  Computed rows are passed through a bounded ring of reusable batches.
+     *  For human-readable output, formatter threads convert batches to text in parallel,
+     *  and with --block-compress, they compress batches instead;
+     *  a single writer thread emits them in order.
+     *  Once every batch is in flight, computation blocks until one has been written.
      */
-    const size_t nq = result.nqueries(), nf = ns ? (ns - nq): 0;
-    volatile int loopint = 0;
-    std::thread sub = std::thread([&](){
-        while(loopint == 0) {
-            if(datq.empty()) {
-                std::this_thread::sleep_for(std::chrono::duration<size_t, std::nano>(500));
-                continue;
+    const unsigned nformatters = human ? std::clamp(opts.nthreads() / 4u, 1u, 8u): compress ? std::clamp(opts.nthreads() / 2u, 1u, 16u): 0u;
+    OrderedRing<RowBatch> ring(std::max(2 * nformatters + 2, 4u), human || compress);
+    auto format_rows = [&](RowBatch &f) {
+        f.text_.clear();
+        auto biof = std::back_inserter(f.text_);
+        const float *datp = f.data_.get();
+        for(size_t i = f.start_; i < f.stop_; ++i) {
+            std::string fn;
+            if((result.names_.size() > i) && (!result.names_[i].empty())) {
+                fn = result.names_[i];
+            } else {
+                fn = std::string("E") + std::to_string(i);
             }
-            auto &f = datq.front();
-            auto fs = f.start(), fe = f.stop();
-#ifndef NDEBUG
-            if(loopint) {
-                std::fprintf(stderr, "Writing data from queue of size %zu after the loopint is terminated. This means all computation is done and we are just formatting and emitting data.\n", datq.size());
+            if(fn.size() < 9) fn.append(9 - fn.size(), ' ');
+            fmt::format_to(biof, "{}", fn);
+            const size_t jend = opts.output_kind_ == PANEL ? nq: asym ? ns: ns - i - 1;
+            if(opts.output_kind_ == SYMMETRIC_ALL_PAIRS) print_tabs(i + 1, biof);
+            batched_write(datp, biof, jend);
+        }
+    };
+    std::vector<std::thread> formatters;
+    for(unsigned i = 0; i < nformatters; ++i) {
+        formatters.emplace_back([&]() {
+            while(RowBatch *f = ring.claim()) {
+                if(compress) blockz_compress(enc != ENCODE_F32 ? f->encoded_.get(): reinterpret_cast<const uint8_t *>(f->data_.get()), f->nwritten_ * eb, eb, f->compressed_, f->scratch_);
+                else format_rows(*f);
+                ring.formatted(*f);
             }
-#endif
-            if(opts.output_format_ == HUMAN_READABLE) {
-                auto &of = ofopt.value();
-                const float *datp = f.data();
-                for(size_t i = fs; i < fe; ++i) {
-                    std::string fn;
-                    if((result.names_.size() > i) && (!result.names_[i].empty())) {
-                        fn = result.names_[i];
-                    } else {
-                        fn = std::string("E") + std::to_string(i);
-                    }
-                    if(fn.size() < 9) fn.append(9 - fn.size(), ' ');
-                    of.print("{}", fn);
-                    const size_t jend = opts.output_kind_ == PANEL ? nq: asym ? ns: ns - i - 1;
-                    if(opts.output_kind_ == SYMMETRIC_ALL_PAIRS) print_tabs(i + 1, of);
-                    batched_write(datp, of, jend);
+        });
+    }
+    // On a write error, the writer keeps releasing batches so that computation can finish, and the error is rethrown afterwards
+    std::exception_ptr write_error;
+    std::thread writer([&]() {
+        while(RowBatch *f = ring.next()) {
+            if(!write_error) {
+                try {
+                    if(human) checked_fwrite(ofp, f->text_.data(), f->text_.size());
+                    else if(compress) blockz->append(f->compressed_.data(), f->compressed_.size(), f->nwritten_ * eb, f->start_, f->stop_ - f->start_);
+                    else if(enc != ENCODE_F32) checked_fwrite(ofp, f->encoded_.get(), f->nwritten_ * eb);
+                    else if(std::fwrite(f->data_.get(), sizeof(float), f->nwritten_, ofp) != f->nwritten_)
+                        THROW_EXCEPTION(std::runtime_error(std::string("Failed to write rows ") + std::to_string(f->start_) + "-" + std::to_string(f->stop_) + " to disk"));
+                } catch(...) {
+                    write_error = std::current_exception();
                 }
-            } else {
-                assert(opts.output_format_ == MACHINE_READABLE);
-                const size_t nwritten = datq.front().nwritten();
-                if(std::fwrite(datq.front().data(), sizeof(float), nwritten, ofp) != nwritten)
-                    THROW_EXCEPTION(std::runtime_error(std::string("Failed to write rows ") + std::to_string(datq.front().start()) + "-" + std::to_string(datq.front().stop()) + " to disk"));
             }
-            std::lock_guard<std::mutex> guard(datq_lock);
-            datq.pop_front();
+            ring.release();
         }
     });
-    const size_t batch_size = std::max(std::min(unsigned(opts.cmp_batch_size_), opts.nthreads()), 1u);
-    // We have two access patterns --
-    // Unbatched (batch_size <= 1), which fills in the matrix one row at a time
-    // and
+    RowBatch *current = nullptr; // Batch being filled by the compute threads
+    // Blocks until a batch is free, and returns storage for nwritten floats for rows [start, stop)
+    auto acquire = [&](size_t start, size_t stop, size_t nwritten) {
+        RowBatch &f = ring.acquire();
+        current = &f;
+        f.start_ = start;
+        f.stop_ = stop;
+        float *const dat = f.reserve(nwritten);
+#ifndef NDEBUG
+        std::fill_n(dat, nwritten, EMPTY);
+#endif
+        return dat;
+    };
+    // Converts the current batch to the output encoding in parallel, if needed, and hands it to the writer
+    auto publish = [&]() {
+        if(enc != ENCODE_F32) {
+            RowBatch &f = *current;
+            static constexpr size_t CHUNK = 1 << 16;
+            const size_t n = f.nwritten_, nchunks = (n + CHUNK - 1) / CHUNK;
+            uint8_t *const out = f.reserve_encoded(n * eb);
+            const KernelTable &k = kernels();
+            OMP_PFOR
+            for(size_t ci = 0; ci < nchunks; ++ci) {
+                const size_t start = ci * CHUNK;
+                k.encode_floats(f.data_.get() + start, std::min(CHUNK, n - start), enc, out + start * eb);
+            }
+        }
+        ring.publish();
+    };
+    // For sketch comparisons, the kernel is resolved once and the matrix is filled in cache-sized tiles.
+    // Exact k-mer and edit-distance comparisons fall back to per-pair compare() calls.
+    const TileComparator tiler(opts, result);
+    const size_t batch_size = tiler ? std::max(tiler.tile_rows(), size_t(opts.cmp_batch_size_))
+                                    : std::max(std::min(unsigned(opts.cmp_batch_size_), opts.nthreads()), 1u);
+    // Parallelizes over column tiles, each of which is compared against every row in [firstrow, erow)
+    auto fill_tiled = [&](size_t firstrow, size_t erow, size_t colstart, size_t colend, float *const *rows, bool upper) {
+        if(colstart >= colend) return;
+        const size_t ncols = colend - colstart, nt = std::max(opts.nthreads(), 1u);
+        const size_t tw = std::max(std::min(tiler.tile_cols(), (ncols + nt - 1) / nt), size_t(1));
+        const size_t ntiles = (ncols + tw - 1) / tw;
+        OMP_PFOR_DYN
+        for(size_t ti = 0; ti < ntiles; ++ti) {
+            const size_t cs = colstart + ti * tw;
+            tiler.fill(firstrow, erow, cs, std::min(cs + tw, colend), rows, upper);
+        }
+    };
+    std::vector<float *> rowptrs;
+    // We have three access patterns --
+    // Unbatched (batch_size <= 1), which fills in the matrix one row at a time,
     // Batched (batch_size > 1), which is more cache efficient by grouping comparisons
-    // so that computations using the same data can share it
+    // so that computations using the same data can share it,
+    // and Tiled, which batches rows and sweeps them across cache-resident tiles of columns
     if(verbosity >= Verbosity::DEBUG) {
         if(opts.output_format_ == MACHINE_READABLE) {
             std::fprintf(stderr, "Before panel, emitting machine-readable: %s\n", to_string(opts.output_format_).data());
@@ -209,12 +270,9 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
         }
     }
     if(opts.output_kind_ == PANEL) {
-        if(batch_size <= 1) {
+        if(batch_size <= 1 && !tiler) {
             for(size_t i = 0; i < nf; ++i) {
-                std::unique_ptr<float[]> dat(new float[nq]);
-#ifndef NDEBUG
-                std::fill_n(dat.get(), nq, EMPTY);
-#endif
+                float *const dat = acquire(i, i + 1, nq);
                 if(verbosity >= Verbosity::DEBUG) {
                     std::fprintf(stderr, "Panel comparing %zd against %zd->%zd\n", i, nf, nf + nq);
                 }
@@ -222,8 +280,7 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
                 for(size_t j = 0; j < nq; ++j) {
                     dat[j] = compare(opts, result, i, j + nf);
                 }
-                std::lock_guard<std::mutex> guard(datq_lock);
-                datq.emplace_back(QTup{std::move(dat), i, i + 1, nq});
+                publish();
             }
         } else {
             const size_t nbatches = (nf + batch_size - 1) / batch_size;
@@ -231,18 +288,19 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
                 const size_t firstrow = bi * batch_size;
                 const size_t erow = std::min((bi + 1) * batch_size, nf);
                 const size_t nrow = erow - firstrow;
-                const size_t nwritten = nq * nrow;
-                std::unique_ptr<float[]> dat(new float[nwritten]);
-#ifndef NDEBUG
-                std::fill_n(dat.get(), nwritten, EMPTY);
-#endif
-                OMP_PFOR_DYN
-                for(size_t i = 0; i < nrow; ++i) {
-                    for(size_t j = 0; j < nq; ++j)
-                        dat[i * nq + j] = compare(opts, result, i + firstrow, j + nf);
+                float *const dat = acquire(firstrow, erow, nq * nrow);
+                if(tiler) {
+                    rowptrs.resize(nrow);
+                    for(size_t i = 0; i < nrow; ++i) rowptrs[i] = &dat[i * nq] - nf;
+                    fill_tiled(firstrow, erow, nf, nf + nq, rowptrs.data(), false);
+                } else {
+                    OMP_PFOR_DYN
+                    for(size_t i = 0; i < nrow; ++i) {
+                        for(size_t j = 0; j < nq; ++j)
+                            dat[i * nq + j] = compare(opts, result, i + firstrow, j + nf);
+                    }
                 }
-                std::lock_guard<std::mutex> guard(datq_lock);
-                datq.emplace_back(QTup{std::move(dat), firstrow, erow, nwritten});
+                publish();
             }
         }
     } else {
@@ -252,30 +310,27 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
                 const size_t firstrow = bi * batch_size;
                 const size_t erow = std::min((bi + 1) * batch_size, ns);
                 const size_t diff = erow - firstrow;
-                const size_t nwritten = ns * diff;
-                std::unique_ptr<float[]> dat(new float[nwritten]);
-#ifndef NDEBUG
-                std::fill_n(dat.get(), nwritten, EMPTY);
-#endif
-                OMP_PFOR_DYN
-                for(size_t fs = firstrow; fs < erow; ++fs) {
-                    auto datp = &dat[(fs - firstrow) * ns];
-                    for(size_t j = 0; j < ns; ++j)
-                        datp[j] = compare(opts, result, fs, j);
+                float *const dat = acquire(firstrow, erow, ns * diff);
+                if(tiler) {
+                    rowptrs.resize(diff);
+                    for(size_t i = 0; i < diff; ++i) rowptrs[i] = &dat[i * ns];
+                    fill_tiled(firstrow, erow, 0, ns, rowptrs.data(), false);
+                } else {
+                    OMP_PFOR_DYN
+                    for(size_t fs = firstrow; fs < erow; ++fs) {
+                        auto datp = &dat[(fs - firstrow) * ns];
+                        for(size_t j = 0; j < ns; ++j)
+                            datp[j] = compare(opts, result, fs, j);
+                    }
                 }
-                std::lock_guard<std::mutex> guard(datq_lock);
-                datq.emplace_back(QTup{std::move(dat), firstrow, erow, nwritten});
+                publish();
             }
         } else { // all-pairs symmetric! (upper-triangular)
-            if(batch_size <= 1) {
+            if(batch_size <= 1 && !tiler) {
                 for(size_t i = 0; i < ns; ++i) {
-                    size_t nelem = asym ? ns: ns - i - 1;
-                    std::unique_ptr<float[]> dat(new float[nelem]);
-#ifndef NDEBUG
-                    std::fill_n(dat.get(), nelem, EMPTY);
-#endif
-                    const auto datp = dat.get() - (asym ? size_t(0): i + 1);
-                    const size_t start_index = asym ? 0: i + 1;
+                    const size_t nelem = ns - i - 1;
+                    const auto datp = acquire(i, i + 1, nelem) - (i + 1);
+                    const size_t start_index = i + 1;
                     if(verbosity >= Verbosity::DEBUG && (start_index < ns)) {
                         std::fprintf(stderr, "UT comparing %zd against %zd through %zd\n", i, start_index, ns - 1);
                     }
@@ -283,15 +338,15 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
                     for(size_t start = start_index;start < ns; ++start) {
                         datp[start] = compare(opts, result, i, start);
                     }
-                    std::lock_guard<std::mutex> guard(datq_lock);
-                    datq.emplace_back(QTup{std::move(dat), i, i + 1, nelem});
+                    publish();
                 }
             } else {
                 const size_t nbatches = (ns + batch_size - 1) / batch_size;
+                std::vector<size_t> offsets;
                 for(size_t bi = 0; bi < nbatches; ++bi) {
                     const size_t firstrow = bi * batch_size;
                     const size_t erow = std::min((bi + 1) * batch_size, ns);
-                    std::vector<size_t> offsets{0};
+                    offsets.assign(1, 0);
                     DBG_ONLY(size_t sum = 0;)
                     for(size_t fs = firstrow; fs < erow; ++fs) {
                         offsets.push_back(ns - fs - 1 + offsets.back());
@@ -299,107 +354,55 @@ void emit_rectangular(const Dashing2DistOptions &opts, const SketchingResult &re
                     }
                     const size_t nwritten = offsets.back();
                     assert(nwritten == sum);
-                    auto dat = std::make_unique<float[]>(nwritten);
-                    DBG_ONLY(std::fill_n(dat.get(), nwritten, EMPTY);)
+                    float *const dat = acquire(firstrow, erow, nwritten);
                     std::atomic<size_t> totalused(0);
-                    OMP_PFOR_DYN
-                    for(size_t fs = firstrow; fs < erow; ++fs) {
-                        auto myoff = fs - firstrow;
+                    if(tiler) {
+                        rowptrs.resize(erow - firstrow);
+                        for(size_t fs = firstrow; fs < erow; ++fs) rowptrs[fs - firstrow] = &dat[offsets[fs - firstrow]] - fs - 1;
+                        fill_tiled(firstrow, erow, firstrow + 1, ns, rowptrs.data(), true);
+                        DBG_ONLY(totalused += nwritten;)
+                    } else {
+                        OMP_PFOR_DYN
+                        for(size_t fs = firstrow; fs < erow; ++fs) {
+                            auto myoff = fs - firstrow;
 #ifndef NDEBUG
-                        size_t shouldoff = 0;
-                        for(size_t ofs = firstrow; ofs < fs; ++ofs) shouldoff += ns - ofs - 1;
-                        assert(shouldoff == offsets.at(myoff) || !std::fprintf(stderr, "Expected %zu for offsets, found %zu\n", shouldoff, offsets.at(myoff)));
+                            size_t shouldoff = 0;
+                            for(size_t ofs = firstrow; ofs < fs; ++ofs) shouldoff += ns - ofs - 1;
+                            assert(shouldoff == offsets.at(myoff) || !std::fprintf(stderr, "Expected %zu for offsets, found %zu\n", shouldoff, offsets.at(myoff)));
 #endif
-                        auto datp = &dat[offsets[myoff]] - fs - 1;
-                        for(size_t j = fs + 1; j < ns; ++j) {
-                            DBG_ONLY(++totalused;)
-                            datp[j] = compare(opts, result, fs, j);
+                            auto datp = &dat[offsets[myoff]] - fs - 1;
+                            for(size_t j = fs + 1; j < ns; ++j) {
+                                DBG_ONLY(++totalused;)
+                                datp[j] = compare(opts, result, fs, j);
+                            }
                         }
                     }
                     assert(totalused.load() == nwritten);
-                    assert(std::all_of(dat.get(), dat.get() + nwritten, [](auto x) {return !std::isinf(x);}));
-                    std::lock_guard<std::mutex> guard(datq_lock);
-                    datq.emplace_back(QTup{std::move(dat), firstrow, erow, nwritten});
+                    assert(std::all_of(dat, dat + nwritten, [](auto x) {return !std::isinf(x);}));
+                    publish();
                 }
             }
         }
     }
-    loopint = 1;
-    if(sub.joinable()) sub.join();
-    static constexpr size_t BUFSIZE = 131072;
-    static constexpr size_t BUFSIZEM1 = BUFSIZE - 1;
-    if(const size_t dqs = datq.size(); dqs) {
-        if(opts.output_format_ == HUMAN_READABLE) {
-            auto &of = ofopt.value();
-            of.flush();
-            std::vector<fmt::memory_buffer> bufs(dqs);
-            // Format in parallel, then write in sequence
-            OMP_PFOR_DYN
-            for(size_t di = 0; di < dqs; ++di) {
-                auto &f = datq[di];
-                auto biof = std::back_inserter(bufs[di]);
-                const auto fs = f.start(), fe = f.stop();
-                const float *datp = f.data();
-                for(size_t i = fs; i < fe; ++i) {
-                    std::string fn;
-                    if((result.names_.size() > i) && (!result.names_[i].empty())) {
-                        fn = result.names_[i];
-                    } else {
-                        fn = std::string("E") + std::to_string(i);
-                    }
-                    if(fn.size() < 9) fn.append(9 - fn.size(), ' ');
-                    fmt::format_to(biof, "{}", fn);
-                    const size_t jend = opts.output_kind_ == PANEL ? nq: asym ? ns: ns - i - 1;
-                    if(opts.output_kind_ == SYMMETRIC_ALL_PAIRS) print_tabs(i + 1, biof);
-                    batched_write(datp, biof, jend);
-                }
-            }
-            datq.clear();
-            of.close(); // Flush and close, and then open a posix file
-            auto off = fmt::file(outp, fmt::file::WRONLY | fmt::file::APPEND);
-            for(const auto &buf: bufs) {
-                const size_t nblocks = (buf.size() + BUFSIZEM1) / BUFSIZE;
-                auto ptr = buf.data();
-                // Chunk the writing according to blocksize
-                for(size_t i = 0; i < nblocks; ++i) {
-                    const size_t n_in_block = (i == nblocks - 1) ? buf.size() & BUFSIZEM1: BUFSIZE;
-                    off.write(ptr, n_in_block);
-                    ptr += BUFSIZE;
-                }
-            }
-        } else {
-#define MANUAL_BUFFER 1
-#if MANUAL_BUFFER
-            const int fd = ::fileno(ofp);
-            std::fflush(ofp);
-#endif
-            while(!datq.empty()) {
-                const auto &pair = datq.front();
-                const size_t nwritten = pair.nwritten();
-#if !MANUAL_BUFFER
-                if(std::fwrite(pair.data(), sizeof(float), nwritten, ofp) != nwritten)
-                   THROW_EXCEPTION(std::runtime_error(std::string("Failed to write rows ") + std::to_string(pair.start()) + "-" + std::to_string(pair.stop()) + " to disk"));
-#else
-                const size_t nbytes = sizeof(float) * nwritten;
-                static constexpr size_t nfloats_per_block = BUFSIZE / sizeof(float);
-                const ssize_t nblocks = (nbytes + BUFSIZEM1) >> 17;
-                for(ssize_t i = 0; i < nblocks - 1; ++i) {
-                    const ssize_t wrc = ::write(fd, pair.data() + i * nfloats_per_block, BUFSIZE);
-                    if(unlikely(wrc < ssize_t(BUFSIZE)))
-                        throw std::runtime_error("Failed to POSIX write. Wrote "s + std::to_string(wrc) + " instead of " + std::to_string(BUFSIZE));
-                }
-                const ssize_t lon = (nwritten & 32767ul) * sizeof(float);
-                const ssize_t wrc = ::write(fd, pair.data() + (nblocks - 1) * nfloats_per_block, lon);
-                if(wrc != lon) {
-                   THROW_EXCEPTION(std::runtime_error(std::string("Failed to write rows ") + std::to_string(pair.start()) + "-" + std::to_string(pair.stop()) + " to disk"));
-                }
-#endif
-                datq.pop_front();
-            }
+    ring.close();
+    writer.join();
+    for(auto &f: formatters) f.join();
+    if(blockz && !write_error) {
+        try {
+            blockz->finish();
+        } catch(...) {
+            write_error = std::current_exception();
         }
     }
-    assert(datq.empty());
-    if(ofp && ofp != stdout) std::fclose(ofp);
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "emit_rectangular: %zu batches in flight, %u formatter threads. Computation stalled on output for %gs; output stalled on computation for %gs and on formatting for %gs\n",
+                     ring.size(), nformatters, ring.producer_stall_seconds(), ring.writer_stall_seconds(), ring.format_stall_seconds());
+        if(blockz) std::fprintf(stderr, "emit_rectangular: compressed %zu blocks, %zu bytes to %zu (%gx)\n",
+                                blockz->nblocks(), size_t(blockz->raw_bytes()), size_t(blockz->bytes_written()), double(blockz->raw_bytes()) / blockz->bytes_written());
+    }
+    if(ofp != stdout) std::fclose(ofp);
+    else std::fflush(ofp);
+    if(write_error) std::rethrow_exception(write_error);
 }
 
 
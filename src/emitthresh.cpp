@@ -0,0 +1,193 @@
+#include "cmp_main.h"
+#include "tilecmp.h"
+#include "fmt/format.h"
+#include "ring.h"
+#include <thread>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+// Passing pairs for rows [start_, stop_), in row-major order, reused across blocks by the output ring
+struct HitBatch {
+    std::vector<PairRecord> hits_;
+    std::vector<std::vector<PairRecord>> parts_; // Hits found by each column tile (or row, without tiling)
+    std::vector<uint64_t> counts_;               // Hits per (part, row), and then each's offset into hits_
+    size_t start_ = 0, stop_ = 0;
+    fmt::memory_buffer text_;                    // Formatted hits, for human-readable output
+};
+
+/*
+ * emit_thresholded
+ * Exact thresholded all-pairs mode (--all-pairs-threshold).
+ * Every pair in the requested shape (upper-triangular, asymmetric or panel) is compared as in emit_rectangular,
+ * with the tiled engine where available, but only pairs passing the threshold are kept:
+ * similarities >= the threshold, or distances below it.
+ *
+ * Each block of rows is swept across column tiles in parallel; each tile is filled into a small per-thread scratch buffer
+ * and scanned for hits, which are then scattered into row-major order, so that output is deterministic.
+ * Blocks pass through the same bounded ring as emit_rectangular, so output and memory scale with the number of hits.
+ * Binary output is a stream of PairRecords, as for --pairlist; for panel output, rhs is the query's index.
+ */
+void emit_thresholded(const Dashing2DistOptions &opts, const SketchingResult &result) {
+    const size_t ns = result.names_.empty() ? result.nqueries(): result.names_.size();
+    if(ns > size_t(std::numeric_limits<uint32_t>::max()))
+        THROW_EXCEPTION(std::invalid_argument("Too many items ("s + std::to_string(ns) + ") for thresholded all-pairs output"));
+    const bool human = opts.output_format_ == HUMAN_READABLE;
+    const bool panel = opts.output_kind_ == PANEL, asym = opts.output_kind_ == ASYMMETRIC_ALL_PAIRS;
+    const bool upper = !panel && !asym;
+    const size_t nq = result.nqueries(), nf = ns ? (ns - nq): 0;
+    // Rows [0, nrows) are compared against columns [colstart, colend); column ids are emitted relative to coloffset
+    const size_t nrows = panel ? nf: ns, colstart = panel ? nf: 0, colend = ns, coloffset = colstart;
+    const double thresh = opts.min_similarity_;
+    const bool isdist = distance(opts.measure_);
+    // Records always hold f32 values, so the full-matrix encodings do not apply
+    if(opts.output_encoding_ != ENCODE_F32 && verbosity >= Verbosity::INFO)
+        std::fprintf(stderr, "Warning: --binary-precision %s is ignored for thresholded all-pairs output\n", to_string(opts.output_encoding_).data());
+    if(opts.block_compress_ && verbosity >= Verbosity::INFO)
+        std::fprintf(stderr, "Warning: --block-compress is ignored for thresholded all-pairs output\n");
+    std::FILE *ofp;
+    if(opts.outfile_path_.empty() || opts.outfile_path_ == "-" || opts.outfile_path_ == "/dev/stdout") {
+        ofp = stdout;
+        buffer_to_blksize(ofp);
+    } else if((ofp = bfopen(opts.outfile_path_.data(), "wb")) == nullptr) {
+        THROW_EXCEPTION(std::runtime_error("Failed to open path "s + opts.outfile_path_ + " for writing"));
+    }
+    auto name = [&](size_t i) -> std::string {
+        if(result.names_.size() > i && !result.names_[i].empty()) return result.names_[i];
+        return "E"s + std::to_string(i);
+    };
+    if(human) {
+        const char *labelstr = asym ? "Asymmetric pairwise": panel ? "Panel (Query/Reference)": "Symmetric pairwise";
+        fmt::print(ofp, "#Dashing2 Thresholded {} Output\n#Dashing2Options: {}\n#Threshold: {} {}\n#Source1\tSource2\t{}\n",
+                   labelstr, opts.to_string(), isdist ? "<": ">=", thresh, to_string(opts.measure_));
+    }
+    const TileComparator tiler(opts, result);
+    const unsigned nt = std::max(opts.nthreads(), 1u);
+    const size_t batch_size = tiler ? std::max(tiler.tile_rows(), size_t(opts.cmp_batch_size_))
+                                    : std::max(size_t(opts.cmp_batch_size_), size_t(nt));
+    // Columns per scratch fill, which bounds each thread's scratch buffer to batch_size * SCRATCH_COLS floats
+    static constexpr size_t SCRATCH_COLS = 1024;
+    if(verbosity >= Verbosity::DEBUG) {
+        std::fprintf(stderr, "Thresholded all-pairs: %zu rows against columns [%zu, %zu), %zu rows per block, tiled kernel: %d\n",
+                     nrows, colstart, colend, batch_size, int(tiler.kernel()));
+    }
+
+    const unsigned nformatters = human ? std::clamp(nt / 4u, 1u, 8u): 0u;
+    OrderedRing<HitBatch> ring(std::max(2 * nformatters + 2, 4u), human);
+    auto format_hits = [&](HitBatch &f) {
+        f.text_.clear();
+        auto biof = std::back_inserter(f.text_);
+        for(const PairRecord &h: f.hits_)
+            fmt::format_to(biof, "{}\t{}\t" D2_VALUE_FMT "\n", name(h.lhs), name(h.rhs + coloffset), h.value);
+    };
+    std::vector<std::thread> formatters;
+    for(unsigned i = 0; i < nformatters; ++i) {
+        formatters.emplace_back([&]() {
+            while(HitBatch *f = ring.claim()) {
+                format_hits(*f);
+                ring.formatted(*f);
+            }
+        });
+    }
+    // On a write error, the writer keeps releasing batches so that computation can finish, and the error is rethrown afterwards
+    std::exception_ptr write_error;
+    std::thread writer([&]() {
+        while(HitBatch *f = ring.next()) {
+            if(!write_error) {
+                try {
+                    if(human) checked_fwrite(ofp, f->text_.data(), f->text_.size());
+                    else checked_fwrite(ofp, f->hits_.data(), f->hits_.size() * sizeof(PairRecord));
+                } catch(...) {
+                    write_error = std::current_exception();
+                }
+            }
+            ring.release();
+        }
+    });
+
+    size_t nhits = 0;
+    for(size_t firstrow = 0; firstrow < nrows; firstrow += batch_size) {
+        const size_t erow = std::min(firstrow + batch_size, nrows), nrow = erow - firstrow;
+        // In upper-triangular mode, no row in the block has columns before firstrow + 1
+        const size_t cs = upper ? firstrow + 1: colstart, ncols = colend > cs ? colend - cs: 0;
+        HitBatch &f = ring.acquire();
+        f.start_ = firstrow;
+        f.stop_ = erow;
+        size_t nparts, tw = 1;
+        if(tiler) {
+            tw = ncols ? std::max(std::min(tiler.tile_cols(), (ncols + nt - 1) / nt), size_t(1)): 1;
+            nparts = (ncols + tw - 1) / tw;
+        } else {
+            nparts = nrow;
+        }
+        if(f.parts_.size() < nparts) f.parts_.resize(nparts);
+        f.counts_.assign(nparts * nrow, 0);
+        auto keep = [&](size_t part, size_t i, size_t j, float v) {
+            if(isdist ? v < thresh: v >= thresh) {
+                f.parts_[part].push_back(PairRecord{uint32_t(i), uint32_t(j - coloffset), v});
+                ++f.counts_[part * nrow + (i - firstrow)];
+            }
+        };
+        if(tiler) {
+            OMP_PRAGMA("omp parallel")
+            {
+                std::vector<float> scratch(nrow * SCRATCH_COLS);
+                std::vector<float *> rowptrs(nrow);
+                OMP_PRAGMA("omp for schedule(dynamic)")
+                for(size_t ti = 0; ti < nparts; ++ti) {
+                    f.parts_[ti].clear();
+                    const size_t tstart = cs + ti * tw, tend = std::min(tstart + tw, colend);
+                    for(size_t sc = tstart; sc < tend; sc += SCRATCH_COLS) {
+                        const size_t se = std::min(sc + SCRATCH_COLS, tend), width = se - sc;
+                        for(size_t r = 0; r < nrow; ++r) rowptrs[r] = scratch.data() + r * width - sc;
+                        tiler.fill(firstrow, erow, sc, se, rowptrs.data(), upper);
+                        for(size_t r = 0; r < nrow; ++r) {
+                            const size_t i = firstrow + r;
+                            for(size_t j = upper ? std::max(sc, i + 1): sc; j < se; ++j)
+                                if(panel || j != i) keep(ti, i, j, rowptrs[r][j]);
+                        }
+                    }
+                }
+            }
+        } else {
+            OMP_PFOR_DYN
+            for(size_t r = 0; r < nrow; ++r) {
+                const size_t i = firstrow + r;
+                f.parts_[r].clear();
+                for(size_t j = upper ? i + 1: colstart; j < colend; ++j)
+                    if(panel || j != i) keep(r, i, j, compare(opts, result, i, j));
+            }
+        }
+        // Within a part, each row's hits are in ascending column order, and parts cover ascending column ranges,
+        // so scattering by (row, part) yields row-major order.
+        size_t total = 0;
+        for(size_t r = 0; r < nrow; ++r) {
+            for(size_t p = 0; p < nparts; ++p) {
+                const uint64_t c = f.counts_[p * nrow + r];
+                f.counts_[p * nrow + r] = total;
+                total += c;
+            }
+        }
+        f.hits_.resize(total);
+        OMP_PFOR
+        for(size_t p = 0; p < nparts; ++p) {
+            uint64_t *const offsets = &f.counts_[p * nrow];
+            for(const PairRecord &h: f.parts_[p])
+                f.hits_[offsets[h.lhs - firstrow]++] = h;
+        }
+        nhits += total;
+        ring.publish();
+    }
+    ring.close();
+    writer.join();
+    for(auto &f: formatters) f.join();
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "emit_thresholded: %zu pairs passed the threshold. Computation stalled on output for %gs; output stalled on computation for %gs and on formatting for %gs\n",
+                     nhits, ring.producer_stall_seconds(), ring.writer_stall_seconds(), ring.format_stall_seconds());
+    }
+    if(ofp != stdout) std::fclose(ofp);
+    else std::fflush(ofp);
+    if(write_error) std::rethrow_exception(write_error);
+}
+
+} // namespace dashing2
@@ -61,6 +61,16 @@ std::string to_string(OutputFormat of) {
     }
     return {};
 }
+static constexpr std::array<const char *, 5> ENCODING_NAMES{"f32", "f16", "bf16", "u8", "u16"};
+std::string to_string(MatrixEncoding enc) {
+    if(size_t(enc) < ENCODING_NAMES.size()) return ENCODING_NAMES[enc];
+    return "UNKNOWN ENCODING";
+}
+MatrixEncoding parse_matrix_encoding(const std::string &s) {
+    for(size_t i = 0; i < ENCODING_NAMES.size(); ++i)
+        if(s == ENCODING_NAMES[i]) return MatrixEncoding(i);
+    throw std::invalid_argument("Unknown binary precision '" + s + "'; expected f32, f16, bf16, u8 or u16");
+}
 std::string to_string(OutputKind ok) {
     switch(ok) {
         case PHYLIP: return "PHYLIP";
@@ -70,6 +80,7 @@ std::string to_string(OutputKind ok) {
         case NN_GRAPH_THRESHOLD: return "ThresholdedNNGraph";
         case DEDUP: return "Deduplication";
         case PANEL: return "Panel (Reference/Query)";
+        case PAIRLIST: return "PairList";
     }
     throw std::runtime_error("Unexpected OutputKind ok");
     return "Unknown";
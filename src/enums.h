@@ -94,7 +94,8 @@ enum OutputKind {
     KNN_GRAPH, // Fixed top-k neighbors
     NN_GRAPH_THRESHOLD, // Variable number of similarities, as given by threshold
     PANEL,
-    DEDUP
+    DEDUP,
+    PAIRLIST // Only the pairs given by --pairlist
 };
 
 enum OutputFormat {
@@ -103,6 +104,18 @@ enum OutputFormat {
     BINARY = MACHINE_READABLE
 };
 
+// Value encodings for binary matrix output (--binary-precision)
+enum MatrixEncoding: uint32_t {
+    ENCODE_F32,  // IEEE single precision; the default, written without a header
+    ENCODE_F16,  // IEEE half precision
+    ENCODE_BF16, // bfloat16: the top half of a float
+    ENCODE_U8,   // round(x * 255) for x in [0, 1]
+    ENCODE_U16   // round(x * 65535) for x in [0, 1]
+};
+static constexpr inline size_t encoded_bytes(MatrixEncoding enc) {
+    return enc == ENCODE_F32 ? 4: enc == ENCODE_U8 ? 1: 2;
+}
+
 enum Verbosity: int {
     STANDARD, // no extra logging
     INFO, // information, but not low-level information
@@ -116,6 +129,9 @@ std::string to_string(DataType dt);
 std::string to_string(CountingType ct);
 std::string to_string(OutputKind ok);
 std::string to_string(OutputFormat of);
+std::string to_string(MatrixEncoding enc);
+// Parses f32, f16, bf16, u8 or u16
+MatrixEncoding parse_matrix_encoding(const std::string &s);
 std::string trim_folder(const std::string &s);
 struct Dashing2Options;
 
@@ -92,6 +92,8 @@ std::string makedest(Dashing2Options &opts, const std::string &path, bool iskmer
         ret = ret + ".ct_threshold";
         if(std::fmod(opts.count_threshold_, 1.)) ret = ret + std::to_string(opts.count_threshold_);
         else ret = ret + std::to_string(int(opts.count_threshold_));
+        if(opts.count_threshold_ > 1 && opts.count_filter_bytes_ && opts.kmer_result_ == FULL_SETSKETCH)
+            ret = ret + ".countfilter" + std::to_string(opts.count_filter_bytes_);
     }
     if(opts.sspace_ != SPACE_SET && opts.sspace_ != SPACE_EDIT_DISTANCE) {
         ret += '.';
@@ -1,4 +1,6 @@
 #include "fastxsketch.h"
+#include "fxsplit.h"
+#include "kernels.h"
 #include "mio.hpp"
 #include "sketch_core.h"
 #include <variant>
@@ -144,6 +146,53 @@ std::string FastxSketchingResult::str() const {
     return msg;
 }
 
+/*
+ * Buffers a sequence's 64-bit k-mers and applies them to a set sketch a block at a time: maskfn is applied to the block
+ * by the vectorized kernel, the filter set and downsampling are applied to what remains, and the survivors go to update_batch.
+ * Equivalent to calling update on each k-mer that passes, in order, without a dependency chain per k-mer.
+ */
+template<typename Sketch>
+class KmerBlockUpdater {
+    static constexpr size_t BLOCK = 256;
+    static_assert(BLOCK <= FilterSet::BATCH_LIMIT, "Block is too large");
+    Sketch &sketch_;
+    Dashing2Options &opts_;
+    const KernelTable &kern_;
+    uint64_t buf_[BLOCK];
+    bool hits_[BLOCK];
+    size_t n_ = 0;
+public:
+    KmerBlockUpdater(Sketch &sketch, Dashing2Options &opts): sketch_(sketch), opts_(opts), kern_(kernels()) {}
+    INLINE void add(uint64_t kmer) {
+        buf_[n_] = kmer;
+        if(++n_ == BLOCK) flush();
+    }
+    void flush() {
+        if(!n_) return;
+        kern_.mask_kmers(buf_, n_);
+        size_t n = n_;
+        if(opts_.fs_) {
+            opts_.fs_->in_set(buf_, n, hits_);
+            size_t nout = 0;
+            for(size_t i = 0; i < n; ++i) {
+                buf_[nout] = buf_[i];
+                nout += !hits_[i];
+            }
+            n = nout;
+        }
+        if(opts_.kmer_downsample_frac_ != 1.) {
+            size_t nout = 0;
+            for(size_t i = 0; i < n; ++i) {
+                buf_[nout] = buf_[i];
+                nout += opts_.downsample_pass();
+            }
+            n = nout;
+        }
+        sketch_.update_batch(buf_, n);
+        n_ = 0;
+    }
+};
+
 INLINE double compute_cardest(const RegT *ptr, const size_t m) {
     double s = 0.;
 #if _OPENMP >= 201307L
@@ -206,8 +255,10 @@ FastxSketchingResult &fastx2sketch(FastxSketchingResult &ret, Dashing2Options &o
                 }
             } else {
                 fss.reserve(nt);
-                for(size_t i = 0; i < nt; ++i)
+                for(size_t i = 0; i < nt; ++i) {
                     fss.emplace_back(opts.count_threshold_, ss, opts.save_kmers_, opts.save_kmercounts_);
+                    fss.back().set_count_filter_bytes(opts.count_filter_bytes_);
+                }
             }
         }
     } else if(opts.sspace_ == SPACE_MULTISET) make_save(bmhs);
@@ -299,12 +350,118 @@ FastxSketchingResult &fastx2sketch(FastxSketchingResult &ret, Dashing2Options &o
     if(opts.kmer_result_ == FULL_MMER_SET) {
         ret.kmerfiles_.resize(ret.destination_files_.size());
     }
-    OMP_PFOR_DYN
-    for(size_t i = 0; i < nitems; ++i) {
-        int tid = 0;
-        OMP_ONLY(tid = omp_get_thread_num();)
-        //const int tid = OMP_ELSE(omp_get_thread_num(), 0);
-        //const auto starttime = std::chrono::high_resolution_clock::now();
+    // Calls func on the raw hash of every k-mer in the sequences handed over by feed,
+    // which calls its argument with either (path, kseq) for a whole file or (seq, len) for a single record.
+    // Encoding and func (and so the sketch updates) are compiled per ISA level, and the CPU's is selected (kernels.h)
+    // for each file or record handed over.
+    auto for_each_hash = [&](const auto &func, const auto &feed) __attribute__((__always_inline__)) {
+#define FUNC_FE(f) feed([&](const auto &...args) {dispatched([&]() {f(func, args...);});})
+        if(opts.use128()) {
+            if(unsigned(opts.k_) <= opts.nremperres128()) {
+                if(entmin) {
+                    auto encoder(opts.enc_.to_entmin128());
+                    FUNC_FE(encoder.for_each);
+                } else {
+                    auto encoder(opts.enc_.to_u128());
+                    FUNC_FE(encoder.for_each);
+                }
+            } else {
+                FUNC_FE(opts.rh128_.for_each_hash);
+            }
+        } else if(unsigned(opts.k_) <= opts.nremperres64()) {
+            if(entmin) {
+                auto encoder(opts.enc_.to_entmin64());
+                FUNC_FE(encoder.for_each);
+            } else {
+                auto encoder(opts.enc_);
+                FUNC_FE(encoder.for_each);
+            }
+        } else {
+            FUNC_FE(opts.rh_.for_each_hash);
+        }
+#undef FUNC_FE
+    };
+    // As for_each_hash, but masked, filtered and downsampled
+    auto for_each_kmer = [&](const auto &func, const auto &feed) __attribute__((__always_inline__)) {
+        // K-mers are checked against the filter set in batches, so that its cache misses overlap
+        auto pass = [&](auto x) __attribute__((__always_inline__)) {
+            if(opts.downsample_pass()) func(x);
+        };
+        FilterBatch<uint64_t> fb64(opts.fs_.get());
+        FilterBatch<u128_t> fb128(opts.fs_.get());
+        auto lfunc = [&](auto x) __attribute__((__always_inline__)) {
+            x = maskfn(x);
+            if(!opts.fs_) pass(x);
+            else if constexpr(sizeof(x) == sizeof(u128_t)) fb128.add(x, pass);
+            else fb64.add(x, pass);
+        };
+        auto lfunc2 = [&func](auto x) __attribute__((__always_inline__)) {func(maskfn(x));};
+        if(!opts.fs_ && opts.kmer_downsample_frac_ == 1.) for_each_hash(lfunc2, feed);
+        else for_each_hash(lfunc, feed);
+        if(opts.fs_) {
+            fb64.flush(pass);
+            fb128.flush(pass);
+        }
+    };
+    // Applies every k-mer to a set sketch: 64-bit k-mers a block at a time, through update_batch, and 128-bit k-mers one by one
+    auto sketch_kmers = [&](auto &sketch, const auto &feed) {
+        if(opts.use128()) {
+            for_each_kmer([&sketch](auto x) {sketch.update(x);}, feed);
+            return;
+        }
+        KmerBlockUpdater<std::decay_t<decltype(sketch)>> block(sketch, opts);
+        for_each_hash([&block](auto x) __attribute__((__always_inline__)) {
+            if constexpr(sizeof(x) == sizeof(uint64_t)) block.add(x);
+        }, feed);
+        block.flush();
+    };
+    const bool counter_based = opts.sspace_ == SPACE_MULTISET || opts.sspace_ == SPACE_PSET || opts.kmer_result_ == FULL_MMER_SET || opts.kmer_result_ == FULL_MMER_COUNTDICT;
+    // Inputs much larger than the rest are split into record-aligned chunks, which every thread sketches
+    // before the per-thread sketches are merged; otherwise one huge file would leave all but one thread idle.
+    // Only sketches which merge exactly are split: k-mer counters, whose count thresholds apply after merging,
+    // and set sketches without a count threshold.
+    const bool mergeable = counter_based || ((opts.kmer_result_ == ONE_PERM || (opts.kmer_result_ == FULL_SETSKETCH && !opts.sketch_compressed_set)) && opts.count_threshold_ <= 1.);
+    std::vector<std::unique_ptr<FastxSplitter>> splitters(nitems);
+    if(nt > 1 && mergeable) {
+        static constexpr uint64_t MIN_SPLIT_BYTES = 16 << 20, MIN_CHUNK_BYTES = 4 << 20;
+        const uint64_t total = std::accumulate(filesizes.begin(), filesizes.end(), uint64_t(0), [](uint64_t s, const auto &x) {return s + x.first;});
+        const uint64_t share = std::max(total / nt, MIN_SPLIT_BYTES);
+        // filesizes is sorted by decreasing size
+        for(const auto &[size, ind]: filesizes) {
+            if(size < share) break;
+            if(paths[ind].find(' ') != std::string::npos) continue; // Multiple files sketched together
+            auto sp = std::make_unique<FastxSplitter>(paths[ind], std::max(size / (4 * nt), MIN_CHUNK_BYTES));
+            if(!*sp) continue;
+            if(verbosity >= INFO) std::fprintf(stderr, "Sketching %s in %zu chunks\n", paths[ind].data(), sp->nchunks());
+            splitters[ind] = std::move(sp);
+        }
+    }
+    // Sketches every chunk into the per-thread sketches and merges them into those of thread dest
+    auto sketch_chunks = [&](const FastxSplitter &splitter, const int dest) {
+        for(size_t t = 0; t < nt; ++t) __RESET(t);
+        OMP_PRAGMA("omp parallel")
+        {
+            int t = 0;
+            OMP_ONLY(t = omp_get_thread_num();)
+            FastxSplitter::Scratch scratch;
+            OMP_PRAGMA("omp for schedule(dynamic)")
+            for(size_t c = 0; c < splitter.nchunks(); ++c) {
+                auto feed = [&](const auto &g) {
+                    splitter.for_each_record(c, [&g](const char *s, size_t n) {g(s, n);}, scratch);
+                };
+                if(counter_based) for_each_kmer([p=&ctrs[t]](auto x) {p->add(x);}, feed);
+                else if(!opss.empty()) sketch_kmers(opss[t], feed);
+                else sketch_kmers(fss[t], feed);
+            }
+        }
+        for(size_t t = 0; t < nt; ++t) {
+            if(t == size_t(dest)) continue;
+            if(counter_based) ctrs[dest] += ctrs[t];
+            else if(!opss.empty()) opss[dest] += opss[t];
+            else fss[dest] += fss[t];
+        }
+    };
+    auto sketch_item = [&](const size_t i, const int tid, const FastxSplitter *const splitter) {
         auto myind = filesizes.size() ? filesizes[i].second: uint64_t(i);
         const size_t mss = ss * myind;
         auto &path = paths[myind];
@@ -370,7 +527,7 @@ FastxSketchingResult &fastx2sketch(FastxSketchingResult &ret, Dashing2Options &o
             if(ret.kmerfiles_.size() > myind) {
                 ret.kmerfiles_[myind] = destkmer;
             }
-            continue;
+            return;
         } else {
 #ifndef NDEBUG
             std::fprintf(stderr, "We skipped caching because with %d as cache sketches\n", opts.cache_sketches_);
@@ -379,53 +536,15 @@ FastxSketchingResult &fastx2sketch(FastxSketchingResult &ret, Dashing2Options &o
 #endif
         }
         perform_sketch:
-        __RESET(tid);
+        if(splitter) sketch_chunks(*splitter, tid);
+        else __RESET(tid);
+        auto feed_path = [&](const auto &g) {
+            for_each_substr([&](const std::string &subpath) {g(subpath.data(), kseqs.kseqs_ + tid);}, path);
+        };
         auto perf_for_substrs = [&](const auto &func) __attribute__((__always_inline__)) {
-            for_each_substr([&](const std::string &subpath) {
-                auto lfunc = [&](auto x) __attribute__((__always_inline__)) {
-                    x = maskfn(x);
-                    if((!opts.fs_ || !opts.fs_->in_set(x)) && opts.downsample_pass()) func(x);
-                };
-                auto lfunc2 = [&func](auto x) __attribute__((__always_inline__)) {func(maskfn(x));};
-                const auto seqp = kseqs.kseqs_ + tid;
-#define FUNC_FE(f) \
-do {\
-    if(!opts.fs_ && opts.kmer_downsample_frac_ == 1.) {\
-        f(lfunc2, subpath.data(), seqp);\
-    } else {\
-        f(lfunc, subpath.data(), seqp);\
-    } \
-} while(0)
-                if(opts.use128()) {
-                    if(unsigned(opts.k_) <= opts.nremperres128()) {
-                        if(entmin) {
-                            auto encoder(opts.enc_.to_entmin128());
-                            FUNC_FE(encoder.for_each);
-                        } else {
-                            auto encoder(opts.enc_.to_u128());
-                            FUNC_FE(encoder.for_each);
-                        }
-                    } else {
-                        FUNC_FE(opts.rh128_.for_each_hash);
-                    }
-                } else if(unsigned(opts.k_) <= opts.nremperres64()) {
-                    if(entmin) {
-                        auto encoder(opts.enc_.to_entmin64());
-                        FUNC_FE(encoder.for_each);
-                    } else {
-                        auto encoder(opts.enc_);
-                        FUNC_FE(encoder.for_each);
-                    }
-                } else {
-                    FUNC_FE(opts.rh_.for_each_hash);
-                }
-#undef FUNC_FE
-            }, path);
+            if(!splitter) for_each_kmer(func, feed_path); // Otherwise, already sketched chunk by chunk
         };
-        if(
-            (opts.sspace_ == SPACE_MULTISET || opts.sspace_ == SPACE_PSET || opts.kmer_result_ == FULL_MMER_SET || opts.kmer_result_ == FULL_MMER_COUNTDICT)
-        )
-        {
+        if(counter_based) {
             auto &ctr = ctrs[tid];
             perf_for_substrs([&ctr](auto x) {ctr.add(x);});
             std::vector<u128_t> kmervec128;
@@ -560,9 +679,9 @@ do {\
             auto &cret = ret.cardinalities_[myind];
             if(opsssz) {
                 assert(opss.size() > unsigned(tid));
-                assert(opss.at(tid).total_updates() == 0);
+                assert(splitter || opss.at(tid).total_updates() == 0);
                 auto p = &opss[tid];
-                perf_for_substrs([p](auto hv) {p->update(hv);});
+                if(!splitter) sketch_kmers(*p, feed_path);
                 assert(ret.cardinalities_.size() > i);
                 cret = p->getcard();
             } else {
@@ -574,7 +693,7 @@ do {\
                         cret = x.cardinality();
                     }, cfss.at(tid));
                 } else {
-                    perf_for_substrs([p=&fss[tid]](auto hv) {p->update(hv);});
+                    if(!splitter) sketch_kmers(fss[tid], feed_path);
                     cret = fss[tid].getcard();
                 }
             }
@@ -621,6 +740,19 @@ do {\
             if(counts && ret.kmercounts_.size())
                 std::copy(counts, counts + ss, &ret.kmercounts_[mss]);
         } else THROW_EXCEPTION(std::runtime_error("Unexpected: Not FULL_MMER_SEQUENCE, FULL_MMER_SET, ONE_PERM, FULL_SETSKETCH, SPACE_MULTISET, or SPACE_PSET"));
+    };
+    // Split inputs go first, each spread across all threads; the rest are sketched one per thread, largest first
+    for(size_t i = 0; i < nitems; ++i) {
+        const auto myind = filesizes.size() ? filesizes[i].second: uint64_t(i);
+        if(splitters[myind]) sketch_item(i, 0, splitters[myind].get());
+    }
+    OMP_PFOR_DYN
+    for(size_t i = 0; i < nitems; ++i) {
+        const auto myind = filesizes.size() ? filesizes[i].second: uint64_t(i);
+        if(splitters[myind]) continue;
+        int tid = 0;
+        OMP_ONLY(tid = omp_get_thread_num();)
+        sketch_item(i, tid, nullptr);
     } // parallel paths loop
     ret.names_ = paths;
     return ret;
@@ -45,6 +45,7 @@ struct SketchingResult {
     std::vector<float> kmercounts_; // Contains counts for k-mers, if desired
     // This contains the k-mers corresponding to signatures, if asked for 128-bit k-mers, these are stored in chunks of 2 64-bit integers.
     size_t nq = 0;
+    size_t stacked_capacity_ = 0; // If nonzero, signatures_ are written in the appendable stacked layout (see stackdb.h), with this many cardinality slots
     size_t total_seqs() const {
         // Sum of nperfile if nonempty
         // otherwise, just one sequence/bag of k-mers per "name"
@@ -1,5 +1,8 @@
 #include "fastxsketch.h"
 #include "cmp_main.h"
+#include "kernels.h"
+#include "stackdb.h"
+#include "seqpipe.h"
 #include <chrono>
 
 namespace dashing2 {
@@ -63,26 +66,29 @@ struct OptSketcher {
             }
         }
     }
+    // Encoding and func (and so the sketch updates) are compiled per ISA level, and the CPU's is selected (kernels.h).
     template<typename Func>
     void for_each(const Func &func, const char *s, const size_t n) {
-        if(use128_) {
-            if(unsigned(k_) <= enc_.nremperres128()) {
-                if(entmin)
-                    ence128_.for_each(func, s, n);
-                else
-                    enc128_.for_each(func, s, n);
+        dispatched([&]() {
+            if(use128_) {
+                if(unsigned(k_) <= enc_.nremperres128()) {
+                    if(entmin)
+                        ence128_.for_each(func, s, n);
+                    else
+                        enc128_.for_each(func, s, n);
+                } else {
+                    rh128_.for_each(func, s, n);
+                }
             } else {
-                rh128_.for_each(func, s, n);
+                if(unsigned(k_) <= enc_.nremperres64()) {
+                    if(entmin)
+                        ence_.for_each(func, s, n);
+                    else
+                        enc_.for_each(func, s, n);
+                } else
+                    rh_.for_each_hash(func, s, n);
             }
-        } else {
-            if(unsigned(k_) <= enc_.nremperres64()) {
-                if(entmin)
-                    ence_.for_each(func, s, n);
-                else
-                    enc_.for_each(func, s, n);
-            } else
-                rh_.for_each_hash(func, s, n);
-        }
+        });
     }
     void input_mode(InputType it) {it_ = it; enc_.hashtype(it); enc128_.hashtype(it); rh_.hashtype(it); rh128_.hashtype(it);}
     bns::InputType input_mode() const {return it_;}
@@ -97,12 +103,32 @@ struct OptSketcher {
         //if(omh) omh->reset();
     }
 };
-void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t newsz, std::vector<OptSketcher> &sketchvec, size_t &lastindex, size_t nthreads, const std::string_view path);
+
+// Sketches of a chunk of sequences, filled by a pipeline worker and appended to the result in order
+struct SketchedChunk {
+    std::vector<RegT> sigs_;
+    std::vector<double> cards_;
+    std::vector<uint64_t> kmers_;
+    std::vector<float> kmercounts_;
+    std::vector<std::vector<uint64_t>> seqmins_;
+};
+static void sketch_chunk(Dashing2DistOptions &opts, OptSketcher &sketchers, SeqChunk<SketchedChunk> &chunk, const std::string_view path);
+
+// Rough input sizes, used to reserve space before reading; being off only costs a move of the registers already written
+static constexpr size_t GZIP_RATIO_ESTIMATE = 4;
+static constexpr size_t BYTES_PER_SEQ_ESTIMATE = 64;
+
+static bool is_gzipped(const std::string &path) {
+    std::FILE *fp = bfopen(path.data(), "rb");
+    if(!fp) return false;
+    unsigned char magic[2];
+    const bool ret = std::fread(magic, 1, 2, fp) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    std::fclose(fp);
+    return ret;
+}
+
 
 FastxSketchingResult &fastx2sketch_byseq(FastxSketchingResult &ret, Dashing2DistOptions &opts, const std::string &path, kseq_t *kseqs, std::string outpath, bool parallel, size_t seqs_per_batch) {
-    gzFile ifp;
-    kseq_t *myseq = kseqs ? &kseqs[OMP_ELSE(omp_get_thread_num(), 0)]: (kseq_t *)std::calloc(sizeof(kseq_t), 1);
-    size_t batch_index = 0;
     OptSketcher sketcher(opts);
     sketcher.rh_ = opts.rh_;
     sketcher.rh128_ = opts.rh128_;
@@ -113,8 +139,10 @@ FastxSketchingResult &fastx2sketch_byseq(FastxSketchingResult &ret, Dashing2Dist
         if(opts.one_perm()) {
             sketcher.opss.reset(new OPSetSketch(opts.sketchsize_));
             if(opts.count_threshold_ > 0) sketcher.opss->set_mincount(opts.count_threshold_);
-        } else if(!opts.sketch_compressed_set)
+        } else if(!opts.sketch_compressed_set) {
             sketcher.fss.reset(new FullSetSketch(opts.count_threshold_, opts.sketchsize_, opts.save_kmers_, opts.save_kmercounts_));
+            sketcher.fss->set_count_filter_bytes(opts.count_filter_bytes_);
+        }
         else {
             assert(sketcher.cfss);
         }
@@ -131,181 +159,159 @@ FastxSketchingResult &fastx2sketch_byseq(FastxSketchingResult &ret, Dashing2Dist
     if(opts.sspace_ == SPACE_MULTISET || opts.sspace_ == SPACE_PSET) {
         sketcher.ctr.reset(new Counter(opts.cssize()));
     }
-    std::atomic<size_t> total_nseqs_a{0};
-    std::atomic<size_t> total_bases_a{0};
-    std::vector<std::thread> threads;
-    std::mutex mutex;
-    const int32_t total_threads = num_threads();
-    auto join_if_joinable = [](std::thread& x) {
-            const bool is_joinable = x.joinable();
-            if(is_joinable) {
-                x.join();
-            }
-            return is_joinable;
-        };
-    for_each_substr([&](const std::string path) {
-        std::lock_guard<std::mutex> lock(mutex);
-        while(int(threads.size()) >= total_threads) {
-            std::this_thread::sleep_for(std::chrono::duration<double, std::micro>{10});
-        }
-        threads.emplace_back([&,path]() {
-            gzFile fp = gzopen(path.data(), "r");
-            if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open gzfile"s + path + "to count sequences."));
-            kseq_t *ks = kseq_init(fp);
-            while(kseq_read(ks) >= 0) {
-                ++total_nseqs_a;
-                total_bases_a += ks->seq.l;
-            }
-            kseq_destroy(ks);
-            gzclose(fp);
-        });
-        std::erase_if(threads, join_if_joinable);
+    const bool need_to_keep_sequences =
+                (opts.measure_ == M_EDIT_DISTANCE || (opts.sspace_ == SPACE_EDIT_DISTANCE && opts.exact_kmer_dist_))
+                                         || (opts.output_kind_ == DEDUP);
+    // Sequences are read only once, so their number and length are estimated from the input's size
+    std::vector<std::string> paths;
+    size_t input_bytes = 0, est_bases = 0;
+    for_each_substr([&](const std::string &p) {
+        const size_t nb = bns::filesize(p.data());
+        input_bytes += nb;
+        est_bases += is_gzipped(p) ? nb * GZIP_RATIO_ESTIMATE: nb;
+        paths.push_back(p);
     }, path);
-    const size_t total_nseqs = total_nseqs_a.load();
-    const size_t total_bases = total_bases_a.load();
-    while(!threads.empty()) {
-        std::erase_if(threads, join_if_joinable);
-    }
     if(verbosity >= INFO) {
-        std::fprintf(stderr, "%zu seqs in dataset, of total %zu bases\n", total_nseqs, total_bases);
+        std::fprintf(stderr, "%zu bytes of input, estimated at %zu bases\n", input_bytes, est_bases);
     }
-    if(!seqs_in_memory && (total_bases <= 2'000'000'000ull)) {
+    // Only sequences which are kept after sketching are stored
+    if(!seqs_in_memory && need_to_keep_sequences && est_bases <= 2'000'000'000ull) {
         if(verbosity >= DEBUG) {
-            std::fprintf(stderr, "Swapping to keep sequences in RAM instead of storing on disk and memory-mapping because total number of bases < 2 billion %zu.\n", total_bases);
+            std::fprintf(stderr, "Swapping to keep sequences in RAM instead of storing on disk and memory-mapping because total number of bases is estimated at < 2 billion.\n");
         }
         ret.sequences_.swap_to_ram();
     }
-    if(outpath.size() && outpath != "-" && outpath != "/dev/stdout") {
-        if(!bns::isfile(outpath)) {
-            DBG_ONLY(std::fprintf(stderr, "Creating outpath '%s'\n", outpath.data()););
-            std::FILE *fp = std::fopen(outpath.data(), "wb");
-            if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open path "s + outpath + " for writing"));
-            std::fclose(fp);
-        }
-        size_t offset = 16 + sizeof(double) * total_nseqs;
-        if(opts.kmer_result_ == FULL_MMER_SEQUENCE) {
-            offset = 20 + sizeof(double) * total_nseqs;
-        }
-        if(int rc = ::truncate(outpath.data(), offset); rc) {
+    // Registers stream into outpath after room for the estimated number of cardinalities, and are moved if more sequences turn up.
+    // Sketches are written in the appendable stacked layout, whose unused cardinality slots cost nothing,
+    // and the header is written once all sequences have been sketched.
+    // Other results use the one-shot layout, and are moved into place at the end.
+    const bool to_file = outpath.size() && outpath != "-" && outpath != "/dev/stdout";
+    const bool appendable = to_file && opts.kmer_result_ != FULL_MMER_SEQUENCE && !opts.sketch_compressed_set;
+    const size_t hdrsize = appendable ? sizeof(StackedHeader): opts.kmer_result_ == FULL_MMER_SEQUENCE ? 20: 16;
+    size_t capacity = std::max(input_bytes / BYTES_PER_SEQ_ESTIMATE, size_t(1024));
+    if(to_file) {
+        // Truncate any previous contents, so that unused cardinality slots are left as holes
+        DBG_ONLY(std::fprintf(stderr, "Creating outpath '%s'\n", outpath.data()););
+        std::FILE *fp = std::fopen(outpath.data(), "wb");
+        if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open path "s + outpath + " for writing"));
+        std::fclose(fp);
+        if(int rc = ::truncate(outpath.data(), hdrsize + sizeof(double) * capacity); rc) {
             std::fprintf(stderr, "is outpath %s a file? %d\n", outpath.data(), bns::isfile(outpath));
             THROW_EXCEPTION(std::runtime_error("Failed to resize signature file for fastx2sketch_byseq. rc: "s + std::to_string(rc)));
         }
         ret.signatures_.assign(outpath);
     }
+    auto make_room = [&]() {
+        if(!to_file || ret.names_.size() <= capacity) return;
+        capacity = std::max(capacity * 2, ret.names_.size());
+        if(verbosity >= INFO) {
+            std::fprintf(stderr, "More sequences than estimated: moving registers in %s to make room for %zu cardinalities\n", outpath.data(), capacity);
+        }
+        ret.signatures_.rebase(hdrsize + sizeof(double) * capacity);
+    };
 
-    const size_t num_sigs = (total_nseqs * opts.sketchsize_) >> opts.sigshift();
-    if(verbosity >= INFO) {
-        std::fprintf(stderr, "Reserving signatures space: %zu entries, for %zu bytes each\n", num_sigs, (sizeof(double) * opts.sketchsize_) >> opts.sigshift());
-    }
-    if(opts.kmer_result_ != FULL_MMER_SEQUENCE) {
-        ret.signatures_.reserve(num_sigs);
-    }
-
-    ret.cardinalities_.resize(total_nseqs);
-    if(opts.kmer_result_ != FULL_MMER_SEQUENCE && opts.save_kmers_) {
-        ret.kmers_.resize(opts.sketchsize_ * total_nseqs);
-    }
-
-    if((opts.kmer_result_ != FULL_MMER_SEQUENCE) && opts.save_kmercounts_) {
-        ret.kmercounts_.resize(opts.sketchsize_ * total_nseqs);
-    }
-    if(verbosity >= INFO) {
-        std::fprintf(stderr, "Reserved kmers, kmer counts, etc.\n");
-    }
-
-
-    std::vector<OptSketcher> sketching_data;
+    // Parsing overlaps with sketching: a parser per file (up to a quarter of the threads) feeds the sketching threads,
+    // which take the rest, and this thread appends sketches in input order, so that no more than -p threads run at once.
     const int nt = parallel ? num_threads(): 1;
-    std::vector<OptSketcher> sv;
-    if(nt > 1) {
-        sketching_data.resize(nt, sketcher);
+    const size_t nparsers = nt > 1 ? std::max(nt / 4, 1): 0, nworkers = nt > 1 ? nt - nparsers: 0;
+    SeqPipeline<SketchedChunk> pipeline(paths, nparsers, nworkers, seqs_per_batch, size_t(4) << 20, kseqs);
+    std::vector<OptSketcher> sketching_data;
+    if(pipeline.nworkers() > 1) {
+        sketching_data.resize(pipeline.nworkers(), sketcher);
     } else {
         sketching_data.emplace_back(std::move(sketcher));
     }
     DBG_ONLY(std::fprintf(stderr, "save ids: %d, save counts %d\n", opts.save_kmers_, opts.save_kmercounts_););
-    size_t lastindex = 0;
-    const bool need_to_keep_sequences =
-                (opts.measure_ == M_EDIT_DISTANCE || (opts.sspace_ == SPACE_EDIT_DISTANCE && opts.exact_kmer_dist_))
-                                         || (opts.output_kind_ == DEDUP);
     if(verbosity >= DEBUG) {
         std::fprintf(stderr, "%s to keep sequences\n", need_to_keep_sequences ? "Need": "Do not need");
     }
-    for_each_substr([&](const auto &x) {
-        DBG_ONLY(std::fprintf(stderr, "Processing substr %s\n", x.data()););
-        if((ifp = gzopen(x.data(), "rb")) == nullptr) THROW_EXCEPTION(std::runtime_error(std::string("Failed to read from ") + x));
-        gzbuffer(ifp, 1u << 17);
-        kseq_assign(myseq, ifp);
-        for(int c;(c = kseq_read(myseq)) >= 0;) {
-            //DBG_ONLY(std::fprintf(stderr, "Sequence %s of length %zu\n", myseq->name.s, myseq->seq.l););
-            ret.sequences_.emplace_back(myseq->seq.s, myseq->seq.l);
-            const int off = (myseq->name.s[0] == '>');
-            ret.names_.emplace_back(myseq->name.s + off, myseq->name.l - off);
-            if(++batch_index == seqs_per_batch) {
-                DBG_ONLY(std::fprintf(stderr, "batch index = %zu\n", batch_index););
-                resize_fill(opts, ret, std::min(size_t(seqs_per_batch), size_t(total_nseqs - ret.names_.size())), sketching_data, lastindex, nt, std::string_view(path));
-                batch_index = 0;
-                seqs_per_batch = std::min(seqs_per_batch << 1, size_t(0x1000));
+    const size_t sigsper = opts.sketchsize_ >> opts.sigshift();
+    const SeqPipelineStats stats = pipeline.run([&](int tid, SeqChunk<SketchedChunk> &chunk) {
+        sketch_chunk(opts, sketching_data[tid], chunk, std::string_view(path));
+    }, [&](SeqChunk<SketchedChunk> &chunk) {
+        const SketchedChunk &out = chunk.out_;
+        const size_t n = chunk.n_, oldn = ret.names_.size();
+        if(!n) return;
+        for(size_t i = 0; i < n; ++i) {
+            ret.names_.push_back(chunk.names_[i]);
+            if(need_to_keep_sequences) ret.sequences_.emplace_back(chunk.seqs_[i]);
+        }
+        ret.cardinalities_.insert(ret.cardinalities_.end(), out.cards_.begin(), out.cards_.begin() + n);
+        // Outputs grow with each chunk, as the number of sequences is not known up front
+        auto append = [](mm::vector<RegT> &sigs, const RegT *src, size_t nregs) {
+            const size_t oldsz = sigs.size();
+            if(oldsz + nregs > sigs.capacity())
+                sigs.reserve(std::max(oldsz + nregs, sigs.capacity() * 2));
+            sigs.resize(oldsz + nregs);
+            std::memcpy(&sigs[oldsz], src, nregs * sizeof(RegT));
+        };
+        if(opts.kmer_result_ != FULL_MMER_SEQUENCE) {
+            make_room();
+            append(ret.signatures_, out.sigs_.data(), n * sigsper);
+            if(opts.save_kmers_) {
+                ret.kmers_.resize(opts.sketchsize_ * (oldn + n));
+                std::copy(out.kmers_.begin(), out.kmers_.begin() + opts.sketchsize_ * n, &ret.kmers_[opts.sketchsize_ * oldn]);
+            }
+            if(opts.save_kmercounts_)
+                ret.kmercounts_.insert(ret.kmercounts_.end(), out.kmercounts_.begin(), out.kmercounts_.begin() + opts.sketchsize_ * n);
+        } else {
+            for(size_t i = 0; i < n; ++i) {
+                // Minimizers are stored as pairs of u64s when 128-bit, and so are half as many registers for 16-byte RegT
+                const auto &x = out.seqmins_[i];
+                const size_t xsz = sizeof(RegT) == 16 ? x.size() >> 1: x.size();
+                ret.nperfile_.push_back(xsz);
+                append(ret.signatures_, (const RegT *)x.data(), xsz);
             }
         }
-        gzclose(ifp);
-    }, path);
-    if(!kseqs) kseq_destroy(myseq);
-    if(batch_index) resize_fill(opts, ret, batch_index, sketching_data, lastindex, nt, std::string_view(path));
-    ret.names_.resize(lastindex);
+    });
+    if(verbosity >= INFO) {
+        stats.report(stderr, "Sketch-by-seq pipeline");
+    }
+    const size_t nseqs = ret.names_.size();
+    if(to_file) {
+        // sketch_core writes the header and cardinalities
+        if(appendable) ret.stacked_capacity_ = capacity;
+        else ret.signatures_.rebase(hdrsize + sizeof(double) * nseqs);
+    }
     if(!need_to_keep_sequences) {
         ret.sequences_.free_if_possible();
     }
-    ret.cardinalities_.resize(lastindex);
-    if(ret.kmers_.size()) ret.kmers_.resize(opts.sketchsize_ * lastindex);
-    if(ret.kmercounts_.size()) ret.kmercounts_.resize(opts.sketchsize_ * lastindex);
 #ifndef NDEBUG
     std::fprintf(stderr, "ret kmer size %zu\n", ret.kmers_.size());
     std::fprintf(stderr, "ret names size %zu\n", ret.names_.size());
     std::fprintf(stderr, "ret signatures size %zu\n", ret.signatures_.size());
     std::fprintf(stderr, "ret signatures capacity %zu\n", ret.signatures_.capacity());
-    std::fprintf(stderr, "ret names size %zu\n", ret.names_.size());
+    std::fprintf(stderr, "ret names size %zu\n", nseqs);
 #endif
     return ret;
 }
-void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t newsz, std::vector<OptSketcher> &sketchvec, size_t &lastindex, const size_t nt, const std::string_view path) {
-    if(verbosity >= DEBUG) {
-        std::fprintf(stderr, "Calling resize_fill with newsz = %zu\n", newsz);
-    }
-    const bool need_to_keep_sequences =
-            (opts.measure_ == M_EDIT_DISTANCE || (opts.sspace_ == SPACE_EDIT_DISTANCE && opts.exact_kmer_dist_))
-                                         || (opts.output_kind_ == DEDUP);
-    const size_t oldsz = ret.names_.size();
-    newsz = oldsz + newsz;
+
+static void sketch_chunk(Dashing2DistOptions &opts, OptSketcher &sketchers, SeqChunk<SketchedChunk> &chunk, const std::string_view path) {
+    const size_t n = chunk.n_;
     const int sigshift = opts.sigshift();
-    if(opts.kmer_result_ != FULL_MMER_SEQUENCE) {
-        DBG_ONLY(std::fprintf(stderr, "old sig size %zu, cap %zu, new %zu\n", ret.signatures_.size(), ret.signatures_.capacity(), newsz * opts.sketchsize_ >> sigshift););
-        assert(oldsz * (opts.sketchsize_ >> sigshift) <= ret.signatures_.capacity());
-        ret.signatures_.resize(oldsz * (opts.sketchsize_ >> sigshift));
-        DBG_ONLY(std::fprintf(stderr, "ret signature size: %zu\n", ret.signatures_.size()););
-    }
-    DBG_ONLY(std::fprintf(stderr, "mmer matrix size %zu. save kmers %d\n", ret.kmers_.size(), opts.save_kmers_););
-    DBG_ONLY(std::fprintf(stderr, "Parsing %s\n", sketchvec.front().enable_protein() ? "Protein": "DNA"););
-    std::unique_ptr<std::vector<uint64_t>[]> seqmins;
+    const size_t sigsper = opts.sketchsize_ >> sigshift;
+    SketchedChunk &out = chunk.out_;
+    out.cards_.resize(n);
     if(opts.kmer_result_ == FULL_MMER_SEQUENCE) {
-        seqmins.reset(new std::vector<uint64_t>[(oldsz - lastindex)]);
+        if(out.seqmins_.size() < n) out.seqmins_.resize(n);
+    } else {
+        out.sigs_.resize(n * sigsper);
+        if(opts.save_kmers_) out.kmers_.assign(n * opts.sketchsize_, uint64_t(0));
+        if(opts.save_kmercounts_) out.kmercounts_.assign(n * opts.sketchsize_, 0.f);
     }
-    OMP_PRAGMA("omp parallel for num_threads(nt) schedule(dynamic)")
-    for(size_t i = lastindex; i < oldsz; ++i) {
-        const int tid = OMP_ELSE(omp_get_thread_num(), 0);
-        //DBG_ONLY(std::fprintf(stderr, "%zu/%zu -- parsing sequence from tid = %d\n", i, oldsz, tid););
-        auto &sketchers(sketchvec[tid]);
+    for(size_t i = 0; i < n; ++i) {
         sketchers.reset();
-        const std::string sequence{ret.sequences_[i]};
+        const std::string &sequence = chunk.seqs_[i], &name = chunk.names_[i];
         const auto seqp = sequence.data();
         const auto seql = sequence.size();
         if(sketchers.omh) { // OrderMinHash
             if(seql == 0) {
-                std::fprintf(stderr, "EMPTY SEQ at idx %zu for %s in path %s\n", i, ret.names_[i].data(), path.data());
+                std::fprintf(stderr, "EMPTY SEQ for %s in path %s\n", name.data(), path.data());
                 std::exit(1);
             }
-            std::fprintf(stderr, "OMH sketching from %s of length %zu\n", ret.names_[i].data(), size_t(seql));
+            std::fprintf(stderr, "OMH sketching from %s of length %zu\n", name.data(), size_t(seql));
             const std::vector<uint64_t> res = sketchers.omh->hash(seqp, seql);
-            auto destp = &ret.signatures_[i * opts.sketchsize_];
+            auto destp = &out.sigs_[i * opts.sketchsize_];
             if constexpr(sizeof(RegT) == sizeof(uint64_t)) { // double
                 // Copy as-is
                 std::memcpy(destp, res.data(), res.size() * sizeof(uint64_t));
@@ -319,9 +325,10 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
             } else {
                 std::copy(res.begin(), res.end(), (uint32_t *)destp);
             }
-            ret.cardinalities_[i] = seql;
-        } else if(seqmins) { // Sequence of minimizers
-            auto &myseq(seqmins[i - lastindex]);
+            out.cards_[i] = seql;
+        } else if(opts.kmer_result_ == FULL_MMER_SEQUENCE) { // Sequence of minimizers
+            auto &myseq(out.seqmins_[i]);
+            myseq.clear();
             sketchers.for_each([&](auto x) {
                 x = maskfn(x);
                 if(opts.fs_ && opts.fs_->in_set(x)) return;
@@ -340,7 +347,6 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
             // and the entire sequence yields no minimizer.
             // We instead take the minimum-hashed value from the b-tree
             if(opts.w_ > opts.k_ && myseq.empty() && seql) {
-                //std::fprintf(stderr, "Adding in single item for small seq]\n");
                 if(sketchers.rh128_.n_in_queue()) {
                     u128_t v = sketchers.rh128_.max_in_queue().el_;
                     myseq.push_back(0); myseq.push_back(0);
@@ -361,29 +367,42 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
                     myseq.push_back(sketchers.ence_.max_in_queue().el_);
                 }
             }
-            ret.cardinalities_[i] = myseq.size();
+            out.cards_[i] = myseq.size();
+            // Undo the masking, as the writer only copies these out
+            if(opts.use128_) {
+                auto ptr = (u128_t *)myseq.data();
+                for(size_t K = 0; K < (myseq.size() >> 1); ++K) {
+                    u128_t item;
+                    std::memcpy(&item, ptr + K, sizeof(item));
+                    item = invmaskfn(item);
+                    std::memcpy(ptr + K, &item, sizeof(item));
+                }
+            } else {
+                std::transform(myseq.begin(), myseq.end(), myseq.begin(), [](auto item) {return invmaskfn(item);});
+            }
         } else {
-            DBG_ONLY(std::fprintf(stderr, "Sketching all k-mers in sequence %s/%zu\n", ret.names_[i].data(), i););
+            DBG_ONLY(std::fprintf(stderr, "Sketching all k-mers in sequence %s\n", name.data()););
+            double &card = out.cards_[i];
             const bool isop = sketchers.opss.get(), isctr = sketchers.ctr.get(), isfs = sketchers.fss.get(), iscfss = sketchers.cfss.get();
-            auto fsfunc = [&](auto x) __attribute__((always_inline)) {
-                x = maskfn(x);
-                if(opts.fs_->in_set(x)) return;
+            auto update = [&](auto x) __attribute__((always_inline)) {
                 if(isop)    sketchers.opss->update(x);
                 else if(isctr) sketchers.ctr->add(x);
                 else if(isfs) sketchers.fss->update(x);
                 else if(iscfss) std::visit([&x](auto &sketch) __attribute__((always_inline)) {sketch.update(x);}, *sketchers.cfss);
             };
-            auto nofsfunc = [&](auto x) __attribute__((always_inline)) {
-                x = maskfn(x);
-                if(isop) sketchers.opss->update(x);
-                else if(isctr) sketchers.ctr->add(x);
-                else if(isfs) sketchers.fss->update(x);
-                else if(iscfss) std::visit([&x](auto &sketch) __attribute__((always_inline)) {sketch.update(x);}, *sketchers.cfss);
-            };
             if(opts.fs_) {
-                sketchers.for_each(fsfunc, seqp, seql);
+                // Filtered in batches, so that the filter's cache misses overlap
+                FilterBatch<uint64_t> fb64(opts.fs_.get());
+                FilterBatch<u128_t> fb128(opts.fs_.get());
+                sketchers.for_each([&](auto x) __attribute__((always_inline)) {
+                    x = maskfn(x);
+                    if constexpr(sizeof(x) == sizeof(u128_t)) fb128.add(x, update);
+                    else fb64.add(x, update);
+                }, seqp, seql);
+                fb64.flush(update);
+                fb128.flush(update);
             } else {
-                sketchers.for_each(nofsfunc, seqp, seql);
+                sketchers.for_each([&](auto x) __attribute__((always_inline)) {update(maskfn(x));}, seqp, seql);
             }
             DBG_ONLY(std::fprintf(stderr, "Sketched all k-mers in sequence\n"););
             RegT *ptr = nullptr;
@@ -395,25 +414,25 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
                     if(sketchers.opss) {
                         sketchers.ctr->finalize(*sketchers.opss, opts.count_threshold_);
                         ptr = sketchers.opss->data();
-                        ret.cardinalities_[i] = sketchers.opss->getcard();
+                        card = sketchers.opss->getcard();
                     } else if(sketchers.fss) {
                         sketchers.ctr->finalize(*sketchers.fss, opts.count_threshold_);
                         ptr = sketchers.fss->data();
-                        ret.cardinalities_[i] = sketchers.fss->getcard();
+                        card = sketchers.fss->getcard();
                     } else if(sketchers.cfss) {
-                        std::visit([&](auto &sketch) {sketchers.ctr->finalize(sketch, opts.count_threshold_); ptr = (RegT *)sketch.data();ret.cardinalities_[i] = sketch.getcard();}, *sketchers.cfss);
+                        std::visit([&](auto &sketch) {sketchers.ctr->finalize(sketch, opts.count_threshold_); ptr = (RegT *)sketch.data();card = sketch.getcard();}, *sketchers.cfss);
                     }
                     DBG_ONLY(std::fprintf(stderr, "Sketched setspace with count thresholding.\n"););
                 } else {
                     ptr = sketchers.opss ? sketchers.opss->data(): sketchers.fss ? sketchers.fss->data(): (RegT *)getdata(*sketchers.cfss);
-                    ret.cardinalities_[i] = sketchers.opss ? sketchers.opss->getcard(): sketchers.fss ? sketchers.fss->getcard(): sketchers.cfss ? getcard(*sketchers.cfss): std::numeric_limits<double>::quiet_NaN();
-                    if(std::isnan(ret.cardinalities_[i])) {
+                    card = sketchers.opss ? sketchers.opss->getcard(): sketchers.fss ? sketchers.fss->getcard(): sketchers.cfss ? getcard(*sketchers.cfss): std::numeric_limits<double>::quiet_NaN();
+                    if(std::isnan(card)) {
                         if(verbosity >= INFO) {
                             std::fprintf(stderr, "Warning: sketch cardinality was a NAN. This is unexpected. Settings to 0.\n");
                         }
-                        ret.cardinalities_[i] = 0.;
+                        card = 0.;
                     }
-                    if(ret.cardinalities_[i] < 10 * opts.sketchsize_) {
+                    if(card < 10 * opts.sketchsize_) {
                         DBG_ONLY(std::fprintf(stderr, "Cardinality exact counting fall-back\n"););
                         flat_hash_set<uint64_t> ids;
                         ids.reserve(opts.sketchsize_);
@@ -426,7 +445,7 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
                         } else {
                             sketchers.for_each([&](auto x) {ids.insert(maskfn(x));}, seqp, seql);
                         }
-                        ret.cardinalities_[i] = ids.size();
+                        card = ids.size();
                         DBG_ONLY(std::fprintf(stderr, "Cardinality exact counting fall-back complete\n"););
                     }
                     kmer_ptr = sketchers.opss ? sketchers.opss->ids().data(): sketchers.fss ? sketchers.fss->ids().data(): (const uint64_t *)nullptr;
@@ -442,7 +461,7 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
             } else if(opts.sspace_ == SPACE_MULTISET) {
                 sketchers.ctr->finalize(*sketchers.bmh, opts.count_threshold_);
                 ptr = sketchers.bmh->data();
-                ret.cardinalities_[i] = sketchers.bmh->total_weight();
+                card = sketchers.bmh->total_weight();
                 if(sketchers.bmh->ids().size()) kmer_ptr = sketchers.bmh->ids().data();
                 if(sketchers.bmh->idcounts().size()) {
                     kmercounts.resize(opts.sketchsize_);
@@ -452,7 +471,7 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
                 sketchers.ctr->finalize(*sketchers.pmh, opts.count_threshold_);
                 ptr = sketchers.pmh->data();
                 if(sketchers.pmh->ids().size()) kmer_ptr = sketchers.pmh->ids().data();
-                ret.cardinalities_[i] = sketchers.pmh->total_weight();
+                card = sketchers.pmh->total_weight();
                 if(sketchers.pmh->idcounts().size()) {
                     kmercounts.resize(opts.sketchsize_);
                     std::copy(sketchers.pmh->idcounts().begin(), sketchers.pmh->idcounts().end(), kmercounts.begin());
@@ -461,71 +480,25 @@ void resize_fill(Dashing2DistOptions &opts, FastxSketchingResult &ret, size_t ne
             if(!sketchers.cfss || opts.fd_level_ != 0.5) {
                 const size_t mss = opts.sketchsize_ * i;
                 VERBOSE_ONLY(std::fprintf(stderr, "About to copy out. For sketch idx %zu, Offset into dict: %zu. copying %zu bytes.\n", mss, mss >> sigshift, ((opts.sketchsize_ * sizeof(RegT)) >> sigshift)););
-                std::memcpy(&ret.signatures_[mss >> sigshift], ptr, ((opts.sketchsize_ * sizeof(RegT)) >> sigshift));
-                // std::copy(ptr, ptr + (opts.sketchsize_ >> sigshift), &ret.signatures_[i * (opts.sketchsize_ >> sigshift)]);
+                std::memcpy(&out.sigs_[i * sigsper], ptr, ((opts.sketchsize_ * sizeof(RegT)) >> sigshift));
                 VERBOSE_ONLY(std::fprintf(stderr, "Copied out. For sketch idx %zu, Offset into dict: %zu. copying %zu bytes.\n", mss, mss >> sigshift, ((opts.sketchsize_ * sizeof(RegT)) >> sigshift)););
             } else {
                 const uint8_t *const srcptr = std::get<NibbleSetS>(*sketchers.cfss).data();
-                uint8_t *destptr = (uint8_t *)&ret.signatures_[i * opts.sketchsize_ >> sigshift];
-                for(size_t i = 0; i < opts.sketchsize_; i += 2) {
-                    *destptr++ = (srcptr[i] << 4) | srcptr[i + 1];
+                uint8_t *destptr = (uint8_t *)&out.sigs_[i * sigsper];
+                for(size_t j = 0; j < opts.sketchsize_; j += 2) {
+                    *destptr++ = (srcptr[j] << 4) | srcptr[j + 1];
                 }
             }
-            if(kmer_ptr && ret.kmers_.size()) {
-                std::copy(kmer_ptr, kmer_ptr + opts.sketchsize_, &ret.kmers_[i * opts.sketchsize_]);
+            if(kmer_ptr && out.kmers_.size()) {
+                std::copy(kmer_ptr, kmer_ptr + opts.sketchsize_, &out.kmers_[i * opts.sketchsize_]);
             }
-            if(kmercounts.size() && ret.kmercounts_.size()) {
-                std::copy(kmercounts.begin(), kmercounts.end(), &ret.kmercounts_[i * opts.sketchsize_]);
+            if(kmercounts.size() && out.kmercounts_.size()) {
+                std::copy(kmercounts.begin(), kmercounts.end(), &out.kmercounts_[i * opts.sketchsize_]);
             }
         }
-        if(!need_to_keep_sequences) {
-            ret.sequences_.free_if_possible(i);
-        }
         if(verbosity >= DEBUG) {
-            std::fprintf(stderr, "Completing sequence %zu\n", i);
-        }
-    }
-    if(seqmins) {
-        const size_t seqminsz = oldsz - lastindex;
-        using OT = std::conditional_t<(sizeof(RegT) == 8), uint64_t, std::conditional_t<(sizeof(RegT) == 4), uint32_t, u128_t>>;
-        static_assert(sizeof(RegT) == sizeof(OT), "Size of hash registers must match that being sketched");
-        size_t new_sigsz = std::accumulate(seqmins.get(), seqmins.get() + seqminsz, size_t(0), [](size_t cs, const auto &v) {return cs + v.size();});
-        if constexpr(sizeof(RegT) == 16) new_sigsz >>= 1;
-        else if constexpr(sizeof(RegT) == 4) new_sigsz <<= 1;
-        std::vector<size_t> offsets{{ret.signatures_.size()}};
-        ret.signatures_.resize(new_sigsz + ret.signatures_.size());
-        for(size_t i = 0; i < seqminsz; ++i) {
-            auto noff = seqmins[i].size();
-            if constexpr(sizeof(RegT) == 16) {
-                noff >>= 1;
-            }
-            offsets.push_back(offsets.back() + noff);
-        }
-        size_t oldnpf = ret.nperfile_.size();
-        ret.nperfile_.resize(oldnpf + seqminsz);
-        OMP_PFOR
-        for(size_t i = 0; i < seqminsz; ++i) {
-            auto &x(seqmins[i]);
-            if(opts.use128_) {
-                auto ptr = (u128_t *)x.data();
-                for(size_t K = 0; K < (x.size() >> 1); ++K) {
-                    u128_t item;
-                    std::memcpy(&item, ptr + K, sizeof(item));
-                    item = invmaskfn(item);
-                    std::memcpy(ptr + K, &item, sizeof(item));
-                }
-            } else {
-                std::transform(x.begin(), x.end(), x.begin(), [](auto item) {return invmaskfn(item);});
-            }
-            const OT *ptr = (const OT *)x.data();
-            size_t xsz = x.size();
-            if constexpr(sizeof(RegT) == 16) {
-                xsz >>= 1;
-            }
-            ret.nperfile_[oldnpf + i] = xsz;
-            std::memcpy(&ret.signatures_[offsets[i]], ptr, sizeof(RegT) * xsz);
+            std::fprintf(stderr, "Completing sequence %s\n", name.data());
         }
     }
-    lastindex = oldsz;
 }
 } // dashing2
@@ -1,34 +1,57 @@
-#include "filterset.h"
+#include "d2.h"
 namespace dashing2 {
     void FilterSet::finalize() {
-        //reset(data_.begin(), data_.end(), bfexp_, k_ > 0 ? k_: -1);
         if(is_bf()) {
-            const size_t nelem = data_.size();
-            auto beg = data_.data(), end = &*data_.end();
+            const size_t nelem = data_.size() >> wide_;
             auto oldd = std::move(data_);
             const double dbits_per_el = std::log(1. / bfexp_) / std::pow(M_LN2, 2);
-            int k = k_ > 0 ? k_: int(dbits_per_el * M_LN2);
-            // Constant is std::pow(1. / std::log(2), 2.)
-            size_t mem = nelem * dbits_per_el;
-            mem = std::max((mem + mem % bits_per_reg) / bits_per_reg, size_t(1));
-            k_ = k;
-            std::fprintf(stderr, "nreg: %zu. k: %d. nbits: %zu\n", mem, k_, mem * 64);
-            std::fprintf(stderr, "False positive rate %g using %d bits per el\n", bfexp_, k_);
-            data_.resize(mem);
-            std::fprintf(stderr, "data size: %zu. total mem: %zu\n", data_.size(), size_t(nelem * dbits_per_el));
-            schism::Schismatic<uint64_t> mod_(mem * 64);
-            // Maybe we batch this in the future?
-            for(;beg != end; ++beg) {
-                RNG mt(hash(*beg));
-                for(int i = 0; i < k_; ++i) {
-                    const uint64_t rem = mod_.mod(mt());
-                    data_[(rem >> SHIFT)] |= (T(1) << (rem & MASK));
-                }
+            // Round k to whole bits per word, so that each word of a block has the same number set
+            const int k = k_ > 0 ? k_: int(dbits_per_el * M_LN2);
+            k_ = std::clamp(int(std::lround(double(k) / BLOCK_WORDS)), 1, MAX_BITS_PER_WORD) * BLOCK_WORDS;
+            const size_t nblocks = std::max(size_t(std::ceil(nelem * dbits_per_el * BLOCKED_OVERHEAD / BLOCK_BITS)), size_t(1));
+            data_.resize(nblocks * BLOCK_WORDS);
+            if(verbosity >= INFO) {
+                std::fprintf(stderr, "Blocked Bloom filter for %zu elements with target false positive rate %g: %zu 512-bit blocks, %d bits per element\n", nelem, bfexp_, nblocks, k_);
+            }
+            T mask[BLOCK_WORDS];
+            auto insert = [&](uint64_t h) {
+                make_mask(h, mask);
+                T *const blk = const_cast<T *>(block(h));
+                for(size_t i = 0; i < BLOCK_WORDS; ++i) blk[i] |= mask[i];
+            };
+            if(wide_) {
+                const u128_t *p = reinterpret_cast<const u128_t *>(oldd.data());
+                for(size_t i = 0; i < nelem; ++i) insert(hash(p[i]));
+            } else {
+                for(const auto x: oldd) insert(hash(x));
             }
         } else {
-            std::sort(data_.begin(), data_.end());
-            //std::fprintf(stderr, "Sorted filterset of size %zu\n", data_.size());
-            // Maybe replace with a faster sorter
+            if(wide_) {
+                u128_t *p = reinterpret_cast<u128_t *>(data_.data());
+                std::sort(p, p + (data_.size() >> 1));
+            } else {
+                std::sort(data_.begin(), data_.end());
+                // Maybe replace with a faster sorter
+            }
+            fit_interpolation();
         }
     }
+    void FilterSet::fit_interpolation() {
+        auto fit = [&](const auto *p, const size_t n) {
+            if(!n) return;
+            interp_min_ = top64(p[0]);
+            const uint64_t range = top64(p[n - 1]) - interp_min_;
+            interp_scale_ = range ? double(n - 1) / double(range): 0.;
+            interp_err_ = 0;
+            for(size_t i = 0; i < n; ++i) {
+                const size_t pred = predict(p[i]);
+                interp_err_ = std::max(interp_err_, pred > i ? pred - i: i - pred);
+            }
+            if(verbosity >= INFO) {
+                std::fprintf(stderr, "Sorted filter set of %zu keys, each within %zu of its interpolated position\n", n, interp_err_);
+            }
+        };
+        if(wide_) fit(keys<u128_t>(), nkeys<u128_t>());
+        else fit(keys<uint64_t>(), nkeys<uint64_t>());
+    }
 } // namespace dashing2
@@ -8,8 +8,12 @@
 #include "aligned_vector.h"
 #include "interpbound.h"
 #include "enums.h"
+#include <array>
 #include <climits>
 #include <cmath>
+#if __AVX2__ || __AVX512F__
+#include <immintrin.h>
+#endif
 
 
 namespace dashing2 {
@@ -32,19 +36,54 @@ static constexpr int ceilog2(size_t n) {
 using namespace sketch::hash;
 
 
+/*
+ * FilterSet
+ * A set of k-mers to skip when sketching (--filterset), either as
+ *   a sorted vector of keys (the default), which is exact, or
+ *   a blocked Bloom filter (--filterset-fpr), which is smaller, at the cost of false positives.
+ * The Bloom filter maps each key to one 512-bit (cache-line) block, and sets k bits within it,
+ * k / 8 in each of its 8 words, so a lookup costs one cache miss and a single SIMD test.
+ * Sorted keys are hashed, and so close to uniform: a lookup interpolates the key's position, and binary searches only
+ * the window around it which finalize() found to hold every key.
+ * Batched lookups (in_set(keys, n, hits)) prefetch every block before testing any, or, for sorted vectors,
+ * step all of the batch's searches through their windows together, so that their cache misses overlap.
+ */
 class FilterSet {
     using T = uint64_t;
-    aligned::vector<T> data_;
+    aligned::vector<T> data_; // Sorted keys (u128 keys as pairs of words), or Bloom filter blocks
     double bfexp_;
     int k_ = 0;
+    bool wide_ = false; // Whether keys are u128
+    // Sorted keys are located by interpolation: key i lies within interp_err_ of predict(key i)
+    uint64_t interp_min_ = 0;
+    double interp_scale_ = 0.;
+    size_t interp_err_ = 0;
     //  Table size is
 #ifndef M_LN2
     static constexpr double M_LN2 = 0.6931471805599453;
 #endif
-    using RNG = wy::WyRand<uint64_t, 0>;
     CEIFused<CEIXOR<0x533f8c2151b20f97>, CEIMul<0x9a98567ed20c127d>, CEIXOR<0x691a9d706391077a>>
         fshasher_;
     static constexpr size_t bits_per_reg = sizeof(T) * CHAR_BIT;
+public:
+    static constexpr size_t BLOCK_WORDS = 8, BLOCK_BITS = BLOCK_WORDS * bits_per_reg;
+    static constexpr int MAX_BITS_PER_WORD = 4;
+    // Keys collide within blocks more often than across a whole filter, so blocked filters take this much more space
+    // than the textbook size to stay at or below the requested false positive rate
+    static constexpr double BLOCKED_OVERHEAD = 1.2;
+private:
+    // Odd multipliers which select a bit in each word of a block from the low half of a key's hash
+    static constexpr std::array<uint32_t, BLOCK_WORDS * MAX_BITS_PER_WORD> SALTS = []() {
+        std::array<uint32_t, BLOCK_WORDS * MAX_BITS_PER_WORD> ret{};
+        uint64_t x = 0x47b6137b44974d91ull;
+        for(auto &s: ret) {
+            x += 0x9e3779b97f4a7c15ull;
+            uint64_t z = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            s = uint32_t(z ^ (z >> 31)) | 1u;
+        }
+        return ret;
+    }();
     template<typename T>
     uint64_t hash(const T x) const noexcept {
         if constexpr(std::is_same_v<T, uint64_t>) {
@@ -74,153 +113,191 @@ class FilterSet {
         }
         return ret;
     }
+    size_t nblocks() const {return data_.size() / BLOCK_WORDS;}
+    const T *block(uint64_t h) const {
+        return &data_[size_t((u128_t(h) * nblocks()) >> 64) * BLOCK_WORDS];
+    }
+    // Bits to set or test in a key's block
+    void make_mask(uint64_t h, T *mask) const {
+        const uint32_t lo = h;
+        const int bpw = k_ / BLOCK_WORDS;
+        for(size_t i = 0; i < BLOCK_WORDS; ++i) mask[i] = 0;
+        for(int j = 0; j < bpw; ++j)
+            for(size_t i = 0; i < BLOCK_WORDS; ++i)
+                mask[i] |= T(1) << ((lo * SALTS[j * BLOCK_WORDS + i]) >> 26);
+    }
+    static bool block_contains(const T *blk, const T *mask) {
+#if __AVX512F__
+        const __m512i b = _mm512_load_si512((const void *)blk), m = _mm512_loadu_si512((const void *)mask);
+        return _mm512_test_epi64_mask(_mm512_andnot_si512(b, m), m) == 0;
+#elif __AVX2__
+        return _mm256_testc_si256(_mm256_load_si256((const __m256i *)blk), _mm256_loadu_si256((const __m256i *)mask))
+            && _mm256_testc_si256(_mm256_load_si256((const __m256i *)blk + 1), _mm256_loadu_si256((const __m256i *)mask + 1));
+#else
+        T missing = 0;
+        for(size_t i = 0; i < BLOCK_WORDS; ++i) missing |= mask[i] & ~blk[i];
+        return missing == 0;
+#endif
+    }
+    bool bf_contains(uint64_t h) const {
+        alignas(64) T mask[BLOCK_WORDS];
+        make_mask(h, mask);
+        return block_contains(block(h), mask);
+    }
+    template<typename KT>
+    const KT *keys() const {return reinterpret_cast<const KT *>(data_.data());}
+    template<typename KT>
+    size_t nkeys() const {return data_.size() * sizeof(T) / sizeof(KT);}
+    static uint64_t top64(uint64_t x) {return x;}
+    static uint64_t top64(u128_t x) {return x >> 64;}
+    // Interpolated position of x among the sorted keys, which are hashed and so close to uniform
+    template<typename KT>
+    size_t predict(KT x) const {
+        const uint64_t t = top64(x);
+        return t <= interp_min_ ? size_t(0): std::min(size_t((t - interp_min_) * interp_scale_), nkeys<KT>() - 1);
+    }
+    void fit_interpolation();
+    // Start of the window of keys which holds x, if x is a key.
+    // Every window has length window_size(), so that batched searches proceed in lockstep.
+    template<typename KT>
+    size_t window_size() const {return std::min(2 * interp_err_ + 2, nkeys<KT>());}
+    template<typename KT>
+    const KT *window(KT x) const {
+        const size_t p = predict(x);
+        return keys<KT>() + std::min(p - std::min(p, interp_err_), nkeys<KT>() - window_size<KT>());
+    }
+    template<typename KT>
+    bool sorted_contains(KT x) const {
+        if(data_.empty()) return false;
+        const KT *p = window(x), *e = p + window_size<KT>(), *it = std::lower_bound(p, e, x);
+        return it != e && *it == x;
+    }
+    template<typename KT>
+    void sorted_in_set(const KT *xs, size_t n, bool *hits) const {
+        if(data_.empty()) {
+            std::fill(hits, hits + n, false);
+            return;
+        }
+        // Branchless binary searches over equal-length windows, one step of every search at a time,
+        // so that the cache misses of different keys overlap
+        const KT *base[BATCH_LIMIT];
+        for(size_t i = 0; i < n; ++i) base[i] = window(xs[i]);
+        for(size_t len = window_size<KT>(); len > 1;) {
+            const size_t half = len / 2;
+            for(size_t i = 0; i < n; ++i) {
+                base[i] += (base[i][half] < xs[i]) * half;
+                __builtin_prefetch(base[i] + (len - half) / 2);
+            }
+            len -= half;
+        }
+        const KT *const e = keys<KT>() + nkeys<KT>();
+        for(size_t i = 0; i < n; ++i) {
+            const KT *it = base[i] + (*base[i] < xs[i]);
+            hits[i] = it != e && *it == xs[i];
+        }
+    }
+    template<typename KT>
+    void bf_in_set(const KT *xs, size_t n, bool *hits) const {
+        uint64_t hs[BATCH_LIMIT];
+        for(size_t i = 0; i < n; ++i) {
+            hs[i] = hash(xs[i]);
+            __builtin_prefetch(block(hs[i]));
+        }
+        for(size_t i = 0; i < n; ++i) hits[i] = bf_contains(hs[i]);
+    }
 public:
+    // Largest batch for in_set(keys, n, hits); larger batches are split
+    static constexpr size_t BATCH_LIMIT = 256;
     std::string to_string() const {
         if(is_bf()) {
-            return std::string("FilterSetBloomFilter-size=") + std::to_string(data_.size()) + ",k=" + std::to_string(k_) + ",err=" + std::to_string(bfexp_);
+            return std::string("FilterSetBlockedBloomFilter-size=") + std::to_string(data_.size()) + ",k=" + std::to_string(k_) + ",err=" + std::to_string(bfexp_);
         }
-        return std::string("FilterSetSortedHashSet-size=") + std::to_string(data_.size());
-    }
-#if 0
-    template<typename IT>
-    void reset(IT beg, IT end, double bfexp=-1., int ktouse=-1) {
-        //aligned::vector<T> dat = std::move(data_);
-        *this = FilterSet(beg, end, bfexp, ktouse);
+        return std::string("FilterSetSortedHashSet-size=") + std::to_string(nkeys<uint64_t>() >> wide_);
     }
-#endif
     FilterSet &operator=(const FilterSet &o) = default;
     FilterSet &operator=(FilterSet &&o){
         data_ = std::move(o.data_);
         bfexp_ = o.bfexp_;
         k_ = o.k_;
+        wide_ = o.wide_;
+        interp_min_ = o.interp_min_;
+        interp_scale_ = o.interp_scale_;
+        interp_err_ = o.interp_err_;
         return *this;
     }
+    // bfexp is the target false positive rate; if it is not positive, the set is exact.
     FilterSet(double bfexp=-1., int k=-1): bfexp_(bfexp), k_(k) {
     }
     void add(u128_t item) {
-        data_.push_back(item >> 64);
-        data_.push_back(item);
+        // Stored in native order, so that sorted keys can be read back as u128s
+        wide_ = true;
+        data_.resize(data_.size() + 2);
+        std::memcpy(&data_[data_.size() - 2], &item, sizeof(item));
     }
     void add(uint64_t item) {
         data_.push_back(item);
     }
+    // Builds the Bloom filter or sorts the keys added
     void finalize();
     template<typename IT>
-    FilterSet(IT beg, IT end, double bfexp=-1., int ktouse=-1): bfexp_(bfexp) {
-        const size_t nelem = std::distance(beg, end);
-        if(is_bf()) {
-            const double dbits_per_el = std::log(1. / bfexp) / std::pow(M_LN2, 2);
-            int k = ktouse > 0 ? ktouse: int(dbits_per_el * M_LN2);
-            // Constant is std::pow(1. / std::log(2), 2.)
-            size_t mem = nelem * dbits_per_el;
-            mem = std::max((mem + mem % bits_per_reg) / bits_per_reg, size_t(1));
-            k_ = k;
-            data_.resize(mem);
-            schism::Schismatic<uint64_t> mod_(mem * 64);
-            // Maybe we batch this in the future?
-            for(;beg != end; ++beg) {
-                RNG mt(hash(*beg));
-                for(int i = 0; i < k_; ++i) {
-                    auto v = mt();
-                    const size_t rem = mod_.mod(v);
-                    data_[(rem >> SHIFT)] |= (T(1) << (rem & MASK));
-                }
-            }
-        } else {
-            data_.reserve(nelem);
-            if(&*beg != &data_[0])
-                std::copy(beg, end, std::back_inserter(data_));
-            std::sort(data_.begin(), data_.end());
-            // Maybe replace with a faster sorter
-        }
+    FilterSet(IT beg, IT end, double bfexp=-1., int ktouse=-1): bfexp_(bfexp), k_(ktouse) {
+        data_.reserve(std::distance(beg, end));
+        for(;beg != end; ++beg) add(*beg);
+        finalize();
     }
     bool is_bf() const {return bfexp_ > 0.;}
     size_t tablesize() const {return (data_.size());}
     static constexpr int SHIFT = ceilog2(sizeof(T) * CHAR_BIT);
     static constexpr uint64_t MASK = (size_t(1) << SHIFT) - 1;
     size_t nbits() const {return tablesize() << SHIFT;}
-#if 0
-private:
-    std::vector<std::tuple<uint64_t, uint64_t, RNG>> tmpvs;
-    std::mutex mut;
-public:
-    std::vector<uint64_t> in_set(uint64_t *beg, uint64_t *end) {
-        std::lock_guard<std::mutex> lock(mut);
-        std::ptrdiff_t n = end - beg;
-        if(n == 0) return {};
-        if(n < 0) throw std::invalid_argument("Iterators are not ordered correctly.");
-        std::vector<uint64_t> ret(((end - beg) + 63) / 64);
-        if(is_bf()) {
-            if(tmpvs.capacity() < size_t(n)) tmpvs.resize(n);
-            for(ptrdiff_t i = 0; i < n; ++i) {
-                const auto v = beg[i];
-                std::get<1>(tmpvs[i]) = i;
-                std::get<2>(tmpvs[i]) = RNG(v);
-                std::get<0>(tmpvs[i]) = i;
-            }
-            std::sort(tmpvs.begin(), tmpvs.end());
-            auto tmpp = tmpids.data();
-            auto tvpp = tmpvs.data();
-            std::transform(beg, end, rngs.begin(), RNG);
-            std::transform(rngs.begin(), rngs.end(), tmpvs.begin(), [mp=&mod_](auto x) {return mp->mod(x);});
-            std::transform(beg, end, tmpvs.data(), [mp=&mod_](auto x) {return mp->mod(RNG(x)());});
-            std::iota(tmpp, tmpp + n, size_t(0));
-            std::sort(tmpp, tmpp, [&](auto x, auto y) {return tmpvs[x] < tmpvs[y];});
-            for(size_t i = 0; i < n; ++i) {
-            }
-            std::sort(&tmpvs[0], &tmpvs[n]);
-        } else {
-        }
-        return ret;
-    }
-#endif
     bool in_set(u128_t x) const {
-        if(is_bf()) {
-            // TODO: batch to sort for efficiency -- see above drafting
-            RNG rng((x >> 64) - (x & u128_t(0xFFFFFFFFFFFFFFFF)));
-            schism::Schismatic<uint64_t> mod_(nbits());
-            // Maybe this can even be SIMDIfied?
-            for(int i = 0; i < k_; ++i) {
-                const size_t v = rng();
-                const size_t rem = mod_.mod(v);
-                //std::fprintf(stderr, "Getting hash %zu from rem %zu - %d at index %zu at bit %d\n", v, rem, i, (rem >> SHIFT), (rem & MASK));
-                if((data_[rem >> SHIFT] & (uint64_t(1) << (rem & MASK))) == 0) {
-                    //std::fprintf(stderr, "Data %zu at bit %d is 0\n", rem >> SHIFT, (rem & MASK));
-                    return false;
-                }
-            }
-            return true;
-        }
-        const  u128_t *p = (const u128_t *)data_.data(), *e = p + (data_.size() / 2), *it = std::lower_bound(p, e, x);
-        return it != e && *it == x;
+        if(is_bf()) return bf_contains(hash(x));
+        return sorted_contains(x);
     }
     bool in_set(T x) const {
-        if(is_bf()) {
-            // TODO: batch to sort for efficiency -- see above drafting
-            RNG rng(x);
-            schism::Schismatic<uint64_t> mod_(nbits());
-            // Maybe this can even be SIMDIfied?
-            for(int i = 0; i < k_; ++i) {
-                const size_t v = rng();
-                const size_t rem = mod_.mod(v);
-                //std::fprintf(stderr, "Getting hash %zu from rem %zu - %d at index %zu at bit %d\n", v, rem, i, (rem >> SHIFT), (rem & MASK));
-                if((data_[rem >> SHIFT] & (uint64_t(1) << (rem & MASK))) == 0) {
-                    //std::fprintf(stderr, "Data %zu at bit %d is 0\n", rem >> SHIFT, (rem & MASK));
-                    return false;
-                }
-            }
-            return true;
+        if(is_bf()) return bf_contains(hash(x));
+        return sorted_contains(x);
+    }
+    // Sets hits[i] to whether xs[i] is in the set, for i in [0, n)
+    template<typename KT>
+    void in_set(const KT *xs, size_t n, bool *hits) const {
+        static_assert(std::is_same_v<KT, uint64_t> || std::is_same_v<KT, u128_t>, "Keys must be u64 or u128");
+        for(size_t i = 0; i < n; i += BATCH_LIMIT) {
+            const size_t nb = std::min(n - i, BATCH_LIMIT);
+            if(is_bf()) bf_in_set(xs + i, nb, hits + i);
+            else sorted_in_set(xs + i, nb, hits + i);
         }
-        //std::fprintf(stderr, "Testing with hash set lookup, and %s\n", std::is_sorted(data_.begin(), data_.end()) ? "is sorted": "is not sorted");
-        // Replace with interpolation search in the future
-        const T *p = data_.data(), *e = p + data_.size(), *it = std::lower_bound(p, e, x);
-        // Equivalent, but no logging
-        return it != e && *it == x;
     }
     const T *data() const {return data_.data();}
     size_t size() const {return data_.size();}
 };
 
+// Buffers k-mers as they are generated and passes those not in fs on to func, in the order they were added,
+// testing them a batch at a time. Call flush once the k-mers run out. fs may be null if nothing is added.
+template<typename KT, size_t BATCH=64>
+class FilterBatch {
+    static_assert(BATCH <= FilterSet::BATCH_LIMIT, "Batch is too large");
+    const FilterSet *fs_;
+    KT keys_[BATCH];
+    bool hits_[BATCH];
+    size_t n_ = 0;
+public:
+    FilterBatch(const FilterSet *fs): fs_(fs) {}
+    template<typename Func>
+    INLINE void add(KT x, const Func &func) {
+        keys_[n_] = x;
+        if(++n_ == BATCH) flush(func);
+    }
+    template<typename Func>
+    void flush(const Func &func) {
+        if(!n_) return;
+        fs_->in_set(keys_, n_, hits_);
+        for(size_t i = 0; i < n_; ++i)
+            if(!hits_[i]) func(keys_[i]);
+        n_ = 0;
+    }
+};
+
 FilterSet from_fastx(const std::string &path);
 
 }
@@ -0,0 +1,214 @@
+#include "fxsplit.h"
+#include "enums.h"
+#include <cctype>
+#include <cstring>
+#include <thread>
+#include <zlib.h>
+
+namespace dashing2 {
+
+// Size of the BGZF block starting at p, or 0 if p does not start a complete BGZF block
+static size_t bgzf_block_size(const uint8_t *p, size_t avail) {
+    if(avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+    const size_t xlen = p[10] | (size_t(p[11]) << 8);
+    if(12 + xlen > avail) return 0;
+    for(size_t off = 12; off + 4 <= 12 + xlen;) {
+        const size_t slen = p[off + 2] | (size_t(p[off + 3]) << 8);
+        if(p[off] == 'B' && p[off + 1] == 'C' && slen == 2 && off + 6 <= 12 + xlen) {
+            const size_t bs = (p[off + 4] | (size_t(p[off + 5]) << 8)) + 1;
+            return bs >= 12 + xlen + 8 && bs <= avail ? bs: size_t(0);
+        }
+        off += 4 + slen;
+    }
+    return 0;
+}
+
+// Offset of the first BGZF block starting at or after offset, confirmed by the block following it (or the end of the file)
+static size_t next_bgzf_block(const uint8_t *gz, size_t n, size_t offset) {
+    for(size_t p = offset; p + 18 <= n; ++p) {
+        const void *m = std::memchr(gz + p, 0x1f, n - p);
+        if(!m) break;
+        p = static_cast<const uint8_t *>(m) - gz;
+        if(const size_t bs = bgzf_block_size(gz + p, n - p); bs && (p + bs == n || bgzf_block_size(gz + p + bs, n - p - bs)))
+            return p;
+    }
+    return n;
+}
+
+// Appends the decompressed contents of the BGZF block at p to out and returns the block's size
+static size_t inflate_bgzf_block(const uint8_t *gz, size_t n, size_t p, z_stream *zs, std::string &out) {
+    const uint8_t *blk = gz + p;
+    const size_t bs = bgzf_block_size(blk, n - p);
+    if(!bs) THROW_EXCEPTION(std::runtime_error(std::string("Invalid BGZF block at offset ") + std::to_string(p)));
+    const size_t xlen = blk[10] | (size_t(blk[11]) << 8);
+    const uint32_t isize = blk[bs - 4] | (uint32_t(blk[bs - 3]) << 8) | (uint32_t(blk[bs - 2]) << 16) | (uint32_t(blk[bs - 1]) << 24);
+    const size_t prev = out.size();
+    out.resize(prev + isize);
+    inflateReset(zs);
+    zs->next_in = const_cast<Bytef *>(blk + 12 + xlen);
+    zs->avail_in = bs - 12 - xlen - 8;
+    zs->next_out = reinterpret_cast<Bytef *>(out.data() + prev);
+    zs->avail_out = isize;
+    const int rc = inflate(zs, Z_FINISH);
+    if(rc != Z_STREAM_END || zs->avail_out)
+        THROW_EXCEPTION(std::runtime_error(std::string("Corrupt BGZF block at offset ") + std::to_string(p) + ": zlib error " + std::to_string(rc)));
+    return bs;
+}
+
+FastxSplitter::Scratch::~Scratch() {
+    if(zs_) {
+        inflateEnd(static_cast<z_stream *>(zs_));
+        delete static_cast<z_stream *>(zs_);
+    }
+}
+
+static z_stream *get_zstream(FastxSplitter::Scratch &scratch) {
+    if(!scratch.zs_) {
+        z_stream *zs = new z_stream{};
+        if(inflateInit2(zs, -15) != Z_OK) {
+            delete zs;
+            THROW_EXCEPTION(std::runtime_error("Failed to initialize zlib"));
+        }
+        scratch.zs_ = zs;
+    }
+    return static_cast<z_stream *>(scratch.zs_);
+}
+
+namespace {
+// The text of one chunk: [0, own_) is the chunk itself, and extend() makes more of the file available to finish its last record.
+// Uncompressed chunks see the rest of the file from the start; BGZF chunks decompress following blocks on demand.
+struct ChunkText {
+    const char *data_ = nullptr;
+    size_t size_ = 0, own_ = 0;
+    std::string *buf_ = nullptr;
+    const uint8_t *gz_ = nullptr;
+    size_t gzsize_ = 0, next_block_ = 0;
+    z_stream *zs_ = nullptr;
+
+    ChunkText(const uint8_t *file, size_t n, uint64_t lo, uint64_t hi, bool bgzf, FastxSplitter::Scratch &scratch) {
+        if(!bgzf) {
+            data_ = reinterpret_cast<const char *>(file) + lo;
+            size_ = n - lo;
+            own_ = hi - lo;
+            return;
+        }
+        buf_ = &scratch.text_;
+        buf_->clear();
+        gz_ = file;
+        gzsize_ = n;
+        zs_ = get_zstream(scratch);
+        size_t p = lo ? next_bgzf_block(file, n, lo): size_t(0);
+        while(p < hi) p += inflate_bgzf_block(file, n, p, zs_, *buf_);
+        next_block_ = p;
+        data_ = buf_->data();
+        size_ = own_ = buf_->size();
+    }
+    bool extend() {
+        if(!buf_ || next_block_ >= gzsize_) return false;
+        next_block_ += inflate_bgzf_block(gz_, gzsize_, next_block_, zs_, *buf_);
+        data_ = buf_->data();
+        size_ = buf_->size();
+        return true;
+    }
+    // Character at pos, or -1 past the end of the file
+    int at(size_t pos) {
+        while(pos >= size_)
+            if(!extend()) return -1;
+        return static_cast<unsigned char>(data_[pos]);
+    }
+    // Sets [b, e) to the line starting at pos, without its line break, and moves pos to the next line
+    bool getline(size_t &pos, size_t &b, size_t &e) {
+        if(at(pos) < 0) return false;
+        b = pos;
+        for(size_t from = pos;;) {
+            if(const void *nl = std::memchr(data_ + from, '\n', size_ - from)) {
+                e = static_cast<const char *>(nl) - data_;
+                pos = e + 1;
+                break;
+            }
+            from = size_;
+            if(!extend()) {
+                e = pos = size_;
+                break;
+            }
+        }
+        if(e > b && data_[e - 1] == '\r') --e;
+        return true;
+    }
+};
+
+bool fastq_record_at(ChunkText &t, size_t pos) {
+    size_t hb, he, sb, se, pb, pe, qb, qe;
+    return t.at(pos) == '@' && t.getline(pos, hb, he) && t.getline(pos, sb, se)
+        && t.getline(pos, pb, pe) && pe > pb && t.data_[pb] == '+'
+        && t.getline(pos, qb, qe) && qe - qb == se - sb;
+}
+
+bool record_at(ChunkText &t, size_t pos, FastxSplitter::Format fmt) {
+    return fmt == FastxSplitter::FASTA ? t.at(pos) == '>': fastq_record_at(t, pos);
+}
+
+// First record start among the line starts in [0, own_] (or (0, own_], for all but the first chunk)
+size_t find_record(ChunkText &t, FastxSplitter::Format fmt, bool first) {
+    if(first && record_at(t, 0, fmt)) return 0;
+    for(size_t i = 0; i < t.own_;) {
+        const void *nl = std::memchr(t.data_ + i, '\n', t.own_ - i);
+        if(!nl) break;
+        i = static_cast<const char *>(nl) - t.data_ + 1;
+        if(record_at(t, i, fmt)) return i;
+    }
+    return size_t(-1);
+}
+} // anonymous namespace
+
+FastxSplitter::FastxSplitter(const std::string &path, size_t chunk_bytes) {
+    std::error_code ec;
+    map_.map(path, ec);
+    if(ec || map_.size() == 0) return;
+    const uint8_t *file = reinterpret_cast<const uint8_t *>(map_.data());
+    const size_t n = map_.size();
+    if(n >= 2 && file[0] == 0x1f && file[1] == 0x8b) {
+        // Plain gzip can only be decompressed from the start
+        if(!bgzf_block_size(file, n)) return;
+        bgzf_ = true;
+    }
+    chunk_bytes = std::max(chunk_bytes, size_t(1));
+    std::vector<uint64_t> bounds;
+    for(size_t o = 0; o < n; o += chunk_bytes) bounds.push_back(o);
+    bounds.push_back(n);
+    Scratch scratch;
+    ChunkText t(file, n, bounds[0], bounds[1], bgzf_, scratch);
+    size_t pos = 0;
+    for(int c; (c = t.at(pos)) >= 0 && std::isspace(c); ++pos);
+    if(pos && t.data_[pos - 1] != '\n') return;
+    const int c = t.at(pos);
+    if(c == '>') format_ = FASTA;
+    else if(c == '@' && fastq_record_at(t, pos)) format_ = FASTQ;
+    else return;
+    bounds_ = std::move(bounds);
+}
+
+void FastxSplitter::for_each_record(size_t c, const std::function<void(const char *, size_t)> &func, Scratch &scratch) const {
+    if(format_ == NOT_SPLITTABLE) THROW_EXCEPTION(std::runtime_error("Cannot split this file"));
+    if(c >= nchunks()) THROW_EXCEPTION(std::out_of_range(std::string("Chunk ") + std::to_string(c) + " is out of range"));
+    ChunkText t(reinterpret_cast<const uint8_t *>(map_.data()), map_.size(), bounds_[c], bounds_[c + 1], bgzf_, scratch);
+    std::string &seq = scratch.seq_;
+    size_t b, e;
+    for(size_t pos = find_record(t, format_, c == 0); pos <= t.own_ && t.getline(pos, b, e);) {
+        seq.clear();
+        if(format_ == FASTA) {
+            for(int ch; (ch = t.at(pos)) >= 0 && ch != '>';) {
+                t.getline(pos, b, e);
+                seq.append(t.data_ + b, e - b);
+            }
+        } else {
+            while(t.getline(pos, b, e) && !(e > b && t.data_[b] == '+'))
+                seq.append(t.data_ + b, e - b);
+            // As in kseq, at least one quality line, even for an empty sequence
+            for(size_t qlen = 0; t.getline(pos, b, e) && (qlen += e - b) < seq.size(););
+        }
+        func(seq.data(), seq.size());
+    }
+}
+
+} // namespace dashing2
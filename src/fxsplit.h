@@ -0,0 +1,61 @@
+#pragma once
+#ifndef DASHING2_FXSPLIT_H__
+#define DASHING2_FXSPLIT_H__
+#include "mio.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace dashing2 {
+
+/*
+ * FastxSplitter
+ * Splits one large FASTA/FASTQ file into record-aligned chunks which can be parsed independently,
+ * so that a single huge input can be sketched by every thread and the per-thread sketches merged.
+ *
+ * Chunks are byte ranges of the file on disk: of the text itself for uncompressed files,
+ * or of the compressed stream for BGZF (blocked gzip, as written by bgzip), whose blocks are independent deflate streams.
+ * A BGZF chunk begins at the first block starting in its range, found by its header and confirmed by the block after it.
+ *
+ * A record belongs to the chunk in which it starts. Chunks read past their end to finish their last record
+ * and skip the partial record at their start; a record starting exactly at a boundary belongs to the earlier chunk,
+ * so that chunks never need to look behind their start.
+ * Record starts are unambiguous in FASTA ('>' at the start of a line). In FASTQ, an '@' line only starts a record
+ * if the line two below it starts with '+' and the lines between have the same length,
+ * so multi-line FASTQ is reported as not splittable, as are plain gzip and anything else; those should be read whole.
+ */
+class FastxSplitter {
+public:
+    enum Format {
+        NOT_SPLITTABLE,
+        FASTA,
+        FASTQ
+    };
+    // Per-thread parsing state, reused across chunks
+    struct Scratch {
+        std::string text_; // Decompressed BGZF blocks
+        std::string seq_;  // The current record's sequence, without line breaks
+        void *zs_ = nullptr;
+        Scratch() = default;
+        Scratch(const Scratch &) = delete;
+        ~Scratch();
+    };
+    FastxSplitter(const std::string &path, size_t chunk_bytes);
+    Format format() const {return format_;}
+    bool bgzf() const {return bgzf_;}
+    size_t nchunks() const {return bounds_.empty() ? size_t(0): bounds_.size() - 1;}
+    // True if the file can be read in more than one chunk
+    explicit operator bool() const {return format_ != NOT_SPLITTABLE && nchunks() > 1;}
+    // Calls func(seq, len) for every record starting in chunk c, in order
+    void for_each_record(size_t c, const std::function<void(const char *, size_t)> &func, Scratch &scratch) const;
+private:
+    mio::mmap_source map_;
+    Format format_ = NOT_SPLITTABLE;
+    bool bgzf_ = false;
+    std::vector<uint64_t> bounds_;
+};
+
+} // namespace dashing2
+
+#endif
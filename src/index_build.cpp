@@ -1,7 +1,6 @@
 #include "cmp_main.h"
 #include "minispan.h"
 #include <vector>
-#include <mutex>
 #include "index_build.h"
 #include "dedup_core.h"
 
@@ -17,30 +16,91 @@ void pqueue::erase(typename std::priority_queue<PairT>::container_type::iterator
 }
 
 
-void update(pqueue &x, flat_hash_set<LSHIDType> &xset, const PairT &item, const int topk, size_t k, std::mutex &mut) {
-    const auto [dist, id] = item;
-    if(xset.find(id) != xset.end()) {
-        DBG_ONLY(std::fprintf(stderr, "id %u is already present\n", int(id));)
-        return;
-    }
-    if(topk <= 0 || x.size() < k) {
-        std::lock_guard<std::mutex> lock(mut);
-        xset.insert(id);
-        x.push(item);
-        return;
-    }
-    if(item.first <= x.top().first) {
-        DBG_ONLY(std::fprintf(stderr, "New top before update: %g/Size %zu, with new item %g/%u added\n", x.front().first, x.size(), item.first, item.second);)
-        std::lock_guard<std::mutex> lock(mut);
-        auto old = x.top();
-        // If the rank is the same as k - 1, save both
-        // otherwise, discard the old one, since it's not good enough
-        if(old.first != item.first) {
-            xset.erase(old.second);
-            x.pop();
+namespace {
+// A candidate neighbor nbr of node, with score -(LSH table hits)
+struct Candidate {
+    LSHIDType node, nbr;
+    LSHDistType dist;
+};
+}
+
+static bool by_neighbor(const PairT &x, const PairT &y) {return std::tie(x.second, x.first) < std::tie(y.second, y.first);}
+
+// Merges new (score, neighbor) pairs into a node's list.
+// Without topk, they are only appended, and finish_neighbors removes duplicates once all have been added.
+// With topk > 0, lists stay sorted by neighbor: only the new pairs are sorted and merged in, each neighbor is kept once,
+// with its best score, and only the k best are kept, along with any tied with the k-th.
+static void merge_neighbors(pqueue &nl, const Candidate *b, const Candidate *e, const int topk, size_t k, std::vector<LSHDistType> &scores) {
+    auto &c = nl.getc();
+    const size_t nold = c.size();
+    for(; b < e; ++b) c.emplace_back(b->dist, b->nbr);
+    if(topk <= 0) return;
+    std::sort(c.begin() + nold, c.end(), by_neighbor);
+    std::inplace_merge(c.begin(), c.begin() + nold, c.end(), by_neighbor);
+    c.erase(std::unique(c.begin(), c.end(), [](const PairT &x, const PairT &y) {return x.second == y.second;}), c.end());
+    if(c.size() > k) {
+        scores.resize(c.size());
+        std::transform(c.begin(), c.end(), scores.begin(), [](const PairT &x) {return x.first;});
+        std::nth_element(scores.begin(), scores.begin() + (k - 1), scores.end());
+        const auto kth_bestv = scores[k - 1];
+        c.erase(std::remove_if(c.begin(), c.end(), [kth_bestv](const PairT &x) {return x.first > kth_bestv;}), c.end());
+    }
+}
+
+// Orders a finished list by score. Without topk, merge_neighbors left duplicates, of which the first (best) is kept:
+// seen[nbr] == stamp marks the neighbors already kept, stamp being unique to the list.
+static void finish_neighbors(pqueue &nl, const int topk, std::vector<uint32_t> &seen, uint32_t stamp) {
+    nl.sort();
+    if(topk <= 0) {
+        auto &c = nl.getc();
+        size_t n = 0;
+        for(const PairT &x: c)
+            if(std::exchange(seen[x.second], stamp) != stamp) c[n++] = x;
+        c.resize(n);
+    }
+}
+
+// Moves the candidates from each thread's buffer into the neighbor lists.
+// Candidates are scattered by node range into nparts partitions, as in ContainIndex,
+// and each partition's nodes are then updated by a single thread, so no locking is needed.
+static void flush_candidates(std::vector<std::vector<Candidate>> &bufs, std::vector<Candidate> &sorted, std::vector<pqueue> &neighbor_lists, const int topk, size_t k) {
+    const int nt = bufs.size();
+    const size_t ns = neighbor_lists.size();
+    const size_t nparts = std::min(ns, size_t(nt) * 16);
+    auto part_of = [ns, nparts](LSHIDType node) {return size_t(uint64_t(node) * nparts / ns);};
+    std::vector<uint64_t> pos(size_t(nt) * nparts), pstart(nparts + 1);
+    OMP_PRAGMA("omp parallel for schedule(static, 1) num_threads(nt)")
+    for(int t = 0; t < nt; ++t) {
+        uint64_t *const hist = &pos[size_t(t) * nparts];
+        for(const Candidate &x: bufs[t]) ++hist[part_of(x.node)];
+    }
+    for(size_t part = 0, total = 0; part < nparts; ++part) {
+        pstart[part] = total;
+        for(int t = 0; t < nt; ++t) {
+            const uint64_t c = pos[size_t(t) * nparts + part];
+            pos[size_t(t) * nparts + part] = total;
+            total += c;
         }
-        x.push(item);
-    } DBG_ONLY(else std::fprintf(stderr, "Count %g was not sufficient to be included. Current top: %g\n", item.first, x.top().first);)
+        pstart[part + 1] = total;
+    }
+    sorted.resize(pstart[nparts]);
+    OMP_PRAGMA("omp parallel for schedule(static, 1) num_threads(nt)")
+    for(int t = 0; t < nt; ++t) {
+        uint64_t *const cursor = &pos[size_t(t) * nparts];
+        for(const Candidate &x: bufs[t]) sorted[cursor[part_of(x.node)]++] = x;
+        bufs[t].clear();
+    }
+    OMP_PFOR_DYN
+    for(size_t part = 0; part < nparts; ++part) {
+        Candidate *const b = sorted.data() + pstart[part], *const e = sorted.data() + pstart[part + 1];
+        std::sort(b, e, [](const Candidate &x, const Candidate &y) {return x.node < y.node;});
+        std::vector<LSHDistType> scores;
+        for(Candidate *p = b; p < e;) {
+            Candidate *const pe = std::find_if(p, e, [node=p->node](const Candidate &x) {return x.node != node;});
+            merge_neighbors(neighbor_lists[p->node], p, pe, topk, k, scores);
+            p = pe;
+        }
+    }
 }
 
 #define ALL_CASE_NS\
@@ -50,6 +110,25 @@ void update(pqueue &x, flat_hash_set<LSHIDType> &xset, const PairT &item, const
                CASE_N(1, uint8_t);\
                 default: __builtin_unreachable();
 
+SetSketchIndex<LSHIDType, LSHIDType> make_index(const Dashing2DistOptions &opts) {
+    std::vector<uint64_t> nperhashes;
+    while(nperhashes.size() < opts.nLSH) {
+        nperhashes.emplace_back(nperhashes.size() < 3 ? (1ull << nperhashes.size()): static_cast<unsigned long long>(nperhashes.size() * 2));
+    }
+    std::vector<uint64_t> nperrows(nperhashes.size());
+    for(size_t i = 0; i < nperhashes.size(); ++i) {
+        const auto nh = nperhashes[i];
+        auto &np = nperrows[i];
+        if(nh <= 2) {
+            np = opts.sketchsize_ / nh;
+        } else {
+            np = opts.sketchsize_ * 8 / nh;
+        }
+    }
+    using SSI = SetSketchIndex<LSHIDType, LSHIDType>;
+    return opts.kmer_result_ < FULL_MMER_SET ? SSI(opts.sketchsize_, nperhashes, nperrows): SSI();
+}
+
 std::vector<pqueue> build_index(SetSketchIndex<LSHIDType, LSHIDType> &idx, const Dashing2DistOptions &opts, const SketchingResult &result) {
     // Builds the LSH index and populates nearest-neighbor lists in parallel
     const size_t ns = result.names_.size();
@@ -65,8 +144,6 @@ std::vector<pqueue> build_index(SetSketchIndex<LSHIDType, LSHIDType> &idx, const
     if(opts.output_kind_ == KNN_GRAPH && opts.num_neighbors_ > 0)
         for(auto &n: neighbor_lists)
             n.reserve(opts.num_neighbors_);
-    std::vector<flat_hash_set<LSHIDType>> neighbor_sets(ns);
-    std::unique_ptr<std::mutex[]> mutexes(new std::mutex[ns]);
     auto idxstart = std::chrono::high_resolution_clock::now();
     // Build the index
     const bool indexing_compressed = opts.sketch_compressed_set && opts.fd_level_ >= 1. && opts.fd_level_ < sizeof(RegT) && opts.kmer_result_ < FULL_MMER_SET;
@@ -74,74 +151,82 @@ std::vector<pqueue> build_index(SetSketchIndex<LSHIDType, LSHIDType> &idx, const
     if(verbosity >= DEBUG) {
         std::fprintf(stderr, "Indexing compressed: %s\n", indexing_compressed ? "true": "false");
     }
-    idx.size(ns);
-    OMP_PFOR
-    for(size_t i  = 0; i < ns; ++i) {
-        if(indexing_compressed) {
-            if(opts.fd_level_ == 0.5) {
-                idx.update(minispan<uint8_t>((uint8_t *)opts.compressed_ptr_ + opts.sketchsize_ / 2 * i, opts.sketchsize_ / 2));
-                continue;
-            }
-            switch(int(opts.fd_level_)) {
+    if(indexing_compressed && (opts.fd_level_ == 0.5)) {
+        THROW_EXCEPTION(std::runtime_error("Error: Dashing2 can only perform LSH-assisted analyses using registers of at least 1 byte."));
+    }
+    if(indexing_compressed) {
+        if(verbosity >= EXTREME) {
+            std::fprintf(stderr, "register size %d. Indexing %zu entities from %p.\n", int(opts.fd_level_), ns, opts.compressed_ptr_);
+        }
+        switch(int(opts.fd_level_)) {
 #define CASE_N(digit, TYPE) case digit: \
-            {\
-                if(verbosity >= EXTREME) {\
-                    std::fprintf(stderr, "register size %d. Accessing offset %zu for entity %zu.\n", digit, size_t(opts.compressed_ptr_) + digit * opts.sketchsize_ * i, i);}\
-                \
-            idx.update(minispan<TYPE>((TYPE *)opts.compressed_ptr_ + opts.sketchsize_ * i, opts.sketchsize_), i); break;\
-            }
+            idx.build(ns, [&](size_t i) {return minispan<TYPE>((TYPE *)opts.compressed_ptr_ + opts.sketchsize_ * i, opts.sketchsize_);}); break;
             ALL_CASE_NS
 #undef CASE_N
-            }
-        } else {
-            idx.update(minispan<RegT>(&result.signatures_[opts.sketchsize_ * i], opts.sketchsize_), i);
         }
+    } else {
+        idx.build(ns, [&](size_t i) {return minispan<RegT>(&result.signatures_[opts.sketchsize_ * i], opts.sketchsize_);});
     }
     auto idxstop = std::chrono::high_resolution_clock::now();
     if(verbosity >= DEBUG) {
         std::fprintf(stderr, "Indexed in: %gms\n", std::chrono::duration<double, std::milli>(idxstop - idxstart).count());
     }
-    if(indexing_compressed && (opts.fd_level_ == 0.5)) {
-        THROW_EXCEPTION(std::runtime_error("Error: Dashing2 can only perform LSH-assisted analyses using registers of at least 1 byte."));
-    }
     // Build neighbor lists
-    // Currently parallelizing the outer loop,
-    // but the inner might be worth trying
-    OMP_PFOR_DYN
-    for(size_t id = 0; id < ns; ++id) {
-        std::tuple<std::vector<LSHIDType>, std::vector<uint32_t>, std::vector<uint32_t>> query_res;
-        if(indexing_compressed && opts.fd_level_ >= 1. && opts.fd_level_ < sizeof(RegT) && opts.kmer_result_ < FULL_MMER_SET) {
-            switch(int(opts.fd_level_)) {
+    // Each thread appends the candidates for both ends of every pair it finds to its own buffer,
+    // and once the buffers hold CANDIDATES_PER_ROUND candidates, or the queries are done, flush_candidates merges them into the lists.
+    // Queries go in small rounds, so that the buffers overshoot that by little even when every query returns ntoquery candidates.
+    static constexpr size_t CANDIDATES_PER_ROUND = size_t(1) << 24;
+    const int nt = std::max(OMP_ELSE(omp_get_max_threads(), 1), 1);
+    const size_t round_size = std::clamp(CANDIDATES_PER_ROUND / (2 * std::max(ntoquery, size_t(1))), size_t(nt), size_t(nt) * 64);
+    std::vector<std::vector<Candidate>> candidate_bufs(nt);
+    std::vector<Candidate> sorted_candidates;
+    for(size_t round_start = 0; round_start < ns; round_start += round_size) {
+        const size_t round_end = std::min(ns, round_start + round_size);
+        OMP_PRAGMA("omp parallel for schedule(dynamic) num_threads(nt)")
+        for(size_t id = round_start; id < round_end; ++id) {
+            auto &buf = candidate_bufs[OMP_ELSE(omp_get_thread_num(), 0)];
+            std::tuple<std::vector<LSHIDType>, std::vector<uint32_t>, std::vector<uint32_t>> query_res;
+            if(indexing_compressed && opts.fd_level_ >= 1. && opts.fd_level_ < sizeof(RegT) && opts.kmer_result_ < FULL_MMER_SET) {
+                switch(int(opts.fd_level_)) {
 #define CASE_N(i, TYPE) \
-        case i: {query_res = idx.query_candidates(\
-            minispan<TYPE>((TYPE *)opts.compressed_ptr_ + opts.sketchsize_ * id, opts.sketchsize_),\
-            ntoquery);\
-        } break
-               ALL_CASE_NS
+            case i: {query_res = idx.query_candidates(\
+                minispan<TYPE>((TYPE *)opts.compressed_ptr_ + opts.sketchsize_ * id, opts.sketchsize_),\
+                ntoquery);\
+            } break
+                   ALL_CASE_NS
 #undef CASE_N
+                }
+            } else {
+                query_res = idx.query_candidates(minispan<RegT>(&result.signatures_[opts.sketchsize_ * id], opts.sketchsize_), ntoquery);
+            }
+            auto &[ids, counts, npr] = query_res;
+            const size_t idn = ids.size();
+            for(size_t j = 0; j < idn; ++j) {
+                const LSHIDType oid = ids[j];
+                if(id == oid) continue; // Don't track one's self
+                const auto cd(-LSHDistType(counts[j]));
+                buf.push_back(Candidate{oid, LSHIDType(id), cd});
+                buf.push_back(Candidate{LSHIDType(id), oid, cd});
+            }
+            if(verbosity >= DEBUG) {
+                std::fprintf(stderr, "Processed candidates for %zu/%zu\n", id, ns);
             }
-        } else {
-            query_res = idx.query_candidates(minispan<RegT>(&result.signatures_[opts.sketchsize_ * id], opts.sketchsize_), ntoquery);
-        }
-        auto &[ids, counts, npr] = query_res;
-        const size_t idn = ids.size();
-        for(size_t j = 0; j < idn; ++j) {
-            const LSHIDType oid = ids[j];
-            if(id == oid) continue; // Don't track one's self
-            const auto cd(-LSHDistType(counts[j]));
-            update(neighbor_lists[oid], neighbor_sets[oid], PairT{cd, id}, topk, ntoquery, mutexes[oid]);
-            update(neighbor_lists[id], neighbor_sets[id], PairT{cd, oid}, topk, ntoquery, mutexes[id]);
-        }
-        if(verbosity >= DEBUG) {
-            std::fprintf(stderr, "Processed candidates for %zu/%zu\n", id, ns);
         }
+        size_t nbuffered = 0;
+        for(const auto &buf: candidate_bufs) nbuffered += buf.size();
+        if(nbuffered >= CANDIDATES_PER_ROUND || round_end == ns)
+            flush_candidates(candidate_bufs, sorted_candidates, neighbor_lists, topk, ntoquery);
     }
     if(verbosity >= DEBUG) {
         std::fprintf(stderr, "Built neighbor lists.\n");
     }
-    OMP_PFOR_DYN
-    for(size_t i = 0; i < ns; ++i)
-        neighbor_lists[i].sort();
+    OMP_PRAGMA("omp parallel num_threads(nt)")
+    {
+        std::vector<uint32_t> seen(topk <= 0 ? ns: 0);
+        OMP_PRAGMA("omp for schedule(dynamic)")
+        for(size_t i = 0; i < ns; ++i)
+            finish_neighbors(neighbor_lists[i], topk, seen, i + 1);
+    }
     if(verbosity >= DEBUG) {
         std::fprintf(stderr, "Sorted neighbor lists.\n");
     }
@@ -172,8 +257,6 @@ std::vector<pqueue> build_exact_graph(SetSketchIndex<LSHIDType, LSHIDType> &, co
     if(opts.output_kind_ == KNN_GRAPH && opts.num_neighbors_ > 0)
         for(auto &n: neighbor_lists)
             n.reserve(opts.num_neighbors_);
-    std::vector<flat_hash_set<LSHIDType>> neighbor_sets(ns);
-    std::unique_ptr<std::mutex[]> mutexes(new std::mutex[ns]);
     auto idxstart = std::chrono::high_resolution_clock::now();
     auto idxstop = std::chrono::high_resolution_clock::now();
     // Build neighbor lists
@@ -28,6 +28,8 @@ struct pqueue: public std::priority_queue<PairT> {
 };
 
 
+// Creates an empty LSH index with the table layout selected by opts (see --nLSH)
+SetSketchIndex<LSHIDType, LSHIDType> make_index(const Dashing2DistOptions &opts);
 std::vector<pqueue> build_index(SetSketchIndex<LSHIDType, LSHIDType> &idx, const Dashing2DistOptions &opts, const SketchingResult &result);
 std::vector<pqueue> build_exact_graph(SetSketchIndex<LSHIDType, LSHIDType> &, const Dashing2DistOptions &opts, const SketchingResult &result);
 
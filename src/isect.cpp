@@ -0,0 +1,305 @@
+#include "isect.h"
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define D2_ISECT_X86 1
+#include <immintrin.h>
+#else
+#define D2_ISECT_X86 0
+#endif
+
+namespace dashing2 {
+using u128_t = __uint128_t;
+
+// Above this ratio of set sizes, galloping through the larger set beats merging
+static constexpr size_t GALLOP_RATIO = 32;
+// Below this ratio, too few blocks can be skipped for block merges to beat the branch-free scalar merge (test/isectbench)
+static constexpr size_t BLOCK_RATIO = 8;
+
+static IntersectKernel detect_kernel() noexcept {
+#if D2_ISECT_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return IntersectKernel::AVX512;
+    if(__builtin_cpu_supports("avx2")) return IntersectKernel::AVX2;
+#endif
+    return IntersectKernel::SCALAR;
+}
+static const IntersectKernel best_kernel = detect_kernel();
+static IntersectKernel active_kernel = best_kernel;
+
+IntersectKernel intersection_kernel() noexcept {return active_kernel;}
+bool intersection_kernel(IntersectKernel kernel) noexcept {
+    if(static_cast<int>(kernel) > static_cast<int>(best_kernel)) return false;
+    active_kernel = kernel;
+    return true;
+}
+const char *to_string(IntersectKernel kernel) noexcept {
+    switch(kernel) {
+        case IntersectKernel::MERGE: return "merge";
+        case IntersectKernel::SCALAR: return "scalar";
+        case IntersectKernel::AVX2: return "avx2";
+        case IntersectKernel::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+template<bool KAHAN>
+struct Accumulator {
+    double sum = 0., carry = 0.;
+    inline void add(double x) {
+        if constexpr(KAHAN) {
+            const double y = x - carry;
+            const double t = sum + y;
+            carry = (t - sum) - y;
+            sum = t;
+        } else sum += x;
+    }
+};
+
+// Ops are called with (lhs index, rhs index) for every shared key
+struct CountOp {
+    size_t n = 0;
+    inline void operator()(size_t, size_t) {++n;}
+    // Block kernels add whole match masks at once
+    inline void add_mask(uint64_t m) {n += __builtin_popcountll(m);}
+};
+template<typename Op>
+static constexpr bool is_count_v = std::is_same_v<Op, CountOp>;
+template<bool KAHAN>
+struct MinOp: public Accumulator<KAHAN> {
+    const double *lc, *rc;
+    MinOp(const double *l, const double *r): lc(l), rc(r) {}
+    inline void operator()(size_t i, size_t j) {this->add(std::min(lc[i], rc[j]));}
+};
+template<bool KAHAN>
+struct DotOp: public Accumulator<KAHAN> {
+    const double *lc, *rc;
+    DotOp(const double *l, const double *r): lc(l), rc(r) {}
+    inline void operator()(size_t i, size_t j) {this->add(lc[i] * rc[j]);}
+};
+
+template<typename T, typename Op>
+static inline void merge_scalar(const T *a, size_t na, size_t i, const T *b, size_t nb, size_t j, Op &op) {
+    // Advances are branch-free, since whether keys match or which is smaller is unpredictable in dense intersections
+    while(i < na && j < nb) {
+        const T x = a[i], y = b[j];
+        if constexpr(is_count_v<Op>) op.n += x == y;
+        else if(x == y) op(i, j);
+        i += x <= y;
+        j += y <= x;
+    }
+}
+
+// Searches for each key of the small set a in the large set b with exponential steps followed by binary search.
+// If SWAP, a is the rhs, and op receives indices in (b, a) order.
+template<bool SWAP, typename T, typename Op>
+static void gallop(const T *a, size_t na, const T *b, size_t nb, Op &op) {
+    size_t j = 0;
+    for(size_t i = 0; i < na; ++i) {
+        const T x = a[i];
+        if(b[j] < x) {
+            // b[lo] < x
+            size_t lo = j, step = 1, hi = j + 1;
+            while(hi < nb && b[hi] < x) {
+                lo = hi;
+                step <<= 1;
+                hi = lo + step;
+            }
+            j = std::lower_bound(b + lo + 1, b + std::min(hi, nb), x) - b;
+            if(j == nb) return;
+        }
+        if(b[j] == x) {
+            if constexpr(SWAP) op(j, i); else op(i, j);
+            if(++j == nb) return;
+        }
+    }
+}
+
+#if D2_ISECT_X86
+/*
+ * Block merges: compare a block of keys from a against every rotation of a block from b,
+ * then advance whichever block ends with the smaller key (or both, if equal).
+ * Keys are unique within each set, so each match is reported exactly once.
+ */
+template<typename Op>
+__attribute__((target("avx2")))
+static void block_avx2(const uint64_t *a, size_t na, const uint64_t *b, size_t nb, Op &op) {
+    size_t i = 0, j = 0;
+    while(i + 4 <= na && j + 4 <= nb) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+        // Lane k of rotation r holds b[j + ((k + r) & 3)]
+        unsigned masks[4];
+        for(unsigned r = 0; r < 4; ++r) {
+            masks[r] = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(va, vb)));
+            vb = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        }
+        const unsigned any = masks[0] | masks[1] | masks[2] | masks[3];
+        if constexpr(is_count_v<Op>) op.add_mask(any);
+        else if(any) {
+            for(unsigned r = 0; r < 4; ++r) {
+                for(unsigned m = masks[r]; m; m &= m - 1) {
+                    const unsigned k = __builtin_ctz(m);
+                    op(i + k, j + ((k + r) & 3));
+                }
+            }
+        }
+        const uint64_t amax = a[i + 3], bmax = b[j + 3];
+        i += (amax <= bmax) * 4;
+        j += (bmax <= amax) * 4;
+    }
+    merge_scalar(a, na, i, b, nb, j, op);
+}
+
+template<typename Op>
+__attribute__((target("avx2")))
+static void block_avx2(const u128_t *a, size_t na, const u128_t *b, size_t nb, Op &op) {
+    size_t i = 0, j = 0;
+    while(i + 2 <= na && j + 2 <= nb) {
+        const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+        // A key matches if both of its 64-bit halves do
+        unsigned masks[2];
+        for(unsigned r = 0; r < 2; ++r) {
+            const unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(va, vb)));
+            masks[r] = m & (m >> 1) & 0x5u;
+            vb = _mm256_permute4x64_epi64(vb, _MM_SHUFFLE(1, 0, 3, 2));
+        }
+        const unsigned any = masks[0] | masks[1];
+        if constexpr(is_count_v<Op>) op.add_mask(any);
+        else if(any) {
+            for(unsigned r = 0; r < 2; ++r) {
+                for(unsigned m = masks[r]; m; m &= m - 1) {
+                    const unsigned k = __builtin_ctz(m) >> 1;
+                    op(i + k, j + ((k + r) & 1));
+                }
+            }
+        }
+        const u128_t amax = a[i + 1], bmax = b[j + 1];
+        i += (amax <= bmax) * 2;
+        j += (bmax <= amax) * 2;
+    }
+    merge_scalar(a, na, i, b, nb, j, op);
+}
+
+// Rotations use two-source permutes, whose intrinsics (unlike the one-source ones) take no undefined pass-through operand,
+// which GCC otherwise reports as maybe-uninitialized once inlined.
+template<typename Op>
+__attribute__((target("avx512f")))
+static void block_avx512(const uint64_t *a, size_t na, const uint64_t *b, size_t nb, Op &op) {
+    const __m512i rot = _mm512_set_epi64(0, 7, 6, 5, 4, 3, 2, 1);
+    size_t i = 0, j = 0;
+    while(i + 8 <= na && j + 8 <= nb) {
+        const __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + j);
+        unsigned masks[8];
+        for(unsigned r = 0; r < 8; ++r) {
+            masks[r] = _mm512_cmpeq_epi64_mask(va, vb);
+            vb = _mm512_permutex2var_epi64(vb, rot, vb);
+        }
+        const unsigned any = masks[0] | masks[1] | masks[2] | masks[3] | masks[4] | masks[5] | masks[6] | masks[7];
+        if constexpr(is_count_v<Op>) op.add_mask(any);
+        else if(any) {
+            for(unsigned r = 0; r < 8; ++r) {
+                for(unsigned m = masks[r]; m; m &= m - 1) {
+                    const unsigned k = __builtin_ctz(m);
+                    op(i + k, j + ((k + r) & 7));
+                }
+            }
+        }
+        const uint64_t amax = a[i + 7], bmax = b[j + 7];
+        i += (amax <= bmax) * 8;
+        j += (bmax <= amax) * 8;
+    }
+    merge_scalar(a, na, i, b, nb, j, op);
+}
+
+template<typename Op>
+__attribute__((target("avx512f")))
+static void block_avx512(const u128_t *a, size_t na, const u128_t *b, size_t nb, Op &op) {
+    const __m512i rot = _mm512_set_epi64(1, 0, 7, 6, 5, 4, 3, 2);
+    size_t i = 0, j = 0;
+    while(i + 4 <= na && j + 4 <= nb) {
+        const __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + j);
+        unsigned masks[4];
+        for(unsigned r = 0; r < 4; ++r) {
+            const unsigned m = _mm512_cmpeq_epi64_mask(va, vb);
+            masks[r] = m & (m >> 1) & 0x55u;
+            vb = _mm512_permutex2var_epi64(vb, rot, vb);
+        }
+        const unsigned any = masks[0] | masks[1] | masks[2] | masks[3];
+        if constexpr(is_count_v<Op>) op.add_mask(any);
+        else if(any) {
+            for(unsigned r = 0; r < 4; ++r) {
+                for(unsigned m = masks[r]; m; m &= m - 1) {
+                    const unsigned k = __builtin_ctz(m) >> 1;
+                    op(i + k, j + ((k + r) & 3));
+                }
+            }
+        }
+        const u128_t amax = a[i + 3], bmax = b[j + 3];
+        i += (amax <= bmax) * 4;
+        j += (bmax <= amax) * 4;
+    }
+    merge_scalar(a, na, i, b, nb, j, op);
+}
+#endif
+
+template<typename T, typename Op>
+static void intersect(const T *a, size_t na, const T *b, size_t nb, Op &op) {
+    if(!na || !nb) return;
+    const IntersectKernel kernel = active_kernel;
+    if(kernel != IntersectKernel::MERGE) {
+        if(na * GALLOP_RATIO < nb) return gallop<false>(a, na, b, nb, op);
+        if(nb * GALLOP_RATIO < na) return gallop<true>(b, nb, a, na, op);
+    }
+    const bool blocks = std::max(na, nb) >= BLOCK_RATIO * std::min(na, nb);
+    switch(blocks ? kernel: IntersectKernel::MERGE) {
+#if D2_ISECT_X86
+        case IntersectKernel::AVX512: return block_avx512(a, na, b, nb, op);
+        case IntersectKernel::AVX2: return block_avx2(a, na, b, nb, op);
+#endif
+        default: return merge_scalar(a, na, size_t(0), b, nb, size_t(0), op);
+    }
+}
+
+template<typename T>
+static size_t count_(const T *a, size_t na, const T *b, size_t nb) {
+    CountOp op;
+    intersect(a, na, b, nb, op);
+    return op.n;
+}
+template<template<bool> class OpT, typename T>
+static double accumulate_(const T *a, const double *ac, size_t na, const T *b, const double *bc, size_t nb, bool kahan) {
+    if(kahan) {
+        OpT<true> op(ac, bc);
+        intersect(a, na, b, nb, op);
+        return op.sum;
+    }
+    OpT<false> op(ac, bc);
+    intersect(a, na, b, nb, op);
+    return op.sum;
+}
+
+size_t intersect_count(const uint64_t *lptr, size_t lhl, const uint64_t *rptr, size_t rhl) noexcept {
+    return count_(lptr, lhl, rptr, rhl);
+}
+size_t intersect_count(const u128_t *lptr, size_t lhl, const u128_t *rptr, size_t rhl) noexcept {
+    return count_(lptr, lhl, rptr, rhl);
+}
+double intersect_min_sum(const uint64_t *lptr, const double *lnptr, size_t lhl, const uint64_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept {
+    return accumulate_<MinOp>(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+}
+double intersect_min_sum(const u128_t *lptr, const double *lnptr, size_t lhl, const u128_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept {
+    return accumulate_<MinOp>(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+}
+double intersect_dot(const uint64_t *lptr, const double *lnptr, size_t lhl, const uint64_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept {
+    return accumulate_<DotOp>(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+}
+double intersect_dot(const u128_t *lptr, const double *lnptr, size_t lhl, const u128_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept {
+    return accumulate_<DotOp>(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+}
+
+} // namespace dashing2
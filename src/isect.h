@@ -0,0 +1,41 @@
+#pragma once
+#ifndef DASHING2_ISECT_H__
+#define DASHING2_ISECT_H__
+#include <cstddef>
+#include <cstdint>
+
+namespace dashing2 {
+
+/*
+ * Intersection kernels for sorted, duplicate-free k-mer sets.
+ *
+ * Sets of similar sizes are merged key by key, sets whose sizes differ by 8-32x in blocks
+ * (4 or 8 keys at a time with AVX2/AVX-512, comparing every pair in a block), where most blocks can be skipped,
+ * and sets of very different sizes are intersected by galloping through the larger set.
+ * The kernel is selected at runtime from the CPU's features.
+ */
+enum class IntersectKernel: int {
+    MERGE,  // Scalar two-pointer merge; the reference implementation
+    SCALAR, // Scalar merge, galloping for skewed sizes
+    AVX2,
+    AVX512
+};
+// Returns the kernel in use
+IntersectKernel intersection_kernel() noexcept;
+// Overrides the kernel, e.g. for benchmarking. Returns false (and changes nothing) if the CPU does not support it.
+bool intersection_kernel(IntersectKernel kernel) noexcept;
+const char *to_string(IntersectKernel kernel) noexcept;
+
+// Number of shared keys
+size_t intersect_count(const uint64_t *lptr, size_t lhl, const uint64_t *rptr, size_t rhl) noexcept;
+size_t intersect_count(const __uint128_t *lptr, size_t lhl, const __uint128_t *rptr, size_t rhl) noexcept;
+// Sum over shared keys of min(lhs count, rhs count)
+double intersect_min_sum(const uint64_t *lptr, const double *lnptr, size_t lhl, const uint64_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept;
+double intersect_min_sum(const __uint128_t *lptr, const double *lnptr, size_t lhl, const __uint128_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept;
+// Sum over shared keys of (lhs count * rhs count)
+double intersect_dot(const uint64_t *lptr, const double *lnptr, size_t lhl, const uint64_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept;
+double intersect_dot(const __uint128_t *lptr, const double *lnptr, size_t lhl, const __uint128_t *rptr, const double *rnptr, size_t rhl, bool kahan) noexcept;
+
+} // namespace dashing2
+
+#endif
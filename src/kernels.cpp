@@ -0,0 +1,352 @@
+#include "kernels.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+namespace dashing2 {
+
+/*
+ * Kernel bodies are written once, as always-inlined templates, and instantiated by wrappers compiled for each ISA level
+ * with target attributes, where the compiler vectorizes them at that level's width.
+ * Wrappers have internal linkage and call nothing out of line, so that no code for a higher level
+ * can be shared with (or substituted for) code compiled for the build's target.
+ */
+namespace {
+
+#define INLINE_LAMBDA __attribute__((always_inline))
+
+template<size_t N> struct UIntOfSize;
+template<> struct UIntOfSize<1> {using type = uint8_t;};
+template<> struct UIntOfSize<2> {using type = uint16_t;};
+template<> struct UIntOfSize<4> {using type = uint32_t;};
+template<> struct UIntOfSize<8> {using type = uint64_t;};
+
+/*
+ * Counts are accumulated in 64 bytes of lanes as wide as the values compared, which vectorize at any width,
+ * and flushed before they can overflow. f(i, lanes) adds the counts for items [i, i + 64 / sizeof(T)).
+ */
+template<typename T, size_t NC, typename F>
+INLINE void lane_counts(size_t n, uint64_t *ret, const F &f) {
+    using C = typename UIntOfSize<sizeof(T)>::type;
+    static constexpr size_t L = 64 / sizeof(T);
+    static constexpr size_t MAXSTEPS = sizeof(C) >= 4 ? size_t(1) << 30: size_t(std::numeric_limits<C>::max()) / 2;
+    C lanes[NC][L];
+    size_t i = 0;
+    while(n - i >= L) {
+        std::memset(lanes, 0, sizeof(lanes));
+        for(size_t steps = 0; steps < MAXSTEPS && n - i >= L; ++steps, i += L)
+            f(i, lanes);
+        for(size_t c = 0; c < NC; ++c)
+            for(size_t j = 0; j < L; ++j) ret[c] += lanes[c][j];
+    }
+}
+
+template<typename T>
+INLINE uint64_t count_eq_body(const T *__restrict__ lhs, const T *__restrict__ rhs, size_t n) {
+    using C = typename UIntOfSize<sizeof(T)>::type;
+    static constexpr size_t L = 64 / sizeof(T);
+    uint64_t ret = 0;
+    lane_counts<T, 1>(n, &ret, [lhs,rhs](size_t i, C (*lanes)[L]) INLINE_LAMBDA {
+        for(size_t j = 0; j < L; ++j) lanes[0][j] += lhs[i + j] == rhs[i + j];
+    });
+    for(size_t i = n - n % L; i < n; ++i) ret += lhs[i] == rhs[i];
+    return ret;
+}
+
+// Floating-point comparisons vectorize better into 64-bit counts than into lanes
+template<typename T>
+INLINE std::pair<uint64_t, uint64_t> count_gtlt_body(const T *__restrict__ lhs, const T *__restrict__ rhs, size_t n) {
+    uint64_t ret[2]{0, 0};
+    if constexpr(std::is_floating_point_v<T>) {
+        for(size_t i = 0; i < n; ++i) {
+            ret[0] += lhs[i] > rhs[i];
+            ret[1] += lhs[i] < rhs[i];
+        }
+    } else {
+        using C = typename UIntOfSize<sizeof(T)>::type;
+        static constexpr size_t L = 64 / sizeof(T);
+        lane_counts<T, 2>(n, ret, [lhs,rhs](size_t i, C (*lanes)[L]) INLINE_LAMBDA {
+            for(size_t j = 0; j < L; ++j) {
+                lanes[0][j] += lhs[i + j] > rhs[i + j];
+                lanes[1][j] += lhs[i + j] < rhs[i + j];
+            }
+        });
+        for(size_t i = n - n % L; i < n; ++i) {
+            ret[0] += lhs[i] > rhs[i];
+            ret[1] += lhs[i] < rhs[i];
+        }
+    }
+    return {ret[0], ret[1]};
+}
+
+INLINE uint64_t count_eq_nibbles_body(const uint8_t *__restrict__ lhs, const uint8_t *__restrict__ rhs, size_t n) {
+    const size_t nb = n / 2;
+    uint64_t ret = 0;
+    lane_counts<uint8_t, 1>(nb, &ret, [lhs,rhs](size_t i, uint8_t (*lanes)[64]) INLINE_LAMBDA {
+        for(size_t j = 0; j < 64; ++j) {
+            const uint8_t x = lhs[i + j] ^ rhs[i + j];
+            lanes[0][j] += ((x & 0xfu) == 0) + ((x >> 4) == 0);
+        }
+    });
+    for(size_t i = nb - nb % 64; i < nb; ++i) {
+        const uint8_t x = lhs[i] ^ rhs[i];
+        ret += ((x & 0xfu) == 0) + ((x >> 4) == 0);
+    }
+    if(n & 1) ret += ((lhs[nb] ^ rhs[nb]) & 0xfu) == 0;
+    return ret;
+}
+
+INLINE std::pair<uint64_t, uint64_t> count_gtlt_nibbles_body(const uint8_t *__restrict__ lhs, const uint8_t *__restrict__ rhs, size_t n) {
+    const size_t nb = n / 2;
+    uint64_t ret[2]{0, 0};
+    auto add = [](uint8_t x, uint8_t y, auto &gt, auto &lt) INLINE_LAMBDA {
+        const uint8_t xl = x & 0xfu, xh = x >> 4, yl = y & 0xfu, yh = y >> 4;
+        gt += (xl > yl) + (xh > yh);
+        lt += (xl < yl) + (xh < yh);
+    };
+    lane_counts<uint8_t, 2>(nb, ret, [lhs,rhs,add](size_t i, uint8_t (*lanes)[64]) INLINE_LAMBDA {
+        for(size_t j = 0; j < 64; ++j) add(lhs[i + j], rhs[i + j], lanes[0][j], lanes[1][j]);
+    });
+    for(size_t i = nb - nb % 64; i < nb; ++i) add(lhs[i], rhs[i], ret[0], ret[1]);
+    if(n & 1) {
+        const uint8_t xl = lhs[nb] & 0xfu, yl = rhs[nb] & 0xfu;
+        ret[0] += xl > yl;
+        ret[1] += xl < yl;
+    }
+    return {ret[0], ret[1]};
+}
+
+template<typename T> INLINE uint64_t reg2sig(const T x) {
+    if constexpr(sizeof(T) <= 4) {
+        uint32_t v = 0;
+        std::memcpy(&v, &x, sizeof(T));
+        return sketch::hash::WangHash::hash(v ^ 0xa3407fb23cd20eful);
+    }
+    uint64_t v;
+    std::memcpy(&v, &x, sizeof(uint64_t));
+    uint64_t hashvalue = sketch::hash::WangHash::hash(v ^ 0xa3407fb23cd20eful);
+    if constexpr(sizeof(T) == 8) {
+        return hashvalue;
+    }
+    for(size_t i = 1; i < sizeof(T) / sizeof(uint64_t); ++i) {
+        std::memcpy(&v, &x, sizeof(uint64_t));
+        const uint64_t new_hash_value = sketch::hash::WangHash::hash(v ^ hashvalue);
+        hashvalue ^= new_hash_value;
+    }
+    return hashvalue;
+}
+
+// Keeps the top bits of each signature at widths of 1, 2 and 4 bytes, and the low 4 bits for nibbles
+template<typename Sig>
+INLINE void pack_bbit_body(const Sig &getsig, size_t n, int width, void *out) {
+    switch(width) {
+        case 1: {
+            uint8_t *const ptr = static_cast<uint8_t *>(out);
+            for(size_t i = 0; i < n / 2; ++i)
+                ptr[i] = (getsig(2 * i) & 0xfu) | ((getsig(2 * i + 1) & 0xfu) << 4);
+            break;
+        }
+        case 2: for(size_t i = 0; i < n; ++i) static_cast<uint8_t *>(out)[i] = getsig(i) >> 58; break;
+        case 4: for(size_t i = 0; i < n; ++i) static_cast<uint16_t *>(out)[i] = getsig(i) >> 48; break;
+        case 8: for(size_t i = 0; i < n; ++i) static_cast<uint32_t *>(out)[i] = getsig(i) >> 32; break;
+        case 16: for(size_t i = 0; i < n; ++i) static_cast<uint64_t *>(out)[i] = getsig(i); break;
+        default: __builtin_unreachable();
+    }
+}
+
+INLINE void pack_setsketch_body(const RegT *sigs, size_t n, int width, long double a, long double logbinv, long double q, void *out) {
+    if(width == 1) {
+        for(size_t i = 0; i < n / 2; ++i) {
+            const auto lowerv = std::max((1.L - std::log(sigs[2 * i] / a) * logbinv), 0.L);
+            const auto higherv = std::max((1.L - std::log(sigs[2 * i + 1] / a) * logbinv), 0.L);
+            const uint8_t lower_half = std::max(0, std::min(int(q) + 1, static_cast<int>(lowerv)));
+            const uint8_t upper_half = std::max(0, std::min(int(q) + 1, static_cast<int>(higherv))) << 4;
+            static_cast<uint8_t *>(out)[i] = lower_half | upper_half;
+        }
+        return;
+    }
+    for(size_t i = 0; i < n; ++i) {
+        const long double sub = 1.L - std::log(static_cast<long double>(sigs[i]) / a) * logbinv;
+        if(width == 16) {
+            static_cast<uint64_t *>(out)[i] = std::min(uint64_t(q + 1), uint64_t(sub));
+        } else {
+            const int64_t isub = std::max(int64_t(0), std::min(int64_t(q + 1), static_cast<int64_t>(sub)));
+            if(width == 8)      static_cast<uint32_t *>(out)[i] = isub;
+            else if(width == 4) static_cast<uint16_t *>(out)[i] = isub;
+            else                static_cast<uint8_t *>(out)[i] = isub;
+        }
+    }
+}
+
+INLINE void mask_kmers_body(uint64_t *__restrict__ kmers, size_t n, uint64_t xormask) {
+    for(size_t i = 0; i < n; ++i)
+        kmers[i] = sketch::hash::WangHash::hash(kmers[i] ^ xormask);
+}
+
+// Branch-free, so that each loop vectorizes without F16C or AVX512-BF16
+INLINE uint16_t float2half(float x) {
+    uint32_t f;
+    std::memcpy(&f, &x, sizeof(f));
+    const uint32_t sign = (f >> 16) & 0x8000u;
+    f &= 0x7fffffffu;
+    // Subnormal halves: adding 0.5 aligns the mantissa so that the float addition rounds it
+    float sub;
+    std::memcpy(&sub, &f, sizeof(sub));
+    sub += 0.5f;
+    uint32_t subbits;
+    std::memcpy(&subbits, &sub, sizeof(subbits));
+    const uint32_t subnormal = subbits - 0x3f000000u;
+    // Normal halves: rebias the exponent and round the mantissa to nearest even
+    const uint32_t normal = (f + 0xc8000fffu + ((f >> 13) & 1u)) >> 13;
+    const uint32_t ret = f > 0x7f800000u ? 0x7e00u: f >= 0x47800000u ? 0x7c00u: f < 0x38800000u ? subnormal: normal;
+    return ret | sign;
+}
+INLINE uint16_t float2bf16(float x) {
+    uint32_t f;
+    std::memcpy(&f, &x, sizeof(f));
+    const uint32_t rounded = (f + 0x7fffu + ((f >> 16) & 1u)) >> 16;
+    return (f & 0x7fffffffu) > 0x7f800000u ? (f >> 16) | 0x40u: rounded;
+}
+template<typename T>
+INLINE T float2fixed(float x) {
+    // The product is exact in double precision, so that rounding matches rounding the exact value
+    static constexpr double MAXV = std::numeric_limits<T>::max();
+    const float c = x > 0.f ? (x < 1.f ? x: 1.f): 0.f;
+    return T(double(c) * MAXV + .5);
+}
+INLINE void encode_floats_body(const float *__restrict__ src, size_t n, MatrixEncoding enc, void *__restrict__ out) {
+    switch(enc) {
+        case ENCODE_F32: std::memcpy(out, src, n * sizeof(float)); break;
+        case ENCODE_F16: for(size_t i = 0; i < n; ++i) static_cast<uint16_t *>(out)[i] = float2half(src[i]); break;
+        case ENCODE_BF16: for(size_t i = 0; i < n; ++i) static_cast<uint16_t *>(out)[i] = float2bf16(src[i]); break;
+        case ENCODE_U8: for(size_t i = 0; i < n; ++i) static_cast<uint8_t *>(out)[i] = float2fixed<uint8_t>(src[i]); break;
+        case ENCODE_U16: for(size_t i = 0; i < n; ++i) static_cast<uint16_t *>(out)[i] = float2fixed<uint16_t>(src[i]); break;
+        default: __builtin_unreachable();
+    }
+}
+
+#define D2_DEFINE_KERNELS(ISA, NAME, LEVEL, ...) \
+namespace ISA {\
+__VA_ARGS__ uint64_t count_eq_u8(const uint8_t *l, const uint8_t *r, size_t n) {return count_eq_body(l, r, n);}\
+__VA_ARGS__ uint64_t count_eq_u16(const uint16_t *l, const uint16_t *r, size_t n) {return count_eq_body(l, r, n);}\
+__VA_ARGS__ uint64_t count_eq_u32(const uint32_t *l, const uint32_t *r, size_t n) {return count_eq_body(l, r, n);}\
+__VA_ARGS__ uint64_t count_eq_u64(const uint64_t *l, const uint64_t *r, size_t n) {return count_eq_body(l, r, n);}\
+__VA_ARGS__ uint64_t count_eq_f32(const float *l, const float *r, size_t n) {\
+    return count_eq_body(reinterpret_cast<const uint32_t *>(l), reinterpret_cast<const uint32_t *>(r), n);\
+}\
+__VA_ARGS__ uint64_t count_eq_f64(const double *l, const double *r, size_t n) {\
+    return count_eq_body(reinterpret_cast<const uint64_t *>(l), reinterpret_cast<const uint64_t *>(r), n);\
+}\
+__VA_ARGS__ uint64_t count_eq_nibbles(const uint8_t *l, const uint8_t *r, size_t n) {return count_eq_nibbles_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_u8(const uint8_t *l, const uint8_t *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_u16(const uint16_t *l, const uint16_t *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_u32(const uint32_t *l, const uint32_t *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_u64(const uint64_t *l, const uint64_t *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_f32(const float *l, const float *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_f64(const double *l, const double *r, size_t n) {return count_gtlt_body(l, r, n);}\
+__VA_ARGS__ std::pair<uint64_t, uint64_t> count_gtlt_nibbles(const uint8_t *l, const uint8_t *r, size_t n) {return count_gtlt_nibbles_body(l, r, n);}\
+__VA_ARGS__ void pack_bbit_kmers(const uint64_t *kmers, size_t n, int width, void *out) {\
+    pack_bbit_body([kmers](size_t i) INLINE_LAMBDA {return sketch::hash::WangHash::hash(kmers[i]);}, n, width, out);\
+}\
+__VA_ARGS__ void pack_bbit_regs(const RegT *sigs, size_t n, int width, void *out) {\
+    pack_bbit_body([sigs](size_t i) INLINE_LAMBDA {return reg2sig(sigs[i]);}, n, width, out);\
+}\
+__VA_ARGS__ void pack_setsketch(const RegT *sigs, size_t n, int width, long double a, long double logbinv, long double q, void *out) {\
+    pack_setsketch_body(sigs, n, width, a, logbinv, q, out);\
+}\
+__VA_ARGS__ void mask_kmers(uint64_t *kmers, size_t n, uint64_t xormask) {mask_kmers_body(kmers, n, xormask);}\
+__VA_ARGS__ void encode_floats(const float *src, size_t n, MatrixEncoding enc, void *out) {encode_floats_body(src, n, enc, out);}\
+const KernelTable table {NAME, LEVEL,\
+    count_eq_u8, count_eq_u16, count_eq_u32, count_eq_u64, count_eq_f32, count_eq_f64, count_eq_nibbles,\
+    count_gtlt_u8, count_gtlt_u16, count_gtlt_u32, count_gtlt_u64, count_gtlt_f32, count_gtlt_f64, count_gtlt_nibbles,\
+    pack_bbit_kmers, pack_bbit_regs, pack_setsketch, mask_kmers, encode_floats};\
+}
+
+// The build's own target
+#if __AVX512BW__
+#define D2_BASELINE_ISA "baseline (avx512bw)"
+#elif __AVX2__
+#define D2_BASELINE_ISA "baseline (avx2)"
+#elif __AVX__
+#define D2_BASELINE_ISA "baseline (avx)"
+#elif __SSE4_1__
+#define D2_BASELINE_ISA "baseline (sse4.1)"
+#elif __SSE2__
+#define D2_BASELINE_ISA "baseline (sse2)"
+#else
+#define D2_BASELINE_ISA "baseline"
+#endif
+D2_DEFINE_KERNELS(baseline, D2_BASELINE_ISA, ISA_BASELINE)
+#if D2_HAS_DISPATCH
+D2_DEFINE_KERNELS(avx2, "avx2", ISA_AVX2, D2_TARGET_AVX2)
+D2_DEFINE_KERNELS(avx512bw, "avx512bw", ISA_AVX512BW, D2_TARGET_AVX512BW)
+#endif
+#undef D2_DEFINE_KERNELS
+#undef INLINE_LAMBDA
+
+} // anonymous namespace
+
+std::vector<std::pair<const KernelTable *, bool>> all_kernels() {
+    std::vector<std::pair<const KernelTable *, bool>> ret{{&baseline::table, true}};
+#if D2_HAS_DISPATCH
+    __builtin_cpu_init();
+    ret.emplace_back(&avx2::table, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt"));
+    ret.emplace_back(&avx512bw::table, ret.back().second && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                                       && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq"));
+#endif
+    return ret;
+}
+
+static const KernelTable &select_kernels() {
+    const auto levels = all_kernels();
+    const KernelTable *ret = &baseline::table;
+    for(const auto &[table, supported]: levels)
+        if(supported) ret = table;
+    if(const char *s = std::getenv("DASHING2_SIMD"); s && *s) {
+        const KernelTable *requested = nullptr;
+        for(const auto &[table, supported]: levels)
+            if(std::strncmp(table->isa_, s, std::strlen(s)) == 0 && supported) requested = table;
+        if(requested) ret = requested;
+        else std::fprintf(stderr, "Warning: DASHING2_SIMD=%s is not a level this CPU supports; using %s\n", s, ret->isa_);
+    }
+    return *ret;
+}
+
+const KernelTable &kernels() {
+    static const KernelTable &ret = select_kernels();
+    return ret;
+}
+
+void report_kernels(std::FILE *fp) {
+    std::fprintf(fp, "#Level\tSupported\n");
+    for(const auto &[table, supported]: all_kernels())
+        std::fprintf(fp, "%s\t%s\n", table->isa_, supported ? "yes": "no");
+    const char *isa = kernels().isa_;
+    std::fprintf(fp, "#Kernel\tSelected\n");
+    for(const char *name: {"count_eq", "count_eq_nibbles", "count_gtlt", "count_gtlt_nibbles", "pack_bbit_kmers", "pack_bbit_regs", "pack_setsketch", "mask_kmers", "encode_floats"})
+        std::fprintf(fp, "%s\t%s\n", name, isa);
+    // Sketching and comparison loops run through dispatched() at the same level
+    std::fprintf(fp, "#Code path\tSelected\n");
+    for(const char *name: {"kmer_encoding", "setsketch_update", "setsketch_update_batch", "setsketch_batch_screen", "oneperm_update", "oneperm_update_batch",
+                           "bigwig_sketch", "compare", "tiled_compare"})
+        std::fprintf(fp, "%s\t%s\n", name, isa);
+    // Everything else runs at the level this binary was compiled for
+#if defined(__AVX512BW__)
+    const char *build_isa = "avx512bw";
+#elif defined(__AVX2__)
+    const char *build_isa = "avx2";
+#elif defined(__AVX__)
+    const char *build_isa = "avx";
+#elif defined(__SSE4_1__)
+    const char *build_isa = "sse4.1";
+#else
+    const char *build_isa = "baseline";
+#endif
+    std::fprintf(fp, "#Everything else\tCompiled for\n");
+    std::fprintf(fp, "other\t%s\n", build_isa);
+}
+
+} // namespace dashing2
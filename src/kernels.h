@@ -0,0 +1,139 @@
+#pragma once
+#ifndef DASHING2_KERNELS_H__
+#define DASHING2_KERNELS_H__
+#include "enums.h"
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+namespace dashing2 {
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define D2_HAS_DISPATCH 1
+#define D2_TARGET_AVX2 __attribute__((target("avx2,bmi2,popcnt")))
+#define D2_TARGET_AVX512BW __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx2,bmi2,popcnt,prefer-vector-width=512")))
+#endif
+
+// ISA levels, from the lowest; levels above the baseline are only compiled in with D2_HAS_DISPATCH
+enum IsaLevel: int {
+    ISA_BASELINE,
+    ISA_AVX2,
+    ISA_AVX512BW
+};
+
+/*
+ * Hot kernels, compiled for several x86 ISA levels and selected at startup
+ *
+ * Everything else, apart from the loops run through dispatched() below, is compiled for the build's target (TARGET_FLAG),
+ * which may be a portable baseline, so that one binary runs everywhere while the hot code runs at full width on each CPU.
+ * The best level the CPU supports is used, unless DASHING2_SIMD names a lower one (baseline, avx2 or avx512bw).
+ * `dashing2 --report-kernels` prints the choice.
+ *
+ * Widths are in bytes per register, times two (1 for nibbles, which are packed two per byte, low nibble first),
+ * as in Dashing2DistOptions::fd_level_ * 2.
+ * count_eq compares floating-point registers bitwise, since they may hold sampled k-mers;
+ * count_gtlt returns (number of lhs > rhs, number of lhs < rhs).
+ */
+struct KernelTable {
+    const char *isa_;
+    IsaLevel level_;
+    uint64_t (*count_eq_u8_)(const uint8_t *, const uint8_t *, size_t);
+    uint64_t (*count_eq_u16_)(const uint16_t *, const uint16_t *, size_t);
+    uint64_t (*count_eq_u32_)(const uint32_t *, const uint32_t *, size_t);
+    uint64_t (*count_eq_u64_)(const uint64_t *, const uint64_t *, size_t);
+    uint64_t (*count_eq_f32_)(const float *, const float *, size_t);
+    uint64_t (*count_eq_f64_)(const double *, const double *, size_t);
+    uint64_t (*count_eq_nibbles_)(const uint8_t *, const uint8_t *, size_t); // n nibbles
+    std::pair<uint64_t, uint64_t> (*count_gtlt_u8_)(const uint8_t *, const uint8_t *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_u16_)(const uint16_t *, const uint16_t *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_u32_)(const uint32_t *, const uint32_t *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_u64_)(const uint64_t *, const uint64_t *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_f32_)(const float *, const float *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_f64_)(const double *, const double *, size_t);
+    std::pair<uint64_t, uint64_t> (*count_gtlt_nibbles_)(const uint8_t *, const uint8_t *, size_t);
+    // b-bit signatures of n sampled k-mers or registers, at the given width; n must be even for nibbles
+    void (*pack_bbit_kmers_)(const uint64_t *kmers, size_t n, int width, void *out);
+    void (*pack_bbit_regs_)(const RegT *sigs, size_t n, int width, void *out);
+    // Truncated setsketch registers: 1 - log_b(sig / a), clamped to [0, q + 1], with logbinv = 1 / log(b)
+    void (*pack_setsketch_)(const RegT *sigs, size_t n, int width, long double a, long double logbinv, long double q, void *out);
+    // k-mers to maskfn(k-mer), in place
+    void (*mask_kmers_)(uint64_t *kmers, size_t n, uint64_t xormask);
+    // Matrix values to the given encoding, rounding to nearest (even); u8 and u16 clamp to [0, 1], and NaN becomes 0
+    void (*encode_floats_)(const float *src, size_t n, MatrixEncoding enc, void *out);
+
+    uint64_t count_eq(const uint8_t *lhs, const uint8_t *rhs, size_t n) const {return count_eq_u8_(lhs, rhs, n);}
+    uint64_t count_eq(const uint16_t *lhs, const uint16_t *rhs, size_t n) const {return count_eq_u16_(lhs, rhs, n);}
+    uint64_t count_eq(const uint32_t *lhs, const uint32_t *rhs, size_t n) const {return count_eq_u32_(lhs, rhs, n);}
+    uint64_t count_eq(const uint64_t *lhs, const uint64_t *rhs, size_t n) const {return count_eq_u64_(lhs, rhs, n);}
+    uint64_t count_eq(const float *lhs, const float *rhs, size_t n) const {return count_eq_f32_(lhs, rhs, n);}
+    uint64_t count_eq(const double *lhs, const double *rhs, size_t n) const {return count_eq_f64_(lhs, rhs, n);}
+    template<typename T>
+    uint64_t count_eq(const T *lhs, const T *rhs, size_t n) const {
+        uint64_t ret = 0;
+        for(size_t i = 0; i < n; ++i) ret += lhs[i] == rhs[i];
+        return ret;
+    }
+    uint64_t count_eq_nibbles(const uint8_t *lhs, const uint8_t *rhs, size_t n) const {return count_eq_nibbles_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const uint8_t *lhs, const uint8_t *rhs, size_t n) const {return count_gtlt_u8_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const uint16_t *lhs, const uint16_t *rhs, size_t n) const {return count_gtlt_u16_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const uint32_t *lhs, const uint32_t *rhs, size_t n) const {return count_gtlt_u32_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const uint64_t *lhs, const uint64_t *rhs, size_t n) const {return count_gtlt_u64_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const float *lhs, const float *rhs, size_t n) const {return count_gtlt_f32_(lhs, rhs, n);}
+    std::pair<uint64_t, uint64_t> count_gtlt(const double *lhs, const double *rhs, size_t n) const {return count_gtlt_f64_(lhs, rhs, n);}
+    template<typename T>
+    std::pair<uint64_t, uint64_t> count_gtlt(const T *lhs, const T *rhs, size_t n) const {
+        std::pair<uint64_t, uint64_t> ret{0, 0};
+        for(size_t i = 0; i < n; ++i) {
+            ret.first += lhs[i] > rhs[i];
+            ret.second += lhs[i] < rhs[i];
+        }
+        return ret;
+    }
+    std::pair<uint64_t, uint64_t> count_gtlt_nibbles(const uint8_t *lhs, const uint8_t *rhs, size_t n) const {return count_gtlt_nibbles_(lhs, rhs, n);}
+    void pack_bbit_kmers(const uint64_t *kmers, size_t n, int width, void *out) const {pack_bbit_kmers_(kmers, n, width, out);}
+    void pack_bbit_regs(const RegT *sigs, size_t n, int width, void *out) const {pack_bbit_regs_(sigs, n, width, out);}
+    void pack_setsketch(const RegT *sigs, size_t n, int width, long double a, long double logbinv, long double q, void *out) const {
+        pack_setsketch_(sigs, n, width, a, logbinv, q, out);
+    }
+    void mask_kmers(uint64_t *kmers, size_t n) const {mask_kmers_(kmers, n, XORMASK);}
+    void encode_floats(const float *src, size_t n, MatrixEncoding enc, void *out) const {encode_floats_(src, n, enc, out);}
+};
+
+// The kernels selected for this CPU, chosen on first use
+const KernelTable &kernels();
+// Every level compiled in, from the lowest, and whether this CPU supports it
+std::vector<std::pair<const KernelTable *, bool>> all_kernels();
+// Prints the levels compiled in, which this CPU supports, and the kernels and code paths selected
+void report_kernels(std::FILE *fp);
+
+namespace isa {
+template<typename F> decltype(auto) run_baseline(const F &f) {return f();}
+#if D2_HAS_DISPATCH
+template<typename F> D2_TARGET_AVX2 __attribute__((flatten)) decltype(auto) run_avx2(const F &f) {return f();}
+template<typename F> D2_TARGET_AVX512BW __attribute__((flatten)) decltype(auto) run_avx512bw(const F &f) {return f();}
+#endif
+} // namespace isa
+
+/*
+ * Runs f() compiled for the level selected by kernels(), for loops too entwined with their callers' types to go in the table:
+ * k-mer encoding and sketch updates, and per-pair comparisons.
+ * f and everything it calls are inlined (flattened) into a wrapper with that level's target attributes,
+ * so each call site gets its own copy per level, as the kernels do.
+ * Only calls the compiler can inline are compiled for the level; calls through pointers or into other translation units are not,
+ * nor are OpenMP regions inside f, which are outlined first, so f should be one thread's share of the work.
+ */
+template<typename F>
+decltype(auto) dispatched(const F &f) {
+#if D2_HAS_DISPATCH
+    switch(kernels().level_) {
+        case ISA_AVX512BW: return isa::run_avx512bw(f);
+        case ISA_AVX2: return isa::run_avx2(f);
+        default: break;
+    }
+#endif
+    return isa::run_baseline(f);
+}
+
+} // namespace dashing2
+
+#endif
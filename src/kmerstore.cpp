@@ -0,0 +1,152 @@
+#include "kmerstore.h"
+#include "wcompare.h"
+#include "isect.h"
+#include <cstring>
+#include <unistd.h>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+// Reads the full output of a decompression command
+static std::vector<uint8_t> read_cmd(const std::string &cmd) {
+    std::FILE *ifp = ::popen(cmd.data(), "r");
+    if(!ifp) THROW_EXCEPTION(std::runtime_error("Failed to run cmd '"s + cmd + "'"));
+    std::vector<uint8_t> ret;
+    static constexpr size_t BUFSZ = 1 << 18;
+    for(size_t n;;) {
+        const size_t oldsz = ret.size();
+        ret.resize(oldsz + BUFSZ);
+        n = std::fread(ret.data() + oldsz, 1, BUFSZ, ifp);
+        ret.resize(oldsz + n);
+        if(n != BUFSZ) break;
+    }
+    ::pclose(ifp);
+    return ret;
+}
+
+KmerSetStore::KmerSetStore(const Dashing2DistOptions &opts, const SketchingResult &result, size_t budget):
+    kmerfiles_(result.destination_files_), countfiles_(result.kmercountfiles_), use128_(opts.use128()), budget_(budget),
+    entries_(kmerfiles_.size()), lrupos_(kmerfiles_.size())
+{
+    if(countfiles_.size() && countfiles_.size() != kmerfiles_.size())
+        THROW_EXCEPTION(std::runtime_error("Expected one k-mer count file per k-mer file, found "s + std::to_string(countfiles_.size()) + " and " + std::to_string(kmerfiles_.size())));
+    for(const auto &p: kmerfiles_)
+        if(p.empty()) THROW_EXCEPTION(std::runtime_error("Destination files for k-mers empty -- cannot load from disk"));
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Exact comparisons for %zu k-mer sets, with a budget of %zu bytes of resident sets, using %s intersections\n", kmerfiles_.size(), budget_, to_string(intersection_kernel()));
+    }
+}
+
+KmerSetStore::~KmerSetStore() {
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Exact comparisons loaded %zu k-mer sets (%zu evictions) for %zu inputs\n", nloads_, nevictions_, kmerfiles_.size());
+    }
+}
+
+KmerSetStore::EntryPtr KmerSetStore::load(size_t i) const {
+    auto ret = std::make_shared<Entry>();
+    const size_t kw = use128_ ? sizeof(u128_t): sizeof(uint64_t);
+    const std::string &kpath = kmerfiles_[i];
+    const char *kdat;
+    size_t knb;
+    std::vector<uint8_t> kraw;
+    if(const std::string cmd = path2cmd(kpath); cmd.empty()) {
+        std::error_code ec;
+        ret->kmap_.map(kpath, ec);
+        if(ec) THROW_EXCEPTION(std::runtime_error("Failed to map "s + kpath + ": " + ec.message()));
+        kdat = ret->kmap_.data();
+        knb = ret->kmap_.size();
+    } else {
+        kraw = read_cmd(cmd);
+        kdat = reinterpret_cast<const char *>(kraw.data());
+        knb = kraw.size();
+    }
+    // The file is a double (the cardinality) followed by sorted k-mers
+    if(knb < sizeof(double) || (knb - sizeof(double)) % kw)
+        THROW_EXCEPTION(std::runtime_error("K-mer file "s + kpath + " has unexpected size " + std::to_string(knb)));
+    std::memcpy(&ret->card_, kdat, sizeof(double));
+    ret->n_ = (knb - sizeof(double)) / kw;
+    const char *const kstart = kdat + sizeof(double);
+    if(use128_) {
+        // 128-bit k-mers follow an 8-byte header, and so are not 16-byte aligned in the file.
+        ret->kbuf128_.resize(ret->n_);
+        std::memcpy(static_cast<void *>(ret->kbuf128_.data()), kstart, ret->n_ * kw);
+        ret->kmers_ = ret->kbuf128_.data();
+        if(ret->kmap_.is_mapped()) ret->kmap_.unmap();
+    } else if(ret->kmap_.is_mapped()) {
+        ret->kmers_ = kstart;
+    } else {
+        ret->kbuf64_.resize(ret->n_);
+        std::memcpy(ret->kbuf64_.data(), kstart, ret->n_ * kw);
+        ret->kmers_ = ret->kbuf64_.data();
+    }
+    ret->nbytes_ = ret->n_ * kw;
+    if(countfiles_.size() && !countfiles_[i].empty() && ret->n_) {
+        const std::string &cpath = countfiles_[i];
+        size_t cnb;
+        if(const std::string cmd = path2cmd(cpath); cmd.empty()) {
+            std::error_code ec;
+            ret->cmap_.map(cpath, ec);
+            if(ec) THROW_EXCEPTION(std::runtime_error("Failed to map "s + cpath + ": " + ec.message()));
+            cnb = ret->cmap_.size();
+            ret->counts_ = reinterpret_cast<const double *>(ret->cmap_.data());
+        } else {
+            const auto craw = read_cmd(cmd);
+            cnb = craw.size();
+            ret->cbuf_.resize(cnb / sizeof(double));
+            std::memcpy(ret->cbuf_.data(), craw.data(), ret->cbuf_.size() * sizeof(double));
+            ret->counts_ = ret->cbuf_.data();
+        }
+        if(cnb != ret->n_ * sizeof(double))
+            THROW_EXCEPTION(std::runtime_error("K-mer count file "s + cpath + " has " + std::to_string(cnb / sizeof(double)) + " counts for " + std::to_string(ret->n_) + " k-mers"));
+        ret->nbytes_ += cnb;
+    }
+    return ret;
+}
+
+KmerSetStore::EntryPtr KmerSetStore::get(size_t i) {
+    {
+        std::lock_guard<std::mutex> lock(mut_);
+        if(auto &e = entries_[i]) {
+            lru_.splice(lru_.begin(), lru_, lrupos_[i]);
+            return e;
+        }
+    }
+    // Load outside of the lock so that other sets can be read concurrently
+    EntryPtr ret = load(i);
+    std::lock_guard<std::mutex> lock(mut_);
+    if(entries_[i]) {
+        // Another thread loaded this set first
+        lru_.splice(lru_.begin(), lru_, lrupos_[i]);
+        return entries_[i];
+    }
+    entries_[i] = ret;
+    lru_.push_front(i);
+    lrupos_[i] = lru_.begin();
+    resident_ += ret->nbytes_;
+    ++nloads_;
+    // Sets still in use by other comparisons are freed once those complete
+    while(resident_ > budget_ && lru_.size() > 1) {
+        const uint32_t victim = lru_.back();
+        lru_.pop_back();
+        resident_ -= entries_[victim]->nbytes_;
+        entries_[victim].reset();
+        ++nevictions_;
+    }
+    return ret;
+}
+
+double KmerSetStore::intersection(const Entry &lhs, const Entry &rhs) const {
+    if(lhs.counts_ && rhs.counts_) {
+        if(use128_)
+            return weighted_compare(static_cast<const u128_t *>(lhs.kmers_), lhs.counts_, lhs.n_, lhs.card_,
+                                    static_cast<const u128_t *>(rhs.kmers_), rhs.counts_, rhs.n_, rhs.card_, true).first;
+        return weighted_compare(static_cast<const uint64_t *>(lhs.kmers_), lhs.counts_, lhs.n_, lhs.card_,
+                                static_cast<const uint64_t *>(rhs.kmers_), rhs.counts_, rhs.n_, rhs.card_, true).first;
+    }
+    if(use128_)
+        return set_compare(static_cast<const u128_t *>(lhs.kmers_), lhs.n_, static_cast<const u128_t *>(rhs.kmers_), rhs.n_);
+    return set_compare(static_cast<const uint64_t *>(lhs.kmers_), lhs.n_, static_cast<const uint64_t *>(rhs.kmers_), rhs.n_);
+}
+
+} // namespace dashing2
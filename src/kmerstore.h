@@ -0,0 +1,56 @@
+#pragma once
+#ifndef DASHING2_KMERSTORE_H__
+#define DASHING2_KMERSTORE_H__
+#include "cmp_main.h"
+#include "mio.hpp"
+#include <list>
+#include <mutex>
+
+namespace dashing2 {
+
+/*
+ * KmerSetStore
+ * Holds the sorted k-mer sets (and k-mer counts, if saved) written by --set and --countdict sketching,
+ * so that exact comparisons read each file once instead of reopening both files for every pair.
+ *
+ * Uncompressed files are memory-mapped; compressed files are decompressed once into memory.
+ * Once the total size of resident sets exceeds the budget, the least-recently-used sets are released.
+ * Sets in use by a comparison remain valid until it completes.
+ */
+class KmerSetStore {
+public:
+    struct Entry {
+        mio::mmap_source kmap_, cmap_;
+        std::vector<uint64_t> kbuf64_;
+        std::vector<u128_t> kbuf128_;
+        std::vector<double> cbuf_;
+        const void *kmers_ = nullptr;
+        const double *counts_ = nullptr; // Null unless counts were saved
+        size_t n_ = 0;
+        double card_ = 0.;
+        size_t nbytes_ = 0;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+private:
+    std::vector<std::string> kmerfiles_, countfiles_;
+    bool use128_;
+    size_t budget_;
+    std::mutex mut_;
+    std::vector<EntryPtr> entries_;
+    std::list<uint32_t> lru_; // Most recently used first
+    std::vector<std::list<uint32_t>::iterator> lrupos_;
+    size_t resident_ = 0;
+    size_t nloads_ = 0, nevictions_ = 0;
+    EntryPtr load(size_t i) const;
+public:
+    KmerSetStore(const Dashing2DistOptions &opts, const SketchingResult &result, size_t budget);
+    ~KmerSetStore();
+    EntryPtr get(size_t i);
+    // Returns the (count-weighted, if counts are available) intersection size of two sets
+    double intersection(const Entry &lhs, const Entry &rhs) const;
+    size_t size() const {return kmerfiles_.size();}
+};
+
+} // namespace dashing2
+
+#endif
@@ -0,0 +1,312 @@
+#include "lshindex.h"
+#include "emitnn.h"
+#include "dedup_core.h"
+#include "minispan.h"
+#include <cstring>
+#include <fstream>
+#include <random>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+static constexpr size_t pad8(size_t nb) {return (nb + 7) & ~size_t(7);}
+
+// Pads a section of nb bytes to the next multiple of 8
+static void write_padding(std::FILE *fp, size_t nb) {
+    static constexpr char zeros[8]{};
+    if(pad8(nb) != nb) checked_fwrite(fp, zeros, pad8(nb) - nb);
+}
+static void write_padded(std::FILE *fp, const void *src, size_t nb) {
+    checked_fwrite(fp, src, nb);
+    write_padding(fp, nb);
+}
+
+static void validate_indexable(const Dashing2DistOptions &opts) {
+    if(opts.kmer_result_ > FULL_SETSKETCH)
+        THROW_EXCEPTION(std::invalid_argument("Persistent LSH indexes hold sketches; k-mer sets, count dictionaries and minimizer sequences cannot be indexed."));
+    if(opts.sketch_compressed_set || opts.fd_level_ < sizeof(RegT))
+        THROW_EXCEPTION(std::invalid_argument("Persistent LSH indexes hold full-width registers; --fastcmp/--regsize and compressed sketches are not supported."));
+}
+
+static std::string segment_path(const std::string &path, size_t i) {
+    return i ? path + '.' + std::to_string(i): path;
+}
+
+static void write_lsh_segment(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result, size_t first_id, uint64_t lineage) {
+    validate_indexable(opts);
+    const size_t ns = result.names_.size(), m = opts.sketchsize_;
+    if(result.signatures_.size() != ns * m)
+        THROW_EXCEPTION(std::runtime_error("Expected "s + std::to_string(ns * m) + " registers for " + std::to_string(ns) + " sketches of size " + std::to_string(m) + ", found " + std::to_string(result.signatures_.size())));
+    if(first_id + ns > size_t(std::numeric_limits<LSHIDType>::max()))
+        THROW_EXCEPTION(std::runtime_error("Too many sketches ("s + std::to_string(ns) + ") for LSHIDType"));
+    auto start = std::chrono::high_resolution_clock::now();
+    auto idx = make_index(opts);
+    idx.build(ns, [&](size_t i) {return minispan<RegT>(&result.signatures_[m * i], m);});
+
+    // Flatten each subtable into sorted keys, each with its sorted list of ids
+    struct FlatSubtable {
+        std::vector<LSHIDType> keys_, ids_;
+        std::vector<uint32_t> sizes_;
+    };
+    std::vector<uint64_t> nsubs, subtable_start{0};
+    for(size_t i = 0; i < idx.ntables(); ++i) {
+        nsubs.push_back(idx.nsubs(i));
+        subtable_start.push_back(subtable_start.back() + idx.nsubs(i));
+    }
+    const size_t nsubtables = subtable_start.back();
+    std::vector<FlatSubtable> flat(nsubtables);
+    OMP_PFOR_DYN
+    for(size_t s = 0; s < nsubtables; ++s) {
+        const size_t i = std::upper_bound(subtable_start.begin(), subtable_start.end(), s) - subtable_start.begin() - 1;
+        struct Bucket {
+            LSHIDType key_;
+            const LSHIDType *ids_;
+            size_t n_;
+        };
+        std::vector<Bucket> buckets;
+        idx.for_each_bucket(i, s - subtable_start[i], [&buckets](LSHIDType key, const LSHIDType *ids, size_t n) {buckets.push_back({key, ids, n});});
+        std::sort(buckets.begin(), buckets.end(), [](const Bucket &x, const Bucket &y) {return x.key_ < y.key_;});
+        auto &f = flat[s];
+        f.keys_.reserve(buckets.size());
+        f.sizes_.reserve(buckets.size());
+        for(auto it = buckets.begin(); it != buckets.end();) {
+            // A key may have buckets in both of the index's layouts
+            const size_t oldsz = f.ids_.size();
+            const LSHIDType key = it->key_;
+            for(; it != buckets.end() && it->key_ == key; ++it)
+                f.ids_.insert(f.ids_.end(), it->ids_, it->ids_ + it->n_);
+            std::sort(f.ids_.begin() + oldsz, f.ids_.end());
+            f.keys_.push_back(key);
+            f.sizes_.push_back(f.ids_.size() - oldsz);
+        }
+    }
+    std::vector<uint64_t> keyptr{0}, idptr{0};
+    keyptr.reserve(nsubtables + 1);
+    for(const auto &f: flat) {
+        keyptr.push_back(keyptr.back() + f.keys_.size());
+        for(const auto sz: f.sizes_) idptr.push_back(idptr.back() + sz);
+    }
+
+    LSHIndexHeader hdr{};
+    std::memcpy(hdr.magic_, LSHIndexHeader::MAGIC, sizeof(hdr.magic_));
+    hdr.version_ = LSHIndexHeader::VERSION;
+    hdr.regsize_ = sizeof(RegT);
+    hdr.idsize_ = sizeof(LSHIDType);
+    hdr.sspace_ = opts.sspace_;
+    hdr.kmer_result_ = opts.kmer_result_;
+    hdr.nitems_ = ns;
+    hdr.sketchsize_ = m;
+    hdr.ntables_ = idx.ntables();
+    hdr.nsubtables_ = nsubtables;
+    hdr.nkeys_ = keyptr.back();
+    hdr.nids_ = idptr.back();
+    hdr.first_id_ = first_id;
+    hdr.lineage_ = lineage;
+
+    // Write to a temporary file and rename, so that a failed build never leaves a truncated index at path
+    const std::string tmppath = path + ".tmp";
+    std::FILE *fp = bfopen(tmppath.data(), "wb");
+    if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open "s + tmppath + " for writing"));
+    write_padded(fp, &hdr, sizeof(hdr));
+    write_padded(fp, idx.regs_per_reg().data(), hdr.ntables_ * sizeof(uint64_t));
+    write_padded(fp, nsubs.data(), hdr.ntables_ * sizeof(uint64_t));
+    write_padded(fp, keyptr.data(), keyptr.size() * sizeof(uint64_t));
+    write_padded(fp, idptr.data(), idptr.size() * sizeof(uint64_t));
+    for(const auto &f: flat) checked_fwrite(fp, f.keys_.data(), f.keys_.size() * sizeof(LSHIDType));
+    write_padding(fp, hdr.nkeys_ * sizeof(LSHIDType));
+    for(const auto &f: flat) checked_fwrite(fp, f.ids_.data(), f.ids_.size() * sizeof(LSHIDType));
+    write_padding(fp, hdr.nids_ * sizeof(LSHIDType));
+    write_padded(fp, result.cardinalities_.data(), ns * sizeof(double));
+    write_padded(fp, result.signatures_.data(), ns * m * sizeof(RegT));
+    std::fclose(fp);
+    if(std::rename(tmppath.data(), path.data()))
+        THROW_EXCEPTION(std::runtime_error("Failed to move "s + tmppath + " to " + path + ": " + std::strerror(errno)));
+    if((fp = bfopen((path + ".names.txt").data(), "wb")) == nullptr)
+        THROW_EXCEPTION(std::runtime_error("Failed to open "s + path + ".names.txt for writing"));
+    std::fputs("#Name\tCardinality\n", fp);
+    for(size_t i = 0; i < ns; ++i) {
+        checked_fwrite(fp, result.names_[i].data(), result.names_[i].size());
+        std::fprintf(fp, tfmt<double>, result.cardinalities_[i]);
+        std::fputc('\n', fp);
+    }
+    std::fclose(fp);
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Wrote LSH index over %zu sketches (%zu tables, %zu subtables, %zu keys) to %s in %gs\n", ns, size_t(hdr.ntables_), nsubtables, size_t(hdr.nkeys_), path.data(),
+                     std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+}
+
+void write_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result) {
+    const uint64_t lineage = (uint64_t(std::random_device()()) << 32) ^ std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    write_lsh_segment(path, opts, result, 0, lineage);
+    // Segments appended to a previous index at path are superseded
+    for(size_t i = 1; bns::isfile(segment_path(path, i)); ++i) {
+        std::remove(segment_path(path, i).data());
+        std::remove((segment_path(path, i) + ".names.txt").data());
+    }
+}
+
+void append_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result, size_t first_id) {
+    if(!bns::isfile(path)) {
+        if(first_id) THROW_EXCEPTION(std::runtime_error("No LSH index at "s + path + " to append to. Build one over all " + std::to_string(first_id + result.names_.size()) + " sketches with `dashing2 index`."));
+        write_lsh_index(path, opts, result);
+        return;
+    }
+    const LSHIndex idx(path);
+    const LSHIndexHeader &hdr = idx.header();
+    if(idx.size() != first_id)
+        THROW_EXCEPTION(std::runtime_error("LSH index at "s + path + " holds " + std::to_string(idx.size()) + " sketches, but the new sketches start at " + std::to_string(first_id) + ". Rebuild it with `dashing2 index`."));
+    if(hdr.sketchsize_ != opts.sketchsize_ || hdr.sspace_ != unsigned(opts.sspace_) || hdr.kmer_result_ != unsigned(opts.kmer_result_))
+        THROW_EXCEPTION(std::invalid_argument("LSH index at "s + path + " holds sketches of a different type or size than those appended."));
+    write_lsh_segment(segment_path(path, idx.segments().size()), opts, result, first_id, hdr.lineage_);
+}
+
+LSHIndexFile::LSHIndexFile(const std::string &path) {
+    std::error_code ec;
+    map_.map(path, ec);
+    if(ec) THROW_EXCEPTION(std::runtime_error("Failed to map LSH index at "s + path + ": " + ec.message()));
+    if(map_.size() < sizeof(LSHIndexHeader) || std::memcmp(map_.data(), LSHIndexHeader::MAGIC, sizeof(LSHIndexHeader::MAGIC)))
+        THROW_EXCEPTION(std::runtime_error(path + " is not a dashing2 LSH index"));
+    hdr_ = reinterpret_cast<const LSHIndexHeader *>(map_.data());
+    if(hdr_->version_ != LSHIndexHeader::VERSION)
+        THROW_EXCEPTION(std::runtime_error("LSH index at "s + path + " has version " + std::to_string(hdr_->version_) + "; expected " + std::to_string(LSHIndexHeader::VERSION) + ". Rebuild it with `dashing2 index`."));
+    if(hdr_->regsize_ != sizeof(RegT) || hdr_->idsize_ != sizeof(LSHIDType))
+        THROW_EXCEPTION(std::runtime_error("LSH index at "s + path + " was built with " + std::to_string(hdr_->regsize_) + "-byte registers and " + std::to_string(hdr_->idsize_) + "-byte ids, which this build of dashing2 cannot read."));
+    const size_t ntables = hdr_->ntables_, nsubtables = hdr_->nsubtables_;
+    // Check the size before taking pointers into the map
+    const size_t expected = pad8(sizeof(LSHIndexHeader)) + 2 * ntables * sizeof(uint64_t) + (nsubtables + 1 + hdr_->nkeys_ + 1) * sizeof(uint64_t)
+        + pad8(hdr_->nkeys_ * sizeof(LSHIDType)) + pad8(hdr_->nids_ * sizeof(LSHIDType))
+        + hdr_->nitems_ * sizeof(double) + pad8(hdr_->nitems_ * hdr_->sketchsize_ * sizeof(RegT));
+    if(map_.size() != expected)
+        THROW_EXCEPTION(std::runtime_error("LSH index at "s + path + " has size " + std::to_string(map_.size()) + "; expected " + std::to_string(expected) + ". It may be truncated."));
+    const char *p = map_.data() + pad8(sizeof(LSHIndexHeader));
+    auto take = [&p](size_t nb) {const char *ret = p; p += pad8(nb); return ret;};
+    regs_per_reg_ = reinterpret_cast<const uint64_t *>(take(ntables * sizeof(uint64_t)));
+    nsubs_ = reinterpret_cast<const uint64_t *>(take(ntables * sizeof(uint64_t)));
+    keyptr_ = reinterpret_cast<const uint64_t *>(take((nsubtables + 1) * sizeof(uint64_t)));
+    idptr_ = reinterpret_cast<const uint64_t *>(take((hdr_->nkeys_ + 1) * sizeof(uint64_t)));
+    keys_ = reinterpret_cast<const LSHIDType *>(take(hdr_->nkeys_ * sizeof(LSHIDType)));
+    ids_ = reinterpret_cast<const LSHIDType *>(take(hdr_->nids_ * sizeof(LSHIDType)));
+    cards_ = reinterpret_cast<const double *>(take(hdr_->nitems_ * sizeof(double)));
+    sigs_ = reinterpret_cast<const RegT *>(take(hdr_->nitems_ * hdr_->sketchsize_ * sizeof(RegT)));
+    subtable_start_.resize(ntables + 1);
+    for(size_t i = 0; i < ntables; ++i)
+        subtable_start_[i + 1] = subtable_start_[i] + nsubs_[i];
+    if(subtable_start_.back() != nsubtables)
+        THROW_EXCEPTION(std::runtime_error("LSH index at "s + path + " is corrupted: subtable counts do not sum to " + std::to_string(nsubtables)));
+    hasher_ = SetSketchIndex<LSHIDType, LSHIDType>(hdr_->sketchsize_, std::vector<uint64_t>(regs_per_reg_, regs_per_reg_ + ntables), std::vector<uint64_t>(nsubs_, nsubs_ + ntables));
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Mapped LSH index over %zu sketches (%zu tables, %zu keys) from %s\n", size(), ntables, size_t(hdr_->nkeys_), path.data());
+    }
+}
+
+LSHIndex::LSHIndex(const std::string &path) {
+    for(size_t i = 0;; ++i) {
+        const std::string segpath = segment_path(path, i);
+        if(i && !bns::isfile(segpath)) break;
+        LSHIndexFile seg(segpath);
+        const LSHIndexHeader &h = seg.header();
+        if(i == 0 && h.first_id_)
+            THROW_EXCEPTION(std::invalid_argument(path + " is a segment of an LSH index rather than its base"));
+        if(i) {
+            const LSHIndexHeader &bh = header();
+            if(h.lineage_ != bh.lineage_ || h.first_id_ != size()) {
+                std::fprintf(stderr, "Warning: ignoring %s and later segments, which were not appended to the index at %s\n", segpath.data(), path.data());
+                break;
+            }
+            if(h.sketchsize_ != bh.sketchsize_ || h.sspace_ != bh.sspace_ || h.kmer_result_ != bh.kmer_result_)
+                THROW_EXCEPTION(std::runtime_error("LSH index segment "s + segpath + " holds sketches of a different type or size than its base"));
+        }
+        const size_t oldsz = names_.size();
+        if(const std::string namesf = segpath + ".names.txt"; bns::isfile(namesf)) {
+            std::string l;
+            for(std::ifstream ifs(namesf);std::getline(ifs, l);) {
+                if(l.empty() || l.front() == '#') continue;
+                names_.emplace_back(l.substr(0, l.find_first_of('\t')));
+            }
+        }
+        if(names_.size() - oldsz != seg.size()) {
+            if(names_.size() != oldsz) std::fprintf(stderr, "Warning: %zu names for %zu sketches in %s. Naming them by index instead.\n", names_.size() - oldsz, seg.size(), segpath.data());
+            names_.resize(oldsz + seg.size());
+            for(size_t j = oldsz; j < names_.size(); ++j) names_[j] = std::to_string(j);
+        }
+        segments_.emplace_back(std::move(seg));
+    }
+}
+
+std::pair<std::vector<LSHIDType>, std::vector<uint32_t>> LSHIndexFile::query_candidates(const RegT *item, size_t maxcand) const {
+    const minispan<RegT> span(item, hdr_->sketchsize_);
+    flat_hash_map<LSHIDType, uint32_t> rset;
+    std::vector<LSHIDType> passing_ids;
+    rset.reserve(maxcand); passing_ids.reserve(maxcand);
+    for(std::ptrdiff_t i = hdr_->ntables_; --i >= 0 && rset.size() < maxcand;) {
+        for(size_t j = 0; j < nsubs_[i] && rset.size() < maxcand; ++j) {
+            const LSHIDType key = hasher_.hash_index(span, i, j);
+            const size_t s = subtable_start_[i] + j;
+            const LSHIDType *const kb = keys_ + keyptr_[s], *const ke = keys_ + keyptr_[s + 1];
+            const LSHIDType *const kit = std::lower_bound(kb, ke, key);
+            if(kit == ke || *kit != key) continue;
+            const size_t k = kit - keys_;
+            for(const LSHIDType *ip = ids_ + idptr_[k], *ie = ids_ + idptr_[k + 1]; ip != ie; ++ip) {
+                if(auto rit = rset.find(*ip); rit == rset.end()) {
+                    rset.emplace(*ip, 1);
+                    passing_ids.push_back(*ip);
+                    if(rset.size() == maxcand) break;
+                } else ++rit->second;
+            }
+        }
+    }
+    std::vector<uint32_t> passing_counts(passing_ids.size());
+    std::transform(passing_ids.begin(), passing_ids.end(), passing_counts.begin(), [&rset](auto x) {return rset[x];});
+    return {std::move(passing_ids), std::move(passing_counts)};
+}
+
+void query_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result) {
+    auto start = std::chrono::high_resolution_clock::now();
+    validate_indexable(opts);
+    if(opts.output_kind_ != KNN_GRAPH && opts.output_kind_ != NN_GRAPH_THRESHOLD)
+        THROW_EXCEPTION(std::invalid_argument("Querying an LSH index emits neighbor lists; use --topk or --similarity-threshold."));
+    const LSHIndex idx(path);
+    const LSHIndexHeader &hdr = idx.header();
+    if(hdr.sketchsize_ != opts.sketchsize_ || hdr.sspace_ != unsigned(opts.sspace_) || hdr.kmer_result_ != unsigned(opts.kmer_result_)) {
+        THROW_EXCEPTION(std::invalid_argument("LSH index at "s + path + " holds " + to_string(KmerSketchResultType(hdr.kmer_result_)) + "/" + to_string(SketchSpace(hdr.sspace_)) + " sketches of size " + std::to_string(hdr.sketchsize_)
+                                              + ", but queries are " + to_string(opts.kmer_result_) + "/" + to_string(opts.sspace_) + " sketches of size " + std::to_string(opts.sketchsize_)));
+    }
+    const size_t nq = result.names_.size(), nref = idx.size(), m = opts.sketchsize_;
+    static constexpr double INFLATE_FACTOR = 3.5;
+    const size_t ntoquery = opts.num_neighbors_ > 0 ? std::min(nref, size_t(std::ceil(opts.num_neighbors_ * INFLATE_FACTOR)))
+                          : maxcand_global > 0 ? std::min(nref, size_t(maxcand_global)): nref;
+    const bool isdist = distance(opts.measure_);
+    // Lists are sorted ascending, so similarities are negated until output
+    const LSHDistType mult = isdist ? 1.: -1.;
+    std::vector<pqueue> lists(nq);
+    OMP_PFOR_DYN
+    for(size_t q = 0; q < nq; ++q) {
+        const RegT *const qsig = &result.signatures_[m * q];
+        const double qcard = result.cardinalities_[q];
+        auto &l = lists[q];
+        // Segments hold disjoint ids, so each contributes its own candidates
+        for(const LSHIndexFile &seg: idx.segments()) {
+            const std::vector<LSHIDType> candidates = seg.query_candidates(qsig, std::min(ntoquery, seg.size())).first;
+            const LSHIDType first_id = seg.header().first_id_;
+            for(const LSHIDType id: candidates) {
+                const LSHDistType v = compare_sketches(opts, qsig, seg.signature(id), qcard, seg.cardinality(id));
+                if(opts.num_neighbors_ > 0 ? !isdist && v == 0.: (isdist ? v > opts.min_similarity_: v < opts.min_similarity_))
+                    continue;
+                l.getc().push_back(PairT{mult * v, first_id + id});
+            }
+        }
+        l.sort();
+        if(opts.num_neighbors_ > 0 && l.size() > size_t(opts.num_neighbors_)) {
+            // Keep items tied with the k-th
+            l.erase(std::find_if(l.begin() + opts.num_neighbors_, l.end(), [kth=l[opts.num_neighbors_ - 1].first](const PairT x) {return x.first > kth;}), l.end());
+        }
+        if(!isdist) for(auto &x: l) x.first = -x.first;
+    }
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Queried %zu sketches against LSH index of %zu in %gs\n", nq, nref, std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+    emit_neighbors(lists, opts, result, &idx.names());
+}
+
+} // namespace dashing2
@@ -0,0 +1,90 @@
+#pragma once
+#ifndef DASHING2_LSHINDEX_H__
+#define DASHING2_LSHINDEX_H__
+#include "index_build.h"
+#include "mio.hpp"
+
+namespace dashing2 {
+
+/*
+ * Persistent LSH index
+ * Written by `dashing2 index`, and memory-mapped by `dashing2 cmp --index` so that queries against a fixed collection
+ * neither reload its sketches nor rebuild its tables.
+ *
+ * Layout (8-byte aligned sections, in order):
+ *   LSHIndexHeader
+ *   u64 regs_per_reg[ntables]            registers per composite key, for each table
+ *   u64 nsubs[ntables]                   number of subtables in each table
+ *   u64 keyptr[nsubtables + 1]           each subtable's range in keys
+ *   u64 idptr[nkeys + 1]                 each key's range in ids
+ *   LSHIDType keys[nkeys]                sorted within each subtable
+ *   LSHIDType ids[nids]                  sorted within each bucket
+ *   f64 cardinalities[nitems]
+ *   RegT signatures[nitems * sketchsize]
+ * Names are written alongside, to <path>.names.txt, in the same format as stacked sketches.
+ *
+ * `dashing2 sketch --append --index <path>` adds sketches without rewriting the index, as a segment at <path>.1, <path>.2, ...,
+ * in the same format. Each segment holds ids from first_id_ on, and shares lineage_ with its base,
+ * so that segments left over from an index since rebuilt at <path> are ignored. Rebuilding with `dashing2 index` merges them.
+ */
+struct LSHIndexHeader {
+    static constexpr char MAGIC[8] = {'D', '2', 'L', 'S', 'H', 'I', 'D', 'X'};
+    static constexpr uint32_t VERSION = 1;
+    char magic_[8];
+    uint32_t version_;
+    uint32_t regsize_;  // sizeof(RegT)
+    uint32_t idsize_;   // sizeof(LSHIDType)
+    uint32_t sspace_;
+    uint32_t kmer_result_;
+    uint32_t reserved_;
+    uint64_t nitems_, sketchsize_;
+    uint64_t ntables_, nsubtables_;
+    uint64_t nkeys_, nids_;
+    uint64_t first_id_; // Id of this segment's first sketch; 0 for the base index
+    uint64_t lineage_;  // Shared by a base index and the segments appended to it
+};
+
+class LSHIndexFile {
+    mio::mmap_source map_;
+    const LSHIndexHeader *hdr_;
+    const uint64_t *regs_per_reg_, *nsubs_, *keyptr_, *idptr_;
+    const LSHIDType *keys_, *ids_;
+    const double *cards_;
+    const RegT *sigs_;
+    std::vector<uint64_t> subtable_start_; // First subtable of each table
+    SetSketchIndex<LSHIDType, LSHIDType> hasher_; // Holds the table layout only, to compute bucket keys
+public:
+    LSHIndexFile(const std::string &path);
+    size_t size() const {return hdr_->nitems_;}
+    size_t sketchsize() const {return hdr_->sketchsize_;}
+    const LSHIndexHeader &header() const {return *hdr_;}
+    const RegT *signature(size_t i) const {return sigs_ + i * hdr_->sketchsize_;}
+    double cardinality(size_t i) const {return cards_[i];}
+    // Returns up to maxcand ids sharing buckets with item, and the number of buckets each shares,
+    // visiting the most specific tables first
+    std::pair<std::vector<LSHIDType>, std::vector<uint32_t>> query_candidates(const RegT *item, size_t maxcand) const;
+};
+
+// A base index and its appended segments, with the names of all indexed sketches
+class LSHIndex {
+    std::vector<LSHIndexFile> segments_;
+    std::vector<std::string> names_;
+public:
+    LSHIndex(const std::string &path);
+    const std::vector<LSHIndexFile> &segments() const {return segments_;}
+    const LSHIndexHeader &header() const {return segments_.front().header();}
+    size_t size() const {return names_.size();}
+    const std::vector<std::string> &names() const {return names_;}
+};
+
+// Builds an LSH index over result's sketches and writes it to path, replacing any index (and segments) there
+void write_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result);
+// Indexes result's sketches as a new segment of the index at path, with ids from first_id on.
+// first_id must equal the number of sketches already indexed.
+void append_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result, size_t first_id);
+// Finds the nearest neighbors (or neighbors within --similarity-threshold) of each of result's sketches in the index at path, and emits them
+void query_lsh_index(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result);
+
+} // namespace dashing2
+
+#endif
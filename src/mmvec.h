@@ -5,6 +5,9 @@
 #include <cassert>
 #include <string>
 #include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "sketch/sseutil.h"
 
 namespace mm {
@@ -320,6 +323,48 @@ public:
         }
         capacity_ = newcap;
     }
+    // Moves the items to start at newoffset in the backing file, e.g. to make room for a header whose size was not known up front.
+    // Items held in RAM are simply written at newoffset when flushed.
+    void rebase(size_t newoffset) {
+        if(path_.empty()) throw std::runtime_error("Cannot rebase a vector without a backing file");
+        const size_t oldoffset = offset();
+        if(newoffset == oldoffset) return;
+        if(using_ram()) {
+            offset_ = newoffset;
+            return;
+        }
+        if(ms_.is_open()) ms_.unmap();
+        const int fd = ::open(path(), O_RDWR);
+        if(fd < 0) throw std::runtime_error("Failed to open "s + path_ + " to rebase");
+        const size_t nb = size_ * sizeof(T);
+        std::vector<char> buf(std::min(nb, size_t(1) << 20));
+        auto move_chunk = [&](size_t pos, size_t len) {
+            if(::pread(fd, buf.data(), len, oldoffset + pos) != ssize_t(len) || ::pwrite(fd, buf.data(), len, newoffset + pos) != ssize_t(len)) {
+                ::close(fd);
+                throw std::runtime_error("Failed to move items in "s + path_ + " to offset " + std::to_string(newoffset));
+            }
+        };
+        // Copy in the direction which never overwrites items not yet moved
+        if(newoffset > oldoffset) {
+            for(size_t end = nb; end;) {
+                const size_t len = std::min(end, buf.size());
+                end -= len;
+                move_chunk(end, len);
+            }
+        } else {
+            for(size_t pos = 0; pos < nb; pos += buf.size())
+                move_chunk(pos, std::min(buf.size(), nb - pos));
+        }
+        const bool failed = ::ftruncate(fd, newoffset + capacity_ * sizeof(T));
+        ::close(fd);
+        if(failed) throw std::runtime_error("Failed to resize "s + path_ + " after rebasing");
+        offset_ = newoffset;
+        if(capacity_) {
+            std::error_code ec;
+            ms_.map(path_, offset_, sizeof(T) * capacity_, ec);
+            if(ec) throw std::runtime_error("Failed to map "s + path_ + " after rebasing: " + ec.message());
+        }
+    }
     void clear() {
         if(using_ram()) {
             ram_.clear();
@@ -209,6 +209,52 @@ public:
             } else cref += (rref == id);
         }
     }
+    // Equivalent to update(oids[i]) for each i, in order.
+    // Ids are hashed and assigned registers a block at a time, so that the hashing vectorizes
+    // and the register updates no longer wait on it.
+    void update_batch(const T *oids, size_t n) {
+        if(mincount_ > 1.) {
+            for(size_t i = 0; i < n; ++i) update(oids[i]);
+            return;
+        }
+        static constexpr size_t BLOCK = 256;
+        T ids[BLOCK];
+        size_t idxs[BLOCK];
+        total_updates_ += n;
+        for(size_t i = 0; i < n; i += BLOCK) {
+            const size_t nb = std::min(BLOCK, n - i);
+            for(size_t j = 0; j < nb; ++j)
+                ids[j] = hasher_(oids[i + j]);
+            for(size_t j = 0; j < nb; ++j) {
+                if constexpr(pow2)
+                    idxs[j] = size_t(ids[j]) & mask_;
+                else
+                    idxs[j] = div_.mod(size_t(ids[j]));
+            }
+            for(size_t j = 0; j < nb; ++j) {
+                const T id = ids[j];
+                auto &rref = registers_[idxs[j]];
+                // Most ids neither replace nor repeat a register, so counts are only touched when they change
+                if(rref >= id) {
+                    auto &cref = counts_[idxs[j]];
+                    if(rref > id) {
+                        rref = id; cref = 1.;
+                    } else cref += 1.;
+                }
+            }
+        }
+    }
+    // 64-bit ids for a sketch of another width (as in 32-bit float builds) are converted as update() would convert them
+    template<typename OT, typename=std::enable_if_t<!std::is_same_v<OT, T>>>
+    void update_batch(const OT *oids, size_t n) {
+        static constexpr size_t BLOCK = 256;
+        T ids[BLOCK];
+        for(size_t i = 0; i < n; i += BLOCK) {
+            const size_t nb = std::min(BLOCK, n - i);
+            std::copy(oids + i, oids + i + nb, ids);
+            update_batch(ids, nb);
+        }
+    }
 
     static constexpr long double omul =
         sizeof(T) == 16 ? 0x1p-128L:
@@ -237,6 +283,25 @@ public:
         for(auto &p: potentials_) p.clear();
         total_updates_ = 0;
     }
+    // Merges a sketch of another part of the same stream, as if its updates had been made here.
+    // Exact unless set_mincount was used, since pending counts are not carried over.
+    LazyOnePermSetSketch &operator+=(const LazyOnePermSetSketch &o) {
+        if(m_ != o.m_) THROW_EXCEPTION(std::invalid_argument("Cannot merge one-permutation sketches of different sizes"));
+        for(size_t i = 0; i < m_; ++i) {
+            if(o.registers_[i] < registers_[i]) {
+                registers_[i] = o.registers_[i];
+                counts_[i] = o.counts_[i];
+            } else if(o.registers_[i] == registers_[i]) {
+                counts_[i] += o.counts_[i];
+            }
+        }
+        total_updates_ += o.total_updates_;
+        as_sigs_.clear();
+        original_ids_.reset();
+        idcounts_.reset();
+        card_ = -1.;
+        return *this;
+    }
     double getcard() {
         if(card_ > 0.) return card_;
         long double sum = std::accumulate(registers_.begin(), registers_.end(), 0.L,
@@ -1,7 +1,44 @@
 #include "options.h"
+#include <fstream>
 
 namespace dashing2 {
+using namespace std::literals::string_literals;
 
 size_t MEMSIGTHRESH = 20ull << 30;
+size_t EXACT_CACHE_BYTES = 0;
+std::string LSH_INDEX_PATH;
+
+void parse_pairlist(const char *path, std::vector<std::string> &paths, std::vector<std::pair<uint32_t, uint32_t>> &ids) {
+    std::ifstream ifs(path);
+    if(!ifs) THROW_EXCEPTION(std::runtime_error("Failed to open pairlist at "s + path));
+    flat_hash_map<std::string, uint32_t> pathids;
+    auto getid = [&](std::string &&key) -> uint32_t {
+        auto it = pathids.find(key);
+        if(it != pathids.end()) return it->second;
+        if(paths.size() >= std::numeric_limits<uint32_t>::max())
+            THROW_EXCEPTION(std::runtime_error("Too many distinct paths in pairlist for 32-bit ids"));
+        const uint32_t id = paths.size();
+        paths.push_back(key);
+        pathids.emplace(std::move(key), id);
+        return id;
+    };
+    auto isspace = [](char c) {return std::isspace(static_cast<unsigned char>(c));};
+    size_t lineno = 0;
+    for(std::string line;std::getline(ifs, line);) {
+        ++lineno;
+        const char *p = line.data(), *const e = p + line.size();
+        p = std::find_if_not(p, e, isspace);
+        if(p == e || *p == '#') continue;
+        const char *lhse = std::find_if(p, e, isspace);
+        const char *rhs = std::find_if_not(lhse, e, isspace);
+        const char *rhse = std::find_if(rhs, e, isspace);
+        if(rhs == e || std::find_if_not(rhse, e, isspace) != e)
+            THROW_EXCEPTION(std::runtime_error("Expected exactly two whitespace-separated paths on line "s + std::to_string(lineno) + " of pairlist " + path));
+        const uint32_t lid = getid(std::string(p, lhse));
+        const uint32_t rid = getid(std::string(rhs, rhse));
+        ids.emplace_back(lid, rid);
+    }
+    if(ids.empty()) THROW_EXCEPTION(std::runtime_error("No pairs read from pairlist "s + path));
+}
 
 }
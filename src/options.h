@@ -40,6 +40,7 @@ enum OptArg {
     OPTARG_SPACING,
     OPTARG_RANDOM_SEED,
     OPTARG_FILTERSET,
+    OPTARG_FILTERSET_FPR,
     OPTARG_PARSEBYSEQ,
     OPTARG_HELP,
     OPTARG_CMP_BATCH_SIZE,
@@ -55,6 +56,12 @@ enum OptArg {
     OPTARG_FASTCMPNIBBLES,
     OPTARG_FULL_SETSKETCH,
     OPTARG_PAIRLIST,
+    OPTARG_EXACT_CACHE,
+    OPTARG_LSHINDEX,
+    OPTARG_ALLPAIRS_THRESHOLD,
+    OPTARG_BINARY_PRECISION,
+    OPTARG_BLOCK_COMPRESS,
+    OPTARG_COUNT_FILTER_SIZE,
     OPTARG_USZ,
     OPTARG_DUMMY,
     OPTARG_SEQS_IN_RAM
@@ -155,6 +162,7 @@ enum OptArg {
     {"spacing", required_argument, 0, OPTARG_SPACING},\
     {"seed", required_argument, 0, OPTARG_RANDOM_SEED},\
     {"filterset", required_argument, 0, OPTARG_FILTERSET},\
+    {"filterset-fpr", required_argument, 0, OPTARG_FILTERSET_FPR},\
     {"parse-by-seq", no_argument, 0, OPTARG_PARSEBYSEQ},\
     {"help", no_argument, 0, OPTARG_HELP},\
     {"batch-size", required_argument, 0, OPTARG_CMP_BATCH_SIZE},\
@@ -168,6 +176,12 @@ enum OptArg {
     {"maxcand", required_argument, 0, OPTARG_MAXCAND},\
     {"setsketch-ab", required_argument, 0, OPTARG_SETSKETCH_AB},\
     {"pairlist", required_argument, 0, OPTARG_PAIRLIST},\
+    {"exact-cache-size", required_argument, 0, OPTARG_EXACT_CACHE},\
+    {"index", required_argument, 0, OPTARG_LSHINDEX},\
+    {"all-pairs-threshold", required_argument, 0, OPTARG_ALLPAIRS_THRESHOLD},\
+    {"binary-precision", required_argument, 0, OPTARG_BINARY_PRECISION},\
+    {"block-compress", no_argument, 0, OPTARG_BLOCK_COMPRESS},\
+    {"count-filter-size", required_argument, 0, OPTARG_COUNT_FILTER_SIZE},\
     {"verbose", no_argument, 0, 'v'}
 
 
@@ -176,6 +190,7 @@ const std::vector<std::string> VALID_LONG_OPTION_STRINGS {{
     "128bit",
     "BMH",
     "PMH",
+    "all-pairs-threshold",
     "asymmetric",
     "asymmetric-all-pairs",
     "bagminhash",
@@ -186,6 +201,8 @@ const std::vector<std::string> VALID_LONG_OPTION_STRINGS {{
     "bigwig",
     "binary",
     "binary-output",
+    "binary-precision",
+    "block-compress",
     "bmh",
     "by-chrom",
     "cache",
@@ -194,6 +211,7 @@ const std::vector<std::string> VALID_LONG_OPTION_STRINGS {{
     "cmpout",
     "compute-edit-distance",
     "containment",
+    "count-filter-size",
     "count-threshold",
     "countdict",
     "countmin-size",
@@ -207,6 +225,7 @@ const std::vector<std::string> VALID_LONG_OPTION_STRINGS {{
     "emit-binary",
     "enable-protein",
     "entmin",
+    "exact-cache-size",
     "exact-kmer-dist",
     "exact-kmer-dist",
     "fastcmp",
@@ -216,11 +235,13 @@ const std::vector<std::string> VALID_LONG_OPTION_STRINGS {{
     "fastcmp-words",
     "ffile",
     "filterset",
+    "filterset-fpr",
     "full",
     "full-setsketch",
     "greedy",
     "help",
     "hp-compress",
+    "index",
     "intersection",
     "intersection-size",
     "kmer-length",
@@ -375,6 +396,7 @@ static inline void validate_options(char **const opts, const std::vector<std::st
         case OPTARG_SPACING: spacing = optarg; canon = false; break;\
         case OPTARG_RANDOM_SEED: {seedseed = std::strtoull(optarg, 0, 10);} break;\
         case OPTARG_FILTERSET: fsarg = optarg; break;\
+        case OPTARG_FILTERSET_FPR: filterset_fpr = std::atof(optarg); break;\
         case OPTARG_PARSEBYSEQ: parse_by_seq = true; break;\
         case OPTARG_CMP_BATCH_SIZE: batch_size = std::strtoull(optarg, 0, 10); break;\
         case OPTARG_NLSH: nLSH = std::atoi(optarg); break;\
@@ -392,6 +414,14 @@ static inline void validate_options(char **const opts, const std::vector<std::st
         case OPTARG_SIGRAMLIMIT: {\
             MEMSIGTHRESH = std::strtoull(optarg, nullptr, 10);\
         } break;\
+        case OPTARG_EXACT_CACHE: {\
+            EXACT_CACHE_BYTES = std::strtoull(optarg, nullptr, 10);\
+        } break;\
+        case OPTARG_LSHINDEX: LSH_INDEX_PATH = optarg; break;\
+        case OPTARG_ALLPAIRS_THRESHOLD: threshold_all_pairs = true; similarity_threshold = std::atof(optarg); break;\
+        case OPTARG_BINARY_PRECISION: binary_precision = parse_matrix_encoding(optarg); break;\
+        case OPTARG_BLOCK_COMPRESS: block_compress = true; break;\
+        case OPTARG_COUNT_FILTER_SIZE: count_filter_bytes = std::strtoull(optarg, nullptr, 10); break;\
         case OPTARG_MAXCAND: {\
             maxcand_global = std::atoi(optarg);\
             if(maxcand_global < 0) {std::fprintf(stderr, "Warning: maxcand_global < 0. This defaults to heuristics for selecting the number of candidates. This may be in error.\n");}\
@@ -427,24 +457,7 @@ static inline void validate_options(char **const opts, const std::vector<std::st
         } break;\
         case OPTARG_PAIRLIST: {\
             if(paths.size()) throw std::runtime_error("Expected empty paths list for pairlist command. Either provide pairlist or paths, not both.");\
-            flat_hash_map<std::string, uint32_t> pathids;\
-            std::ifstream ifs(optarg);\
-            for(std::string line;std::getline(ifs, line);) {\
-                auto spacepos = std::find_if(line.data(), line.data() + line.size(), [](auto x) {return std::isspace(x);});\
-                if(*spacepos == '\0') throw std::runtime_error("Expected two paths separated by a space in pairlist.");\
-                auto lhs = std::string(line.data(), spacepos - line.data());\
-                auto rhs = std::string(spacepos + 1, line.data() + line.size() - spacepos - 1);\
-                assert(!std::isspace(lhs.back()));\
-                assert(!std::isspace(lhs.front()));\
-                assert(!std::isspace(rhs.back()));\
-                assert(!std::isspace(rhs.front()));\
-                auto lit = pathids.find(lhs);\
-                if(lit == pathids.end()) pathids.emplace(lhs, pathids.size()).first;\
-                auto rit = pathids.find(rhs);\
-                if(rit == pathids.end()) pathids.emplace(rhs, pathids.size()).first;\
-                compareids.emplace_back(lit->second, rit->second);\
-            }\
-            for(auto &pair: pathids) paths.emplace_back(std::move(pair.first));\
+            parse_pairlist(optarg, paths, compareids);\
             break;\
         }
 
@@ -506,9 +519,13 @@ static constexpr const char *siglen =
         "Detailed Filtering Options\n\n"\
         "--downsample\t Downsample minimizers at fraction <arg> . Default is 1: IE, all minimizers pass.\n"\
         "-m/--threshold/--count-threshold <arg>: Set a count threshold for inclusion. If set to > 1, this will only sketch k-mers with count >= <arg>\n"\
+        "--count-filter-size <bytes>: With -m > 1, count k-mers in a <bytes>-sized count-min sketch per sketcher before tracking them exactly.\n"\
+        "        This bounds the memory used for k-mers seen fewer than <arg> times (most of them, for read sets); hash collisions may admit a k-mer early, but never late.\n"\
+        "        Default: 0, which counts every candidate k-mer exactly.\n"\
         "If there are a set of common k-mers or artefactual sequence, you can specify --filterset to skip k-mers in this file when sketching other files.\n"\
         "By default, this converts it into a sorted hash set and skips k-mers which are found in the set.\n"\
         "`--filterset [path]` yields this.\n"\
+        "--filterset-fpr <rate>: Store the filter set as a blocked Bloom filter with false positive rate <rate> instead; this takes far less memory for large filters, but skips a fraction <rate> of other k-mers as well.\n"\
         "\n\nInput File Options --\n"\
         "By default, dashing2 reads positional arguments and sketches them. You may want to use flags instructing it\n"\
         "to read from paths in <file>. Additionally, you can put multiple files separated by spaces into a single line "\
@@ -560,6 +577,8 @@ static constexpr const char *siglen =
         "    This generates a sorted hash set for k-mers in the data, and additionally saves the associated counts for these k-mers.\n"\
         "    If an LSH table is generated, then weighted bottom-k hashes as in Cohen, E. \"Summarizing Data using Bottom-K Sketches\"\n"\
         "   -J/--countdict to enable \n"\
+        "   For comparisons of --set and --countdict results, each k-mer set is read once and kept in memory.\n"\
+        "   --exact-cache-size <bytes>: limit the memory used by resident k-mer sets; least-recently-used sets are released beyond this. [Default: half of physical memory]\n"\
         " 7. Full k-mer (or minimizer) sequence. This faster than building the hash set, and can be used to build a minimizer index afterwards\n"\
         "          If you use --parse-by-seq with this and an output path is provided, then the stacked minimizer sequences will be written to it.\n"\
         "          The format is the similar to the standard stacked sketches, except that the cardinality fields instead represent minimizer sequence lengths (in 64-bit registers).\n"\
@@ -604,6 +623,15 @@ static constexpr const char *siglen =
         "--topk/--top-k <arg>\tMaximum number of nearest neighbors to list. If <arg> is greater than N - 1, pairwise distances are instead emitted.\n"\
         "\nThresholded Mode -- \n"\
         "--similarity-threshold <arg>\tMinimum fraction similarity for inclusion.\n\tIf this is enabled, only pairwise similarities over <arg> will be emitted.\n"\
+        "--all-pairs-threshold <arg>\tExact thresholded mode: compare every pair, as for full pairwise output, but emit only similarities >= <arg> (or distances < <arg>).\n"\
+        "\tThis uses no LSH index, so no passing pair is missed. The shape is chosen as for dense output (symmetric, --asymmetric-all-pairs, or -Q), and self-pairs are omitted.\n"\
+        "\tHuman-readable output has one line per pair (lhs, rhs, value), sorted by (lhs, rhs); binary output is a stream of packed (u32 lhs id, u32 rhs id, f32 value) records,\n"\
+        "\tas for --pairlist. With -Q, rhs ids are indexes into the query set.\n"\
+        "\nPair List Mode -- \n"\
+        "--pairlist <path>\tCompare only the listed pairs. Each line of <path> holds two whitespace-separated paths; blank lines and lines starting with '#' are skipped.\n"\
+        "\tOnly paths named in the list are sketched, and no all-pairs comparison is performed. This cannot be combined with positional arguments or -F/-Q.\n"\
+        "\tHuman-readable output has one line per pair (lhs, rhs, value); binary output is a stream of packed (u32 lhs id, u32 rhs id, f32 value) records,\n"\
+        "\twhere ids are 0-based in order of first appearance in the pair list. Pairs are emitted sorted by (lhs, rhs) block for locality, not in input order.\n"\
         "\n\n"\
         "Greedy HIT Clustering Options --\n"\
         "In addition to exhaustive comparisons, we also perform greedy clustering using the CD High-Identity with Tolerance (CD-HIT) algorithm.\n"\
@@ -662,6 +690,13 @@ static constexpr const char *siglen =
         "\t For asymmetric pairwise, this emits a full distance matrix in f32 in row-major storage.\n"\
         "\t For asymmetric pairwise, this emits a flat distance matrix in f32\n"\
         "\t For top-k filtered, this emits a matrix of min(k, |N|) x |N| of IDs and distances\n"\
+        "--binary-precision <f32/f16/bf16/u8/u16>\tValue encoding for binary full-matrix output (symmetric, asymmetric, or panel). [f32]\n"\
+        "\t f16 and bf16 emit IEEE half-precision or bfloat16 values; u8 and u16 quantize values in [0, 1] to round(x * 255) or round(x * 65535).\n"\
+        "\t u8 and u16 are only valid for similarity and containment measures.\n"\
+        "\t Other than f32, the matrix is preceded by a 48-byte header recording its encoding and shape, which python/parse.py reads.\n"\
+        "--block-compress\tCompress binary full-matrix output (symmetric, asymmetric, or panel) in independent blocks of rows, on worker threads.\n"\
+        "\t Blocks are byte-shuffled and deflated, and a trailing index of their row ranges and offsets lets readers decompress any range of rows alone.\n"\
+        "\t See src/blockz.h for the layout; python/parse.py reads it.\n"\
         "In `dashing2 sketch`, distances are not automatically computed; If set, they are written to <arg>\n"\
         "In `dashing2 cmp`, this defaults to stdout.\n"\
         "--cmpout/--distout/--cmp-outfile\tCompute distances and emit them to <arg>.\n"\
@@ -683,9 +718,18 @@ static constexpr const char *siglen =
         "                  This option is ignored in --topk mode, as the number of samples is ceil(3.5 * <topk>).\n"\
         "                  If set in --similarity-threshold mode, the number of items compared will be truncated to <maxcand> even if further samples are above the similarity threshold.\n"\
         "                  This can prevent quadratic complexity for the (rare) case that all items are within threshold distaance of each other.\n"\
+        "--index <path>\t Query a persistent LSH index (built by `dashing2 index`) instead of building one.\n"\
+        "                  All inputs are treated as queries against the indexed collection; requires --topk or --similarity-threshold.\n"\
+        "                  Queries must be sketched with the same sketch type and size as the index. In `dashing2 index`, this is the output path.\n"\
+        "                  With `dashing2 sketch --append`, the appended sketches are added to this index as a new segment.\n"\
 
 
 extern size_t MEMSIGTHRESH;
+extern size_t EXACT_CACHE_BYTES; // If 0, half of physical memory is used
+extern std::string LSH_INDEX_PATH; // If set, cmp queries this persistent index (or `dashing2 index` writes it)
+// Reads whitespace-separated pairs of paths from <path>, one pair per line.
+// Each distinct path is assigned an id in order of first appearance and appended to paths.
+void parse_pairlist(const char *path, std::vector<std::string> &paths, std::vector<std::pair<uint32_t, uint32_t>> &ids);
 
 }
 
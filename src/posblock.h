@@ -0,0 +1,36 @@
+#pragma once
+#ifndef DASHING2_POSBLOCK_H__
+#define DASHING2_POSBLOCK_H__
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace dashing2 {
+
+// Feeds the positions of genomic intervals (ids contig_hash ^ position) to a set sketch through update_batch, 256 ids at a time.
+// Short intervals share blocks; call flush() after the last interval.
+template<typename Sketch>
+class PositionBlockUpdater {
+    static constexpr size_t BLOCK = 256;
+    Sketch &sketch_;
+    uint64_t buf_[BLOCK];
+    size_t n_ = 0;
+public:
+    PositionBlockUpdater(Sketch &sketch): sketch_(sketch) {}
+    void add_range(uint64_t chrom_hash, uint64_t start, uint64_t stop) {
+        while(start < stop) {
+            const size_t nb = std::min(BLOCK - n_, size_t(stop - start));
+            for(size_t j = 0; j < nb; ++j) buf_[n_ + j] = chrom_hash ^ (start + j);
+            start += nb;
+            if((n_ += nb) == BLOCK) flush();
+        }
+    }
+    void flush() {
+        if(n_) sketch_.update_batch(buf_, n_);
+        n_ = 0;
+    }
+};
+
+} // namespace dashing2
+
+#endif
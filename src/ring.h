@@ -0,0 +1,129 @@
+#pragma once
+#ifndef DASHING2_RING_H__
+#define DASHING2_RING_H__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace dashing2 {
+
+/*
+ * OrderedRing
+ * A bounded ring of reusable slots, filled by a single producer and drained in order by a single writer.
+ * Between the two, any number of formatter threads may claim published slots and process them in parallel;
+ * the writer still consumes slots in the order they were published.
+ *
+ * All waits block (std::atomic::wait) rather than poll, and the producer blocks once every slot is in flight,
+ * which bounds memory use and applies backpressure to computation.
+ *
+ * Time spent blocked is recorded:
+ *   producer_stall_ns: producer waiting on a free slot (output is the bottleneck)
+ *   writer_stall_ns:   writer waiting on a published slot (computation is the bottleneck)
+ *   format_stall_ns:   writer waiting on a formatter to finish a published slot
+ */
+template<typename Slot>
+class OrderedRing {
+    static constexpr uint64_t CLOSED = uint64_t(1) << 63;
+    using clock = std::chrono::steady_clock;
+    std::unique_ptr<Slot[]> slots_;
+    std::unique_ptr<std::atomic<uint32_t>[]> ready_;
+    const uint64_t n_;
+    const bool formatted_;
+    alignas(64) std::atomic<uint64_t> tail_{0};  // Number of published slots; CLOSED is set once the producer is done
+    alignas(64) std::atomic<uint64_t> head_{0};  // Number of slots written out, and so available for reuse
+    alignas(64) std::atomic<uint64_t> claim_{0}; // Next slot to be claimed by a formatter
+    alignas(64) uint64_t ptail_ = 0;             // Producer's copy of tail_
+    uint64_t phead_ = 0;                         // Writer's copy of head_
+    std::atomic<uint64_t> producer_stall_ns_{0}, writer_stall_ns_{0}, format_stall_ns_{0};
+    static uint64_t elapsed_ns(clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count();
+    }
+    // Returns false if the producer has closed the ring and idx will never be published
+    bool wait_published(uint64_t idx) {
+        uint64_t t = tail_.load(std::memory_order_acquire);
+        while((t & ~CLOSED) <= idx) {
+            if(t & CLOSED) return false;
+            tail_.wait(t, std::memory_order_acquire);
+            t = tail_.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+public:
+    // If formatted is set, the writer only receives slots once a formatter has marked them done.
+    OrderedRing(size_t nslots, bool formatted):
+        slots_(new Slot[nslots]), ready_(new std::atomic<uint32_t>[nslots]), n_(nslots), formatted_(formatted)
+    {
+        for(size_t i = 0; i < nslots; ++i) ready_[i].store(0, std::memory_order_relaxed);
+    }
+    size_t size() const {return n_;}
+
+    // Producer: blocks until a slot is free, and returns it for filling.
+    Slot &acquire() {
+        uint64_t h = head_.load(std::memory_order_acquire);
+        if(ptail_ - h >= n_) {
+            const auto t = clock::now();
+            do {
+                head_.wait(h, std::memory_order_acquire);
+                h = head_.load(std::memory_order_acquire);
+            } while(ptail_ - h >= n_);
+            producer_stall_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+        }
+        return slots_[ptail_ % n_];
+    }
+    // Producer: makes the slot returned by acquire() visible to formatters and the writer.
+    void publish() {
+        tail_.store(++ptail_, std::memory_order_release);
+        tail_.notify_all();
+    }
+    // Producer: no further slots will be published.
+    void close() {
+        tail_.fetch_or(CLOSED, std::memory_order_acq_rel);
+        tail_.notify_all();
+    }
+
+    // Formatter: claims the next published slot, or returns nullptr once all slots have been claimed.
+    Slot *claim() {
+        const uint64_t idx = claim_.fetch_add(1, std::memory_order_relaxed);
+        if(!wait_published(idx)) return nullptr;
+        return &slots_[idx % n_];
+    }
+    // Formatter: marks a claimed slot as ready to be written.
+    void formatted(Slot &slot) {
+        auto &r = ready_[&slot - slots_.get()];
+        r.store(1, std::memory_order_release);
+        r.notify_one();
+    }
+
+    // Writer: returns the next slot in publication order, or nullptr once the ring is closed and drained.
+    Slot *next() {
+        if((tail_.load(std::memory_order_acquire) & ~CLOSED) <= phead_) {
+            const auto t = clock::now();
+            const bool more = wait_published(phead_);
+            writer_stall_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+            if(!more) return nullptr;
+        }
+        const size_t si = phead_ % n_;
+        if(formatted_ && ready_[si].load(std::memory_order_acquire) == 0) {
+            const auto t = clock::now();
+            while(ready_[si].load(std::memory_order_acquire) == 0)
+                ready_[si].wait(0, std::memory_order_acquire);
+            format_stall_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+        }
+        return &slots_[si];
+    }
+    // Writer: releases the slot returned by next() back to the producer.
+    void release() {
+        ready_[phead_ % n_].store(0, std::memory_order_relaxed);
+        head_.store(++phead_, std::memory_order_release);
+        head_.notify_one();
+    }
+
+    double producer_stall_seconds() const {return producer_stall_ns_.load() * 1e-9;}
+    double writer_stall_seconds() const {return writer_stall_ns_.load() * 1e-9;}
+    double format_stall_seconds() const {return format_stall_ns_.load() * 1e-9;}
+};
+
+} // namespace dashing2
+
+#endif
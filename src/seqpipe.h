@@ -0,0 +1,275 @@
+#pragma once
+#ifndef DASHING2_SEQPIPE_H__
+#define DASHING2_SEQPIPE_H__
+#include "d2.h"
+#include "blockingconcurrentqueue.h"
+#include <chrono>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace dashing2 {
+
+/*
+ * SeqPipeline
+ * Streams the sequences of a list of fastx files through three stages:
+ *   parsers:  decompress and parse files into chunks of sequences, one file per parser at a time (a gzip stream cannot be split)
+ *   workers:  process chunks in whatever order they arrive, each into its chunk's Out
+ *   writer:   the calling thread, which receives chunks in input order (file by file, then sequence by sequence)
+ * Chunks pass between stages through lock-free queues and are recycled once written, so their strings keep their capacity.
+ * Each parser has its own pool of chunks, which bounds memory and keeps a parser which runs ahead from starving
+ * the one the writer is waiting on.
+ *
+ * With no parser or worker threads, the calling thread runs all three stages in turn.
+ * Exceptions thrown in any stage are rethrown from run() once every thread has finished.
+ */
+
+// Busy and blocked time per stage, summed over the threads of each stage
+struct SeqPipelineStats {
+    size_t nparsers_ = 0, nworkers_ = 0, nchunks_ = 0, nseqs_ = 0, nbases_ = 0;
+    double wall_ = 0.;
+    double parse_busy_ = 0., parse_stall_ = 0.;  // parsing; waiting for a free chunk (downstream is the bottleneck)
+    double work_busy_ = 0., work_idle_ = 0.;     // processing chunks; waiting for a parsed chunk (parsing is the bottleneck)
+    double write_busy_ = 0., write_wait_ = 0.;   // writing chunks; waiting for the next chunk in order
+    void report(std::FILE *fp, const char *label) const {
+        const double pt = std::max(nparsers_, size_t(1)) * wall_, wt = std::max(nworkers_, size_t(1)) * wall_;
+        std::fprintf(fp, "%s: %zu sequences (%zu bases) in %zu chunks in %gs. "
+                         "%zu parser(s) %0.1f%% busy, %0.1f%% waiting on free chunks; "
+                         "%zu worker(s) %0.1f%% busy, %0.1f%% waiting on parsers; "
+                         "writer %0.1f%% busy, %0.1f%% waiting on workers\n",
+                     label, nseqs_, nbases_, nchunks_, wall_,
+                     nparsers_, 100. * parse_busy_ / pt, 100. * parse_stall_ / pt,
+                     nworkers_, 100. * work_busy_ / wt, 100. * work_idle_ / wt,
+                     100. * write_busy_ / wall_, 100. * write_wait_ / wall_);
+    }
+};
+
+template<typename Out>
+struct SeqChunk {
+    std::vector<std::string> names_, seqs_; // Only the first n_ are filled
+    size_t n_ = 0;
+    uint32_t file_ = 0, parser_ = 0;
+    uint64_t index_ = 0; // Index of this chunk within its file
+    bool last_ = false;  // Last chunk of its file
+    Out out_;
+};
+
+template<typename Out>
+class SeqPipeline {
+public:
+    using Chunk = SeqChunk<Out>;
+private:
+    using clock = std::chrono::steady_clock;
+    using Queue = moodycamel::BlockingConcurrentQueue<Chunk *>;
+    const std::vector<std::string> &paths_;
+    kseq_t *kseqs_;
+    const size_t seqs_per_chunk_, bytes_per_chunk_;
+    size_t nparsers_, nworkers_;
+    std::vector<std::unique_ptr<Chunk>> chunks_;
+    std::vector<std::unique_ptr<Queue>> free_; // One pool per parser
+    Queue parsed_, done_;
+    std::atomic<uint32_t> next_file_{0};
+    std::atomic<uint64_t> parse_busy_ns_{0}, parse_stall_ns_{0}, work_busy_ns_{0}, work_idle_ns_{0}, nbases_{0};
+    std::mutex err_mut_;
+    std::exception_ptr err_;
+    std::atomic<bool> failed_{false}; // Once set, workers and the writer skip the chunks left, so that the pipeline drains quickly
+    static uint64_t elapsed_ns(clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - t).count();
+    }
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(err_mut_);
+        if(!err_) err_ = e;
+        failed_.store(true, std::memory_order_relaxed);
+    }
+    // Parses file fi into chunks from parser pi's pool, handing each to emit, and always ending with a chunk marked last_
+    template<typename Emit>
+    void parse_file(uint32_t pi, uint32_t fi, const Emit &emit) {
+        auto get = [&]() {
+            Chunk *c;
+            if(nparsers_) {
+                if(!free_[pi]->try_dequeue(c)) {
+                    const auto t = clock::now();
+                    free_[pi]->wait_dequeue(c);
+                    parse_stall_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+                }
+            } else c = chunks_.front().get();
+            c->n_ = 0; c->file_ = fi; c->parser_ = pi; c->last_ = false;
+            return c;
+        };
+        uint64_t index = 0, nbases = 0;
+        Chunk *c = get();
+        auto t = clock::now();
+        auto send = [&](bool last) {
+            c->index_ = index++;
+            c->last_ = last;
+            parse_busy_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+            emit(c);
+            if(!last) c = get();
+            t = clock::now();
+        };
+        try {
+            // Closed on every path out, including a parser or chunk allocation throwing mid-file
+            std::unique_ptr<std::remove_pointer_t<gzFile>, int (*)(gzFile)> fp(gzopen(paths_[fi].data(), "rb"), gzclose);
+            if(!fp) THROW_EXCEPTION(std::runtime_error(std::string("Failed to read from ") + paths_[fi]));
+            gzbuffer(fp.get(), 1u << 17);
+            std::unique_ptr<kseq_t, void (*)(kseq_t *)> owned(kseqs_ ? nullptr: kseq_init(fp.get()), kseq_destroy);
+            kseq_t *ks = kseqs_ ? &kseqs_[pi]: owned.get();
+            if(kseqs_) kseq_assign(ks, fp.get());
+            size_t nb = 0;
+            for(int rc;(rc = kseq_read(ks)) >= 0;) {
+                if(c->n_ == c->seqs_.size()) {
+                    c->seqs_.emplace_back();
+                    c->names_.emplace_back();
+                }
+                const int off = (ks->name.s[0] == '>');
+                c->names_[c->n_].assign(ks->name.s + off, ks->name.l - off);
+                c->seqs_[c->n_].assign(ks->seq.s, ks->seq.l);
+                ++c->n_;
+                nb += ks->seq.l;
+                nbases += ks->seq.l;
+                if(c->n_ == seqs_per_chunk_ || nb >= bytes_per_chunk_) {
+                    send(false);
+                    nb = 0;
+                }
+            }
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        nbases_.fetch_add(nbases, std::memory_order_relaxed);
+        send(true);
+    }
+public:
+    // Uses kseqs[i] as parser i's reader if kseqs is non-null.
+    SeqPipeline(const std::vector<std::string> &paths, size_t nparsers, size_t nworkers, size_t seqs_per_chunk, size_t bytes_per_chunk=size_t(4) << 20, kseq_t *kseqs=nullptr):
+        paths_(paths), kseqs_(kseqs), seqs_per_chunk_(std::max(seqs_per_chunk, size_t(1))), bytes_per_chunk_(bytes_per_chunk),
+        nparsers_(std::min(nparsers, paths.size())), nworkers_(nworkers)
+    {
+        if(!nparsers_ || !nworkers_) {
+            nparsers_ = nworkers_ = 0;
+            chunks_.emplace_back(new Chunk);
+            return;
+        }
+        // Enough chunks per parser to keep every worker busy while the writer waits on a straggler
+        const size_t perparser = std::max(size_t(4), 4 * nworkers_ / nparsers_);
+        for(size_t i = 0; i < nparsers_; ++i) {
+            free_.emplace_back(new Queue(perparser));
+            for(size_t j = 0; j < perparser; ++j) {
+                chunks_.emplace_back(new Chunk);
+                free_.back()->enqueue(chunks_.back().get());
+            }
+        }
+    }
+    size_t nparsers() const {return nparsers_;}
+    size_t nworkers() const {return nworkers_;}
+
+    // work(int tid, Chunk &) is called from worker threads, with tid in [0, nworkers()) (0 when single-threaded);
+    // write(Chunk &) is called from the calling thread, in input order.
+    template<typename Work, typename Write>
+    SeqPipelineStats run(const Work &work, const Write &write) {
+        SeqPipelineStats stats;
+        const auto start = clock::now();
+        uint64_t write_busy_ns = 0, write_wait_ns = 0;
+        auto do_write = [&](Chunk *c) {
+            stats.nseqs_ += c->n_;
+            ++stats.nchunks_;
+            const auto t = clock::now();
+            if(!failed_.load(std::memory_order_relaxed)) {
+                try {
+                    write(*c);
+                } catch(...) {
+                    fail(std::current_exception());
+                }
+            }
+            write_busy_ns += elapsed_ns(t);
+        };
+        if(!nparsers_) {
+            for(size_t fi = 0; fi < paths_.size(); ++fi) {
+                parse_file(0, fi, [&](Chunk *c) {
+                    const auto t = clock::now();
+                    try {
+                        work(0, *c);
+                    } catch(...) {
+                        fail(std::current_exception());
+                    }
+                    work_busy_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+                    do_write(c);
+                });
+            }
+        } else {
+            std::atomic<size_t> parsers_left(nparsers_);
+            std::vector<std::thread> threads;
+            for(size_t pi = 0; pi < nparsers_; ++pi) {
+                threads.emplace_back([&,pi]() {
+                    for(uint32_t fi;(fi = next_file_.fetch_add(1, std::memory_order_relaxed)) < paths_.size();)
+                        parse_file(pi, fi, [&](Chunk *c) {parsed_.enqueue(c);});
+                    // The last parser out stops the workers
+                    if(parsers_left.fetch_sub(1) == 1)
+                        for(size_t i = 0; i < nworkers_; ++i)
+                            parsed_.enqueue(nullptr);
+                });
+            }
+            for(size_t wi = 0; wi < nworkers_; ++wi) {
+                threads.emplace_back([&,wi]() {
+                    for(;;) {
+                        Chunk *c;
+                        if(!parsed_.try_dequeue(c)) {
+                            const auto t = clock::now();
+                            parsed_.wait_dequeue(c);
+                            work_idle_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+                        }
+                        if(!c) break;
+                        const auto t = clock::now();
+                        try {
+                            if(!failed_.load(std::memory_order_relaxed)) work(int(wi), *c);
+                        } catch(...) {
+                            fail(std::current_exception());
+                        }
+                        work_busy_ns_.fetch_add(elapsed_ns(t), std::memory_order_relaxed);
+                        done_.enqueue(c);
+                    }
+                });
+            }
+            // Chunks finished out of order wait here until their predecessors are written
+            std::map<std::pair<uint32_t, uint64_t>, Chunk *> pending;
+            std::pair<uint32_t, uint64_t> next{0, 0};
+            while(next.first < paths_.size()) {
+                Chunk *c;
+                if(auto it = pending.find(next); it != pending.end()) {
+                    c = it->second;
+                    pending.erase(it);
+                } else {
+                    const auto t = clock::now();
+                    done_.wait_dequeue(c);
+                    write_wait_ns += elapsed_ns(t);
+                    if(std::make_pair(c->file_, c->index_) != next) {
+                        pending.emplace(std::make_pair(c->file_, c->index_), c);
+                        continue;
+                    }
+                }
+                do_write(c);
+                if(c->last_) next = {next.first + 1, 0};
+                else ++next.second;
+                free_[c->parser_]->enqueue(c);
+            }
+            for(auto &t: threads) t.join();
+        }
+        stats.nparsers_ = nparsers_;
+        stats.nworkers_ = nworkers_;
+        stats.nbases_ = nbases_.load();
+        stats.wall_ = elapsed_ns(start) * 1e-9;
+        stats.parse_busy_ = parse_busy_ns_.load() * 1e-9;
+        stats.parse_stall_ = parse_stall_ns_.load() * 1e-9;
+        stats.work_busy_ = work_busy_ns_.load() * 1e-9;
+        stats.work_idle_ = work_idle_ns_.load() * 1e-9;
+        stats.write_busy_ = write_busy_ns * 1e-9;
+        stats.write_wait_ = write_wait_ns * 1e-9;
+        if(err_) std::rethrow_exception(err_);
+        return stats;
+    }
+};
+
+} // namespace dashing2
+
+#endif
@@ -8,6 +8,8 @@
 #include <queue>
 #include <unordered_map>
 #include <memory>
+#include <vector>
+#include <algorithm>
 
 #include "enums.h"
 
@@ -421,6 +423,40 @@ public:
             }
         }
     }
+    // Equivalent to update(ids[i]) for each i, in order.
+    // Once the sketch has filled, nearly every id is rejected on its first value, -log(rv * 2^-64) / m, exceeding max().
+    // That is the same as rv falling below exp(-m * max()) * 2^64, so a block of ids is screened against that bound
+    // with integer comparisons (which vectorize, unlike the logarithms), and only the rest go through update.
+    // The bound is lowered by a relative 1e-6, far more than rounding in update, so no id it rejects could be accepted;
+    // the maximum only decreases, so neither could any id later in the block.
+    void update_batch(const uint64_t *ids, size_t n) {
+        CONST_IF(sizeof(FT) > 8) {
+            for(size_t i = 0; i < n; ++i) update(ids[i]);
+        } else {
+            uint8_t pass[BATCH_BLOCK];
+            for(size_t i = 0; i < n; i += BATCH_BLOCK) {
+                const size_t nb = std::min(BATCH_BLOCK, n - i);
+                screen_batch(ids + i, nb, pass);
+                for(size_t j = 0; j < nb; ++j) {
+                    if(pass[j]) update(ids[i + j]);
+                    else ++total_updates_;
+                }
+            }
+            mycard_ = -1.;
+        }
+    }
+protected:
+    static constexpr size_t BATCH_BLOCK = 256;
+    static INLINE uint64_t first_rv(uint64_t id) {return sketch::hash::CEHasher()(id ^ uint64_t(0xb2069fc679a8da0buLL));}
+    // Sets pass[i] to 0 if update would reject ids[i] on its first value at the current maximum, and to 1 otherwise.
+    // update computes that value in FT, so the bound leaves a margin of a few FT roundings (relative) on top of 1e-6 (absolute).
+    void screen_batch(const uint64_t *ids, size_t n, uint8_t *pass) const {
+        const long double bound = std::exp(-static_cast<long double>(max()) * m_ * (1.L + 8.L * std::numeric_limits<FT>::epsilon()) - 1e-6L) * 0x1p64L;
+        const uint64_t minrv = bound >= 0x1p64L ? std::numeric_limits<uint64_t>::max(): static_cast<uint64_t>(bound);
+        for(size_t i = 0; i < n; ++i)
+            pass[i] = first_rv(ids[i]) >= minrv;
+    }
+public:
     bool operator==(const CSetSketch<FT> &o) const {
         return same_params(o) && std::equal(data(), data() + m_, o.data());
     }
@@ -996,11 +1032,41 @@ struct EByteSetS: public SetSketch<uint8_t, double> {
 CFDeclare(UintSetS, 1.0000000109723500835L, 19.77882586L, 0xFFFFFFFEuL, uint32_t, long double);
 #undef CFDeclare
 
+/*
+ * CountMinFilter
+ * Fixed-size count-min sketch with 8-bit saturating counters and conservative update,
+ * used to keep rare ids out of CountFilteredCSetSketch's exact count map.
+ * Each id maps to 4 counters within a single 64-byte line, so an increment touches one cache line.
+ * Estimates never fall below the true count (until saturation at 255).
+ */
+struct CountMinFilter {
+    struct alignas(64) Line {uint8_t c_[64];};
+    std::vector<Line> lines_;
+    CountMinFilter(size_t nbytes=0) {resize(nbytes);}
+    void resize(size_t nbytes) {
+        lines_.assign(nbytes ? std::max(nbytes / sizeof(Line), size_t(1)): size_t(0), Line{});
+    }
+    bool empty() const {return lines_.empty();}
+    size_t bytes() const {return lines_.size() * sizeof(Line);}
+    void clear() {std::fill(lines_.begin(), lines_.end(), Line{});}
+    // Increments the counters for the hashed id h and returns its new estimated count
+    INLINE uint32_t increment(uint64_t h) {
+        uint8_t *const c = lines_[(__uint128_t(h) * lines_.size()) >> 64].c_;
+        uint8_t *const p[4] = {c + (h & 63u), c + ((h >> 6) & 63u), c + ((h >> 12) & 63u), c + ((h >> 18) & 63u)};
+        const uint8_t mn = std::min(std::min(*p[0], *p[1]), std::min(*p[2], *p[3]));
+        if(mn == 255u) return mn;
+        for(auto x: p) if(*x == mn) *x = mn + 1;
+        return mn + 1u;
+    }
+};
+
 template<typename FT=double>
 struct CountFilteredCSetSketch: public CSetSketch<FT> {
     using super = CSetSketch<FT>;
     const uint32_t mc_;
     dashing2::flat_hash_map<uint64_t, uint32_t> potentials_;
+    // If non-empty, ids are only entered into potentials_ once their estimated count reaches min(mc_, 255).
+    CountMinFilter cmf_;
 #ifdef VERBOSE_AF
     size_t numremoved = 0;
     ~CountFilteredCSetSketch() {
@@ -1013,6 +1079,12 @@ struct CountFilteredCSetSketch: public CSetSketch<FT> {
     void reset() {
         CSetSketch<FT>::reset();
         potentials_.clear();
+        cmf_.clear();
+    }
+    // Bounds the memory spent counting ids which have not yet reached mc_. 0 (the default) counts every candidate exactly.
+    // Collisions can only overestimate counts, so ids may be admitted early but are never missed.
+    void set_count_filter_bytes(size_t nbytes) {
+        cmf_.resize(mc_ > 1u ? nbytes: size_t(0));
     }
     // If a weight is passed, ignore it
     template<typename OFT, typename=typename std::enable_if<std::is_arithmetic<OFT>::value>::type>
@@ -1032,19 +1104,19 @@ struct CountFilteredCSetSketch: public CSetSketch<FT> {
         long double tv = (lrv >> 32) * 1.2621774483536188887e-29L;
         return mi * std::log(tv);
     }
-    INLINE void erase_if(typename dashing2::flat_hash_map<uint64_t, uint32_t>::iterator it) {
+    INLINE auto erase_if(typename dashing2::flat_hash_map<uint64_t, uint32_t>::iterator it) {
 #ifdef VERBOSE_AF
         ++numremoved;
 #endif
-        potentials_.erase(it);
+        return potentials_.erase(it);
     }
+    // Removes candidates whose first value (as computed in update) already exceeds mv, since update would now reject them
     void trim_potentials(FT mv) {
         using fastlog::flog;
-        for(auto it = potentials_.begin(); it != potentials_.end(); ++it) {
+        for(auto it = potentials_.begin(); it != potentials_.end();) {
             const FT mi = -1.L / m_;
             FT nv;
-            uint64_t hid = it->first;
-            uint64_t rv = wy::wyhash64_stateless(&hid);
+            uint64_t rv = super::first_rv(it->first);
             CONST_IF(sizeof(FT) > 8) {
                 nv = id2ldv(&rv, mi);
                 // Uses 96 bits of precision
@@ -1054,10 +1126,32 @@ struct CountFilteredCSetSketch: public CSetSketch<FT> {
                 nv = mi * flog(tv) * FT(.7);
                 if(nv < mv) nv = mi * std::log(tv);
             }
-            if(nv >= mv) {
-                erase_if(it);
-                continue;
+            // Erasing moves the following entry into its place
+            if(nv >= mv) it = erase_if(it);
+            else ++it;
+        }
+    }
+    // As CSetSketch::update_batch. Rejected ids still count towards trimming potentials_, as they do in update.
+    void update_batch(const uint64_t *ids, size_t n) {
+        if(mc_ <= 1u) return CSetSketch<FT>::update_batch(ids, n);
+        CONST_IF(sizeof(FT) > 8) {
+            for(size_t i = 0; i < n; ++i) update(ids[i]);
+        } else {
+            uint8_t pass[super::BATCH_BLOCK];
+            for(size_t i = 0; i < n; i += super::BATCH_BLOCK) {
+                const size_t nb = std::min(super::BATCH_BLOCK, n - i);
+                super::screen_batch(ids + i, nb, pass);
+                for(size_t j = 0; j < nb; ++j) {
+                    if(pass[j]) {
+                        update(ids[i + j]);
+                    } else {
+                        ++total_updates_;
+                        if((CEHasher()(ids[i + j]) & 0x8fffffu) == 0u)
+                            trim_potentials(max());
+                    }
+                }
             }
+            mycard_ = -1.;
         }
     }
     void update(const uint64_t id) {
@@ -1072,7 +1166,8 @@ struct CountFilteredCSetSketch: public CSetSketch<FT> {
 
         FT ev;
         FT mv = max();
-        if((CEHasher()(id) & 0x8fffffu) == 0u)
+        const uint64_t h = CEHasher()(id);
+        if((h & 0x8fffffu) == 0u)
             trim_potentials(mv);
         CONST_IF(sizeof(FT) > 8) {
             if((ev = id2ldv(&rv, -1.L / m_)) > mv) return;
@@ -1082,16 +1177,19 @@ struct CountFilteredCSetSketch: public CSetSketch<FT> {
             // Filter with fast log first
             if(bv * flog(tv) * FT(.7) > mv || (ev = bv * std::log(tv)) > mv) return;
         }
+        uint32_t est = 1;
+        if(!cmf_.empty() && (est = cmf_.increment(h)) < std::min(mc_, 255u)) return;
         auto pit = potentials_.find(id);
         if(pit == potentials_.end()) {
-            potentials_.emplace(id, 1);
-            return;
-        }
-        if(pit->second >= mc_) {
-            ++pit->second; // Already added
-            return;
+            potentials_.emplace(id, est);
+            if(est < mc_) return;
+        } else {
+            if(pit->second >= mc_) {
+                ++pit->second; // Already added
+                return;
+            }
+            if(++pit->second < mc_) return;
         }
-        if(++pit->second < mc_) return;
         // What's left now is that we have just reached the minimum count
         // We will periodically remove unnecessary k-mers as the sketch becomes filled.
         // This is done randomly as a function of the random id;
@@ -1,5 +1,6 @@
 #include "sketch_core.h"
 #include "cmp_main.h"
+#include "stackdb.h"
 #include <cinttypes>
 
 namespace dashing2 {
@@ -93,12 +94,14 @@ SketchingResult &sketch_core(SketchingResult &result, Dashing2DistOptions &opts,
                     offset += bc[i].size();
                 }
             } else {
-                OMP_PFOR_DYN
+                // With fewer files than threads, sketch one file at a time, splitting each across threads
+                const bool within_files = npaths < size_t(opts.nthreads());
+                OMP_PRAGMA("omp parallel for schedule(dynamic) if(!within_files)")
                 for(size_t i = 0; i < npaths; ++i) {
                     auto myind = filesizes.size() ? filesizes[i].second: uint64_t(i);
                     auto &p(paths[myind]);
                     result.names_[i] = p;
-                    auto res = bw2sketch(p, opts, /*parallel_process=*/false);
+                    auto res = bw2sketch(p, opts, /*parallel_process=*/within_files);
                     std::copy(res.global_->begin(), res.global_->end(), &result.signatures_[myind * opts.sketchsize_]);
                     result.cardinalities_[myind] = res.card_;
                 }
@@ -127,7 +130,9 @@ SketchingResult &sketch_core(SketchingResult &result, Dashing2DistOptions &opts,
         }
         std::fclose(ofp);
     } else {
-        if(outfile.size() && outfile != "/dev/stdout" && outfile != "-") {
+        if(result.stacked_capacity_) {
+            // Written in the appendable layout; committed below, once names have been written
+        } else if(outfile.size() && outfile != "/dev/stdout" && outfile != "-") {
             // This should not overlap with the memory mapped for result.signatures_
             const uint64_t t = result.cardinalities_.size();
             std::FILE *fp = bfopen(outfile.data(), "r+");
@@ -159,6 +164,11 @@ SketchingResult &sketch_core(SketchingResult &result, Dashing2DistOptions &opts,
         }
         std::fclose(ofp);
     }
+    if(result.stacked_capacity_) {
+        const std::string namesf = outfile + ".names.txt";
+        finalize_stacked(outfile, result.cardinalities_.size(), opts.sketchsize_, result.stacked_capacity_, result.cardinalities_.data(),
+                         bns::isfile(namesf) ? bns::filesize(namesf.data()): 0);
+    }
     if(!outfile.empty() && result.kmercounts_.size()) {
         const size_t nb = result.kmercounts_.size() * sizeof(decltype(result.kmercounts_)::value_type);
         DBG_ONLY(std::fprintf(stderr, "Writing kmercounts of size %zu\n", result.kmercounts_.size());)
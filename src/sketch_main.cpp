@@ -1,11 +1,14 @@
 #include "sketch_core.h"
 #include "options.h"
 #include "cmp_main.h"
+#include "stackdb.h"
+#include "lshindex.h"
 
 
 
 #define SKETCH_OPTS \
 static option_struct sketch_long_options[] = {\
+    LO_FLAG("append", OPTARG_APPEND, append, true)\
     SHARED_OPTS\
 };
 
@@ -15,6 +18,8 @@ namespace dashing2 {
 void sketch_usage() {
     std::fprintf(stderr, "dashing2 sketch <opts> [fastas... (optional)]\n"
                          "We use only m-mers; if w <= k, however, this reduces to k-mers if the -w/--window-size is unspecified.\n"
+                         "--append\t Sketch only the inputs given and append them to the stacked sketches at -o/--outfile, creating them if missing.\n"
+                         "          Only the new sketches are written. If --index <path> is also set, the LSH index there is extended with them.\n"
                          SHARED_DOC_LINES
     );
 }
@@ -31,8 +36,11 @@ int sketch_main(int argc, char **argv) {
     long double compressed_a = -1.L, compressed_b = -1.L;
     bool fasta_dedup = false;
     double similarity_threshold = -1.;
+    bool threshold_all_pairs = false;
+    MatrixEncoding binary_precision = ENCODE_F32;
+    bool block_compress = false;
     unsigned int count_threshold = 0.;
-    size_t cssize = 0, sketchsize = 1024;
+    size_t cssize = 0, sketchsize = 1024, count_filter_bytes = 0;
     std::string ffile, outfile, qfile;
     int option_index = 0;
     bns::RollingHashingType rht = bns::DNA;
@@ -49,16 +57,18 @@ int sketch_main(int argc, char **argv) {
     uint64_t seedseed = 0;
     size_t batch_size = 0;
     int nLSH = 2;
-    std::vector<std::pair<uint32_t, uint32_t>> compareids; // TODO: consider a sparse mode comparing only pairs of presented genomes.
+    int append = false;
+    std::vector<std::pair<uint32_t, uint32_t>> compareids;
     Measure measure = SIMILARITY;
     std::ios_base::sync_with_stdio(false);
     std::string fsarg;
+    double filterset_fpr = -1.;
     // By default, use full hash values, but allow people to enable smaller
     bool normalize_bed = false;
     OutputFormat of = OutputFormat::HUMAN_READABLE;
     std::string spacing;
     std::vector<std::string> paths;
-    validate_options(argv);
+    validate_options(argv, std::vector<std::string>{{"append"}});
     SKETCH_OPTS
     for(;(c = getopt_long(argc, argv, "m:p:k:w:c:f:S:F:Q:o:L:CNs2BPWh?ZJGHv", sketch_long_options, &option_index)) >= 0;) {
         switch(c) {
@@ -75,7 +85,18 @@ int sketch_main(int argc, char **argv) {
     OMP_ONLY(omp_set_num_threads(nt));
     if(compareids.empty()) {
         paths.insert(paths.end(), argv + optind, argv + argc);
-    } else if(optind != argc) throw std::runtime_error("CLI paths must be empty to use pairlist mode.");
+    } else if(optind != argc) {
+        throw std::runtime_error("CLI paths must be empty to use pairlist mode.");
+    } else if(ffile.size() || qfile.size()) {
+        throw std::runtime_error("-F/--ffile and -Q/--qfile cannot be used with pairlist mode.");
+    } else if(parse_by_seq) {
+        throw std::runtime_error("pairlist mode compares files, and cannot be used with --parse-by-seq.");
+    } else if(ok != SYMMETRIC_ALL_PAIRS || threshold_all_pairs) {
+        // Set after parsing, so that no other output option can replace it, whatever the argument order
+        throw std::runtime_error("--pairlist cannot be combined with -K/--topk, -T, --greedy, --asymmetric-all-pairs, or --all-pairs-threshold.");
+    } else {
+        ok = OutputKind::PAIRLIST;
+    }
     std::unique_ptr<std::vector<std::string>> qup;
     if(ffile.size()) {
         if(!bns::isfile(ffile)) THROW_EXCEPTION(std::runtime_error("No path found at "s + ffile));
@@ -108,6 +129,7 @@ int sketch_main(int argc, char **argv) {
         .save_kmers(save_kmers)
         .parse_by_seq(parse_by_seq)
         .count_threshold(count_threshold)
+        .count_filter_bytes(count_filter_bytes)
         .homopolymer_compress_minimizers(hpcompress)
         .seedseed(seedseed)
         .fasta_dedup(fasta_dedup);
@@ -120,26 +142,46 @@ int sketch_main(int argc, char **argv) {
     if(hpcompress) {
         if(!opts.homopolymer_compress_minimizers_) THROW_EXCEPTION(std::runtime_error("Failed to hpcompress minimizers"));
     }
-    opts.filterset(fsarg);
+    opts.filterset(fsarg, filterset_fpr);
     if((opts.sspace_ == SPACE_PSET || opts.sspace_ == SPACE_MULTISET || opts.sspace_ == SPACE_EDIT_DISTANCE)
             && opts.kmer_result_ == ONE_PERM) {
         opts.kmer_result_ = FULL_SETSKETCH;
     }
     opts.bed_parse_normalize_intervals_ = normalize_bed;
     Dashing2DistOptions distopts(opts, ok, of, nbytes_for_fastdists, truncate_mode, topk_threshold, similarity_threshold, cmpout, exact_kmer_dist, refine_exact, nLSH);
+    distopts.compareids_ = std::move(compareids);
+    distopts.threshold_all_pairs_ = threshold_all_pairs;
+    distopts.output_encoding_ = binary_precision;
+    distopts.block_compress_ = block_compress;
     if(paths.empty()) {
         std::fprintf(stderr, "No paths provided. See usage.\n");
         sketch_usage();
         return 1;
     }
+    if(append) {
+        if(outfile.empty() || outfile == "-" || outfile == "/dev/stdout")
+            THROW_EXCEPTION(std::invalid_argument("--append requires -o/--outfile, the stacked sketches to extend."));
+        if(cmpout.size())
+            THROW_EXCEPTION(std::invalid_argument("--append cannot be combined with comparisons (--cmpout)."));
+    }
     SketchingResult result;
     if(verbosity >= EXTREME) {
         std::fprintf(stderr, "About to sketch\n");
     }
-    sketch_core(result, distopts, paths, outfile);
+    // When appending, the new sketches are held in memory rather than written over outfile
+    std::string sketchout = append ? std::string(): outfile;
+    sketch_core(result, distopts, paths, sketchout);
     if(verbosity >= EXTREME) {
         std::fprintf(stderr, "Finished sketching\n");
     }
+    if(append) {
+        const size_t first_id = append_stacked(outfile, distopts, result);
+        if(LSH_INDEX_PATH.size()) {
+            prepare_results(distopts, result);
+            append_lsh_index(LSH_INDEX_PATH, distopts, result, first_id);
+        }
+        return 0;
+    }
     result.nqueries(nq);
     if(cmpout.size()) {
         distopts.measure_ = measure;
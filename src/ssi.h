@@ -14,6 +14,8 @@
 #include "sketch/hash.h"
 #include <mutex>
 #include <optional>
+#include <limits>
+#include <type_traits>
 
 
 namespace sketch {
@@ -42,6 +44,10 @@ struct SetSketchIndex {
     /*
      * Maintains an LSH index over a set of sketches
      *
+     * Items are indexed either incrementally (update/update_mt/update_query), into a hash map of id vectors per subtable,
+     * or all at once by build(), which lays each table's ids out contiguously, bucket by bucket,
+     * with an open-addressed table from key to bucket per subtable.
+     * Items added incrementally after build() go to the hash maps, and queries consult both.
      */
 private:
     size_t m_;
@@ -52,6 +58,38 @@ private:
     size_t total_ids_;
     std::vector<std::vector<std::mutex>> mutexes_;
     bool is_bottomk_only_ = false;
+    // Flat layout written by build()
+    struct FlatSlot {
+        KeyT key_;
+        uint32_t begin_, end_; // Bucket's range in the subtable's ids; end_ == 0 marks an empty slot
+    };
+    size_t flat_n_ = 0; // Items in the flat layout; subtable j of table i holds its ids at flat_ids_[i][j * flat_n_, (j + 1) * flat_n_)
+    std::vector<std::vector<IdT>> flat_ids_;
+    std::vector<std::vector<std::vector<FlatSlot>>> flat_slots_; // [table][subtable], power-of-two sized
+    static constexpr uint32_t UNPLACED = uint32_t(-1);
+    static size_t slot_hash(KeyT key) {
+        uint64_t h = uint64_t(key) * 0x9E3779B97F4A7C15ull;
+        return h ^ (h >> 32);
+    }
+    static size_t flat_capacity(size_t n) {
+        size_t ret = 16;
+        while(ret < n) ret <<= 1;
+        return ret;
+    }
+    // Returns the ids in the flat layout's bucket for key in subtable j of table i, or an empty range
+    std::pair<const IdT *, const IdT *> find_flat(size_t i, size_t j, KeyT key) const {
+        if(i >= flat_slots_.size()) return {nullptr, nullptr};
+        const auto &slots = flat_slots_[i][j];
+        const size_t mask = slots.size() - 1;
+        for(size_t s = slot_hash(key) & mask;; s = (s + 1) & mask) {
+            const FlatSlot &slot = slots[s];
+            if(!slot.end_) return {nullptr, nullptr};
+            if(slot.key_ == key) {
+                const IdT *base = &flat_ids_[i][j * flat_n_];
+                return {base + slot.begin_, base + slot.end_};
+            }
+        }
+    }
 public:
     using key_type = KeyT;
     using id_type = IdT;
@@ -59,6 +97,21 @@ public:
     size_t size() const {return total_ids_;}
     size_t size(size_t total_ids) {return total_ids_ = total_ids;}
     size_t ntables() const {return packed_maps_.size();}
+    bool bottomk_only() const {return is_bottomk_only_;}
+    size_t nsubs(size_t i) const {return packed_maps_[i].size();}
+    const std::vector<uint64_t> &regs_per_reg() const {return regs_per_reg_;}
+    // Calls f(key, ids, nids) for each bucket of subtable j of table i, for serialization.
+    // A key with items in both the flat layout and the hash maps is visited twice.
+    template<typename F>
+    void for_each_bucket(size_t i, size_t j, const F &f) const {
+        if(i < flat_slots_.size()) {
+            const IdT *base = flat_ids_[i].data() + j * flat_n_;
+            for(const FlatSlot &slot: flat_slots_[i][j])
+                if(slot.end_) f(slot.key_, base + slot.begin_, size_t(slot.end_ - slot.begin_));
+        }
+        for(const auto &pair: packed_maps_[i][j])
+            f(pair.first, pair.second.data(), pair.second.size());
+    }
     template<typename IT, typename Alloc, typename OIT, typename OAlloc>
     SetSketchIndex(size_t m, const std::vector<IT, Alloc> &nperhashes, const std::vector<OIT, OAlloc> &nperrows): m_(m) {
         if(nperhashes.size() != nperrows.size()) throw std::invalid_argument("SetSketchIndex requires nperrows and nperhashes have the same size");
@@ -107,6 +160,9 @@ public:
         total_ids_ = o.total_ids_;
         regs_per_reg_ = o.regs_per_reg_;
         packed_maps_ = o.packed_maps_;
+        flat_n_ = o.flat_n_;
+        flat_ids_ = o.flat_ids_;
+        flat_slots_ = o.flat_slots_;
         mutexes_.resize(o.mutexes_.size());
         for(size_t i = 0; i < o.mutexes_.size(); ++i) {
             mutexes_[i] = std::vector<std::mutex>(o.mutexes_[i].size());
@@ -119,7 +175,8 @@ public:
         return total_ids_ == o.total_ids_ &&
             regs_per_reg_.size() == o.regs_per_reg_.size() &&
             packed_maps_.size() == o.packed_maps_.size() &&
-            std::equal(packed_maps_.begin(), packed_maps_.end(), o.packed_maps_.begin());
+            std::equal(packed_maps_.begin(), packed_maps_.end(), o.packed_maps_.begin()) &&
+            flat_n_ == o.flat_n_ && flat_ids_ == o.flat_ids_;
     }
 
     SetSketchIndex &operator=(SetSketchIndex &&o) = default;
@@ -177,6 +234,12 @@ public:
                 assert(j < subtab.size());
                 auto &table = subtab[j];
                 KeyT myhash = hash_index(item, i, j);
+                for(auto [p, e] = find_flat(i, j, myhash); p != e; ++p) {
+                    if(auto rit2 = rset.find(*p); rit2 == rset.end()) {
+                        rset.emplace(*p, 1);
+                        passing_ids.push_back(*p);
+                    } else ++rit2->second;
+                }
                 const std::optional<std::lock_guard<std::mutex>> lock = maybe_lock(mptr, j);
                 auto it = table.find(myhash);
                 if(it == table.end()) {
@@ -310,6 +373,86 @@ public:
         }
         return my_id;
     }
+    /*
+     * Indexes items 0 through n - 1, where item_at(id) returns item id, replacing the index's contents.
+     * Each table is built in two passes: the keys of all items are computed in parallel,
+     * then each subtable counts its keys, assigns each bucket its range, and scatters ids into it in order,
+     * so that ids are contiguous and sorted within each bucket, and no locks are taken.
+     */
+    template<typename ItemAt>
+    void build(size_t n, const ItemAt &item_at) {
+        if(n >= size_t(std::numeric_limits<uint32_t>::max())) throw std::invalid_argument(std::string("Too many items to build SetSketchIndex: ") + std::to_string(n));
+        if(n && item_at(0).size() < m_) throw std::invalid_argument(std::string("Item has wrong size: ") + std::to_string(item_at(0).size()) + ", expected" + std::to_string(m_));
+        for(auto &subtab: packed_maps_) for(auto &map: subtab) map.clear();
+        flat_ids_.clear();
+        flat_slots_.clear();
+        flat_n_ = 0;
+        total_ids_ = n;
+        if(is_bottomk_only_) {
+            // Bottom-k sketches have a key per register, not one per subtable
+            OMP_PFOR
+            for(size_t id = 0; id < n; ++id)
+                insert_bottomk(item_at(id), id);
+            return;
+        }
+        flat_n_ = n;
+        const size_t ntab = packed_maps_.size();
+        flat_ids_.resize(ntab);
+        flat_slots_.resize(ntab);
+        std::vector<KeyT> keys;
+        for(size_t i = 0; i < ntab; ++i) {
+            const size_t nsubs = packed_maps_[i].size();
+            keys.resize(nsubs * n);
+            OMP_PFOR
+            for(size_t id = 0; id < n; ++id) {
+                const auto item = item_at(id);
+                for(size_t j = 0; j < nsubs; ++j)
+                    keys[j * n + id] = hash_index(item, i, j);
+            }
+            auto &ids = flat_ids_[i];
+            ids.resize(nsubs * n);
+            flat_slots_[i].resize(nsubs);
+            OMP_PRAGMA("omp parallel")
+            {
+                // Per-thread scratch: end_ counts each key's items, then serves as its bucket's write cursor once placed
+                std::vector<FlatSlot> counts;
+                std::vector<uint32_t> slot_of(n);
+                OMP_PRAGMA("omp for schedule(dynamic)")
+                for(size_t j = 0; j < nsubs; ++j) {
+                    const KeyT *const subkeys = &keys[j * n];
+                    counts.assign(flat_capacity(2 * n), FlatSlot{KeyT(0), UNPLACED, 0});
+                    const size_t cmask = counts.size() - 1;
+                    size_t nkeys = 0;
+                    for(size_t id = 0; id < n; ++id) {
+                        const KeyT key = subkeys[id];
+                        size_t s = slot_hash(key) & cmask;
+                        while(counts[s].end_ && counts[s].key_ != key) s = (s + 1) & cmask;
+                        if(!counts[s].end_) counts[s].key_ = key, ++nkeys;
+                        ++counts[s].end_;
+                        slot_of[id] = s;
+                    }
+                    auto &slots = flat_slots_[i][j];
+                    slots.assign(flat_capacity(nkeys + nkeys / 3 + 1), FlatSlot{KeyT(0), 0, 0});
+                    const size_t mask = slots.size() - 1;
+                    IdT *const subids = &ids[j * n];
+                    uint32_t offset = 0;
+                    for(size_t id = 0; id < n; ++id) {
+                        FlatSlot &c = counts[slot_of[id]];
+                        if(c.begin_ == UNPLACED) {
+                            // Place buckets in order of their first items, so that items close in id have their buckets close in memory
+                            c.begin_ = offset;
+                            offset += c.end_;
+                            size_t s = slot_hash(c.key_) & mask;
+                            while(slots[s].end_) s = (s + 1) & mask;
+                            slots[s] = FlatSlot{c.key_, c.begin_, offset};
+                            c.end_ = c.begin_;
+                        }
+                        subids[c.end_++] = id;
+                    }
+                }
+            }
+        }
+    }
     INLINE KeyT hashmem256(const uint64_t *x) const {
         hash::CEHasher ceh;
         uint64_t v[4];
@@ -391,6 +534,80 @@ public:
 #undef SINGLE_UPDATE
         return XXH64_digest(&state);
     }
+private:
+    // Candidate ids in the order they are found, with the number of buckets each is found in
+    struct CandidateSet {
+        flat_hash_map<IdT, uint32_t> rset_;
+        std::vector<IdT> ids_;
+        std::vector<uint32_t> items_per_row_;
+        const size_t maxcand_;
+        const bool early_stop_;
+        CandidateSet(size_t maxcand, bool early_stop, size_t nrows): maxcand_(maxcand), early_stop_(early_stop) {
+            rset_.reserve(maxcand); ids_.reserve(maxcand); items_per_row_.reserve(nrows);
+        }
+        bool full() const {return rset_.size() >= maxcand_;}
+        // Counts the ids in [p, e), returning true once maxcand have been found if stopping early
+        bool visit(const IdT *p, const IdT *e) {
+            for(; p != e; ++p) {
+                if(auto rit2 = rset_.find(*p); rit2 == rset_.end()) {
+                    rset_.emplace(*p, 1);
+                    ids_.push_back(*p);
+                    if(early_stop_ && rset_.size() == maxcand_)
+                        return true;
+                } else ++rit2->second;
+            }
+            return false;
+        }
+        std::tuple<std::vector<IdT>, std::vector<uint32_t>, std::vector<uint32_t>> finish() {
+            std::vector<uint32_t> passing_counts(ids_.size());
+            std::transform(ids_.begin(), ids_.end(), passing_counts.begin(), [this](auto x) {return rset_[x];});
+            return std::make_tuple(std::move(ids_), std::move(passing_counts), std::move(items_per_row_));
+        }
+    };
+    // Visits the bucket for key in subtable j of table i, returning true if cs is done
+    bool visit_bucket(CandidateSet &cs, size_t i, size_t j, KeyT key) const {
+        if(const auto [p, e] = find_flat(i, j, key); p != e && cs.visit(p, e))
+            return true;
+        const auto &map = packed_maps_[i][j];
+        if(!map.empty()) {
+            if(auto it = map.find(key); it != map.end())
+                return cs.visit(it->second.data(), it->second.data() + it->second.size());
+        }
+        return false;
+    }
+    /*
+     * Visits subtables from table starting_idx - 1 down to table 0, with key_at(i, j) called once per subtable in that order.
+     * After each subtable's own bucket, the ids extra(p, key) returns as a range are visited,
+     * p being the number of subtables visited before; a caller with items held outside the index
+     * can thereby have them seen where they would be had they been added to it.
+     * Returns the number of subtables visited.
+     */
+    template<typename KeyAt, typename Extra=std::nullptr_t>
+    size_t visit_tables(CandidateSet &cs, const KeyAt &key_at, size_t starting_idx, const Extra &extra=nullptr) const {
+        size_t nvisited = 0;
+        for(std::ptrdiff_t i = starting_idx;--i >= 0 && !cs.full();) {
+            const size_t nsubs = packed_maps_[i].size();
+            const size_t items_before = cs.ids_.size();
+            for(size_t j = 0; j < nsubs; ++j) {
+                const KeyT key = key_at(i, j);
+                bool stop = visit_bucket(cs, i, j, key);
+                if constexpr(!std::is_same_v<Extra, std::nullptr_t>) {
+                    if(!stop) {
+                        const auto [p, e] = extra(nvisited, key);
+                        stop = p != e && cs.visit(p, e);
+                    }
+                }
+                ++nvisited;
+                if(stop) {
+                    cs.items_per_row_.push_back(cs.ids_.size() - items_before);
+                    return nvisited;
+                }
+            }
+            cs.items_per_row_.push_back(cs.ids_.size() - items_before);
+        }
+        return nvisited;
+    }
+public:
     template<typename Sketch>
     std::tuple<std::vector<IdT>, std::vector<uint32_t>, std::vector<uint32_t>>
     query_candidates(const Sketch &item, size_t maxcand, size_t starting_idx = size_t(-1), bool early_stop=true) const {
@@ -400,56 +617,65 @@ public:
          *  to least specific/most sensitive
          *  Can be then used, along with sketches, to select nearest neighbors
          *  */
-        flat_hash_map<IdT, uint32_t> rset;
-        std::vector<IdT> passing_ids;
-        std::vector<uint32_t> items_per_row;
-        rset.reserve(maxcand); passing_ids.reserve(maxcand); items_per_row.reserve(starting_idx);
+        CandidateSet cs(maxcand, early_stop, starting_idx);
         if(is_bottomk_only_) {
             auto &m = packed_maps_.front().front();
-            for(size_t j = 0; j < item.size() && rset.size() < maxcand; ++j) {
-                if(auto it = m.find(item[j]); it != m.end()) {
-                    for(const auto id: it->second) {
-                        auto rit2 = rset.find(id);
-                        if(rit2 == rset.end()) {
-                            rset.emplace(id, 1);
-                            passing_ids.push_back(id);
-                            if(early_stop && rset.size() == maxcand)
-                                goto bk_end;
-                        } else ++rit2->second;
-                    }
-                }
+            for(size_t j = 0; j < item.size() && !cs.full(); ++j) {
+                if(auto it = m.find(item[j]); it != m.end() && cs.visit(it->second.data(), it->second.data() + it->second.size()))
+                    break;
             }
-            bk_end:
-            items_per_row.push_back(passing_ids.size());
+            cs.items_per_row_.push_back(cs.ids_.size());
         } else {
-            for(std::ptrdiff_t i = starting_idx;--i >= 0 && rset.size() < maxcand;) {
-                auto &m = packed_maps_[i];
-                const size_t nsubs = m.size();
-                const size_t items_before = passing_ids.size();
-                for(size_t j = 0; j < nsubs; ++j) {
-                    KeyT myhash = hash_index(item, i, j);
-                    auto it = m[j].find(myhash);
-                    if(it != m[j].end()) {
-                        for(const auto id: it->second) {
-                            //auto rit2 = rset.find(id);
-                            if(auto rit2 = rset.find(id); rit2 == rset.end()) {
-                                rset.emplace(id, 1);
-                                passing_ids.push_back(id);
-                                if(early_stop && rset.size() == maxcand) {
-                                    items_per_row.push_back(passing_ids.size() - items_before);
-                                    goto end;
-                                }
-                            } else ++rit2->second;
-                        }
-                    }
-                }
-                items_per_row.push_back(passing_ids.size() - items_before);
-            }
+            visit_tables(cs, [&](size_t i, size_t j) {return hash_index(item, i, j);}, starting_idx);
         }
-        end:
-        std::vector<uint32_t> passing_counts(passing_ids.size());
-        std::transform(passing_ids.begin(), passing_ids.end(), passing_counts.begin(), [&rset](auto x) {return rset[x];});
-        return std::make_tuple(passing_ids, passing_counts, items_per_row);
+        return cs.finish();
+    }
+    /*
+     * Queries and updates by precomputed keys, so that an item hashed once can be queried against several indexes and inserted later.
+     * Keys are laid out in the order queries visit subtables: table by table from the last (most specific) to the first,
+     * and subtable by subtable within each. Not supported by bottom-k indexes, which key items by their registers.
+     */
+    size_t nkeys() const {
+        size_t ret = 0;
+        for(const auto &subtab: packed_maps_) ret += subtab.size();
+        return ret;
+    }
+    // Writes item's nkeys() keys to keys
+    template<typename Sketch>
+    void hash_keys(const Sketch &item, KeyT *keys) const {
+        for(std::ptrdiff_t i = packed_maps_.size(); --i >= 0;)
+            for(size_t j = 0, nsubs = packed_maps_[i].size(); j < nsubs; ++j)
+                *keys++ = hash_index(item, i, j);
+    }
+    // As query_candidates, over all tables, with extra(p, key) visited after the bucket of the pth key (see visit_tables).
+    // If nvisited is non-null, it is set to the number of keys visited; only those can affect the result.
+    template<typename Extra=std::nullptr_t>
+    std::tuple<std::vector<IdT>, std::vector<uint32_t>, std::vector<uint32_t>>
+    query_keys(const KeyT *keys, size_t maxcand, const Extra &extra=nullptr, bool early_stop=true, size_t *nvisited=nullptr) const {
+        assert(!is_bottomk_only_);
+        CandidateSet cs(maxcand, early_stop, packed_maps_.size());
+        const size_t nv = visit_tables(cs, [&keys](size_t, size_t) {return *keys++;}, packed_maps_.size(), extra);
+        if(nvisited) *nvisited = nv;
+        return cs.finish();
+    }
+    // Adds n items with ids first_id, first_id + 1, ..., whose keys are at keys_at(k), to the hash maps, in order of id.
+    // Subtables are filled in parallel for large batches; this must not run concurrently with other updates.
+    template<typename KeysAt>
+    void insert_keys(size_t n, const KeysAt &keys_at, size_t first_id) {
+        assert(!is_bottomk_only_);
+        if(!n) return;
+        std::vector<std::pair<uint32_t, uint32_t>> subs; // (table, subtable), indexed by key position
+        for(std::ptrdiff_t i = packed_maps_.size(); --i >= 0;)
+            for(size_t j = 0, nsubs = packed_maps_[i].size(); j < nsubs; ++j)
+                subs.emplace_back(i, j);
+        const size_t ns = subs.size();
+        OMP_PRAGMA("omp parallel for schedule(dynamic) if(n * ns >= 65536)")
+        for(size_t p = 0; p < ns; ++p) {
+            auto &map = packed_maps_[subs[p].first][subs[p].second];
+            for(size_t k = 0; k < n; ++k)
+                map[keys_at(k)[p]].push_back(first_id + k);
+        }
+        total_ids_ = std::max(total_ids_, first_id + n);
     }
     void write(std::string path) const {
         gzFile fp = gzopen(&path[0], "w");
@@ -470,7 +696,12 @@ public:
         gzwrite(fp, &islocked, 1);
         for(size_t i = 0; i < packed_maps_.size(); ++i) {
             for(size_t j = 0; j < packed_maps_[i].size(); ++j) {
-                auto &map = packed_maps_[i][j];
+                // Fold the flat layout back into the hash maps' format
+                HashMap map;
+                for_each_bucket(i, j, [&map](KeyT key, const IdT *ids, size_t nids) {
+                    auto &v = map[key];
+                    v.insert(v.end(), ids, ids + nids);
+                });
                 uint64_t sz = map.size();
                 gzwrite(fp, &sz, sizeof(sz));
                 for(auto &pair: map) {
@@ -535,6 +766,9 @@ public:
         packed_maps_.clear();
         mutexes_.clear();
         regs_per_reg_.clear();
+        flat_n_ = 0;
+        flat_ids_.clear();
+        flat_slots_.clear();
     }
 };
 
@@ -0,0 +1,199 @@
+#include "stackdb.h"
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+namespace {
+// Closes a file descriptor on scope exit
+struct FDHolder {
+    int fd_;
+    FDHolder(const std::string &path, int flags, mode_t mode=0644): fd_(::open(path.data(), flags, mode)) {
+        if(fd_ < 0) THROW_EXCEPTION(std::runtime_error("Failed to open "s + path + ": " + std::strerror(errno)));
+    }
+    ~FDHolder() {::close(fd_);}
+    operator int() const {return fd_;}
+};
+}
+
+static void pwrite_all(int fd, const void *src, size_t nb, size_t offset, const std::string &path) {
+    for(const char *p = static_cast<const char *>(src); nb;) {
+        const ssize_t rc = ::pwrite(fd, p, nb, offset);
+        if(rc < 0) {
+            if(errno == EINTR) continue;
+            THROW_EXCEPTION(std::runtime_error("Failed to write to "s + path + ": " + std::strerror(errno)));
+        }
+        p += rc; nb -= rc; offset += rc;
+    }
+}
+
+static void pread_all(int fd, void *dst, size_t nb, size_t offset, const std::string &path) {
+    for(char *p = static_cast<char *>(dst); nb;) {
+        const ssize_t rc = ::pread(fd, p, nb, offset);
+        if(rc <= 0) {
+            if(rc < 0 && errno == EINTR) continue;
+            THROW_EXCEPTION(std::runtime_error("Failed to read from "s + path + ": " + (rc ? std::strerror(errno): "unexpected end of file")));
+        }
+        p += rc; nb -= rc; offset += rc;
+    }
+}
+
+static void sync_fd(int fd, const std::string &path) {
+    if(::fsync(fd)) THROW_EXCEPTION(std::runtime_error("Failed to sync "s + path + ": " + std::strerror(errno)));
+}
+
+bool read_stacked_header(const std::string &path, StackedHeader &hdr) {
+    std::FILE *fp = bfopen(path.data(), "rb");
+    if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open "s + path));
+    const bool ret = std::fread(&hdr, sizeof(hdr), 1, fp) == 1 && !std::memcmp(hdr.magic_, StackedHeader::MAGIC, sizeof(hdr.magic_));
+    std::fclose(fp);
+    return ret;
+}
+
+// Writes the first n entities of the stacked sketches at path (whose cardinalities and registers start at cardoff and regoff)
+// to a new file in the appendable layout, with room for capacity entities, and moves it over path.
+// A crash leaves either the old or the new file in place.
+static StackedHeader rewrite_stacked(const std::string &path, size_t n, size_t m, size_t cardoff, size_t regoff, size_t names_bytes, size_t capacity) {
+    StackedHeader hdr{};
+    std::memcpy(hdr.magic_, StackedHeader::MAGIC, sizeof(hdr.magic_));
+    hdr.nentities_ = n;
+    hdr.names_bytes_ = names_bytes;
+    hdr.sketchsize_ = m;
+    hdr.capacity_ = capacity;
+    const std::string tmppath = path + ".tmp";
+    {
+        FDHolder ofd(tmppath, O_WRONLY | O_CREAT | O_TRUNC);
+        pwrite_all(ofd, &hdr, sizeof(hdr), 0, tmppath);
+        if(n) {
+            FDHolder ifd(path, O_RDONLY);
+            std::vector<char> buf(1 << 20);
+            auto copy = [&](size_t src, size_t dst, size_t nb) {
+                while(nb) {
+                    const size_t chunk = std::min(nb, buf.size());
+                    pread_all(ifd, buf.data(), chunk, src, path);
+                    pwrite_all(ofd, buf.data(), chunk, dst, tmppath);
+                    src += chunk; dst += chunk; nb -= chunk;
+                }
+            };
+            copy(cardoff, hdr.cardinality_offset(), n * sizeof(double));
+            copy(regoff, hdr.register_offset(), n * m * sizeof(RegT));
+        }
+        // Unused cardinality slots stay sparse
+        if(::ftruncate(ofd, hdr.register_offset() + n * m * sizeof(RegT)))
+            THROW_EXCEPTION(std::runtime_error("Failed to resize "s + tmppath + ": " + std::strerror(errno)));
+        sync_fd(ofd, tmppath);
+    }
+    if(std::rename(tmppath.data(), path.data()))
+        THROW_EXCEPTION(std::runtime_error("Failed to move "s + tmppath + " to " + path + ": " + std::strerror(errno)));
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Rewrote %zu stacked sketches at %s with room for %zu\n", n, path.data(), capacity);
+    }
+    return hdr;
+}
+
+void finalize_stacked(const std::string &path, size_t n, size_t sketchsize, size_t capacity, const double *cards, uint64_t names_bytes) {
+    if(n > capacity)
+        THROW_EXCEPTION(std::invalid_argument("Cannot commit "s + std::to_string(n) + " stacked sketches with room for " + std::to_string(capacity)));
+    StackedHeader hdr{};
+    std::memcpy(hdr.magic_, StackedHeader::MAGIC, sizeof(hdr.magic_));
+    hdr.nentities_ = n;
+    hdr.names_bytes_ = names_bytes;
+    hdr.sketchsize_ = sketchsize;
+    hdr.capacity_ = capacity;
+    FDHolder fd(path, O_RDWR);
+    pwrite_all(fd, cards, n * sizeof(double), hdr.cardinality_offset(), path);
+    pwrite_all(fd, &hdr, sizeof(hdr), 0, path);
+}
+
+size_t append_stacked(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result) {
+    if(opts.kmer_result_ > FULL_SETSKETCH)
+        THROW_EXCEPTION(std::invalid_argument("Only sketches can be appended to stacked sketches; k-mer sets and minimizer sequences cannot."));
+    if(opts.sketch_compressed_set)
+        THROW_EXCEPTION(std::invalid_argument("Compressed sketches (--setsketch-ab/--fastcmp with sketching) cannot be appended to stacked sketches."));
+    const size_t nnew = result.names_.size(), m = opts.sketchsize_;
+    if(result.signatures_.size() != nnew * m || result.cardinalities_.size() != nnew)
+        THROW_EXCEPTION(std::runtime_error("Expected "s + std::to_string(nnew) + " sketches of size " + std::to_string(m) + ", found " + std::to_string(result.signatures_.size()) + " registers and " + std::to_string(result.cardinalities_.size()) + " cardinalities"));
+    const std::string namesf = path + ".names.txt";
+    StackedHeader hdr;
+    if(!bns::isfile(path)) {
+        // Start an empty database
+        std::FILE *fp = bfopen(namesf.data(), "wb");
+        if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open "s + namesf + " for writing"));
+        std::fputs("#Name\tCardinality\n", fp);
+        std::fclose(fp);
+        hdr = rewrite_stacked(path, 0, m, 0, 0, bns::filesize(namesf.data()), std::max(2 * nnew, size_t(64)));
+    } else if(!read_stacked_header(path, hdr)) {
+        // One-shot layout: convert it, reserving room for the new entities and as many again
+        FDHolder ifd(path, O_RDONLY);
+        uint64_t lhdr[2];
+        pread_all(ifd, lhdr, sizeof(lhdr), 0, path);
+        const size_t n = lhdr[0], lm = lhdr[1];
+        if(lm != m)
+            THROW_EXCEPTION(std::invalid_argument("Stacked sketches at "s + path + " have sketch size " + std::to_string(lm) + "; new sketches have " + std::to_string(m)));
+        if(const size_t expected = 2 * sizeof(uint64_t) + n * sizeof(double) + n * m * sizeof(RegT), actual = bns::filesize(path.data()); actual != expected)
+            THROW_EXCEPTION(std::runtime_error("Stacked sketches at "s + path + " have size " + std::to_string(actual) + "; expected " + std::to_string(expected)));
+        if(!bns::isfile(namesf)) {
+            // Name existing entities by index, as load_results does, so that appended names line up
+            std::vector<double> cards(n);
+            pread_all(ifd, cards.data(), n * sizeof(double), 2 * sizeof(uint64_t), path);
+            std::FILE *fp = bfopen(namesf.data(), "wb");
+            if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open "s + namesf + " for writing"));
+            std::fputs("#Name\tCardinality\n", fp);
+            for(size_t i = 0; i < n; ++i) {
+                std::fprintf(fp, "%zu", i);
+                std::fprintf(fp, tfmt<double>, cards[i]);
+                std::fputc('\n', fp);
+            }
+            std::fclose(fp);
+        }
+        hdr = rewrite_stacked(path, n, m, 2 * sizeof(uint64_t), 2 * sizeof(uint64_t) + n * sizeof(double), bns::filesize(namesf.data()), std::max(2 * (n + nnew), size_t(64)));
+    } else if(hdr.sketchsize_ != m) {
+        THROW_EXCEPTION(std::invalid_argument("Stacked sketches at "s + path + " have sketch size " + std::to_string(hdr.sketchsize_) + "; new sketches have " + std::to_string(m)));
+    }
+    if(hdr.nentities_ + nnew > hdr.capacity_)
+        hdr = rewrite_stacked(path, hdr.nentities_, m, hdr.cardinality_offset(), hdr.register_offset(), hdr.names_bytes_, 2 * (hdr.nentities_ + nnew));
+    const size_t n = hdr.nentities_;
+    FDHolder fd(path, O_RDWR);
+    // Registers and cardinalities, overwriting (and truncating) anything left by an interrupted append
+    pwrite_all(fd, result.signatures_.data(), nnew * m * sizeof(RegT), hdr.register_offset() + n * m * sizeof(RegT), path);
+    pwrite_all(fd, result.cardinalities_.data(), nnew * sizeof(double), hdr.cardinality_offset() + n * sizeof(double), path);
+    if(::ftruncate(fd, hdr.register_offset() + (n + nnew) * m * sizeof(RegT)))
+        THROW_EXCEPTION(std::runtime_error("Failed to resize "s + path + ": " + std::strerror(errno)));
+    sync_fd(fd, path);
+    // Then names, after the committed portion of the names file
+    uint64_t names_bytes = hdr.names_bytes_;
+    {
+        FDHolder nfd(namesf, O_RDWR | O_CREAT);
+        std::string buf;
+        if(names_bytes) {
+            char last;
+            pread_all(nfd, &last, 1, names_bytes - 1, namesf);
+            if(last != '\n') buf += '\n';
+        }
+        char cbuf[64];
+        for(size_t i = 0; i < nnew; ++i) {
+            buf += result.names_[i];
+            buf.append(cbuf, std::snprintf(cbuf, sizeof(cbuf), tfmt<double>, result.cardinalities_[i]));
+            buf += '\n';
+        }
+        pwrite_all(nfd, buf.data(), buf.size(), names_bytes, namesf);
+        names_bytes += buf.size();
+        if(::ftruncate(nfd, names_bytes))
+            THROW_EXCEPTION(std::runtime_error("Failed to resize "s + namesf + ": " + std::strerror(errno)));
+        sync_fd(nfd, namesf);
+    }
+    // Commit
+    const uint64_t commit[2] = {n + nnew, names_bytes};
+    static_assert(offsetof(StackedHeader, names_bytes_) == offsetof(StackedHeader, nentities_) + sizeof(uint64_t), "nentities_ and names_bytes_ must be adjacent");
+    pwrite_all(fd, commit, sizeof(commit), offsetof(StackedHeader, nentities_), path);
+    sync_fd(fd, path);
+    if(verbosity >= Verbosity::INFO) {
+        std::fprintf(stderr, "Appended %zu sketches to %s, which now holds %zu\n", nnew, path.data(), n + nnew);
+    }
+    return n;
+}
+
+} // namespace dashing2
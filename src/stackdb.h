@@ -0,0 +1,52 @@
+#pragma once
+#ifndef DASHING2_STACKDB_H__
+#define DASHING2_STACKDB_H__
+#include "cmp_main.h"
+
+namespace dashing2 {
+
+/*
+ * Appendable stacked sketch databases
+ *
+ * `dashing2 sketch -o <path>` writes stacked sketches in one shot:
+ *   u64 nentities, u64 sketchsize, f64 cardinalities[nentities], RegT registers[nentities * sketchsize]
+ * Because the cardinalities precede the registers, this layout cannot grow in place.
+ * The first `dashing2 sketch --append -o <path>` rewrites it into the appendable layout:
+ *   StackedHeader
+ *   f64 cardinalities[capacity]           slots past nentities are unused
+ *   RegT registers[nentities * sketchsize]
+ * Appends write new registers past the end of the file and new cardinalities into free slots, then append names,
+ * and only then commit by updating nentities and names_bytes in a single 16-byte write.
+ * A crash before the commit leaves the previous database intact: readers ignore the uncommitted tail,
+ * and the next append overwrites it.
+ * When the cardinality slots run out, the database is rewritten with twice the capacity, so appends cost amortized O(new).
+ * `dashing2 sketch --parse-by-seq -o <path>` writes this layout directly, as it streams registers out
+ * before it knows how many sequences there are.
+ */
+struct StackedHeader {
+    static constexpr char MAGIC[8] = {'D', '2', 'S', 'T', 'A', 'C', 'K', '1'};
+    char magic_[8];
+    uint64_t nentities_;
+    uint64_t names_bytes_; // Committed length of <path>.names.txt
+    uint64_t sketchsize_;
+    uint64_t capacity_;
+    uint64_t reserved_;
+    size_t cardinality_offset() const {return sizeof(StackedHeader);}
+    size_t register_offset() const {return sizeof(StackedHeader) + capacity_ * sizeof(double);}
+};
+static_assert(sizeof(StackedHeader) == 48, "StackedHeader must be packed");
+
+// Reads the header of the stacked sketches at path.
+// Returns false if they are in the one-shot layout, which has no StackedHeader.
+bool read_stacked_header(const std::string &path, StackedHeader &hdr);
+
+// Commits stacked sketches in the appendable layout whose registers have already been written at register_offset(),
+// by writing their cardinalities and then the header
+void finalize_stacked(const std::string &path, size_t n, size_t sketchsize, size_t capacity, const double *cards, uint64_t names_bytes);
+
+// Appends result's sketches, cardinalities and names to the stacked sketches at path, and returns the number of entities before the append
+size_t append_stacked(const std::string &path, const Dashing2DistOptions &opts, const SketchingResult &result);
+
+} // namespace dashing2
+
+#endif
@@ -0,0 +1,145 @@
+#include "tilecmp.h"
+#include "kernels.h"
+
+namespace dashing2 {
+using namespace std::literals::string_literals;
+
+#if COUNT_COMPARE_CALLS
+extern std::atomic<uint64_t> compare_count;
+#endif
+
+// Tag type for 4-bit registers, which are packed two per byte
+struct NibbleTag {};
+
+template<typename T, TileComparator::Kernel K, typename RT>
+static INLINE std::pair<uint64_t, uint64_t> count_pair(const KernelTable &kern, const RT *lhs, const RT *rhs, const size_t m) {
+    static constexpr bool EQ = K == TileComparator::TILE_BBIT || K == TileComparator::TILE_EXACTREG;
+    if constexpr(std::is_same_v<T, NibbleTag>) {
+        if constexpr(EQ) {
+            return {kern.count_eq_nibbles(lhs, rhs, m), 0};
+        } else {
+            return kern.count_gtlt_nibbles(lhs, rhs, m);
+        }
+    } else {
+        if constexpr(EQ) {
+            return {kern.count_eq(lhs, rhs, m), 0};
+        } else {
+            return kern.count_gtlt(lhs, rhs, m);
+        }
+    }
+}
+
+TileComparator::TileComparator(const Dashing2DistOptions &opts, const SketchingResult &result):
+    cards_(result.cardinalities_.data()), m_(opts.sketchsize_), fin_(opts)
+{
+    if(result.cardinalities_.empty() || !m_) return;
+    if(opts.compressed_ptr_) {
+        regs_ = opts.compressed_ptr_;
+        width_ = int(2. * opts.fd_level_);
+        kernel_ = opts.truncation_method_ > 0 ? TILE_BBIT: TILE_SETSKETCH;
+    } else if(opts.sspace_ == SPACE_EDIT_DISTANCE && (opts.exact_kmer_dist_ || opts.measure_ == M_EDIT_DISTANCE)) {
+        return;
+    } else if(opts.kmer_result_ <= FULL_SETSKETCH) {
+        width_ = 2 * sizeof(RegT);
+        if(opts.sspace_ == SPACE_SET && opts.truncation_method_ <= 0) {
+            regs_ = result.signatures_.data();
+            kernel_ = TILE_FULLSET;
+        } else {
+            const RegT *sptr = result.signatures_.data();
+            if constexpr(sizeof(RegT) == 8) {
+                // As in compare(), compare the sampled k-mers themselves when available
+                if(result.kmers_.size() == result.signatures_.size() && !opts.use128())
+                    sptr = reinterpret_cast<const RegT *>(result.kmers_.data());
+            }
+            regs_ = sptr;
+            kernel_ = TILE_EXACTREG;
+        }
+    }
+    if(kernel_ == TILE_NONE) return;
+    static constexpr size_t cache_size =
+#ifdef D2_CACHE_SIZE
+        D2_CACHE_SIZE;
+#else
+        0x400000; // 2^22 bytes, ~= 4 million
+#endif
+    // Half of the cache holds the column tile; the rest is left for the row being swept and the output.
+    const size_t nb = std::max(bytes_per_sketch(), size_t(1));
+    tile_cols_ = std::max(cache_size / 2 / nb, size_t(1));
+    tile_rows_ = std::clamp(cache_size / 4 / nb, size_t(8), size_t(64));
+    if(verbosity >= Verbosity::DEBUG) {
+        std::fprintf(stderr, "Tiled comparisons: kernel %d, %zu bytes per sketch, %zu columns per tile, %zu rows per block\n", int(kernel_), nb, tile_cols_, tile_rows_);
+    }
+}
+
+template<typename T, TileComparator::Kernel K>
+void TileComparator::fill_impl(size_t rowstart, size_t rowend, size_t colstart, size_t colend, float *const *rows, bool upper) const {
+    static constexpr bool NIBBLE = std::is_same_v<T, NibbleTag>;
+    using RT = std::conditional_t<NIBBLE, uint8_t, T>;
+    const RT *const regs = static_cast<const RT *>(regs_);
+    const size_t m = m_, stride = NIBBLE ? m / 2: m;
+    const double *const cards = cards_;
+    const KernelTable &kern = kernels();
+#if COUNT_COMPARE_CALLS
+    size_t ncmp = 0;
+#endif
+    // Each column tile stays in cache while every row is compared against it
+    for(size_t cs = colstart; cs < colend; cs += tile_cols_) {
+        const size_t ce = std::min(cs + tile_cols_, colend);
+        for(size_t i = rowstart; i < rowend; ++i) {
+            const RT *const lhs = regs + i * stride;
+            const long double lhcard = cards[i];
+            float *const dst = rows[i - rowstart];
+            size_t j = upper ? std::max(cs, i + 1): cs;
+#if COUNT_COMPARE_CALLS
+            ncmp += ce > j ? ce - j: 0;
+#endif
+            for(; j < ce; ++j) {
+                const auto [first, second] = count_pair<T, K>(kern, lhs, regs + j * stride, m);
+                const long double rhcard = cards[j];
+                long double ret;
+                if constexpr(K == TILE_BBIT) ret = fin_.bbit(first, lhcard, rhcard);
+                else if constexpr(K == TILE_SETSKETCH) ret = fin_.setsketch(first, second, lhcard, rhcard);
+                else if constexpr(K == TILE_FULLSET) ret = fin_.fullsetsketch(first, second, lhcard, rhcard);
+                else ret = fin_.exactreg(first, lhcard, rhcard);
+                dst[j] = MeasureFinalizer::finish(ret);
+            }
+        }
+    }
+#if COUNT_COMPARE_CALLS
+    compare_count += ncmp;
+#endif
+}
+
+// The tile loops are compiled per ISA level, and the CPU's is selected (kernels.h)
+void TileComparator::fill(size_t rowstart, size_t rowend, size_t colstart, size_t colend, float *const *rows, bool upper) const {
+    if(rowstart >= rowend || colstart >= colend) return;
+#define TILE_WIDTH_DISPATCH(KERN) \
+        switch(width_) {\
+            case 16: return fill_impl<uint64_t, KERN>(rowstart, rowend, colstart, colend, rows, upper);\
+            case 8: return fill_impl<uint32_t, KERN>(rowstart, rowend, colstart, colend, rows, upper);\
+            case 4: return fill_impl<uint16_t, KERN>(rowstart, rowend, colstart, colend, rows, upper);\
+            case 2: return fill_impl<uint8_t, KERN>(rowstart, rowend, colstart, colend, rows, upper);\
+            case 1: return fill_impl<NibbleTag, KERN>(rowstart, rowend, colstart, colend, rows, upper);\
+        }
+    dispatched([&]() {
+        switch(kernel_) {
+            case TILE_BBIT: TILE_WIDTH_DISPATCH(TILE_BBIT) break;
+            case TILE_SETSKETCH: TILE_WIDTH_DISPATCH(TILE_SETSKETCH) break;
+            // Full-precision registers are compared as RegT, as in compare()
+            case TILE_FULLSET: return fill_impl<RegT, TILE_FULLSET>(rowstart, rowend, colstart, colend, rows, upper);
+            case TILE_EXACTREG: return fill_impl<RegT, TILE_EXACTREG>(rowstart, rowend, colstart, colend, rows, upper);
+            default: break;
+        }
+        THROW_EXCEPTION(std::runtime_error("TileComparator has no kernel for register width "s + std::to_string(width_ / 2.) + " bytes"));
+    });
+#undef TILE_WIDTH_DISPATCH
+}
+
+LSHDistType TileComparator::operator()(size_t i, size_t j) const {
+    float ret;
+    float *const row = &ret - j;
+    fill(i, i + 1, j, j + 1, &row);
+    return ret;
+}
+
+} // namespace dashing2
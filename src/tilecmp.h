@@ -0,0 +1,174 @@
+#pragma once
+#ifndef DASHING2_TILECMP_H__
+#define DASHING2_TILECMP_H__
+#include "cmp_main.h"
+
+namespace dashing2 {
+
+static inline long double g_b(long double b, long double arg) {
+    return (1.L - std::pow(b, -arg)) / (1.L - 1.L / b);
+}
+
+/*
+ * Converts register match counts into the requested measure.
+ * This is shared between compare() and the tiled engine so that
+ * both produce bit-identical results.
+ */
+struct MeasureFinalizer {
+    Measure measure_;
+    long double invdenom_;
+    long double b2pow_; // Collision correction for b-bit signatures
+    long double b_;     // Base for truncated setsketch registers
+    bool transform_gb_;
+    double poisson_mult_;
+    MeasureFinalizer(const Dashing2DistOptions &opts):
+        measure_(opts.measure_), invdenom_(1.L / opts.sketchsize_),
+        b2pow_(-std::ldexp(1.L, -static_cast<int>(opts.fd_level_ * 8.))),
+        b_(opts.compressed_b_), transform_gb_(opts.fd_level_ < sizeof(RegT)),
+        poisson_mult_(-1. / std::max(1, opts.k_))
+    {}
+    template<typename T>
+    INLINE double sim2dist(T x) const {
+        if(x) return std::log(2. * x / (1. + x)) * poisson_mult_;
+        return std::numeric_limits<double>::infinity();
+    }
+    static INLINE long double finish(long double ret) {
+        if(std::isnan(ret) || std::isinf(ret)) ret = std::numeric_limits<long double>::max();
+        return ret;
+    }
+    // b-bit signatures: number of equal registers
+    INLINE long double bbit(uint64_t neq, long double lhcard, long double rhcard) const {
+        // ret = ((num / denom) - (1. / 2^b)) / (1. - 1. / 2^b);
+        // maps equality to 1 and down-estimates for account for collisions
+        long double ret = std::max(0.L, std::fma(neq, invdenom_, b2pow_) / (1.L + b2pow_));
+        if(measure_ == INTERSECTION || measure_ == UNION_SIZE) {
+            const long double isz = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L);
+            if(measure_ == INTERSECTION) {
+                ret = isz;
+            } else { // UNION_SIZE
+                ret = lhcard + rhcard - isz;
+            }
+        } else if(measure_ == CONTAINMENT)
+            ret = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L) * ret / lhcard;
+        else if(measure_ == POISSON_LLR)
+            ret = sim2dist(ret);
+        else if(measure_ == SYMMETRIC_CONTAINMENT)
+            ret = std::max((lhcard + rhcard) / (2.L - (1.L - ret)), 0.L) * ret / std::min(lhcard, rhcard);
+        return ret;
+    }
+    // Truncated setsketch registers: counts of (lhs > rhs, lhs < rhs)
+    INLINE long double setsketch(uint64_t ngt, uint64_t nlt, long double lhcard, long double rhcard) const {
+        long double alpha = ngt * invdenom_;
+        long double beta = nlt * invdenom_;
+        long double mu;
+        if(transform_gb_) {
+            alpha = g_b(b_, alpha);
+            beta = g_b(b_, beta);
+        }
+        if(alpha + beta >= 1.) {
+            mu = lhcard + rhcard;
+        } else {
+            mu = std::max((lhcard + rhcard) / (2.L - alpha - beta), 0.L);
+        }
+        long double ret = std::max(1.L - (alpha + beta), 0.L);
+        switch(measure_) {
+            case INTERSECTION: ret *= mu; break;
+            case UNION_SIZE: ret = lhcard + rhcard - (ret * mu); break;
+            case CONTAINMENT: ret  = ret * mu / lhcard; break;
+            case SYMMETRIC_CONTAINMENT:
+                ret = (ret * mu) / std::min(lhcard, rhcard); break;
+            case POISSON_LLR: ret = sim2dist(ret); break;
+            default: ;
+        }
+        return ret;
+    }
+    // Full-precision continuous setsketch registers
+    INLINE long double fullsetsketch(uint64_t ngt, uint64_t nlt, long double lhcard, long double rhcard) const {
+        const long double alpha = ngt * invdenom_, beta = nlt * invdenom_;
+        long double eq = (1. - alpha - beta);
+        const long double ucard = std::max((lhcard + rhcard) / (2.L - alpha - beta), 0.L);
+        if(eq <= 0.) {
+            return measure_ != POISSON_LLR ? 0.: std::numeric_limits<double>::max();
+        }
+        static constexpr long double EPS = 1e-15;
+        if(eq <= EPS) {
+            eq = 0;
+        }
+        const LSHDistType isz = ucard * eq, sim = eq;
+        long double ret;
+        switch(measure_) {
+            case SIMILARITY: ret = sim; break;
+            case INTERSECTION: ret = isz; break;
+            case CONTAINMENT: ret = isz / rhcard; break;
+            case SYMMETRIC_CONTAINMENT: ret = isz / (std::min(lhcard, rhcard)); break;
+            case POISSON_LLR: ret = sim2dist(sim); break;
+            case UNION_SIZE: ret = lhcard + rhcard - isz; break;
+            default: ret = LSHDistType(-1); break; // This never happens
+        }
+        return ret;
+    }
+    // Exact-match registers (one-permutation, multiset and probability sketches)
+    INLINE long double exactreg(uint64_t neq, long double lhcard, long double rhcard) const {
+        long double ret = invdenom_ * neq;
+        if(measure_ == INTERSECTION) {
+            ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L);
+        } else if(measure_ == SYMMETRIC_CONTAINMENT) ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L) / std::min(lhcard, rhcard);
+        else if(measure_ == CONTAINMENT) ret *= std::max((lhcard + rhcard) / (1.L + ret), 0.L) / lhcard;
+        else if(measure_ == POISSON_LLR) ret = sim2dist(ret);
+        else if(measure_ == UNION_SIZE) {
+            const long double isz = ret * std::max((lhcard + rhcard) / (1.L + ret), 0.L);
+            ret = (lhcard + rhcard - isz);
+        }
+        return ret;
+    }
+};
+
+/*
+ * TileComparator
+ * Resolves the register width, truncation method and measure once,
+ * and then fills blocks of the output matrix using tiles of columns sized to stay
+ * resident in cache (D2_CACHE_SIZE) while every row in a batch is swept across them.
+ *
+ * Only sketch comparisons are handled; exact k-mer and edit-distance comparisons
+ * report !*this, and callers should fall back to compare().
+ */
+class TileComparator {
+public:
+    enum Kernel: int {
+        TILE_NONE,
+        TILE_BBIT,       // count_eq on compressed b-bit signatures
+        TILE_SETSKETCH,  // count_gtlt on truncated setsketch registers
+        TILE_FULLSET,    // count_gtlt on full-precision setsketch registers
+        TILE_EXACTREG    // count_eq on full-precision registers or sampled k-mers
+    };
+private:
+    const void *regs_ = nullptr;
+    const double *cards_ = nullptr;
+    size_t m_ = 0;
+    int width_ = 0; // 2 * bytes per register; 1 means nibbles
+    Kernel kernel_ = TILE_NONE;
+    size_t tile_cols_ = 1;
+    size_t tile_rows_ = 1;
+    MeasureFinalizer fin_;
+    template<typename T, Kernel K>
+    void fill_impl(size_t rowstart, size_t rowend, size_t colstart, size_t colend, float *const *rows, bool upper) const;
+public:
+    TileComparator(const Dashing2DistOptions &opts, const SketchingResult &result);
+    explicit operator bool() const {return kernel_ != TILE_NONE;}
+    Kernel kernel() const {return kernel_;}
+    // Number of sketches per column tile
+    size_t tile_cols() const {return tile_cols_;}
+    // Number of rows per output block, so that a column tile is reused across them
+    size_t tile_rows() const {return tile_rows_;}
+    size_t bytes_per_sketch() const {return width_ == 1 ? m_ / 2: m_ * (width_ / 2);}
+    // Computes rows [rowstart, rowend) against columns [colstart, colend),
+    // writing the value for (i, j) to rows[i - rowstart][j].
+    // If upper is set, only j > i is computed (upper-triangular output).
+    void fill(size_t rowstart, size_t rowend, size_t colstart, size_t colend, float *const *rows, bool upper=false) const;
+    // Single pair, using the resolved kernel.
+    LSHDistType operator()(size_t i, size_t j) const;
+};
+
+} // namespace dashing2
+
+#endif
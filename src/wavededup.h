@@ -0,0 +1,177 @@
+#pragma once
+#ifndef DASHING2_WAVEDEDUP_H__
+#define DASHING2_WAVEDEDUP_H__
+#include "src/ssi.h"
+#include <chrono>
+
+namespace dashing2 {
+
+/*
+ * Greedy deduplication in waves
+ *
+ * Greedy clustering visits items in a fixed order: each joins the most similar cluster among its LSH candidates
+ * if it is similar enough, and otherwise founds a new cluster whose representative is added to the index.
+ * One item at a time, this is serial. wave_dedup takes runs of consecutive items instead:
+ *   query:   each item of the wave is hashed, queried against the index as it stood when the wave began,
+ *            and scored against its candidates, in parallel
+ *   resolve: items are decided in order. An item whose query visited no key shared with a representative founded
+ *            earlier in the wave keeps its result. Others are re-queried with the wave's representatives visited
+ *            where the index would hold them (at the ends of buckets), and scored against those alone,
+ *            since their other candidates were scored in the query phase
+ *   insert:  the wave's representatives are added to the index, subtables in parallel
+ * Clusters, representatives and the order of members are therefore those of the serial loop,
+ * for any number of threads and any wave size. Waves grow while few items need re-querying and shrink when many do.
+ */
+
+// Representatives founded in the current wave, by key position and key, in order of id.
+// Buckets keep their capacity from wave to wave.
+template<typename KeyT, typename IdT>
+class WaveBuckets {
+    std::vector<flat_hash_map<KeyT, uint32_t>> maps_; // Per key position, key to bucket
+    std::vector<std::vector<IdT>> buckets_;
+    size_t nbuckets_ = 0, size_ = 0;
+public:
+    WaveBuckets(size_t nkeys): maps_(nkeys) {}
+    size_t size() const {return size_;}
+    void clear() {
+        for(auto &map: maps_) map.clear();
+        for(size_t i = 0; i < nbuckets_; ++i) buckets_[i].clear();
+        nbuckets_ = size_ = 0;
+    }
+    void insert(const KeyT *keys, IdT id) {
+        for(size_t p = 0; p < maps_.size(); ++p) {
+            auto it = maps_[p].find(keys[p]);
+            if(it == maps_[p].end()) {
+                if(nbuckets_ == buckets_.size()) buckets_.emplace_back();
+                it = maps_[p].emplace(keys[p], nbuckets_++).first;
+            }
+            buckets_[it->second].push_back(id);
+        }
+        ++size_;
+    }
+    // Whether any of the first n keys has a bucket
+    bool contains(const KeyT *keys, size_t n) const {
+        for(size_t p = 0; p < n; ++p)
+            if(maps_[p].find(keys[p]) != maps_[p].end()) return true;
+        return false;
+    }
+    std::pair<const IdT *, const IdT *> bucket(size_t p, KeyT key) const {
+        if(auto it = maps_[p].find(key); it != maps_[p].end())
+            return {buckets_[it->second].data(), buckets_[it->second].data() + buckets_[it->second].size()};
+        return {nullptr, nullptr};
+    }
+};
+
+struct WaveDedupStats {
+    size_t nitems_ = 0, nclusters_ = 0, nwaves_ = 0, nrequeried_ = 0;
+    double query_ = 0., resolve_ = 0., insert_ = 0.; // Seconds per phase
+    void report(std::FILE *fp) const {
+        std::fprintf(fp, "Deduplicated %zu items into %zu clusters in %zu waves; %zu items (%0.3g%%) re-queried. "
+                         "%gs querying in parallel, %gs resolving, %gs inserting\n",
+                     nitems_, nclusters_, nwaves_, nrequeried_, nitems_ ? 100. * nrequeried_ / nitems_: 0.,
+                     query_, resolve_, insert_);
+    }
+};
+
+/*
+ * Clusters items order[0, n) greedily, appending to ids (representatives) and constituents (members by cluster).
+ * idx must hold ids.size() items, the representatives of ids, by cluster number, and must not be bottom-k.
+ *   item_at(id):          item id's sketch
+ *   score(id, rep):       the value to minimize over candidate clusters, which is called concurrently
+ *   founds_cluster(best): whether an item whose best (lowest, earliest on ties) score is best founds a new cluster
+ * maxcand bounds candidates per query, as in query_candidates.
+ */
+template<typename KeyT, typename IdT, typename ItemAt, typename Score, typename FoundsCluster>
+WaveDedupStats wave_dedup(sketch::lsh::SetSketchIndex<KeyT, IdT> &idx, const IdT *order, size_t n, size_t maxcand,
+                          const ItemAt &item_at, const Score &score, const FoundsCluster &founds_cluster,
+                          std::vector<IdT> &ids, std::vector<std::vector<IdT>> &constituents,
+                          size_t min_wave=64, size_t max_wave=size_t(1) << 16)
+{
+    using ScoreT = std::decay_t<decltype(score(IdT(0), IdT(0)))>;
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::time_point t) {return std::chrono::duration<double>(clock::now() - t).count();};
+    if(idx.bottomk_only())
+        throw std::invalid_argument("wave_dedup requires an index keyed by subtable, not bottom-k");
+    if(idx.size() != ids.size() || ids.size() != constituents.size())
+        throw std::invalid_argument("wave_dedup requires an index holding exactly the existing representatives");
+    WaveDedupStats stats;
+    stats.nitems_ = n;
+    const size_t nk = idx.nkeys();
+    // Keep the wave's keys within 64MiB
+    max_wave = std::max(min_wave, std::min(max_wave, (size_t(64) << 20) / std::max(nk * sizeof(KeyT), size_t(1))));
+    WaveBuckets<KeyT, IdT> delta(nk);
+    std::vector<KeyT> keys;
+    std::vector<std::vector<IdT>> hits;
+    std::vector<std::vector<ScoreT>> scores;
+    std::vector<size_t> nvisited;
+    std::vector<size_t> founders; // Positions of the current wave's representatives within the wave
+    std::vector<IdT> rhits;
+    std::vector<ScoreT> rscores;
+    for(size_t start = 0, wave = min_wave; start < n;) {
+        const size_t wn = std::min(wave, n - start);
+        keys.resize(wn * nk);
+        hits.resize(wn); scores.resize(wn); nvisited.resize(wn);
+        auto t = clock::now();
+        OMP_PFOR_DYN
+        for(size_t w = 0; w < wn; ++w) {
+            const IdT x = order[start + w];
+            KeyT *const kp = &keys[w * nk];
+            idx.hash_keys(item_at(x), kp);
+            auto &h = hits[w];
+            h = std::move(std::get<0>(idx.query_keys(kp, maxcand, nullptr, true, &nvisited[w])));
+            auto &s = scores[w];
+            s.resize(h.size());
+            for(size_t k = 0; k < h.size(); ++k) s[k] = score(x, ids[h[k]]);
+        }
+        stats.query_ += seconds(t);
+        t = clock::now();
+        const size_t base = ids.size();
+        size_t nrequeried = 0;
+        founders.clear();
+        for(size_t w = 0; w < wn; ++w) {
+            const IdT x = order[start + w];
+            const KeyT *const kp = &keys[w * nk];
+            const IdT *hp = hits[w].data();
+            const ScoreT *sp = scores[w].data();
+            size_t nh = hits[w].size();
+            if(delta.size() && delta.contains(kp, nvisited[w])) {
+                ++nrequeried;
+                rhits = std::move(std::get<0>(idx.query_keys(kp, maxcand, [&delta](size_t p, KeyT key) {return delta.bucket(p, key);})));
+                rscores.resize(rhits.size());
+                // Clusters from before the wave are seen in the same order as before, and may only stop sooner
+                for(size_t k = 0, fi = 0; k < rhits.size(); ++k) {
+                    if(rhits[k] < base) {
+                        assert(fi < nh && hits[w][fi] == rhits[k]);
+                        rscores[k] = scores[w][fi++];
+                    } else rscores[k] = score(x, ids[rhits[k]]);
+                }
+                hp = rhits.data(); sp = rscores.data(); nh = rhits.size();
+            }
+            const ScoreT *const best = std::min_element(sp, sp + nh);
+            if(!nh || founds_cluster(*best)) {
+                delta.insert(kp, ids.size());
+                founders.push_back(w);
+                ids.push_back(x);
+                constituents.emplace_back();
+            } else {
+                constituents[hp[best - sp]].push_back(x);
+            }
+        }
+        stats.resolve_ += seconds(t);
+        t = clock::now();
+        idx.insert_keys(founders.size(), [&](size_t k) {return &keys[founders[k] * nk];}, base);
+        delta.clear();
+        stats.insert_ += seconds(t);
+        stats.nrequeried_ += nrequeried;
+        ++stats.nwaves_;
+        start += wn;
+        if(nrequeried * 4 > wn) wave = std::max(wave / 2, min_wave);
+        else if(nrequeried * 16 < wn) wave = std::min(wave * 2, max_wave);
+    }
+    stats.nclusters_ = ids.size();
+    return stats;
+}
+
+} // namespace dashing2
+
+#endif
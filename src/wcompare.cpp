@@ -8,6 +8,7 @@
 #include "edit-distance.h"
 #include <cstring>
 #include "edlib.h"
+#include "isect.h"
 
 #include <span>
 
@@ -15,39 +16,15 @@ namespace dashing2 {
 //using u128_t = __uint128_t;
 template<typename T, size_t BUFSZ=16384> std::vector<T> load_file(std::FILE *fp);
 
-struct PushBackCounter
-
-{
-  struct value_type { template<typename T> value_type(const T&) { } };
-  void push_back(const value_type &){++count;}
-  PushBackCounter(): count(0) {}
-  size_t count;
-};
-
-template<typename IT, size_t MODE=0>
-std::pair<double, double> weighted_compare_mode(const IT *lptr, size_t lhl, const double lhsum, const double *lnptr, const IT *rptr, const double *rnptr, size_t rhl, const double rhsum) noexcept {
-    double isz_size = 0, isz_carry = 0.;
-    for(size_t lhi = 0, rhi = 0; lhi < lhl && rhi < rhl;) {
-        if(lptr[lhi] == rptr[rhi]) {
-            const auto increment = std::min(lnptr[lhi++], rnptr[rhi++]);
-            if(MODE) {
-                sketch::kahan::update(isz_size, isz_carry, increment);
-            } else {
-                isz_size += increment;
-            }
-        } else {
-            const bool v = lptr[lhi] < rptr[rhi];
-            lhi += v; rhi += !v;
-        }
-    }
-    return std::make_pair(isz_size, lhsum + rhsum - isz_size);
-}
+// In-memory comparisons dispatch to the intersection kernels in isect.cpp,
+// which gallop for skewed set sizes and block-merge with SIMD otherwise.
 std::pair<double, double> weighted_compare(const uint64_t *lptr, const double *lnptr, size_t lhl, const double lhsum, const uint64_t *rptr, const double *rnptr, size_t rhl, const double rhsum, bool kahan) noexcept {
-    return kahan ? weighted_compare_mode<uint64_t, 1>(lptr, lhl, lhsum, lnptr, rptr, rnptr, rhl, rhsum): weighted_compare_mode<uint64_t, 0>(lptr, lhl, lhsum, lnptr, rptr, rnptr, rhl, rhsum);
+    const double isz_size = intersect_min_sum(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+    return std::make_pair(isz_size, lhsum + rhsum - isz_size);
 }
 std::pair<double, double> weighted_compare(const u128_t *lptr, const double *lnptr, size_t lhl, const double lhsum, const u128_t *rptr, const double *rnptr, size_t rhl, const double rhsum, bool kahan) noexcept {
-    auto ptr = kahan ? &weighted_compare_mode<u128_t, 1> : &weighted_compare_mode<u128_t, 0>;
-    return ptr(lptr, lhl, lhsum, lnptr, rptr, rnptr, rhl, rhsum);
+    const double isz_size = intersect_min_sum(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+    return std::make_pair(isz_size, lhsum + rhsum - isz_size);
 }
 size_t hamming_compare(const uint64_t *SK_RESTRICT lptr, size_t lhl, const uint64_t *SK_RESTRICT rptr, size_t rhl) noexcept {
     return std::inner_product(lptr, lptr + std::min(lhl, rhl), rptr, size_t(0), [](auto c, auto x) noexcept {return c += x;}, [](auto lhs, auto rhs) noexcept -> size_t {return lhs == rhs;})
@@ -109,24 +86,17 @@ size_t hamming_compare_f(std::FILE *lfp, std::FILE *rfp) {
 size_t hamming_compare_f64(std::FILE *lfp, std::FILE *rfp) noexcept {return hamming_compare_f<8>(lfp, rfp);}
 size_t hamming_compare_f128(std::FILE *lfp, std::FILE *rfp) noexcept {return hamming_compare_f<16>(lfp, rfp);}
 size_t set_compare(const uint64_t *lptr, size_t lhl, const uint64_t *rptr, size_t rhl) noexcept {
-    PushBackCounter c;
-    std::set_intersection(lptr, lptr + lhl, rptr, rptr + rhl, std::back_inserter(c));
-    return c.count;
+    return intersect_count(lptr, lhl, rptr, rhl);
+}
+size_t set_compare(const u128_t *lptr, size_t lhl, const u128_t *rptr, size_t rhl) noexcept {
+    return intersect_count(lptr, lhl, rptr, rhl);
 }
 
 double cosine_compare(const uint64_t *lptr, size_t lhl, [[maybe_unused]] const double lhnorm, const uint64_t *rptr, size_t rhl, [[maybe_unused]] const double rhnorm, const double *lnptr, const double *rnptr, bool kahan) noexcept {
-    double dotprod = 0, carry = 0.;
-    auto increment = [kahan](auto &norm, auto &carry, auto inc) __attribute__((__always_inline__)) {
-        if(kahan) sketch::kahan::update(norm, carry, inc); else norm += inc;
-    };
-    for(size_t lhi = 0, rhi = 0; lhi < lhl && rhi < rhl;) {
-        if(lptr[lhi] == rptr[rhi]) increment(dotprod, carry, lnptr[lhi++] * rnptr[rhi++]);
-        else {
-            const bool v = lptr[lhi] < rptr[rhi];
-            lhi += v; rhi += !v;
-        }
-    }
-    return dotprod;
+    return intersect_dot(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
+}
+double cosine_compare(const u128_t *lptr, size_t lhl, [[maybe_unused]] const double lhnorm, const u128_t *rptr, size_t rhl, [[maybe_unused]] const double rhnorm, const double *lnptr, const double *rnptr, bool kahan) noexcept {
+    return intersect_dot(lptr, lnptr, lhl, rptr, rnptr, rhl, kahan);
 }
 
 template<typename T, size_t BUFSZ>
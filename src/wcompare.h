@@ -14,8 +14,10 @@ std::pair<double, double> weighted_compare(const uint64_t *lptr, const double *l
 std::pair<double, double> weighted_compare(const u128_t *lptr, const double *lnptr, size_t lhl, const double lhsum, const u128_t *rptr, const double *rnptr, size_t rhl, const double rhsum, bool kahan=true) noexcept;
 // Compute set similarity, which normalizes to Jaccard
 size_t set_compare(const uint64_t *lptr, size_t lhl, const uint64_t *rptr, size_t rhl) noexcept;
+size_t set_compare(const u128_t *lptr, size_t lhl, const u128_t *rptr, size_t rhl) noexcept;
 // Compute the dot product between k-mer sets, which can be used to compute cosine similarity/distance.
 double cosine_compare(const uint64_t *lptr, size_t lhl, const double lhnorm, const uint64_t *rptr, size_t rhl, const double rhnorm, const double *lnptr, const double *rnptr, bool kahan=false) noexcept;
+double cosine_compare(const u128_t *lptr, size_t lhl, const double lhnorm, const u128_t *rptr, size_t rhl, const double rhnorm, const double *lnptr, const double *rnptr, bool kahan=false) noexcept;
 size_t hamming_compare(const uint64_t *SK_RESTRICT lptr, size_t lhl, const uint64_t *SK_RESTRICT rptr, size_t rhl) noexcept;
 
 std::pair<double, double> weighted_compare(std::FILE *lhk, std::FILE *rhk, std::FILE *lhn, std::FILE *rhn, double lhsum, double rhsum, bool use128) noexcept;
@@ -0,0 +1,86 @@
+#include "src/blockz.h"
+#include "src/kernels.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+namespace dashing2 {
+uint64_t XORMASK = 0x724526e320f9967dull;
+void checked_fwrite(std::FILE *fp, const void *src, const size_t nb) {
+    if(std::fwrite(src, 1, nb, fp) != nb) throw std::runtime_error("Failed to write");
+}
+}
+using namespace dashing2;
+
+// Round-trips the block-compressed container and reports its ratio and single-threaded throughput
+// on a simulated similarity matrix: clustered sets compared by 1024-register sketches,
+// so that values are multiples of 1/1024, as for dashing2's similarity estimates.
+
+int main(int argc, char **argv) {
+    const size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10): 4000, rows_per_block = 64;
+    std::mt19937_64 rng(13);
+    std::vector<unsigned> cluster(n);
+    std::vector<double> within(n / 50 + 1);
+    for(auto &c: cluster) c = rng() % within.size();
+    for(auto &w: within) w = .5 + std::uniform_real_distribution<double>(0, .45)(rng);
+    // Upper triangle, row-major
+    std::vector<float> mat;
+    mat.reserve(n * (n - 1) / 2);
+    for(size_t i = 0; i < n; ++i) {
+        for(size_t j = i + 1; j < n; ++j) {
+            const double p = cluster[i] == cluster[j] ? within[cluster[i]]: .01 + .02 * ((cluster[i] ^ cluster[j]) & 3);
+            mat.push_back(std::binomial_distribution<unsigned>(1024, p)(rng) / 1024.f);
+        }
+    }
+    static const char *const names[] {"f32", "f16", "bf16", "u8", "u16"};
+    int rc = 0;
+    std::fprintf(stdout, "#Encoding\tRawMB\tRatio\tCompressMB/s\tDecompressMB/s\n");
+    for(const MatrixEncoding enc: {ENCODE_F32, ENCODE_F16, ENCODE_U8}) {
+        const uint32_t eb = encoded_bytes(enc);
+        std::vector<uint8_t> raw(mat.size() * eb);
+        kernels().encode_floats(mat.data(), mat.size(), enc, raw.data());
+        std::FILE *fp = std::tmpfile();
+        BlockzWriter writer(fp, eb, "prefix", 6);
+        std::vector<uint8_t> out, scratch;
+        double csecs = 0;
+        for(size_t first = 0, off = 0; first < n; first += rows_per_block) {
+            const size_t last = std::min(first + rows_per_block, n);
+            size_t nelem = 0;
+            for(size_t i = first; i < last; ++i) nelem += n - i - 1;
+            const auto t = std::chrono::steady_clock::now();
+            blockz_compress(&raw[off], nelem * eb, eb, out, scratch);
+            csecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+            writer.append(out.data(), out.size(), nelem * eb, first, last - first);
+            off += nelem * eb;
+        }
+        writer.finish();
+        // Read back through the index, as a seeking reader would
+        BlockzTrailer trailer;
+        std::fseek(fp, -long(sizeof(trailer)), SEEK_END);
+        bool ok = std::fread(&trailer, sizeof(trailer), 1, fp) == 1 && trailer.nblocks_ == writer.nblocks();
+        std::vector<BlockzIndexEntry> index(trailer.nblocks_);
+        std::fseek(fp, trailer.index_offset_, SEEK_SET);
+        ok = ok && std::fread(index.data(), sizeof(BlockzIndexEntry), index.size(), fp) == index.size();
+        std::vector<uint8_t> back, buf;
+        double dsecs = 0;
+        for(const auto &e: index) {
+            buf.resize(e.compressed_bytes_);
+            std::fseek(fp, e.offset_, SEEK_SET);
+            ok = ok && std::fread(buf.data(), 1, buf.size(), fp) == buf.size();
+            const size_t prev = back.size();
+            back.resize(prev + e.raw_bytes_);
+            const auto t = std::chrono::steady_clock::now();
+            blockz_decompress(buf.data(), buf.size(), eb, &back[prev], e.raw_bytes_, scratch);
+            dsecs += std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+        }
+        std::fclose(fp);
+        if(!ok || back != raw) {
+            std::fprintf(stderr, "Round trip failed for %s\n", names[enc]);
+            rc = 1;
+        }
+        const double mb = raw.size() / 1e6;
+        std::fprintf(stdout, "%s\t%g\t%g\t%g\t%g\n", names[enc], mb, double(raw.size()) / writer.bytes_written(), mb / csecs, mb / dsecs);
+    }
+    return rc;
+}
@@ -0,0 +1,136 @@
+#include "src/containidx.h"
+#include <chrono>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+#include <unistd.h>
+
+namespace dashing2 {int verbosity = 0;}
+using namespace dashing2;
+
+void usage() {
+    std::fprintf(stderr, "containidxbench <opts>\n"
+                         "Times building and querying the CSR contain index against a hash map of id vectors,\n"
+                         "checks that both return the same references, that the index reloads from disk intact, and that it is rebuilt once the database is replaced.\n"
+                         "-n: number of references [20000]\n"
+                         "-S: k-mers per reference [1024]\n"
+                         "-q: number of queries [10000000]\n"
+                         "-p: number of threads [1]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+static double since(clk::time_point t) {return std::chrono::duration<double>(clk::now() - t).count();}
+
+int main(int argc, char **argv) {
+    size_t n = 20000, m = 1024, nq = 10000000;
+    uint64_t seed = 13;
+    int nt = 1;
+    for(int c;(c = getopt(argc, argv, "n:S:q:p:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': m = std::strtoull(optarg, nullptr, 10); break;
+        case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+        case 'p': nt = std::atoi(optarg); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+#ifdef _OPENMP
+    omp_set_num_threads(nt);
+#endif
+    // References come in clades of 8 which share most of their k-mers, as related genomes do
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> db(n * m);
+    for(size_t i = 0; i < n; i += 8) {
+        std::vector<uint64_t> base(m);
+        for(auto &x: base) x = rng();
+        for(size_t k = i; k < std::min(n, i + 8); ++k)
+            for(size_t j = 0; j < m; ++j)
+                db[k * m + j] = rng() % 4 ? base[j]: rng();
+    }
+
+    auto t = clk::now();
+    ContainIndex idx(db.data(), n, m);
+    const double tbuild = since(t);
+    t = clk::now();
+    flat_hash_map<uint64_t, std::vector<uint64_t>> kmer2ids;
+    for(size_t i = 0; i < n; ++i)
+        for(size_t j = 0; j < m; ++j)
+            kmer2ids[db[i * m + j]].push_back(i);
+    const double tmap = since(t);
+
+    // Half of the queries hit
+    std::vector<uint64_t> queries(nq);
+    for(auto &q: queries) q = rng() & 1 ? db[rng() % db.size()]: rng();
+    std::vector<uint64_t> sums(3);
+    t = clk::now();
+    for(const auto q: queries)
+        if(auto it = kmer2ids.find(q); it != kmer2ids.end()) sums[0] += it->second.size();
+    const double qmap = since(t);
+    t = clk::now();
+    for(const auto q: queries)
+        if(const size_t ki = idx.find(q); ki != ContainIndex::npos) sums[1] += idx.ids_end(ki) - idx.ids_begin(ki);
+    const double qfind = since(t);
+    t = clk::now();
+    idx.find_batch(queries.data(), nq, [&](size_t, size_t ki) {sums[2] += idx.ids_end(ki) - idx.ids_begin(ki);});
+    const double qbatch = since(t);
+
+    std::fprintf(stdout, "#Method\tBuildSeconds\tQueriesPerSecond\n");
+    std::fprintf(stdout, "hashmap\t%g\t%g\n", tmap, nq / qmap);
+    std::fprintf(stdout, "csr\t%g\t%g\n", tbuild, nq / qfind);
+    std::fprintf(stdout, "csr-batched\t-\t%g\n", nq / qbatch);
+    int rc = 0;
+    if(sums[0] != sums[1] || sums[0] != sums[2]) {
+        std::fprintf(stderr, "Lookups disagree: %zu, %zu, %zu\n", size_t(sums[0]), size_t(sums[1]), size_t(sums[2]));
+        rc = 1;
+    }
+    auto check = [&](const ContainIndex &ci, const char *label) {
+        if(ci.nkeys() != kmer2ids.size()) {
+            std::fprintf(stderr, "%s: %zu keys, expected %zu\n", label, ci.nkeys(), kmer2ids.size());
+            return false;
+        }
+        for(const auto &[key, ids]: kmer2ids) {
+            const size_t ki = ci.find(key);
+            if(ki == ContainIndex::npos || !std::equal(ids.begin(), ids.end(), ci.ids_begin(ki), ci.ids_end(ki))) {
+                std::fprintf(stderr, "%s: wrong references for key %zu\n", label, size_t(key));
+                return false;
+            }
+        }
+        return true;
+    };
+    if(!check(idx, "built")) rc = 1;
+    char dbpath[] = "/tmp/containidxbenchXXXXXX";
+    const int fd = mkstemp(dbpath);
+    if(fd < 0) {std::perror("mkstemp"); return 1;}
+    if(::write(fd, db.data(), db.size() * sizeof(uint64_t)) < 0) {std::perror("write"); return 1;}
+    ::close(fd);
+    const std::string cidxpath = std::string(dbpath) + ".cidx";
+    {
+        ContainIndex opened = ContainIndex::open(dbpath, db.data(), n, m);
+        if(!check(opened, "saved")) rc = 1;
+        ContainIndex loaded = ContainIndex::open(dbpath, db.data(), n, m);
+        if(!loaded.mapped()) {
+            std::fprintf(stderr, "Saved index was rebuilt instead of loaded\n");
+            rc = 1;
+        }
+        if(!check(loaded, "loaded")) rc = 1;
+    }
+    {
+        // Replace the database with a same-size file, most likely within the same second; the saved index must not be trusted
+        const std::string replpath = std::string(dbpath) + ".new";
+        std::FILE *fp = std::fopen(replpath.data(), "wb");
+        if(!fp || std::fwrite(db.data(), sizeof(uint64_t), db.size(), fp) != db.size() || std::fclose(fp) || std::rename(replpath.data(), dbpath)) {
+            std::perror("replace database");
+            return 1;
+        }
+        ContainIndex reopened = ContainIndex::open(dbpath, db.data(), n, m);
+        if(reopened.mapped()) {
+            std::fprintf(stderr, "Index of a replaced database was loaded instead of rebuilt\n");
+            rc = 1;
+        }
+        if(!check(reopened, "rebuilt")) rc = 1;
+    }
+    std::remove(cidxpath.data());
+    std::remove(dbpath);
+    return rc;
+}
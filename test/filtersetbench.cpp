@@ -0,0 +1,66 @@
+#include "src/filterset.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <unordered_set>
+
+using namespace dashing2;
+namespace dashing2 {int verbosity = 0;} // Defined in d2.cpp, which is not linked
+
+// Times per-key and batched FilterSet lookups for the sorted set and the blocked Bloom filter,
+// checks that both agree and that neither misses a member, and reports the Bloom filter's false positive rate.
+using clk = std::chrono::high_resolution_clock;
+
+template<typename KT>
+int run(size_t n, size_t nq, double fpr, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    auto draw = [&]() {
+        if constexpr(sizeof(KT) == 16) return (u128_t(rng()) << 64) | rng();
+        else return KT(rng());
+    };
+    std::vector<KT> members(n), queries(nq);
+    for(auto &x: members) x = draw();
+    // Half of the queries are members
+    for(size_t i = 0; i < nq; ++i) queries[i] = i & 1 ? members[rng() % n]: draw();
+    int rc = 0;
+    for(const double bfexp: {-1., fpr}) {
+        auto t = clk::now();
+        FilterSet fs(members.begin(), members.end(), bfexp);
+        const double tbuild = std::chrono::duration<double>(clk::now() - t).count();
+        std::unique_ptr<bool[]> single(new bool[nq]), batched(new bool[nq]);
+        t = clk::now();
+        for(size_t i = 0; i < nq; ++i) single[i] = fs.in_set(queries[i]);
+        const double tsingle = std::chrono::duration<double>(clk::now() - t).count();
+        t = clk::now();
+        size_t nbatched = 0;
+        FilterBatch<KT> fb(&fs);
+        for(size_t i = 0; i < nq; ++i) fb.add(queries[i], [&](KT) {++nbatched;});
+        fb.flush([&](KT) {++nbatched;});
+        const double tbatched = std::chrono::duration<double>(clk::now() - t).count();
+        fs.in_set(queries.data(), nq, batched.get());
+        size_t nmissed = 0, ndiff = 0, nfp = 0, nhit = 0;
+        for(size_t i = 0; i < nq; ++i) {
+            nmissed += (i & 1) && !single[i];
+            ndiff += single[i] != batched[i];
+            nhit += single[i];
+            nfp += !(i & 1) && single[i];
+        }
+        ndiff += nbatched != nq - nhit;
+        std::fprintf(stdout, "%s\t%zu\t%zu\t%g\t%g\t%g\t%g\n", fs.to_string().data(), sizeof(KT) * 8, n, tbuild, nq / tsingle, nq / tbatched, double(nfp) / (nq / 2));
+        if(nmissed || ndiff || (bfexp < 0 && nfp)) {
+            std::fprintf(stderr, "%s: %zu members missed, %zu batched results differ, %zu false positives\n", fs.to_string().data(), nmissed, ndiff, nfp);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10): 10000000;
+    const size_t nq = argc > 2 ? std::strtoull(argv[2], nullptr, 10): 10000000;
+    const double fpr = argc > 3 ? std::atof(argv[3]): 0.01;
+    std::fprintf(stdout, "#Filter\tKeyBits\tNumKeys\tBuildSeconds\tLookupsPerSecond\tBatchedLookupsPerSecond\tFalsePositiveRate\n");
+    return run<uint64_t>(n, nq, fpr, 13) | run<u128_t>(n / 2, nq, fpr, 17);
+}
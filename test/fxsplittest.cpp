@@ -0,0 +1,96 @@
+#include "src/fxsplit.h"
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace dashing2;
+
+// Checks that reading a FASTA/FASTQ file chunk by chunk yields every record exactly once and in order,
+// for uncompressed and BGZF files, across chunk sizes from smaller than a record to the whole file.
+
+static std::string make_records(bool fastq, std::vector<std::string> &seqs, std::mt19937_64 &rng) {
+    std::string text;
+    for(size_t i = 0; i < 2000; ++i) {
+        std::string seq;
+        const size_t len = rng() % 7 == 0 ? size_t(0): rng() % 600;
+        for(size_t j = 0; j < len; ++j) seq.push_back("ACGT"[rng() & 3]);
+        text += (fastq ? "@read" : ">contig") + std::to_string(i) + " desc\n";
+        if(fastq) {
+            text += seq + "\n+\n";
+            // Quality strings starting with '@' or '+' must not be mistaken for record starts
+            for(size_t j = 0; j < len; ++j) text.push_back(j == 0 ? "@+I"[rng() % 3]: char('!' + rng() % 40));
+            text += '\n';
+        } else {
+            const size_t width = 60 + rng() % 20;
+            for(size_t j = 0; j < len; j += width) text += seq.substr(j, width) + (rng() % 5 ? "\n": "\r\n");
+            if(rng() % 11 == 0) text += '\n';
+        }
+        seqs.push_back(std::move(seq));
+    }
+    return text;
+}
+
+// Writes text as BGZF blocks of varying size, followed by the empty end-of-file block
+static std::string bgzf_compress(const std::string &text, std::mt19937_64 &rng) {
+    std::string out;
+    auto put16 = [&](unsigned x) {out.push_back(x & 0xFF); out.push_back(x >> 8);};
+    auto put32 = [&](uint32_t x) {put16(x & 0xFFFF); put16(x >> 16);};
+    for(size_t off = 0;;) {
+        const size_t len = std::min(text.size() - off, size_t(1000 + rng() % 60000));
+        z_stream zs{};
+        if(deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) throw std::runtime_error("deflateInit2");
+        std::string cdata(deflateBound(&zs, len), '\0');
+        zs.next_in = (Bytef *)&text[off];
+        zs.avail_in = len;
+        zs.next_out = (Bytef *)cdata.data();
+        zs.avail_out = cdata.size();
+        if(deflate(&zs, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("deflate");
+        cdata.resize(zs.total_out);
+        deflateEnd(&zs);
+        out += std::string("\x1f\x8b\x08\x04\0\0\0\0\0\xff", 10);
+        put16(6);
+        out += "BC";
+        put16(2);
+        put16(cdata.size() + 25);
+        out += cdata;
+        put32(crc32(0, (const Bytef *)&text[off], len));
+        put32(len);
+        off += len;
+        if(len == 0) break;
+    }
+    return out;
+}
+
+int main() {
+    std::mt19937_64 rng(7);
+    char tmpl[] = "/tmp/fxsplittestXXXXXX";
+    const int fd = mkstemp(tmpl);
+    if(fd < 0) throw std::runtime_error("Failed to create temporary file");
+    close(fd);
+    int rc = 0;
+    for(const bool fastq: {false, true}) {
+        for(const bool bgzf: {false, true}) {
+            std::vector<std::string> seqs;
+            std::string text = make_records(fastq, seqs, rng);
+            if(bgzf) text = bgzf_compress(text, rng);
+            std::FILE *fp = std::fopen(tmpl, "wb");
+            std::fwrite(text.data(), 1, text.size(), fp);
+            std::fclose(fp);
+            for(const size_t chunk_bytes: {size_t(97), size_t(4096), size_t(100000), text.size() / 3, text.size()}) {
+                FastxSplitter splitter(tmpl, chunk_bytes);
+                std::vector<std::string> got;
+                FastxSplitter::Scratch scratch;
+                for(size_t c = 0; c < splitter.nchunks(); ++c)
+                    splitter.for_each_record(c, [&](const char *s, size_t n) {got.emplace_back(s, n);}, scratch);
+                const bool ok = splitter.format() == (fastq ? FastxSplitter::FASTQ: FastxSplitter::FASTA) && got == seqs;
+                std::fprintf(stderr, "%s %s, %zu-byte chunks (%zu): %zu/%zu records %s\n", fastq ? "FASTQ": "FASTA", bgzf ? "BGZF": "plain",
+                             chunk_bytes, splitter.nchunks(), got.size(), seqs.size(), ok ? "ok": "FAILED");
+                rc |= !ok;
+            }
+        }
+    }
+    std::remove(tmpl);
+    return rc;
+}
@@ -0,0 +1,95 @@
+#include "src/isect.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+#include <vector>
+
+using namespace dashing2;
+using u128_t = __uint128_t;
+
+void usage() {
+    std::fprintf(stderr, "isectbench <opts>\n"
+                         "Times sorted-set intersection kernels over a range of set-size ratios, and checks them against the scalar merge.\n"
+                         "-n: size of the larger set [1000000]\n"
+                         "-f: fraction of the smaller set shared with the larger [0.5]\n"
+                         "-r: number of repetitions [5]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+
+template<typename T>
+std::vector<T> draw(std::mt19937_64 &rng, size_t n) {
+    std::vector<T> ret(n);
+    for(auto &x: ret) {
+        x = rng();
+        if constexpr(sizeof(T) == 16) x = (x << 64) | rng();
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+template<typename T>
+int run(const char *label, size_t nlarge, double frac, size_t nreps, uint64_t seed) {
+    int rc = 0;
+    std::mt19937_64 rng(seed);
+    const std::vector<T> large = draw<T>(rng, nlarge);
+    std::vector<double> lc(large.size());
+    for(auto &c: lc) c = 1 + rng() % 64;
+    for(const size_t ratio: {1, 2, 4, 8, 16, 64, 256, 1024, 16384}) {
+        // The smaller set shares a fraction of its keys with the larger one
+        const size_t nsmall = std::max(large.size() / ratio, size_t(1));
+        std::vector<T> small = draw<T>(rng, nsmall - size_t(nsmall * frac));
+        for(size_t i = 0; i < size_t(nsmall * frac); ++i) small.push_back(large[rng() % large.size()]);
+        std::sort(small.begin(), small.end());
+        small.erase(std::unique(small.begin(), small.end()), small.end());
+        std::vector<double> sc(small.size());
+        for(auto &c: sc) c = 1 + rng() % 64;
+        size_t refcount = 0;
+        double refmin = 0., refdot = 0., reftime = 0.;
+        for(const auto kernel: {IntersectKernel::MERGE, IntersectKernel::SCALAR, IntersectKernel::AVX2, IntersectKernel::AVX512}) {
+            if(!intersection_kernel(kernel)) continue;
+            size_t count = 0;
+            double mn = 0., dot = 0.;
+            const auto t = clk::now();
+            for(size_t rep = 0; rep < nreps; ++rep) {
+                count = intersect_count(small.data(), small.size(), large.data(), large.size());
+                mn = intersect_min_sum(large.data(), lc.data(), large.size(), small.data(), sc.data(), small.size(), false);
+                dot = intersect_dot(small.data(), sc.data(), small.size(), large.data(), lc.data(), large.size(), true);
+            }
+            const double ms = std::chrono::duration<double, std::milli>(clk::now() - t).count() / nreps;
+            if(kernel == IntersectKernel::MERGE) {
+                refcount = count; refmin = mn; refdot = dot; reftime = ms;
+            }
+            // Counts are integers, so sums are exact regardless of the order in which matches are visited
+            const bool ok = count == refcount && mn == refmin && dot == refdot;
+            rc |= !ok;
+            std::fprintf(stdout, "%s\t%zu/%zu (1:%zu)\t%s\tshared: %zu\t%0.3fms\tspeedup: %0.2fx\t%s\n",
+                         label, small.size(), large.size(), ratio, to_string(kernel), count, ms, reftime / ms, ok ? "ok": "MISMATCH");
+        }
+    }
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000, nreps = 5;
+    double frac = 0.5;
+    uint64_t seed = 13;
+    for(int c;(c = getopt(argc, argv, "n:f:r:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'f': frac = std::atof(optarg); break;
+        case 'r': nreps = std::strtoull(optarg, nullptr, 10); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+    const IntersectKernel best = intersection_kernel();
+    std::fprintf(stderr, "Best supported kernel: %s\n", to_string(best));
+    int rc = run<uint64_t>("u64", n, frac, nreps, seed);
+    rc |= run<u128_t>("u128", n, frac, nreps, seed);
+    return rc;
+}
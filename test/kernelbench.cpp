@@ -0,0 +1,176 @@
+#include "src/kernels.h"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+
+namespace dashing2 {uint64_t XORMASK = 0x724526e320f9967dull;}
+using namespace dashing2;
+
+// Checks every level of the dispatched kernels this CPU supports against scalar references
+// (and the packing kernels against the baseline level), then times comparisons of 1024-register sketches at each.
+
+template<typename T>
+std::vector<T> randvec(std::mt19937_64 &rng, size_t n, unsigned mod) {
+    std::vector<T> ret(n);
+    for(auto &x: ret) x = T(rng() % mod);
+    return ret;
+}
+template<typename T>
+uint64_t ref_eq(const std::vector<T> &a, const std::vector<T> &b) {
+    uint64_t ret = 0;
+    for(size_t i = 0; i < a.size(); ++i) ret += a[i] == b[i];
+    return ret;
+}
+template<typename T>
+std::pair<uint64_t, uint64_t> ref_gtlt(const std::vector<T> &a, const std::vector<T> &b) {
+    std::pair<uint64_t, uint64_t> ret{0, 0};
+    for(size_t i = 0; i < a.size(); ++i) {
+        ret.first += a[i] > b[i];
+        ret.second += a[i] < b[i];
+    }
+    return ret;
+}
+
+// Rounds to the nearest bfloat16, ties to even, by comparing the two candidates exactly
+static uint16_t ref_bf16(float x) {
+    uint32_t f;
+    std::memcpy(&f, &x, sizeof(f));
+    if(std::isnan(x)) return (f >> 16) | 0x40;
+    const uint32_t lo = f >> 16, hi = lo + 1;
+    auto val = [](uint32_t b) {uint32_t u = b << 16; float r; std::memcpy(&r, &u, sizeof(r)); return double(r);};
+    if((f & 0xffff) == 0) return lo;
+    const double dlo = std::abs(double(x) - val(lo)), dhi = std::isinf(val(hi)) ? std::abs(double(x) - 3.4028236692093846e38): std::abs(val(hi) - double(x));
+    return dlo < dhi ? lo: dhi < dlo ? hi: (lo & 1) ? hi: lo;
+}
+static uint16_t ref_f16(float x) {
+    const _Float16 h = static_cast<_Float16>(x);
+    uint16_t ret;
+    std::memcpy(&ret, &h, sizeof(ret));
+    return std::isnan(x) ? (ret & 0x8000) | 0x7e00: ret;
+}
+
+int main() {
+    std::mt19937_64 rng(13);
+    int rc = 0;
+    const auto levels = all_kernels();
+    const KernelTable &base = *levels.front().first;
+    for(const size_t n: {size_t(0), size_t(1), size_t(7), size_t(255), size_t(256), size_t(1000), size_t(70001)}) {
+        // Few distinct values, so that ties are common
+        const auto a8 = randvec<uint8_t>(rng, n, 3), b8 = randvec<uint8_t>(rng, n, 3);
+        const auto a16 = randvec<uint16_t>(rng, n, 3), b16 = randvec<uint16_t>(rng, n, 3);
+        const auto a32 = randvec<uint32_t>(rng, n, 3), b32 = randvec<uint32_t>(rng, n, 3);
+        const auto a64 = randvec<uint64_t>(rng, n, 3), b64 = randvec<uint64_t>(rng, n, 3);
+        const auto af = randvec<float>(rng, n, 3), bf = randvec<float>(rng, n, 3);
+        const auto ad = randvec<double>(rng, n, 3), bd = randvec<double>(rng, n, 3);
+        // n nibbles, with half of the bytes differing from lhs in at most their high nibble
+        const size_t nb = (n + 1) / 2;
+        auto an = randvec<uint8_t>(rng, nb, 256), bn = randvec<uint8_t>(rng, nb, 256);
+        for(size_t i = 0; i < nb; ++i) if(rng() & 1) bn[i] = an[i] ^ (rng() & 1 ? 0x10: 0);
+        uint64_t nibeq = 0;
+        std::pair<uint64_t, uint64_t> nibgtlt{0, 0};
+        for(size_t i = 0; i < n; ++i) {
+            const unsigned x = an[i / 2] >> (4 * (i & 1)) & 15, y = bn[i / 2] >> (4 * (i & 1)) & 15;
+            nibeq += x == y;
+            nibgtlt.first += x > y;
+            nibgtlt.second += x < y;
+        }
+        std::vector<RegT> sigs(n);
+        for(auto &x: sigs) x = std::ldexp(double(rng() >> 11), -53) + 1e-300;
+        std::vector<uint64_t> kmers(n);
+        for(auto &x: kmers) x = rng();
+        const size_t ne = n & ~size_t(1);
+        for(const auto &[kp, supported]: levels) {
+            if(!supported) continue;
+            const KernelTable &k = *kp;
+            bool ok = k.count_eq(a8.data(), b8.data(), n) == ref_eq(a8, b8)
+                   && k.count_eq(a16.data(), b16.data(), n) == ref_eq(a16, b16)
+                   && k.count_eq(a32.data(), b32.data(), n) == ref_eq(a32, b32)
+                   && k.count_eq(a64.data(), b64.data(), n) == ref_eq(a64, b64)
+                   && k.count_eq(af.data(), bf.data(), n) == ref_eq(af, bf)
+                   && k.count_eq(ad.data(), bd.data(), n) == ref_eq(ad, bd)
+                   && k.count_gtlt(a8.data(), b8.data(), n) == ref_gtlt(a8, b8)
+                   && k.count_gtlt(a16.data(), b16.data(), n) == ref_gtlt(a16, b16)
+                   && k.count_gtlt(a32.data(), b32.data(), n) == ref_gtlt(a32, b32)
+                   && k.count_gtlt(a64.data(), b64.data(), n) == ref_gtlt(a64, b64)
+                   && k.count_gtlt(af.data(), bf.data(), n) == ref_gtlt(af, bf)
+                   && k.count_gtlt(ad.data(), bd.data(), n) == ref_gtlt(ad, bd)
+                   && k.count_eq_nibbles(an.data(), bn.data(), n) == nibeq
+                   && k.count_gtlt_nibbles(an.data(), bn.data(), n) == nibgtlt;
+            for(const int width: {1, 2, 4, 8, 16}) {
+                std::vector<uint8_t> lhs(ne * 8), rhs(ne * 8);
+                k.pack_bbit_kmers(kmers.data(), ne, width, lhs.data());
+                base.pack_bbit_kmers(kmers.data(), ne, width, rhs.data());
+                ok = ok && lhs == rhs;
+                k.pack_bbit_regs(sigs.data(), ne, width, lhs.data());
+                base.pack_bbit_regs(sigs.data(), ne, width, rhs.data());
+                ok = ok && lhs == rhs;
+                k.pack_setsketch(sigs.data(), ne, width, 1e-10L, 1.L / std::log1p(.5L), 254.3L, lhs.data());
+                base.pack_setsketch(sigs.data(), ne, width, 1e-10L, 1.L / std::log1p(.5L), 254.3L, rhs.data());
+                ok = ok && lhs == rhs;
+            }
+            {
+                // Values around every precision boundary, plus specials
+                std::vector<float> vals(n);
+                for(auto &x: vals) {
+                    const uint32_t u = uint32_t(rng());
+                    std::memcpy(&x, &u, sizeof(x));
+                    if(rng() & 1) x = std::ldexp(float(rng() % 70001) / 70000.f, -int(rng() % 30));
+                }
+                const float specials[] {0.f, -0.f, 1.f, 65504.f, 65520.f, 6.1035156e-05f, 5.9604645e-08f, 2.9802322e-08f, 1.f / 510, 1.f / 131070,
+                                        std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), std::numeric_limits<float>::quiet_NaN(), 2.f};
+                for(size_t i = 0; i < std::min(n, std::size(specials)); ++i) vals[i] = specials[i];
+                std::vector<uint16_t> half(n), bf(n), u16(n);
+                std::vector<uint8_t> u8(n);
+                k.encode_floats(vals.data(), n, ENCODE_F16, half.data());
+                k.encode_floats(vals.data(), n, ENCODE_BF16, bf.data());
+                k.encode_floats(vals.data(), n, ENCODE_U8, u8.data());
+                k.encode_floats(vals.data(), n, ENCODE_U16, u16.data());
+                for(size_t i = 0; i < n; ++i) {
+                    const float c = std::isnan(vals[i]) ? 0.f: std::clamp(vals[i], 0.f, 1.f);
+                    if(half[i] != ref_f16(vals[i]) || bf[i] != ref_bf16(vals[i])
+                       || u8[i] != uint8_t(std::lround(c * 255.)) || u16[i] != uint16_t(std::lround(c * 65535.))) {
+                        std::fprintf(stderr, "%s encodes %a as (%x, %x, %u, %u)\n", k.isa_, vals[i], half[i], bf[i], u8[i], u16[i]);
+                        ok = false;
+                        break;
+                    }
+                }
+            }
+            auto masked = kmers;
+            k.mask_kmers(masked.data(), n);
+            for(size_t i = 0; i < n; ++i) ok = ok && masked[i] == maskfn(kmers[i]);
+            if(!ok) {
+                std::fprintf(stderr, "%s kernels are wrong for n = %zu\n", k.isa_, n);
+                rc = 1;
+            }
+        }
+    }
+
+    static constexpr size_t SKETCHSIZE = 1024, NREPS = 200000, NSKETCHES = 8;
+    std::vector<uint64_t> lhs(SKETCHSIZE * NSKETCHES), rhs(SKETCHSIZE * NSKETCHES);
+    std::vector<uint8_t> lhs8(lhs.size()), rhs8(rhs.size());
+    std::vector<double> lhsd(lhs.size()), rhsd(rhs.size());
+    for(size_t i = 0; i < lhs.size(); ++i) {
+        lhs[i] = rng() % 4; rhs[i] = rng() % 4;
+        lhs8[i] = lhs[i]; rhs8[i] = rhs[i];
+        lhsd[i] = lhs[i]; rhsd[i] = rhs[i];
+    }
+    std::fprintf(stdout, "#Level\tKernel\tMillionSketchComparisonsPerSecond\n");
+    uint64_t sink = 0;
+    for(const auto &[kp, supported]: levels) {
+        if(!supported) continue;
+        auto time = [&](const char *name, const auto &f) {
+            auto t = std::chrono::steady_clock::now();
+            for(size_t r = 0; r < NREPS; ++r) sink += f(r % NSKETCHES * SKETCHSIZE);
+            const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+            std::fprintf(stdout, "%s\t%s\t%g\n", kp->isa_, name, NREPS / secs / 1e6);
+        };
+        time("count_eq_u8", [&](size_t o) {return kp->count_eq(&lhs8[o], &rhs8[o], SKETCHSIZE);});
+        time("count_eq_u64", [&](size_t o) {return kp->count_eq(&lhs[o], &rhs[o], SKETCHSIZE);});
+        time("count_gtlt_f64", [&](size_t o) {return kp->count_gtlt(&lhsd[o], &rhsd[o], SKETCHSIZE).first;});
+    }
+    if(sink == 0) std::fprintf(stderr, "No comparisons matched\n");
+    report_kernels(stdout);
+    return rc;
+}
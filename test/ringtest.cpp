@@ -0,0 +1,62 @@
+#include "src/ring.h"
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace dashing2;
+
+struct Slot {
+    std::vector<uint64_t> data;
+    uint64_t start = 0;
+    uint64_t sum = 0; // Set by formatters
+};
+
+int main(int argc, char **argv) {
+    const size_t nslots = argc > 1 ? std::strtoull(argv[1], nullptr, 10): 4;
+    const size_t nformatters = argc > 2 ? std::strtoull(argv[2], nullptr, 10): 3;
+    const size_t nbatches = argc > 3 ? std::strtoull(argv[3], nullptr, 10): 20000;
+    int rc = 0;
+    for(const bool formatted: {false, true}) {
+        OrderedRing<Slot> ring(nslots, formatted);
+        std::vector<std::thread> formatters;
+        if(formatted) {
+            for(size_t i = 0; i < nformatters; ++i) {
+                formatters.emplace_back([&]() {
+                    while(Slot *s = ring.claim()) {
+                        uint64_t sum = 0;
+                        for(const auto x: s->data) sum += x;
+                        s->sum = sum;
+                        ring.formatted(*s);
+                    }
+                });
+            }
+        }
+        size_t nseen = 0, nbad = 0;
+        std::thread writer([&]() {
+            while(Slot *s = ring.next()) {
+                nbad += s->start != nseen;
+                if(formatted) {
+                    const uint64_t n = s->data.size();
+                    nbad += s->sum != n * s->start + n * (n - 1) / 2;
+                }
+                ++nseen;
+                ring.release();
+            }
+        });
+        for(size_t i = 0; i < nbatches; ++i) {
+            Slot &s = ring.acquire();
+            s.start = i;
+            s.data.resize(1 + i % 37);
+            for(size_t j = 0; j < s.data.size(); ++j) s.data[j] = i + j;
+            ring.publish();
+        }
+        ring.close();
+        writer.join();
+        for(auto &f: formatters) f.join();
+        std::fprintf(stderr, "formatted: %d\tslots: %zu\tbatches: %zu/%zu\terrors: %zu\tproducer stall: %gs\twriter stall: %gs\tformat stall: %gs\n",
+                     formatted, nslots, nseen, nbatches, nbad, ring.producer_stall_seconds(), ring.writer_stall_seconds(), ring.format_stall_seconds());
+        rc |= nbad || nseen != nbatches;
+    }
+    return rc;
+}
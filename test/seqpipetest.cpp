@@ -0,0 +1,69 @@
+#include "src/seqpipe.h"
+#include <cstdio>
+#include <cstdlib>
+
+using namespace dashing2;
+
+// Checks that SeqPipeline hands chunks to the writer in input order across files,
+// with workers' results intact, for several parser/worker counts, and reports stage utilization.
+struct Out {
+    std::vector<uint64_t> sums;
+};
+
+int main(int argc, char **argv) {
+    const size_t nfiles = argc > 1 ? std::strtoull(argv[1], nullptr, 10): 5;
+    const size_t nseqs = argc > 2 ? std::strtoull(argv[2], nullptr, 10): 20000;
+    std::vector<std::string> paths;
+    std::vector<std::string> names;
+    std::vector<uint64_t> sums;
+    for(size_t f = 0; f < nfiles; ++f) {
+        // Alternate plain and gzipped files, of uneven lengths, and leave one empty
+        const bool gz = f & 1;
+        paths.push_back("seqpipetest." + std::to_string(f) + (gz ? ".fa.gz": ".fa"));
+        gzFile fp = gzopen(paths.back().data(), gz ? "wb": "wbT");
+        const size_t n = f == 2 ? 0: nseqs / (f + 1);
+        for(size_t i = 0; i < n; ++i) {
+            std::string s(1 + (i * 7919 + f) % 997, 'A');
+            uint64_t sum = 0;
+            for(size_t j = 0; j < s.size(); ++j) sum += (s[j] = "ACGT"[(i + j * j) % 4]);
+            names.push_back("seq" + std::to_string(f) + "_" + std::to_string(i));
+            sums.push_back(sum);
+            gzprintf(fp, ">%s\n%s\n", names.back().data(), s.data());
+        }
+        gzclose(fp);
+    }
+    int rc = 0;
+    for(const auto &[np, nw]: std::vector<std::pair<size_t, size_t>>{{0, 0}, {1, 1}, {1, 4}, {2, 3}, {8, 2}}) {
+        SeqPipeline<Out> pipeline(paths, np, nw, 100, 1 << 15);
+        size_t nseen = 0, nbad = 0;
+        auto stats = pipeline.run([](int, SeqChunk<Out> &c) {
+            c.out_.sums.resize(c.n_);
+            for(size_t i = 0; i < c.n_; ++i) {
+                uint64_t sum = 0;
+                for(const char x: c.seqs_[i]) sum += x;
+                c.out_.sums[i] = sum;
+            }
+        }, [&](SeqChunk<Out> &c) {
+            for(size_t i = 0; i < c.n_; ++i, ++nseen)
+                nbad += nseen >= names.size() || c.names_[i] != names[nseen] || c.out_.sums[i] != sums[nseen];
+        });
+        stats.report(stderr, ("parsers=" + std::to_string(np) + ",workers=" + std::to_string(nw)).data());
+        if(nbad || nseen != names.size() || stats.nseqs_ != names.size()) {
+            std::fprintf(stderr, "%zu parsers, %zu workers: %zu/%zu sequences seen, %zu out of order or wrong\n", np, nw, nseen, names.size(), nbad);
+            rc = 1;
+        }
+    }
+    bool threw = false;
+    try {
+        std::vector<std::string> missing{paths.front(), "seqpipetest.missing.fa"};
+        SeqPipeline<Out>(missing, 2, 2, 100).run([](int, SeqChunk<Out> &) {}, [](SeqChunk<Out> &) {});
+    } catch(const std::runtime_error &) {
+        threw = true;
+    }
+    if(!threw) {
+        std::fprintf(stderr, "Missing input did not throw\n");
+        rc = 1;
+    }
+    for(const auto &p: paths) std::remove(p.data());
+    return rc;
+}
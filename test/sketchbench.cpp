@@ -0,0 +1,124 @@
+#include "src/oph.h"
+#include "src/setsketch.h"
+#include "src/kernels.h"
+#include "src/posblock.h"
+#include <chrono>
+#include <getopt.h>
+#include <numeric>
+#include <random>
+
+namespace dashing2 {
+uint64_t XORMASK = 0x724526e320f9967dull;
+}
+using namespace dashing2;
+
+// Compares sketching k-mers one at a time (maskfn, then update) against the block path used by fastx2sketch
+// (mask_kmers over 256 k-mers, then update_batch), checking that both give the same sketch.
+// Then does the same for interval positions (contig hash ^ position, as in BED and BigWig sketching): per-base update vs PositionBlockUpdater.
+// Also reports how closely min-count 2 SetSketches, with and without a count filter, match a sketch of the k-mers seen at least twice.
+
+void usage() {
+    std::fprintf(stderr, "sketchbench <opts>\n"
+                         "-n: number of k-mers [20000000]\n"
+                         "-d: number of distinct k-mers [n / 4]\n"
+                         "-S: sketch size [1024]\n"
+                         "-s: seed [13]\n"
+                         "-f: count filter bytes for the min-count 2 SetSketch [1048576]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+
+template<typename Sketch>
+int bench(const char *name, const std::vector<uint64_t> &kmers, Sketch &single, Sketch batched) {
+    auto t = clk::now();
+    for(const uint64_t x: kmers) single.update(maskfn(x));
+    const double ssec = std::chrono::duration<double>(clk::now() - t).count();
+    t = clk::now();
+    const KernelTable &kern = kernels();
+    uint64_t buf[256];
+    for(size_t i = 0; i < kmers.size(); i += 256) {
+        const size_t nb = std::min(size_t(256), kmers.size() - i);
+        std::copy(&kmers[i], &kmers[i + nb], buf);
+        kern.mask_kmers(buf, nb);
+        batched.update_batch(buf, nb);
+    }
+    const double bsec = std::chrono::duration<double>(clk::now() - t).count();
+    const bool same = std::equal(single.data(), single.data() + single.size(), batched.data()) && single.total_updates() == batched.total_updates();
+    std::fprintf(stdout, "%s\t%g\t%g\t%g\t%s\n", name, kmers.size() / ssec * 1e-6, kmers.size() / bsec * 1e-6, ssec / bsec, same ? "yes": "NO");
+    return !same;
+}
+
+struct Interval {uint64_t chrom_hash, start, stop;};
+
+template<typename Sketch>
+int bench_intervals(const char *name, const std::vector<Interval> &ivs, Sketch single, Sketch batched) {
+    size_t npos = 0;
+    auto t = clk::now();
+    for(const auto &iv: ivs) {
+        for(uint64_t i = iv.start; i < iv.stop; single.update(iv.chrom_hash ^ i++));
+        npos += iv.stop - iv.start;
+    }
+    const double ssec = std::chrono::duration<double>(clk::now() - t).count();
+    t = clk::now();
+    PositionBlockUpdater<Sketch> block(batched);
+    for(const auto &iv: ivs) block.add_range(iv.chrom_hash, iv.start, iv.stop);
+    block.flush();
+    const double bsec = std::chrono::duration<double>(clk::now() - t).count();
+    const bool same = std::equal(single.data(), single.data() + single.size(), batched.data()) && single.total_updates() == batched.total_updates();
+    std::fprintf(stdout, "%s\t%g\t%g\t%g\t%s\n", name, npos / ssec * 1e-6, npos / bsec * 1e-6, ssec / bsec, same ? "yes": "NO");
+    return !same;
+}
+
+int main(int argc, char **argv) {
+    size_t n = 20000000, ndistinct = 0, sketchsize = 1024, filter_bytes = 1 << 20;
+    uint64_t seed = 13;
+    for(int c;(c = getopt(argc, argv, "n:d:S:s:f:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'd': ndistinct = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': sketchsize = std::strtoull(optarg, nullptr, 10); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case 'f': filter_bytes = std::strtoull(optarg, nullptr, 10); break;
+        case 'h': case '?': usage(); return 1;
+    }}
+    if(!ndistinct) ndistinct = std::max(n / 4, size_t(1));
+    std::mt19937_64 rng(seed);
+    std::vector<uint64_t> distinct(ndistinct), kmers(n);
+    for(auto &x: distinct) x = rng();
+    for(auto &x: kmers) x = distinct[rng() % ndistinct];
+    std::fprintf(stdout, "#Sketch\tSingleMkmers/s\tBatchedMkmers/s\tSpeedup\tIdentical\t(%s kernels)\n", kernels().isa_);
+    using CFS = sketch::setsketch::CountFilteredCSetSketch<double>;
+    LazyOnePermSetSketch<uint64_t> op(sketchsize);
+    CFS ss(1, sketchsize), exact(2, sketchsize), filtered(2, sketchsize);
+    filtered.set_count_filter_bytes(filter_bytes);
+    int rc = bench("OnePerm", kmers, op, LazyOnePermSetSketch<uint64_t>(sketchsize));
+    rc |= bench("SetSketch", kmers, ss, CFS(1, sketchsize));
+    rc |= bench("SetSketchMinCount2", kmers, exact, CFS(2, sketchsize));
+    // 32-bit registers, as in float builds, where update rounds values more coarsely than the batch screen's bound
+    sketch::setsketch::CountFilteredCSetSketch<float> ssf(1, sketchsize);
+    rc |= bench("SetSketchF32", kmers, ssf, sketch::setsketch::CountFilteredCSetSketch<float>(1, sketchsize));
+    rc |= bench("SetSketchMinCount2Filtered", kmers, filtered, filtered);
+    // Reference: a plain SetSketch of the k-mers which occur at least twice
+    flat_hash_map<uint64_t, uint32_t> counts;
+    for(const uint64_t x: kmers) ++counts[maskfn(x)];
+    CFS reference(1, sketchsize);
+    for(const auto &pair: counts) if(pair.second >= 2) reference.update(pair.first);
+    auto nmatch = [&](const CFS &x) {
+        return std::inner_product(x.data(), x.data() + x.size(), reference.data(), size_t(0), std::plus<>(), std::equal_to<>());
+    };
+    std::fprintf(stdout, "#Registers matching a sketch of k-mers with count >= 2: %zu/%zu (exact counting), %zu/%zu (%zu-byte count filter)\n",
+                 nmatch(exact), exact.size(), nmatch(filtered), filtered.size(), filtered.cmf_.bytes());
+    // BED-like intervals of 20-2000 bases, a few hundred bases apart, over 24 contigs
+    std::vector<Interval> ivs;
+    for(size_t npos = 0; npos < n;) {
+        const uint64_t chrom_hash = distinct[ivs.size() % 24 % ndistinct];
+        const uint64_t start = ivs.empty() ? uint64_t(0): ivs.back().stop + rng() % 500, len = 20 + rng() % 1981;
+        ivs.push_back(Interval{chrom_hash, start, start + len});
+        npos += len;
+    }
+    std::fprintf(stdout, "#Intervals\tPerBaseMpos/s\tBlockedMpos/s\tSpeedup\tIdentical\n");
+    rc |= bench_intervals("OnePerm", ivs, LazyOnePermSetSketch<uint64_t>(sketchsize), LazyOnePermSetSketch<uint64_t>(sketchsize));
+    rc |= bench_intervals("SetSketch", ivs, CFS(1, sketchsize), CFS(1, sketchsize));
+    rc |= bench_intervals("SetSketchMinCount2", ivs, CFS(2, sketchsize), CFS(2, sketchsize));
+    return rc;
+}
@@ -0,0 +1,103 @@
+#include "src/ssi.h"
+#include "src/minispan.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+
+using namespace dashing2;
+using SSI = sketch::lsh::SetSketchIndex<uint32_t, uint32_t>;
+
+void usage() {
+    std::fprintf(stderr, "ssibench <opts>\n"
+                         "Times building and querying an LSH index by incremental updates (hash map per bucket) and by the flat two-phase build,\n"
+                         "and checks that both return the same candidates.\n"
+                         "-n: number of sketches [100000]\n"
+                         "-S: sketch size [256]\n"
+                         "-L: number of LSH tables [4]\n"
+                         "-c: maximum candidates per query [50]\n"
+                         "-p: number of threads [1]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+
+// Same table layout as make_index in src/index_build.cpp
+SSI make_ssi(size_t m, size_t nlsh) {
+    std::vector<uint64_t> nperhashes, nperrows;
+    while(nperhashes.size() < nlsh)
+        nperhashes.push_back(nperhashes.size() < 3 ? (1ull << nperhashes.size()): nperhashes.size() * 2);
+    for(const auto nh: nperhashes) nperrows.push_back(nh <= 2 ? m / nh: m * 8 / nh);
+    return SSI(m, nperhashes, nperrows);
+}
+
+int main(int argc, char **argv) {
+    size_t n = 100000, m = 256, nlsh = 4, maxcand = 50;
+    uint64_t seed = 13;
+    int nt = 1;
+    for(int c;(c = getopt(argc, argv, "n:S:L:c:p:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': m = std::strtoull(optarg, nullptr, 10); break;
+        case 'L': nlsh = std::strtoull(optarg, nullptr, 10); break;
+        case 'c': maxcand = std::strtoull(optarg, nullptr, 10); break;
+        case 'p': nt = std::atoi(optarg); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+#ifdef _OPENMP
+    omp_set_num_threads(nt);
+#endif
+    // Sketches come in families of 16 which share each register with probability 0.8, so that buckets hold near neighbors
+    std::mt19937_64 rng(seed);
+    std::vector<double> sigs(n * m);
+    for(size_t i = 0; i < n; i += 16) {
+        std::vector<double> base(m);
+        for(auto &x: base) x = rng() % 1000000;
+        for(size_t k = i; k < std::min(n, i + 16); ++k)
+            for(size_t j = 0; j < m; ++j)
+                sigs[k * m + j] = rng() % 5 ? base[j]: double(rng() % 1000000);
+    }
+    auto item_at = [&](size_t i) {return minispan<double>(&sigs[i * m], m);};
+
+    auto t = clk::now();
+    SSI incremental = make_ssi(m, nlsh);
+    incremental.size(n);
+    OMP_PFOR
+    for(size_t i = 0; i < n; ++i) incremental.update(item_at(i), i);
+    const double tinc = std::chrono::duration<double>(clk::now() - t).count();
+
+    t = clk::now();
+    SSI flat = make_ssi(m, nlsh);
+    flat.build(n, item_at);
+    const double tflat = std::chrono::duration<double>(clk::now() - t).count();
+
+    auto query_all = [&](const SSI &idx, std::vector<std::vector<std::pair<uint32_t, uint32_t>>> &res) {
+        res.resize(n);
+        OMP_PFOR_DYN
+        for(size_t i = 0; i < n; ++i) {
+            // Without stopping early, so that both layouts see the same candidates regardless of bucket order
+            auto [ids, counts, rows] = idx.query_candidates(item_at(i), maxcand, size_t(-1), false);
+            auto &r = res[i];
+            for(size_t k = 0; k < ids.size(); ++k) r.emplace_back(ids[k], counts[k]);
+            std::sort(r.begin(), r.end());
+        }
+    };
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> rinc, rflat;
+    t = clk::now();
+    query_all(incremental, rinc);
+    const double qinc = std::chrono::duration<double>(clk::now() - t).count();
+    t = clk::now();
+    query_all(flat, rflat);
+    const double qflat = std::chrono::duration<double>(clk::now() - t).count();
+
+    std::fprintf(stdout, "#Layout\tBuildSeconds\tItemsBuiltPerSecond\tQuerySeconds\tQueriesPerSecond\n");
+    std::fprintf(stdout, "hashmap\t%g\t%g\t%g\t%g\n", tinc, n / tinc, qinc, n / qinc);
+    std::fprintf(stdout, "flat\t%g\t%g\t%g\t%g\n", tflat, n / tflat, qflat, n / qflat);
+    if(rinc != rflat) {
+        std::fprintf(stderr, "Flat and incremental indexes returned different candidates\n");
+        return 1;
+    }
+    return 0;
+}
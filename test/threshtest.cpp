@@ -0,0 +1,172 @@
+#include "src/cmp_main.h"
+#include "src/tilecmp.h"
+#include "aesctr/wy.h"
+#include "fmt/format.h"
+#include <getopt.h>
+#include <unistd.h>
+
+using namespace dashing2;
+
+void usage() {
+    std::fprintf(stderr, "threshtest <opts>\n"
+                         "Checks that thresholded all-pairs output (emit_thresholded) holds exactly the pairs of the full matrix (emit_rectangular) passing the threshold,\n"
+                         "in binary and in text, with values formatted as in the full matrix,\n"
+                         "for upper-triangular, asymmetric and panel output, with the tiled engine (compressed sketches) and per-pair compare() (exact k-mer sets).\n"
+                         "-n: number of items [150]\n"
+                         "-q: number of queries, for panel output [40]\n"
+                         "-S: sketch size [256]\n"
+                         "-p: number of threads [1]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+template<typename T>
+std::vector<T> slurp(const std::string &path) {
+    std::vector<T> ret;
+    std::FILE *fp = std::fopen(path.data(), "rb");
+    if(!fp) THROW_EXCEPTION(std::runtime_error("Failed to open " + path));
+    T x;
+    while(std::fread(&x, sizeof(x), 1, fp) == 1) ret.push_back(x);
+    std::fclose(fp);
+    std::remove(path.data());
+    return ret;
+}
+
+// Threshold at a quantile of the full matrix, so that a fraction of pairs pass whatever the measure's scale
+// Returns the number of mismatches between the sparse and thresholded dense outputs
+size_t check(Dashing2DistOptions &dopts, const SketchingResult &result, const std::string &prefix, const char *label) {
+    const size_t ns = result.names_.size(), nq = result.nqueries(), nf = ns - nq;
+    const bool panel = dopts.output_kind_ == PANEL, asym = dopts.output_kind_ == ASYMMETRIC_ALL_PAIRS;
+    const bool isdist = distance(dopts.measure_);
+    dopts.outfile_path_ = prefix + ".dense";
+    emit_rectangular(dopts, result);
+    const std::vector<float> dense = slurp<float>(dopts.outfile_path_);
+    // Recover (lhs, rhs, value) for each entry of the full matrix, in row-major order
+    std::vector<PairRecord> all;
+    for(size_t i = 0, k = 0; i < (panel ? nf: ns); ++i) {
+        const size_t jstart = panel || asym ? 0: i + 1, jend = panel ? nq: ns;
+        for(size_t j = jstart; j < jend; ++j, ++k) {
+            if(k >= dense.size()) THROW_EXCEPTION(std::runtime_error("Full matrix output is truncated"));
+            if(!panel && j == i) continue;
+            all.push_back(PairRecord{uint32_t(i), uint32_t(j), dense[k]});
+        }
+    }
+    std::vector<float> vals(all.size());
+    std::transform(all.begin(), all.end(), vals.begin(), [](const PairRecord &r) {return r.value;});
+    std::nth_element(vals.begin(), vals.begin() + vals.size() / 4, vals.end(), [isdist](float x, float y) {return isdist ? x < y: x > y;});
+    dopts.min_similarity_ = vals[vals.size() / 4];
+    std::vector<PairRecord> expected;
+    for(const PairRecord &r: all)
+        if(isdist ? r.value < dopts.min_similarity_: r.value >= dopts.min_similarity_)
+            expected.push_back(r);
+    dopts.outfile_path_ = prefix + ".sparse";
+    emit_thresholded(dopts, result);
+    const std::vector<PairRecord> sparse = slurp<PairRecord>(dopts.outfile_path_);
+    size_t nmismatch = sparse.size() > expected.size() ? sparse.size() - expected.size(): expected.size() - sparse.size();
+    for(size_t i = 0; i < std::min(sparse.size(), expected.size()); ++i)
+        nmismatch += std::memcmp(&sparse[i], &expected[i], sizeof(PairRecord)) != 0;
+    // Text output holds the same pairs, with values formatted as in the full matrix
+    dopts.output_format_ = HUMAN_READABLE;
+    dopts.outfile_path_ = prefix + ".txt";
+    emit_thresholded(dopts, result);
+    dopts.output_format_ = MACHINE_READABLE;
+    std::vector<std::string> lines;
+    {
+        const std::vector<char> text = slurp<char>(dopts.outfile_path_);
+        for(auto it = text.begin(); it != text.end();) {
+            auto eol = std::find(it, text.end(), '\n');
+            if(*it != '#') lines.emplace_back(it, eol);
+            it = eol == text.end() ? eol: eol + 1;
+        }
+    }
+    nmismatch += lines.size() != expected.size();
+    for(size_t i = 0; i < std::min(lines.size(), expected.size()); ++i) {
+        const PairRecord &r = expected[i];
+        nmismatch += lines[i] != fmt::format("{}\t{}\t" D2_VALUE_FMT, result.names_[r.lhs], result.names_[r.rhs + (panel ? nf: 0)], r.value);
+    }
+    std::fprintf(stdout, "%s\t%s\t%s\t%zu/%zu pairs passed %s %g\tmismatches: %zu\n",
+                 label, asym ? "asymmetric": panel ? "panel": "upper", to_string(dopts.measure_).data(),
+                 sparse.size(), all.size(), isdist ? "<": ">=", dopts.min_similarity_, nmismatch);
+    return nmismatch;
+}
+
+int main(int argc, char **argv) {
+    size_t n = 150, nq = 40, sketchsize = 256;
+    uint64_t seed = 13;
+    int nt = 1;
+    for(int c;(c = getopt(argc, argv, "n:q:S:p:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'q': nq = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': sketchsize = std::strtoull(optarg, nullptr, 10); break;
+        case 'p': nt = std::atoi(optarg); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+    if(nq == 0 || nq >= n) {
+        std::fprintf(stderr, "-q must be in [1, n)\n");
+        return 1;
+    }
+    if(sketchsize & 7) sketchsize += 8 - (sketchsize & 7);
+    const std::string prefix = "threshtest." + std::to_string(::getpid());
+    wy::WyRand<uint64_t> rng(seed);
+    SketchingResult result;
+    result.names_.resize(n);
+    for(size_t i = 0; i < n; ++i) result.names_[i] = "S" + std::to_string(i);
+    // Registers are drawn from a small range so that pairs share a nontrivial fraction of them
+    std::unique_ptr<uint64_t[]> regs(new uint64_t[n * sketchsize]);
+    uint8_t *rp = reinterpret_cast<uint8_t *>(regs.get());
+    for(size_t i = 0; i < n * sketchsize * 8; ++i) rp[i] = rng() % 6;
+    // Exact k-mer sets are drawn from a small universe, sorted and written as the sketcher does: the cardinality, then the k-mers
+    std::vector<double> setcards(n);
+    for(size_t i = 0; i < n; ++i) {
+        std::vector<uint64_t> kmers(50 + rng() % 200);
+        for(auto &x: kmers) x = rng() % 2000;
+        std::sort(kmers.begin(), kmers.end());
+        kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+        setcards[i] = kmers.size();
+        result.destination_files_.push_back(prefix + ".kmers." + std::to_string(i));
+        std::FILE *fp = std::fopen(result.destination_files_.back().data(), "wb");
+        if(!fp || std::fwrite(&setcards[i], sizeof(double), 1, fp) != 1 || std::fwrite(kmers.data(), sizeof(uint64_t), kmers.size(), fp) != kmers.size()) {
+            std::fprintf(stderr, "Failed to write k-mer set to %s\n", result.destination_files_.back().data());
+            return 1;
+        }
+        std::fclose(fp);
+    }
+    size_t nmismatch = 0;
+    for(const OutputKind kind: {SYMMETRIC_ALL_PAIRS, ASYMMETRIC_ALL_PAIRS, PANEL}) {
+        result.nqueries(kind == PANEL ? nq: n);
+        // Tiled: compressed setsketch registers
+        {
+            Dashing2Options opts(17);
+            opts.nthreads(nt).sketchsize(sketchsize);
+            result.cardinalities_.resize(n);
+            for(auto &c: result.cardinalities_) c = 1e5 + (rng() % 1000000);
+            for(const Measure msr: {SIMILARITY, MASH_DISTANCE}) {
+                Dashing2DistOptions dopts(opts, kind, MACHINE_READABLE, 1., 0);
+                dopts.sketchsize_ = sketchsize;
+                dopts.compressed_b_ = 1.2;
+                dopts.compressed_ptr_ = static_cast<void *>(regs.get());
+                dopts.measure_ = msr;
+                if(!TileComparator(dopts, result)) {
+                    std::fprintf(stderr, "Expected compressed sketches to use the tiled engine\n");
+                    return 1;
+                }
+                nmismatch += check(dopts, result, prefix, "tiled");
+            }
+        }
+        // Untiled: exact k-mer sets, compared pair by pair
+        {
+            Dashing2Options opts(17, -1, bns::DNA, SPACE_SET, FASTX, nt, false, "", false, FULL_MMER_SET);
+            result.cardinalities_ = setcards;
+            Dashing2DistOptions dopts(opts, kind, MACHINE_READABLE);
+            dopts.measure_ = SIMILARITY;
+            if(TileComparator(dopts, result)) {
+                std::fprintf(stderr, "Expected exact k-mer sets to bypass the tiled engine\n");
+                return 1;
+            }
+            nmismatch += check(dopts, result, prefix, "untiled");
+        }
+    }
+    for(const auto &path: result.destination_files_) std::remove(path.data());
+    return nmismatch != 0;
+}
@@ -0,0 +1,86 @@
+#include "src/tilecmp.h"
+#include "aesctr/wy.h"
+#include <chrono>
+#include <getopt.h>
+
+using namespace dashing2;
+
+void usage() {
+    std::fprintf(stderr, "tilebench <opts>\n"
+                         "Compares all-pairs (upper-triangular) comparison via per-pair compare() against the tiled engine.\n"
+                         "-n: number of sketches [2000]\n"
+                         "-S: sketch size [1024]\n"
+                         "-p: number of threads [1]\n"
+                         "-r: number of repetitions [1]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+
+int main(int argc, char **argv) {
+    size_t n = 2000, sketchsize = 1024, nreps = 1;
+    uint64_t seed = 13;
+    int nt = 1;
+    for(int c;(c = getopt(argc, argv, "n:S:p:r:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': sketchsize = std::strtoull(optarg, nullptr, 10); break;
+        case 'p': nt = std::atoi(optarg); break;
+        case 'r': nreps = std::strtoull(optarg, nullptr, 10); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+    if(sketchsize & 1) ++sketchsize;
+    Dashing2Options opts(17);
+    opts.nthreads(nt).sketchsize(sketchsize);
+    SketchingResult result;
+    result.cardinalities_.resize(n);
+    wy::WyRand<uint64_t> rng(seed);
+    for(auto &c: result.cardinalities_) c = 1e5 + (rng() % 1000000);
+    // Registers are drawn from a small range so that pairs share a nontrivial fraction of them
+    std::unique_ptr<uint64_t[]> regs(new uint64_t[(n * sketchsize * 8 + 7) / 8]);
+    uint8_t *rp = reinterpret_cast<uint8_t *>(regs.get());
+    for(size_t i = 0; i < n * sketchsize * 8; ++i) rp[i] = rng() % 6;
+    const size_t npairs = n * (n - 1) / 2;
+    std::vector<float> ref(npairs), tiled(npairs);
+    std::vector<size_t> rowoff(n + 1);
+    for(size_t i = 0; i < n; ++i) rowoff[i + 1] = rowoff[i] + (n - i - 1);
+    std::vector<float *> rows(n);
+    for(size_t i = 0; i < n; ++i) rows[i] = tiled.data() + rowoff[i] - i - 1;
+    for(const int truncation: {1, 0}) {
+        for(const double fd: {0.5, 1., 2., 4., 8.}) {
+            Dashing2DistOptions dopts(opts, SYMMETRIC_ALL_PAIRS, MACHINE_READABLE, fd, truncation);
+            dopts.sketchsize_ = sketchsize;
+            dopts.compressed_b_ = 1.2;
+            dopts.compressed_ptr_ = static_cast<void *>(regs.get());
+            const TileComparator tc(dopts, result);
+            double tpair = 0., ttile = 0.;
+            for(size_t rep = 0; rep < nreps; ++rep) {
+                auto t = clk::now();
+                OMP_PFOR_DYN
+                for(size_t i = 0; i < n; ++i) {
+                    float *dst = ref.data() + rowoff[i] - i - 1;
+                    for(size_t j = i + 1; j < n; ++j)
+                        dst[j] = compare(dopts, result, i, j);
+                }
+                tpair += std::chrono::duration<double, std::milli>(clk::now() - t).count();
+                t = clk::now();
+                const size_t tw = std::max(std::min(tc.tile_cols(), (n + nt - 1) / nt), size_t(1));
+                const size_t ntiles = (n + tw - 1) / tw;
+                for(size_t rs = 0; rs < n; rs += tc.tile_rows()) {
+                    const size_t re = std::min(rs + tc.tile_rows(), n);
+                    OMP_PFOR_DYN
+                    for(size_t ti = 0; ti < ntiles; ++ti)
+                        tc.fill(rs, re, ti * tw, std::min((ti + 1) * tw, n), rows.data() + rs, true);
+                }
+                ttile += std::chrono::duration<double, std::milli>(clk::now() - t).count();
+            }
+            size_t nmismatch = 0;
+            for(size_t i = 0; i < npairs; ++i)
+                nmismatch += std::memcmp(&ref[i], &tiled[i], sizeof(float)) != 0;
+            std::fprintf(stdout, "%s\t%g bytes\t%zu sketches\t%zu registers\tcompare: %0.3fms\ttiled: %0.3fms\tspeedup: %0.3fx\tmismatches: %zu\n",
+                         truncation ? "bbit": "setsketch", fd, n, sketchsize, tpair / nreps, ttile / nreps, tpair / ttile, nmismatch);
+            if(nmismatch) return 1;
+        }
+    }
+}
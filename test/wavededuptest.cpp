@@ -0,0 +1,113 @@
+#include "src/wavededup.h"
+#include "src/minispan.h"
+#include <algorithm>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+
+using namespace dashing2;
+using SSI = sketch::lsh::SetSketchIndex<uint32_t, uint32_t>;
+
+void usage() {
+    std::fprintf(stderr, "wavededuptest <opts>\n"
+                         "Clusters synthetic sketches greedily, one item at a time and in waves,\n"
+                         "and checks that waves of every size give the serial clustering.\n"
+                         "-n: number of sketches [50000]\n"
+                         "-S: sketch size [128]\n"
+                         "-L: number of LSH tables [3]\n"
+                         "-c: maximum candidates per query [30]\n"
+                         "-t: similarity threshold [0.7]\n"
+                         "-p: number of threads [1]\n"
+                         "-s: seed [13]\n"
+    );
+}
+
+using clk = std::chrono::high_resolution_clock;
+
+// Same table layout as make_index in src/index_build.cpp
+SSI make_ssi(size_t m, size_t nlsh) {
+    std::vector<uint64_t> nperhashes, nperrows;
+    while(nperhashes.size() < nlsh)
+        nperhashes.push_back(nperhashes.size() < 3 ? (1ull << nperhashes.size()): nperhashes.size() * 2);
+    for(const auto nh: nperhashes) nperrows.push_back(nh <= 2 ? m / nh: m * 8 / nh);
+    return SSI(m, nperhashes, nperrows);
+}
+
+int main(int argc, char **argv) {
+    size_t n = 50000, m = 128, nlsh = 3, maxcand = 30;
+    double simt = 0.7;
+    uint64_t seed = 13;
+    int nt = 1;
+    for(int c;(c = getopt(argc, argv, "n:S:L:c:t:p:s:h?")) >= 0;) {switch(c) {
+        case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+        case 'S': m = std::strtoull(optarg, nullptr, 10); break;
+        case 'L': nlsh = std::strtoull(optarg, nullptr, 10); break;
+        case 'c': maxcand = std::strtoull(optarg, nullptr, 10); break;
+        case 't': simt = std::atof(optarg); break;
+        case 'p': nt = std::atoi(optarg); break;
+        case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+        case '?': case 'h': usage(); std::exit(1);
+    }}
+#ifdef _OPENMP
+    omp_set_num_threads(nt);
+#endif
+    // Families of random size whose members share each register with a family-specific probability,
+    // so that some members fall below the threshold and found clusters of their own.
+    // Registers take few values, so that unrelated sketches collide in the least specific tables.
+    std::mt19937_64 rng(seed);
+    std::vector<double> sigs(n * m);
+    for(size_t i = 0; i < n;) {
+        const size_t fsz = 1 + rng() % 32;
+        const double keep = 0.5 + 0.5 * std::uniform_real_distribution<double>()(rng);
+        std::vector<double> base(m);
+        for(auto &x: base) x = rng() % 64;
+        for(const size_t e = std::min(n, i + fsz); i < e; ++i)
+            for(size_t j = 0; j < m; ++j)
+                sigs[i * m + j] = std::uniform_real_distribution<double>()(rng) < keep ? base[j]: double(rng() % 64);
+    }
+    auto item_at = [&](size_t i) {return minispan<double>(&sigs[i * m], m);};
+    std::vector<uint32_t> order(n);
+    for(size_t i = 0; i < n; ++i) order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+    auto score = [&](uint32_t x, uint32_t rep) {
+        size_t neq = 0;
+        for(size_t j = 0; j < m; ++j) neq += sigs[x * m + j] == sigs[rep * m + j];
+        return -double(neq) / m;
+    };
+    auto founds_cluster = [simt](double best) {return -best < simt;};
+
+    // Reference: one item at a time
+    auto t = clk::now();
+    std::vector<uint32_t> sids;
+    std::vector<std::vector<uint32_t>> scons;
+    SSI sidx = make_ssi(m, nlsh);
+    for(const auto x: order) {
+        const auto hits = std::get<0>(sidx.query_candidates(item_at(x), maxcand));
+        std::vector<double> vals(hits.size());
+        for(size_t k = 0; k < hits.size(); ++k) vals[k] = score(x, sids[hits[k]]);
+        const auto best = std::min_element(vals.begin(), vals.end());
+        if(hits.empty() || founds_cluster(*best)) {
+            sids.push_back(x);
+            scons.emplace_back();
+            sidx.update(item_at(x));
+        } else scons[hits[best - vals.begin()]].push_back(x);
+    }
+    const double tserial = std::chrono::duration<double>(clk::now() - t).count();
+    std::fprintf(stdout, "#Method\tSeconds\tItemsPerSecond\tClusters\tWaves\tRequeried\n");
+    std::fprintf(stdout, "serial\t%g\t%g\t%zu\t-\t-\n", tserial, n / tserial, sids.size());
+    int rc = 0;
+    for(const size_t min_wave: {size_t(1), size_t(64), size_t(1024)}) {
+        t = clk::now();
+        std::vector<uint32_t> ids;
+        std::vector<std::vector<uint32_t>> cons;
+        SSI idx = make_ssi(m, nlsh);
+        const auto stats = wave_dedup(idx, order.data(), n, maxcand, item_at, score, founds_cluster, ids, cons, min_wave);
+        const double tw = std::chrono::duration<double>(clk::now() - t).count();
+        std::fprintf(stdout, "waves(min %zu)\t%g\t%g\t%zu\t%zu\t%zu\n", min_wave, tw, n / tw, ids.size(), stats.nwaves_, stats.nrequeried_);
+        if(ids != sids || cons != scons) {
+            std::fprintf(stderr, "Waves of at least %zu items gave a different clustering than the serial loop\n", min_wave);
+            rc = 1;
+        }
+    }
+    return rc;
+}